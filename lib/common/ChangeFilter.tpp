@@ -0,0 +1,178 @@
+#ifndef SENSENET_CHANGE_FILTER_TPP
+#define SENSENET_CHANGE_FILTER_TPP
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <vector>
+
+#ifndef CHANGE_FILTER_MAX_KEYS
+#define CHANGE_FILTER_MAX_KEYS 48
+#endif
+
+/*
+ * Report by exception: a key is only passed on when its value moved past the deadband since it was
+ * last sent, or when it has been silent for maxSilenceMs.
+ *
+ * Numbers, including numbers sent as strings, are compared against an absolute and a relative
+ * deadband, a zero deadband passes any change. Other values pass whenever they differ.
+ * Keys beyond CHANGE_FILTER_MAX_KEYS are never filtered.
+ */
+class ChangeFilter {
+public:
+    ChangeFilter(float absolute = 0, float relative = 0, uint32_t maxSilenceMs = 900000);
+
+    void setDefaultDeadband(float absolute, float relative, uint32_t maxSilenceMs);
+
+    void setDeadband(const String &key, float absolute, float relative, uint32_t maxSilenceMs);
+
+    // Removes the members that did not change enough and returns how many are left
+    size_t filter(JsonObject data, uint64_t now);
+
+    // Everything passes on the next call, e.g. when the receiver may have lost its state
+    void reset() {
+        for (Entry &entry: entries) entry.sentAt = 0;
+    }
+
+    uint32_t getSuppressed() const {
+        return suppressed;
+    }
+
+private:
+    struct Rule {
+        String key;
+        float absolute, relative;
+        uint32_t maxSilenceMs;
+    };
+
+    struct Entry {
+        String key;
+        const Rule *rule;
+        bool numeric;
+        double number;
+        uint32_t hash;
+        uint64_t sentAt;
+    };
+
+    Rule defaultRule;
+    std::vector<Rule> rules;
+    std::vector<Entry> entries;
+    uint32_t suppressed = 0;
+
+    Entry *findEntry(const char *key);
+
+    const Rule *findRule(const char *key) const;
+
+    bool changed(Entry &entry, JsonVariantConst value, uint64_t now, bool &numeric, double &number,
+                 uint32_t &hash) const;
+
+    static bool toNumber(JsonVariantConst value, double &number);
+
+    static uint32_t hashOf(const char *text);
+};
+
+ChangeFilter::ChangeFilter(float absolute, float relative, uint32_t maxSilenceMs) {
+    defaultRule = {"", absolute, relative, maxSilenceMs};
+}
+
+void ChangeFilter::setDefaultDeadband(float absolute, float relative, uint32_t maxSilenceMs) {
+    defaultRule = {"", absolute, relative, maxSilenceMs};
+}
+
+void ChangeFilter::setDeadband(const String &key, float absolute, float relative, uint32_t maxSilenceMs) {
+    for (Rule &rule: rules) {
+        if (rule.key == key) {
+            rule = {key, absolute, relative, maxSilenceMs};
+            return;
+        }
+    }
+    rules.push_back({key, absolute, relative, maxSilenceMs});
+    // Entries keep pointers to their rule and the vector may have moved
+    for (Entry &entry: entries) entry.rule = findRule(entry.key.c_str());
+}
+
+// A member is removed once the iterator has moved past it, so no list of keys has to be kept aside
+size_t ChangeFilter::filter(JsonObject data, uint64_t now) {
+    size_t unchangedCount = 0;
+
+    for (JsonObject::iterator it = data.begin(); it != data.end();) {
+        JsonObject::iterator current = it;
+        ++it;
+        const char *key = current->key().c_str();
+        Entry *entry = findEntry(key);
+        if (entry == nullptr) {
+            if (entries.size() >= CHANGE_FILTER_MAX_KEYS) continue;
+            entries.push_back({key, findRule(key), false, 0, 0, 0});
+            entry = &entries.back();
+        }
+
+        bool numeric;
+        double number;
+        uint32_t hash;
+        if (!changed(*entry, current->value(), now, numeric, number, hash)) {
+            data.remove(current);
+            unchangedCount++;
+            continue;
+        }
+        entry->numeric = numeric;
+        entry->number = number;
+        entry->hash = hash;
+        entry->sentAt = now;
+    }
+
+    suppressed += unchangedCount;
+    return data.size();
+}
+
+ChangeFilter::Entry *ChangeFilter::findEntry(const char *key) {
+    for (Entry &entry: entries)
+        if (entry.key == key) return &entry;
+    return nullptr;
+}
+
+const ChangeFilter::Rule *ChangeFilter::findRule(const char *key) const {
+    for (const Rule &rule: rules)
+        if (rule.key == key) return &rule;
+    return &defaultRule;
+}
+
+bool ChangeFilter::changed(Entry &entry, JsonVariantConst value, uint64_t now, bool &numeric, double &number,
+                           uint32_t &hash) const {
+    numeric = toNumber(value, number);
+    hash = 0;
+    if (!numeric)
+        hash = value.is<const char *>() ? hashOf(value.as<const char *>()) : hashOf(value.as<String>().c_str());
+
+    if (entry.sentAt == 0 || now - entry.sentAt >= entry.rule->maxSilenceMs) return true;
+    if (numeric != entry.numeric) return true;
+    if (!numeric) return hash != entry.hash;
+
+    if (isnan(number) || isnan(entry.number)) return isnan(number) != isnan(entry.number);
+    double delta = fabs(number - entry.number);
+    if (entry.rule->absolute <= 0 && entry.rule->relative <= 0) return delta > 0;
+    if (entry.rule->absolute > 0 && delta >= entry.rule->absolute) return true;
+    return entry.rule->relative > 0 && delta >= entry.rule->relative * fabs(entry.number);
+}
+
+// Readings are often stored as String(value), those still get a numeric deadband
+bool ChangeFilter::toNumber(JsonVariantConst value, double &number) {
+    if (value.is<double>() || value.is<long long>() || value.is<unsigned long long>()) {
+        number = value.as<double>();
+        return true;
+    }
+    if (!value.is<const char *>()) return false;
+    const char *text = value.as<const char *>();
+    char *end;
+    number = strtod(text, &end);
+    return end != text && *end == '\0';
+}
+
+uint32_t ChangeFilter::hashOf(const char *text) {
+    uint32_t hash = 2166136261u;
+    while (*text) {
+        hash ^= (uint8_t) *text++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#endif //SENSENET_CHANGE_FILTER_TPP
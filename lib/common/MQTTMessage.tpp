@@ -7,9 +7,23 @@
 #define V1_TELEMETRY_TOPIC "v1/devices/me/telemetry"
 #define V1_TELEMETRY_GATEWAY_TOPIC "v1/gateway/telemetry"
 
+// Non-owning view of a queued message, valid until the queue it was peeked from is modified
+struct MQTTMessageView {
+    const char *topic;
+    const uint8_t *payload;
+    uint16_t payloadLength;
+    // millis() when the message was queued, 0 when unknown
+    uint32_t enqueuedAt;
+};
+
+// Payloads queued in compact form are MessagePack maps or arrays, whose first byte can never start JSON text
+inline bool isMsgPackPayload(const uint8_t *payload, uint16_t length) {
+    return length > 0 && payload[0] >= 0x80;
+}
+
 class MQTTMessage {
 public:
-    MQTTMessage(const String &topic, const String &payload);
+    MQTTMessage(const String &topic, const String &payload, uint32_t enqueuedAt = 0);
 
     MQTTMessage();
 
@@ -19,19 +33,26 @@ public:
         return payload;
     }
 
+    uint32_t getEnqueuedAt() const {
+        return enqueuedAt;
+    }
+
 
 private:
     String topic, payload;
+    uint32_t enqueuedAt;
 };
 
 MQTTMessage::MQTTMessage() {
     topic = "";
     payload = "";
+    enqueuedAt = 0;
 }
 
-MQTTMessage::MQTTMessage(const String &messageTopic, const String &messagePayload) {
+MQTTMessage::MQTTMessage(const String &messageTopic, const String &messagePayload, uint32_t enqueuedAt) {
     this->topic = messageTopic;
     this->payload = messagePayload;
+    this->enqueuedAt = enqueuedAt;
 }
 
 const String &MQTTMessage::getTopic() const {
@@ -15,6 +15,39 @@
 #define FW_REQUEST_TOPIC "v2/fw/request/"
 #define FW_RESPONSE_TOPIC "v2/fw/response/"
 
+// Chunk requests kept outstanding at once
+#ifndef MQTT_OTA_WINDOW
+#define MQTT_OTA_WINDOW 4
+#endif
+
+// A requested chunk that did not arrive by then is requested again
+#ifndef MQTT_OTA_CHUNK_TIMEOUT_MS
+#define MQTT_OTA_CHUNK_TIMEOUT_MS 10000
+#endif
+
+// Chunks arriving ahead of the write position are only buffered while this much heap stays allocatable
+#ifndef MQTT_OTA_HEAP_RESERVE
+#define MQTT_OTA_HEAP_RESERVE 32768
+#endif
+
+// Chunk sizes are powers of two from this one up to the chunkSize given to the constructor
+#ifndef MQTT_OTA_MIN_CHUNK_SIZE
+#define MQTT_OTA_MIN_CHUNK_SIZE 1024
+#endif
+
+// Chunks arriving within this grow the chunk size, slower than twice this shrinks it
+#ifndef MQTT_OTA_RTT_TARGET_MS
+#define MQTT_OTA_RTT_TARGET_MS 1500
+#endif
+
+// Chunks in a row within the RTT target before the chunk size doubles
+#ifndef MQTT_OTA_GROW_AFTER
+#define MQTT_OTA_GROW_AFTER 8
+#endif
+
+// Room around a chunk in the MQTT buffer for the packet header and topic
+#define MQTT_OTA_PACKET_OVERHEAD 64
+
 void OTAResetESP() {
     ESP.restart();
 }
@@ -25,8 +58,14 @@ public:
 
     bool checkForUpdate();
 
+    // chunkSize is the largest chunk requested, the size actually used depends on the heap and the link
     MQTTOTA(MQTTController *mqttController, uint16_t chunkSize);
 
+    ~MQTTOTA();
+
+    // Requests chunks again once they timed out, call it from the same loop as the controller
+    void loop();
+
     void startHandleOTAMessages() {
         enabled = true;
     }
@@ -39,23 +78,85 @@ private:
     String current_fw_title, current_fw_version;
     MQTTController *mqttController;
     Ticker restartTicker;
-    uint16_t totalChunks, chunkSize, currentChunk, requestId;
-    bool enabled;
-    uint8_t lastSentProgressPercent;
-    MQTTController::MqttCallbackJsonPayload callbackJson = [this](String topic, DynamicJsonDocument json) -> bool {
+    uint32_t imageSize = 0, writeOffset = 0, requestOffset = 0;
+    // Chunk sizes get their own request id, requestBase plus the size's power of two. Picked anew when a
+    // download starts and kept across reconnects, so a resumed download keeps matching its responses
+    uint32_t requestBase = 0;
+    uint16_t chunkSize, chunkCeiling, maxChunkSize;
+    uint32_t smoothedRtt = 0;
+    uint8_t goodChunks = 0;
+    bool enabled = false;
+    // begin() runs again on every reconnect, the handlers are only registered by the first call
+    bool registered = false;
+    uint8_t lastSentProgressPercent = 0;
+    Metric *bytesWrittenMetric = Metrics.gauge("OTA Bytes Written");
+    Metric *imageSizeMetric = Metrics.gauge("OTA Image Size");
+    Metric *chunkSizeMetric = Metrics.gauge("OTA Chunk Size");
+    Metric *failuresMetric = Metrics.counter("OTA Failures");
+    Metric *retriesMetric = Metrics.counter("OTA Chunk Retries");
+    Metric *duplicatesMetric = Metrics.counter("OTA Chunk Duplicates");
+    // Throughput of the current or last download, kept until the next one starts
+    Metric *throughputMetric = Metrics.gauge("OTA Bytes Per Second");
+    Metric *requestsMetric = Metrics.gauge("OTA Chunk Requests");
+    Metric *rttAvgMetric = Metrics.gauge("OTA Chunk RTT Avg");
+    Metric *rttMaxMetric = Metrics.gauge("OTA Chunk RTT Max");
+    Metric *minHeapMetric = Metrics.gauge("OTA Min Free Heap");
+    Metric *durationMetric = Metrics.gauge("OTA Duration");
+    uint64_t downloadStartedAt = 0, rttTotal = 0;
+    uint32_t bytesReceived = 0, chunksReceived = 0;
+
+    // Every outstanding request holds a slot. A received chunk waits in its slot until everything in front
+    // of its offset was written
+    struct ChunkSlot {
+        bool used;
+        uint32_t requestId, chunk, offset;
+        uint16_t size;
+        uint64_t requestedAt;
+        uint8_t *data;
+        uint16_t length;
+        bool received;
+    };
+    ChunkSlot slots[MQTT_OTA_WINDOW] = {};
+    uint8_t window = 1;
+    MQTTController::MqttCallbackJsonPayload callbackJson = [this](const String &topic,
+                                                                  const JsonDocument &json) -> bool {
         return handleMessage(topic, json);
     };
 
-    bool handleMessage(String topic, DynamicJsonDocument json);
+    bool handleMessage(const String &topic, const JsonDocument &json);
+
+    bool handleChunk(const uint32_t *params, uint8_t *payload, unsigned int length);
+
+    void requestChunk(const ChunkSlot &slot);
+
+    bool allocateChunkBuffer();
+
+    void startDownload();
+
+    ChunkSlot *findSlot(uint32_t requestId, uint32_t chunk);
+
+    ChunkSlot *slotAt(uint32_t offset);
+
+    ChunkSlot *freeSlot();
+
+    void adaptChunkSize(uint32_t rtt, bool timedOut);
 
-    bool handleMessageRaw(String topic, uint8_t *payload, unsigned int length);
+    void fillWindow();
 
-    void requestChunkPart(int chunkPart);
+    void requestOutstanding(bool timedOutOnly);
+
+    bool writeChunk(uint8_t *data, uint16_t length);
+
+    void recordChunk(const ChunkSlot &slot, unsigned int length);
+
+    void reportDownload(bool result);
+
+    void releaseSlots();
 };
 
-bool MQTTOTA::handleMessage(String topic, DynamicJsonDocument json) {
-    if (json.containsKey("shared"))
-        json = json["shared"].as<JsonObject>();
+bool MQTTOTA::handleMessage(const String &topic, const JsonDocument &doc) {
+    JsonObjectConst json = doc.containsKey("shared") ? doc["shared"].as<JsonObjectConst>()
+                                                     : doc.as<JsonObjectConst>();
 
     if (!json.containsKey(FW_CHECKSUM_ATTR) || !json.containsKey(FW_CHECKSUM_ALG_ATTR) ||
         !json.containsKey(FW_SIZE_ATTR) || !json.containsKey(FW_TITLE_ATTR) || !json.containsKey(FW_VERSION_ATTR)) {
@@ -68,12 +169,30 @@ bool MQTTOTA::handleMessage(String topic, DynamicJsonDocument json) {
     String targetTitle = json[FW_TITLE_ATTR].as<String>();
     String targetVersion = json[FW_VERSION_ATTR].as<String>();
 
-    if (json[FW_CHECKSUM_ATTR].as<String>().equals(ESP.getSketchMD5())) {
+    OTAHashType hashType;
+    if (!OTAHash::parseType(json[FW_CHECKSUM_ALG_ATTR].as<String>(), hashType)) {
+        printDBGln("Unsupported checksum Algorithm");
+        DynamicJsonDocument status(100);
+        status[FW_STATE_ATTR] = "FAILED";
+        status[FW_ERROR_ATTR] = "Unsupported checksum Algorithm";
+        status.shrinkToFit();
+        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status, true);
+        return true;
+    }
+
+    if (OTAUpdate.isInstalled(json[FW_CHECKSUM_ATTR].as<String>(), hashType)) {
         printDBGln("Firmware is Up-to-date");
         DynamicJsonDocument status(200);
         status[FW_STATE_ATTR] = "UPDATED";
         status.shrinkToFit();
-        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status.as<String>(), true);
+        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status, true);
+        return true;
+    }
+
+    // Shared attributes come again after every reconnect, a download of the same image just goes on
+    if (OTAUpdate.isUpdating() && OTAUpdate.getChecksum().equalsIgnoreCase(json[FW_CHECKSUM_ATTR].as<String>())) {
+        printDBGln("OTA in progress, continuing at byte [" + String(writeOffset) + "]");
+        requestOutstanding(false);
         return true;
     }
 
@@ -82,43 +201,40 @@ bool MQTTOTA::handleMessage(String topic, DynamicJsonDocument json) {
             String("New Firmware Available .... Start Update from [" + current_fw_title + ":" + current_fw_version +
                    "] To [" + targetTitle + ":" + targetVersion + "]"));
 
-    if (!json[FW_CHECKSUM_ALG_ATTR].as<String>().equals("MD5")) {
-        printDBGln("Unsupported checksum Algorithm");
-        DynamicJsonDocument status(100);
-        status[FW_STATE_ATTR] = "FAILED";
-        status[FW_ERROR_ATTR] = "Unsupported checksum Algorithm";
-        status.shrinkToFit();
-        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status.as<String>(), true);
-        return true;
-    }
-
     OTAUpdate.onStart([&]() {
         printDBGln("OTA started");
         lastSentProgressPercent = 0;
-        currentChunk = 0;
+        imageSize = json[FW_SIZE_ATTR].as<uint32_t>();
+        // Non zero when a download of this image was cut off by a reboot
+        writeOffset = OTAUpdate.getReceived();
+        requestOffset = writeOffset;
         DynamicJsonDocument status(300);
         status[FW_STATE_ATTR] = "UPDATING";
-        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status.as<String>(), true);
+        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status, true);
 
         mqttController->setTimeout(30000);
-        if (!mqttController->setBufferSize(chunkSize + 50)) {
+        if (!allocateChunkBuffer()) {
             mqttController->resetTimeout();
             mqttController->resetBufferSize();
+            OTAUpdate.abortUpdate();
             printDBGln("NOT ENOUGH RAM!");
+            failuresMetric->add();
             status[FW_STATE_ATTR] = "FAILED";
             status[FW_ERROR_ATTR] = "NOT ENOUGH RAM!";
             status.shrinkToFit();
-            mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status.as<String>(), true);
+            mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status, true);
             return;
         }
 
-        requestId = random(1, 1000);
-        totalChunks = (json[FW_SIZE_ATTR].as<String>().toInt() / chunkSize);
-        if (json[FW_SIZE_ATTR].as<String>().toInt() % chunkSize == 0) totalChunks--;
-        requestChunkPart(0);
+        requestBase = random(1, 1000) * 32;
+        bytesWrittenMetric->set(writeOffset);
+        imageSizeMetric->set(imageSize);
+        startDownload();
     });
 
     OTAUpdate.onEnd([&](bool result) {
+        reportDownload(result);
+        releaseSlots();
         mqttController->resetTimeout();
         mqttController->resetBufferSize();
         if (result) {
@@ -133,66 +249,246 @@ bool MQTTOTA::handleMessage(String topic, DynamicJsonDocument json) {
             DynamicJsonDocument status(200);
             status[FW_STATE_ATTR] = "UPDATING_" + String(progressPercent * 10);
             status.shrinkToFit();
-            mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status.as<String>(), true);
+            mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status, true);
             lastSentProgressPercent = progressPercent;
         }
     });
 
     OTAUpdate.onError([&](int err) {
+        reportDownload(false);
+        releaseSlots();
         mqttController->resetTimeout();
         mqttController->resetBufferSize();
         printDBGln(String("OTA ERROR [" + String(err) + "]: " + OTAUpdate.getLastErrorString()));
+        failuresMetric->add();
         DynamicJsonDocument status(100);
         status[FW_STATE_ATTR] = "FAILED";
         status[FW_ERROR_ATTR] = String("OTA ERROR [" + String(err) + "]: " + OTAUpdate.getLastErrorString());
         status.shrinkToFit();
-        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status.as<String>(), true);
+        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status, true);
     });
 
     OTAUpdate.rebootOnUpdate(false);
-//    todo force to start new one after the last process failed. And try to continue in connection loss
-    if (!OTAUpdate.startUpdate(json[FW_SIZE_ATTR], json[FW_CHECKSUM_ATTR])) {
+    if (!OTAUpdate.startUpdate(json[FW_SIZE_ATTR].as<uint32_t>(), json[FW_CHECKSUM_ATTR].as<String>(), hashType,
+                                 MQTT_OTA_MIN_CHUNK_SIZE)) {
         printDBGln("Can Not start OTA");
+        failuresMetric->add();
         printDBGln(OTAUpdate.getLastErrorString());
         DynamicJsonDocument status(100);
         status[FW_STATE_ATTR] = "FAILED";
         status.shrinkToFit();
-        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status.as<String>(), true);
+        mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, status, true);
     }
 
     return true;
 }
 
-bool MQTTOTA::handleMessageRaw(String topic, uint8_t *payload, unsigned int length) {
-    if (topic.indexOf(FW_RESPONSE_TOPIC) != 0) return false;
-
+// Routed from FW_RESPONSE_TOPIC "+/chunk/+", params hold the request id and the chunk number.
+// Chunks are written in order, one that arrives early is copied aside if the heap allows it and is
+// otherwise dropped and requested again after its timeout
+bool MQTTOTA::handleChunk(const uint32_t *params, uint8_t *payload, unsigned int length) {
     if (!enabled) return true;
+    if (!OTAUpdate.isUpdating()) return true;
 
-    int id = topic.substring(15, topic.indexOf("/", 15)).toInt();
-    if (requestId != id)
+    ChunkSlot *slot = findSlot(params[0], params[1]);
+    if (slot == nullptr || slot->received) {
+        duplicatesMetric->add();
         return true;
+    }
+    // Anything but the requested size is left to time out
+    if (length != min((uint32_t) slot->size, imageSize - slot->offset)) return true;
+    recordChunk(*slot, length);
+
+    if (slot->offset != writeOffset) {
+        if (ESP.getMaxAllocHeap() < length + MQTT_OTA_HEAP_RESERVE) return true;
+        slot->data = (uint8_t *) malloc(length);
+        if (slot->data == nullptr) return true;
+        memcpy(slot->data, payload, length);
+        slot->length = length;
+        slot->received = true;
+        return true;
+    }
 
-    int chunkPart = topic.substring(topic.lastIndexOf("/") + 1).toInt();
-    if (OTAUpdate.isUpdating() && chunkPart == currentChunk) {
-        printDBGln(String("Writing Chuck part: " + String(currentChunk)));
-        printDBG("OTA progress: ");
-        printDBGln(String(String((((float) currentChunk) / ((float) totalChunks)) * 100) + "%"));
+    if (!writeChunk(payload, length)) return true;
+    *slot = {};
+    // Chunks that were waiting for this one follow it
+    ChunkSlot *next;
+    while ((next = slotAt(writeOffset)) != nullptr && next->received) {
+        bool written = writeChunk(next->data, next->length);
+        free(next->data);
+        *next = {};
+        if (!written) return true;
+    }
 
-        if (!OTAUpdate.writeUpdateChunk(payload, length))
-            return true;
+    if (writeOffset >= imageSize) OTAUpdate.endUpdate();
+    else fillWindow();
+    return true;
+}
+
+bool MQTTOTA::writeChunk(uint8_t *data, uint16_t length) {
+    printDBGln(String("Writing OTA chunk at: " + String(writeOffset)));
+    printDBG("OTA progress: ");
+    printDBGln(String(String((((float) writeOffset) / ((float) imageSize)) * 100) + "%"));
+
+    if (!OTAUpdate.writeUpdateChunk(data, length))
+        return false;
+    writeOffset += length;
+    bytesWrittenMetric->set(writeOffset);
+    return true;
+}
 
-        if (currentChunk == totalChunks) {
-            OTAUpdate.endUpdate();
-        } else {
-            currentChunk++;
-            requestChunkPart(currentChunk);
+// The largest chunk the heap can back decides the MQTT receive buffer, the only allocation that grows with
+// the chunk size. A fragmented heap gets smaller chunks instead of a failed update
+bool MQTTOTA::allocateChunkBuffer() {
+    uint32_t allocatable = ESP.getMaxAllocHeap();
+    uint32_t size = maxChunkSize;
+    while (size > MQTT_OTA_MIN_CHUNK_SIZE && size + MQTT_OTA_PACKET_OVERHEAD + MQTT_OTA_HEAP_RESERVE > allocatable)
+        size /= 2;
+    for (; size >= MQTT_OTA_MIN_CHUNK_SIZE; size /= 2) {
+        if (mqttController->setBufferSize(size + MQTT_OTA_PACKET_OVERHEAD)) {
+            chunkCeiling = chunkSize = size;
+            chunkSizeMetric->set(chunkSize);
+            printDBGln("OTA chunk size [" + String(chunkSize) + "]");
+            return true;
         }
     }
-    return true;
+    return false;
+}
+
+// Early chunks may need a buffer each, the window only grows as far as the heap can back it
+void MQTTOTA::startDownload() {
+    releaseSlots();
+    uint32_t allocatable = ESP.getMaxAllocHeap();
+    uint32_t buffers = allocatable > MQTT_OTA_HEAP_RESERVE ? (allocatable - MQTT_OTA_HEAP_RESERVE) / chunkCeiling : 0;
+    window = 1 + min(buffers, (uint32_t) MQTT_OTA_WINDOW - 1);
+    printDBGln("OTA chunk window [" + String(window) + "]");
+    downloadStartedAt = Uptime.getMilliseconds();
+    rttTotal = 0;
+    bytesReceived = 0;
+    chunksReceived = 0;
+    smoothedRtt = 0;
+    goodChunks = 0;
+    throughputMetric->set(0);
+    requestsMetric->set(0);
+    rttAvgMetric->set(0);
+    rttMaxMetric->set(0);
+    minHeapMetric->set(ESP.getFreeHeap());
+    durationMetric->set(0);
+    fillWindow();
+}
+
+void MQTTOTA::recordChunk(const ChunkSlot &slot, unsigned int length) {
+    uint64_t now = Uptime.getMilliseconds();
+    uint32_t rtt = now - slot.requestedAt;
+    bytesReceived += length;
+    chunksReceived++;
+    rttTotal += rtt;
+    if (rtt > rttMaxMetric->get()) rttMaxMetric->set(rtt);
+    rttAvgMetric->set(rttTotal / chunksReceived);
+    if (now > downloadStartedAt) throughputMetric->set((uint64_t) bytesReceived * 1000 / (now - downloadStartedAt));
+    if (ESP.getFreeHeap() < minHeapMetric->get()) minHeapMetric->set(ESP.getFreeHeap());
+    adaptChunkSize(rtt, false);
+}
+
+// Halves the chunk size on a timeout or a slow link and doubles it back after a run of fast chunks, up to
+// what the MQTT buffer was sized for. Only requests sent from now on use the new size
+void MQTTOTA::adaptChunkSize(uint32_t rtt, bool timedOut) {
+    uint16_t size = chunkSize;
+    if (!timedOut) smoothedRtt = smoothedRtt == 0 ? rtt : (smoothedRtt * 7 + rtt) / 8;
+    if (timedOut || smoothedRtt > 2 * MQTT_OTA_RTT_TARGET_MS) {
+        goodChunks = 0;
+        if (size > MQTT_OTA_MIN_CHUNK_SIZE) size /= 2;
+    } else if (smoothedRtt < MQTT_OTA_RTT_TARGET_MS && ++goodChunks >= MQTT_OTA_GROW_AFTER) {
+        goodChunks = 0;
+        if (size < chunkCeiling) size *= 2;
+    }
+    if (size == chunkSize) return;
+    // The link is judged again at the new size
+    smoothedRtt = 0;
+    chunkSize = size;
+    chunkSizeMetric->set(chunkSize);
+    printDBGln("OTA chunk size [" + String(chunkSize) + "]");
+}
+
+void MQTTOTA::reportDownload(bool result) {
+    uint64_t duration = Uptime.getMilliseconds() - downloadStartedAt;
+    durationMetric->set(duration / 1000);
+    printDBGln("OTA download " + String(result ? "finished" : "failed") + ": " + String(bytesReceived) +
+               " bytes in " + String((uint32_t) duration) + " ms, " + String(throughputMetric->get()) +
+               " B/s, " + String(requestsMetric->get()) + " requests, RTT avg " + String(rttAvgMetric->get()) +
+               " ms max " + String(rttMaxMetric->get()) + " ms, min free heap " + String(minHeapMetric->get()));
+}
+
+// A chunk is numbered in units of its own size, so a request only uses a size that divides its offset.
+// Every size is a multiple of MQTT_OTA_MIN_CHUNK_SIZE and so is every offset
+void MQTTOTA::fillWindow() {
+    uint8_t outstanding = 0;
+    for (const ChunkSlot &slot: slots)
+        if (slot.used) outstanding++;
+
+    while (requestOffset < imageSize && outstanding < window) {
+        ChunkSlot *slot = freeSlot();
+        if (slot == nullptr) break;
+        uint16_t size = chunkSize;
+        while (requestOffset % size != 0) size /= 2;
+        uint8_t power = 0;
+        while ((1UL << power) < size) power++;
+        *slot = {true, requestBase + power, requestOffset / size, requestOffset, size, Uptime.getMilliseconds(),
+                 nullptr, 0, false};
+        requestChunk(*slot);
+        requestOffset += min((uint32_t) size, imageSize - requestOffset);
+        outstanding++;
+    }
+}
+
+MQTTOTA::ChunkSlot *MQTTOTA::findSlot(uint32_t requestId, uint32_t chunk) {
+    for (ChunkSlot &slot: slots)
+        if (slot.used && slot.requestId == requestId && slot.chunk == chunk) return &slot;
+    return nullptr;
+}
+
+MQTTOTA::ChunkSlot *MQTTOTA::slotAt(uint32_t offset) {
+    for (ChunkSlot &slot: slots)
+        if (slot.used && slot.offset == offset) return &slot;
+    return nullptr;
+}
+
+MQTTOTA::ChunkSlot *MQTTOTA::freeSlot() {
+    for (ChunkSlot &slot: slots)
+        if (!slot.used) return &slot;
+    return nullptr;
+}
+
+void MQTTOTA::releaseSlots() {
+    for (ChunkSlot &slot: slots) {
+        free(slot.data);
+        slot = {};
+    }
+}
+
+void MQTTOTA::loop() {
+    if (!enabled || !OTAUpdate.isUpdating()) return;
+    requestOutstanding(true);
+}
+
+// Slots that time out together were lost to the same stall, the chunk size is halved once for all of them
+void MQTTOTA::requestOutstanding(bool timedOutOnly) {
+    uint64_t now = Uptime.getMilliseconds();
+    bool anyTimedOut = false;
+    for (ChunkSlot &slot: slots) {
+        if (!slot.used || slot.received) continue;
+        bool timedOut = now - slot.requestedAt >= MQTT_OTA_CHUNK_TIMEOUT_MS;
+        if (timedOutOnly && !timedOut) continue;
+        printDBGln("Requesting OTA chunk at [" + String(slot.offset) + "] again");
+        anyTimedOut |= timedOut;
+        slot.requestedAt = now;
+        retriesMetric->add();
+        requestChunk(slot);
+    }
+    if (anyTimedOut) adaptChunkSize(0, true);
 }
 
 bool MQTTOTA::begin(String currentFirmwareTitle, String currentFirmwareVersion) {
-    requestId = 0;
     enabled = true;
 
     this->current_fw_title = currentFirmwareTitle;
@@ -202,14 +498,23 @@ bool MQTTOTA::begin(String currentFirmwareTitle, String currentFirmwareVersion)
     data["current_fw_title"] = current_fw_title;
     data["current_fw_version"] = current_fw_version;
     data.shrinkToFit();
-    mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, data.as<String>(), true);
-
-    mqttController->registerCallbackJsonPayload(callbackJson);
-    mqttController->registerCallbackRawPayload([this](String topic, uint8_t *payload, unsigned int length) -> bool {
-        return handleMessageRaw(topic, payload, length);
-    });
+    mqttController->addToPublishQueue(V1_TELEMETRY_TOPIC, data, true);
+
+    if (!registered) {
+        registered = true;
+        mqttController->registerCallbackJsonPayload(callbackJson, {"shared", FW_CHECKSUM_ATTR, FW_CHECKSUM_ALG_ATTR,
+                                                                   FW_SIZE_ATTR, FW_TITLE_ATTR, FW_VERSION_ATTR});
+        mqttController->registerRoute(FW_RESPONSE_TOPIC "+/chunk/+",
+                                      [this](const String &topic, const uint32_t *params, uint8_t *payload,
+                                             unsigned int length) -> bool {
+                                          return handleChunk(params, payload, length);
+                                      });
+    }
 
-    checkForUpdate();
+    // Fetched with the other shared keys on every connect
+    mqttController->requestSharedKeysOnConnect(
+            String(FW_CHECKSUM_ATTR) + "," + FW_CHECKSUM_ALG_ATTR + "," + FW_SIZE_ATTR + "," + FW_TITLE_ATTR + "," +
+            FW_VERSION_ATTR, callbackJson);
     return true;
 }
 
@@ -222,13 +527,28 @@ bool MQTTOTA::checkForUpdate() {
     return mqttController->requestAttributesJson(requestData.as<String>(), callbackJson);
 }
 
-void MQTTOTA::requestChunkPart(int chunkPart) {
-    mqttController->addToPublishQueue(
-            String(FW_REQUEST_TOPIC + String(requestId) + "/chunk/" + String(chunkPart)),
-            String(chunkSize), true);
+// Sent right away instead of queueing behind telemetry, a request lost while offline times out and is
+// sent again
+void MQTTOTA::requestChunk(const ChunkSlot &slot) {
+    char topic[48];
+    char payload[8];
+    snprintf(topic, sizeof(topic), FW_REQUEST_TOPIC "%lu/chunk/%lu", (unsigned long) slot.requestId,
+             (unsigned long) slot.chunk);
+    int length = snprintf(payload, sizeof(payload), "%u", (unsigned) slot.size);
+    requestsMetric->add();
+    mqttController->publishNow(topic, (const uint8_t *) payload, length);
 }
 
-MQTTOTA::MQTTOTA(MQTTController *mqttController, uint16_t chunkSize) : mqttController(mqttController),
-                                                                       chunkSize(chunkSize) {}
+// Rounded down to a power of two, chunk numbers are only unambiguous for sizes dividing each other
+MQTTOTA::MQTTOTA(MQTTController *mqttController, uint16_t chunkSize) : mqttController(mqttController) {
+    uint32_t size = MQTT_OTA_MIN_CHUNK_SIZE;
+    while (size * 2 <= chunkSize) size *= 2;
+    maxChunkSize = size;
+    this->chunkSize = chunkCeiling = size;
+}
+
+MQTTOTA::~MQTTOTA() {
+    releaseSlots();
+}
 
 #endif
@@ -0,0 +1,161 @@
+#ifndef SENSENET_METRICS_TPP
+#define SENSENET_METRICS_TPP
+
+#include <Arduino.h>
+#include "PrintDBG.tpp"
+
+#ifndef METRICS_MAX
+#define METRICS_MAX 64
+#endif
+
+enum MetricType {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_GAUGE_FLOAT
+};
+
+// Counters only grow, gauges hold the latest reading. Updates are plain stores
+struct Metric {
+    const char *name;
+    MetricType type;
+    union {
+        uint32_t u;
+        float f;
+    } value, reported;
+    uint64_t reportedAt;
+    bool everReported;
+
+    void add(uint32_t n = 1) {
+        value.u += n;
+    }
+
+    void set(uint32_t v) {
+        value.u = v;
+    }
+
+    void setFloat(float v) {
+        value.f = v;
+    }
+
+    uint32_t get() const {
+        return value.u;
+    }
+
+    float getFloat() const {
+        return value.f;
+    }
+};
+
+/*
+ * Fixed table of named counters and gauges.
+ *
+ * Modules register their metrics once at startup and keep the returned pointer, updating it never
+ * allocates. serialize() writes the metrics that moved past the relative deadband, or were silent for
+ * maxSilenceMs, as one flat JSON object into a caller owned buffer. Names are kept as pointers and
+ * written without escaping, so they must be string literals without quotes.
+ */
+class MetricsRegistry {
+public:
+    // A known name returns its metric. Once the table is full every new name shares one unreported metric
+    Metric *counter(const char *name) {
+        return add(name, METRIC_COUNTER);
+    }
+
+    Metric *gauge(const char *name) {
+        return add(name, METRIC_GAUGE);
+    }
+
+    Metric *gaugeFloat(const char *name) {
+        return add(name, METRIC_GAUGE_FLOAT);
+    }
+
+    void setDeadband(float relative, uint32_t maxSilenceMs) {
+        this->relative = relative;
+        this->maxSilenceMs = maxSilenceMs;
+    }
+
+    // Returns the length written, 0 when nothing changed or the buffer cannot hold a single metric.
+    // Metrics that do not fit stay pending for the next call
+    size_t serialize(char *buffer, size_t capacity, uint64_t now);
+
+    // Everything is reported on the next call, e.g. when the receiver may have lost its state
+    void reset() {
+        for (uint8_t i = 0; i < count; i++) metrics[i].everReported = false;
+    }
+
+    uint32_t getSuppressed() const {
+        return suppressed;
+    }
+
+private:
+    Metric metrics[METRICS_MAX];
+    Metric overflow = {"overflow", METRIC_COUNTER, {0}, {0}, 0, false};
+    uint8_t count = 0;
+    float relative = 0;
+    uint32_t maxSilenceMs = 0;
+    uint32_t suppressed = 0;
+
+    Metric *add(const char *name, MetricType type);
+
+    bool changed(const Metric &metric, uint64_t now) const;
+};
+
+Metric *MetricsRegistry::add(const char *name, MetricType type) {
+    for (uint8_t i = 0; i < count; i++)
+        if (strcmp(metrics[i].name, name) == 0) return &metrics[i];
+    if (count >= METRICS_MAX) {
+        printDBGln(String("Metrics table is full, not reporting: ") + name);
+        return &overflow;
+    }
+    metrics[count] = {name, type, {0}, {0}, 0, false};
+    return &metrics[count++];
+}
+
+bool MetricsRegistry::changed(const Metric &metric, uint64_t now) const {
+    if (!metric.everReported || now - metric.reportedAt >= maxSilenceMs) return true;
+    double current = metric.type == METRIC_GAUGE_FLOAT ? metric.value.f : metric.value.u;
+    double last = metric.type == METRIC_GAUGE_FLOAT ? metric.reported.f : metric.reported.u;
+    if (isnan(current) || isnan(last)) return isnan(current) != isnan(last);
+    double delta = fabs(current - last);
+    if (relative <= 0) return delta > 0;
+    return delta > 0 && delta >= relative * fabs(last);
+}
+
+size_t MetricsRegistry::serialize(char *buffer, size_t capacity, uint64_t now) {
+    if (capacity < 3) return 0;
+    size_t length = 1;
+    buffer[0] = '{';
+    for (uint8_t i = 0; i < count; i++) {
+        Metric &metric = metrics[i];
+        if (!changed(metric, now)) {
+            suppressed++;
+            continue;
+        }
+
+        // Room is left for the closing brace and the terminator
+        size_t room = capacity - length - 1;
+        const char *separator = length > 1 ? "," : "";
+        int written;
+        if (metric.type != METRIC_GAUGE_FLOAT)
+            written = snprintf(buffer + length, room, "%s\"%s\":%lu", separator, metric.name,
+                               (unsigned long) metric.value.u);
+        else if (isnan(metric.value.f) || isinf(metric.value.f))
+            written = snprintf(buffer + length, room, "%s\"%s\":null", separator, metric.name);
+        else
+            written = snprintf(buffer + length, room, "%s\"%s\":%.2f", separator, metric.name, metric.value.f);
+        if (written < 0 || (size_t) written >= room) break;
+
+        length += written;
+        metric.reported = metric.value;
+        metric.reportedAt = now;
+        metric.everReported = true;
+    }
+    if (length == 1) return 0;
+    buffer[length++] = '}';
+    buffer[length] = '\0';
+    return length;
+}
+
+MetricsRegistry Metrics;
+
+#endif //SENSENET_METRICS_TPP
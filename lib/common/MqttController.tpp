@@ -4,24 +4,225 @@
 #include <ArduinoJson.h>
 #include <PubSubClient.h>
 #include "MQTTMessage.tpp"
+#include "TieredQueue.tpp"
+#include "SPSCChannel.tpp"
+#include "TopicRouter.tpp"
+#include "PendingRequests.tpp"
+#include "ChangeFilter.tpp"
+#include "Metrics.tpp"
 
 #include "map"
 
+#ifdef ESP32
+#include <WiFi.h>
+#endif
+
+#include <atomic>
 #include <utility>
 #include "sensenet.h"
 
+#ifndef MQTT_MEMORY_QUEUE_SIZE
+#define MQTT_MEMORY_QUEUE_SIZE 50
+#endif
+
+// Payload bytes preallocated for the memory queue
+#ifndef MQTT_MEMORY_QUEUE_ARENA
+#define MQTT_MEMORY_QUEUE_ARENA 8192
+#endif
+
+// RAM front of the persistent queue, oldest messages above the watermark are spilled to flash
+#ifndef MQTT_FS_QUEUE_RAM_SIZE
+#define MQTT_FS_QUEUE_RAM_SIZE 32
+#endif
+
+#ifndef MQTT_FS_QUEUE_RAM_ARENA
+#define MQTT_FS_QUEUE_RAM_ARENA 16384
+#endif
+
+#ifndef MQTT_FS_QUEUE_SPILL_WATERMARK
+#define MQTT_FS_QUEUE_SPILL_WATERMARK 16
+#endif
+
+#ifndef MQTT_FS_QUEUE_SIZE
+#define MQTT_FS_QUEUE_SIZE 4096
+#endif
+
+// Bytes of the wait-free channel carrying messages from producer tasks to loop()
+#ifndef MQTT_PRODUCER_CHANNEL_SIZE
+#define MQTT_PRODUCER_CHANNEL_SIZE 8192
+#endif
+
+// Define to push from producer tasks under semaQueue like before, to compare stall times
+//#define MQTT_PRODUCER_USE_SEMAPHORE
+
+// Messages moved from RAM to flash per loop() call
+#ifndef MQTT_FS_QUEUE_SPILL_PER_LOOP
+#define MQTT_FS_QUEUE_SPILL_PER_LOOP 4
+#endif
+
+// Consecutive telemetry messages are merged into one ThingsBoard array payload of up to this many bytes
+#ifndef MQTT_BATCH_BUFFER_SIZE
+#define MQTT_BATCH_BUFFER_SIZE 2048
+#endif
+
+#ifndef MQTT_BATCH_MAX_MESSAGES
+#define MQTT_BATCH_MAX_MESSAGES 32
+#endif
+
+// Upper bound of time and bytes spent publishing in one loop() call. A client that reports its free send
+// space lowers the byte budget to it, a short write still ends the connection in PubSubClient
+#ifndef MQTT_DRAIN_TIME_BUDGET_MS
+#define MQTT_DRAIN_TIME_BUDGET_MS 20
+#endif
+
+#ifndef MQTT_DRAIN_BYTE_BUDGET
+#define MQTT_DRAIN_BYTE_BUDGET 16384
+#endif
+
+// Publishes not yet acknowledged by the broker, 0 publishes at QoS 0 and removes messages once written
+#ifndef MQTT_QOS1_WINDOW
+#define MQTT_QOS1_WINDOW 8
+#endif
+
+#ifndef MQTT_QOS1_RETRANSMIT_MS
+#define MQTT_QOS1_RETRANSMIT_MS 10000
+#endif
+
+// The reconnect delay doubles from the connection timeout up to this cap, half of it is random
+#ifndef MQTT_RECONNECT_MAX_MS
+#define MQTT_RECONNECT_MAX_MS 120000
+#endif
+
+// The first connect after boot waits up to this long, so devices powered up together spread out
+#ifndef MQTT_CONNECT_START_JITTER_MS
+#define MQTT_CONNECT_START_JITTER_MS 3000
+#endif
+
+// A resolved broker address is reused for this long, or until connecting to it fails
+#ifndef MQTT_DNS_CACHE_MS
+#define MQTT_DNS_CACHE_MS 3600000
+#endif
+
+// System attributes are only republished after a relative change this large, or after this much silence
+#ifndef MQTT_SYSTEM_ATTRIBUTES_DEADBAND
+#define MQTT_SYSTEM_ATTRIBUTES_DEADBAND 0.05
+#endif
+
+#ifndef MQTT_SYSTEM_ATTRIBUTES_MAX_SILENCE_MS
+#define MQTT_SYSTEM_ATTRIBUTES_MAX_SILENCE_MS 600000
+#endif
+
+// Upper bounds of the enqueue to publish latency buckets, a last bucket takes everything slower
+#define MQTT_LATENCY_BUCKET_COUNT 8
+static const uint32_t mqttLatencyBucketBounds[MQTT_LATENCY_BUCKET_COUNT - 1] = {100, 500, 1000, 5000, 30000, 300000,
+                                                                               3600000};
+static const char *const mqttLatencyBucketNames[MQTT_LATENCY_BUCKET_COUNT] = {
+        "Queue Latency <=100 ms", "Queue Latency <=500 ms", "Queue Latency <=1000 ms", "Queue Latency <=5000 ms",
+        "Queue Latency <=30000 ms", "Queue Latency <=300000 ms", "Queue Latency <=3600000 ms",
+        "Queue Latency >3600000 ms"};
+
+// System attributes are serialized into this buffer, metrics that do not fit go out with the next report
+#ifndef MQTT_METRICS_BUFFER_SIZE
+#define MQTT_METRICS_BUFFER_SIZE 1536
+#endif
+
+// Attribute and RPC requests without an answer by then are reported as timed out
+#ifndef MQTT_REQUEST_TIMEOUT_MS
+#define MQTT_REQUEST_TIMEOUT_MS 10000
+#endif
+
+// Encoding of telemetry and attribute payloads on the wire, MessagePack needs a converter on the broker side
+enum WireEncoding {
+    WIRE_ENCODING_JSON,
+    WIRE_ENCODING_MSGPACK
+};
+
+#ifndef MQTT_WIRE_ENCODING
+#define MQTT_WIRE_ENCODING WIRE_ENCODING_JSON
+#endif
+
+// Document used to re-encode queued payloads while publishing
+#ifndef MQTT_TRANSMIT_DOC_SIZE
+#define MQTT_TRANSMIT_DOC_SIZE 2048
+#endif
+
+// Largest MessagePack payload a JsonDocument is queued as, the size of the controller's encodeBuffer
+#ifndef MQTT_ENCODE_BUFFER_SIZE
+#define MQTT_ENCODE_BUFFER_SIZE 2048
+#endif
+
+// What the {ts, values} envelope adds to transmitDoc when a timestamped payload is decoded again
+#define MQTT_TS_ENVELOPE_USAGE (JSON_OBJECT_SIZE(2) + sizeof("ts") + sizeof("values"))
+
+// A payload on its way into a queue: bytes as they are, or doc as MessagePack after prefix
+struct QueuedPayload {
+    const uint8_t *bytes;
+    const JsonDocument *doc;
+    const uint8_t *prefix;
+    size_t prefixLength;
+    uint16_t length;
+
+    void writeTo(uint8_t *destination) const {
+        if (doc == nullptr) {
+            memcpy(destination, bytes, length);
+            return;
+        }
+        if (prefixLength > 0) memcpy(destination, prefix, prefixLength);
+        serializeMsgPack(*doc, destination + prefixLength, length - prefixLength);
+    }
+};
+
+// Gathers serializer output into small chunks so the socket is not written one byte at a time
+class PublishWriter : public Print {
+public:
+    explicit PublishWriter(PubSubClient &client) : client(client) {}
+
+    size_t write(uint8_t c) override {
+        if (length == sizeof(chunk) && !finish()) return 0;
+        chunk[length++] = c;
+        return 1;
+    }
+
+    size_t write(const uint8_t *data, size_t size) override {
+        for (size_t i = 0; i < size; i++)
+            if (!write(data[i])) return i;
+        return size;
+    }
+
+    bool finish() {
+        if (length > 0 && client.write(chunk, length) != length) failed = true;
+        length = 0;
+        return !failed;
+    }
+
+private:
+    PubSubClient &client;
+    uint8_t chunk[128];
+    size_t length = 0;
+    bool failed = false;
+};
+
 class MQTTController {
 public:
 
-    typedef std::function<bool(const String, DynamicJsonDocument)> DefaultMqttCallbackJsonPayload;
+    typedef std::function<bool(const String &, const JsonDocument &)> DefaultMqttCallbackJsonPayload;
 
     typedef std::function<bool(const String &, uint8_t *, unsigned int)> DefaultMqttCallbackRawPayload;
 
-    typedef std::function<bool(String topic, DynamicJsonDocument json)> MqttCallbackJsonPayload;
+    typedef std::function<bool(const String &topic, const JsonDocument &json)> MqttCallbackJsonPayload;
+
+    typedef PendingRequests::ResultCallback RequestResultCallback;
 
     typedef std::function<bool(const String &topic, uint8_t *payload, unsigned int length)> MqttCallbackRawPayload;
 
-    typedef std::function<void(MQTTMessage mqttMessage)> SentMQTTMessageCallback;
+    typedef std::function<bool(const String &topic, const uint32_t *params, uint8_t *payload,
+                               unsigned int length)> MqttRouteCallback;
+
+    // Called once per message handed to the client for the first time, with the time it spent queued.
+    // latencyMs is 0 when the enqueue time is unknown, e.g. for messages queued before a reboot. Runs from
+    // loop() after the queues are unlocked, so it may queue messages. The message is a copy that is only
+    // valid during the call
+    typedef std::function<void(const MQTTMessageView &message, uint32_t latencyMs)> SentMQTTMessageCallback;
 
     typedef std::function<void(void)> ConnectionEvent;
 
@@ -43,9 +244,40 @@ public:
 
     bool addToPublishQueue(const String &topic, const String &payload, bool memory_fs);
 
-    bool requestAttributesJson(const String &keysJson, const MqttCallbackJsonPayload &callback = nullptr);
+    bool addToPublishQueue(const char *topic, const uint8_t *payload, uint16_t payloadLength, bool memory_fs);
+
+    // Queues a document as MessagePack, it becomes JSON only while being published
+    bool addToPublishQueue(const char *topic, const JsonDocument &doc, bool memory_fs);
+
+    // Publishes at QoS 0 without going through the queues, false when it could not be sent now.
+    // Only for messages the caller retries by itself, and only from the task running loop()
+    bool publishNow(const char *topic, const uint8_t *payload, uint16_t payloadLength);
+
+    // Return the request id, 0 when it could not be queued or too many requests are outstanding
+    uint32_t requestAttributesJson(const String &keysJson, const MqttCallbackJsonPayload &callback = nullptr,
+                                   const RequestResultCallback &result = nullptr,
+                                   uint32_t timeoutMs = MQTT_REQUEST_TIMEOUT_MS);
+
+    uint32_t requestRPC(const String &payload, const MqttCallbackJsonPayload &callback = nullptr,
+                        const RequestResultCallback &result = nullptr, uint32_t timeoutMs = MQTT_REQUEST_TIMEOUT_MS);
+
+    // Shared keys fetched on every connect. All registrations go out as one attributes request and every
+    // callback sees the response. Registering the same keys again replaces the callback
+    void requestSharedKeysOnConnect(const String &keys, const MqttCallbackJsonPayload &callback = nullptr);
 
-    bool requestRPC(const String &payload, const MqttCallbackJsonPayload &callback = nullptr);
+    // Other topics, requests and RPC responses, always go out as JSON
+    void setWireEncoding(WireEncoding encoding) {
+        wireEncoding = encoding;
+    }
+
+    // Documents passed to sendTelemetry/sendAttributes only keep the keys that changed past their deadband
+    void setTelemetryFilter(ChangeFilter *filter) {
+        telemetryFilter = filter;
+    }
+
+    void setAttributesFilter(ChangeFilter *filter) {
+        attributesFilter = filter;
+    }
 
     bool sendAttributes(DynamicJsonDocument json, bool queueOnMemoryOrFs, const String &deviceName = "");
 
@@ -69,7 +301,16 @@ public:
 
     void registerCallbackRawPayload(const MqttCallbackRawPayload &callback);
 
-    void registerCallbackJsonPayload(const MqttCallbackJsonPayload &callback);
+    // Inbound documents are parsed down to the keys declared by the handlers, a handler without keys gets them all.
+    // Keys are kept by pointer and must outlive the controller
+    void registerCallbackJsonPayload(const MqttCallbackJsonPayload &callback,
+                                     std::initializer_list<const char *> keys = {});
+
+    void setDefaultCallbackKeys(std::initializer_list<const char *> keys);
+
+    // Sends messages matching the filter straight to the handler, '+' levels arrive as integers in params.
+    // Registering a known filter again replaces its handler
+    void registerRoute(const char *filter, const MqttRouteCallback &callback);
 
     void onSentMQTTMessageCallback(const SentMQTTMessageCallback &callback);
 
@@ -81,18 +322,65 @@ public:
 
     void sendSystemAttributes(bool value);
 
+    void setDrainBudget(uint16_t timeMs, uint32_t bytes);
+
     void disconnect();
 
 private:
-    Queue *memoryQueue;
-    Queue *fsQueue;
+    Queue *memoryQueue = nullptr;
+    TieredQueue *fsQueue = nullptr;
 #ifdef INC_FREERTOS_H
     SemaphoreHandle_t semaQueue;
+    TaskHandle_t controllerTask = nullptr;
+    std::atomic<TaskHandle_t> producerTask{nullptr};
 #endif
+    SPSCChannel *producerChannel = nullptr;
+    // Written by producer tasks and taken by sendAttributesFunc() on the controller task, one report interval each
+    std::atomic<uint32_t> producerStallMaxUs{0};
+    std::atomic<uint32_t> producerStallTotalUs{0};
+    std::atomic<uint32_t> producerPushes{0};
+    uint8_t *batchBuffer = nullptr;
+    // Documents queued outside the producer channel are serialized here, under semaQueue
+    uint8_t *encodeBuffer = nullptr;
+    WireEncoding wireEncoding = MQTT_WIRE_ENCODING;
+    DynamicJsonDocument *transmitDoc = nullptr;
+    uint32_t batchedMessages = 0;
+    uint16_t drainTimeBudgetMs = MQTT_DRAIN_TIME_BUDGET_MS;
+    uint32_t drainByteBudgetMax = MQTT_DRAIN_BYTE_BUDGET, drainByteBudget = MQTT_DRAIN_BYTE_BUDGET;
+    uint32_t drainedBytes = 0;
+    uint64_t drainRateSince = 0;
+
+    // One in flight publish covers count messages starting at sequence firstSequence of its queue.
+    // Messages leave the queue only when every earlier publish from the same queue is acknowledged.
+    struct InFlightPublish {
+        uint16_t msgId;
+        bool memory;
+        uint16_t count;
+        uint32_t firstSequence;
+        uint64_t sentAt;
+        bool acked;
+    };
+    InFlightPublish inFlight[MQTT_QOS1_WINDOW > 0 ? MQTT_QOS1_WINDOW : 1];
+    uint8_t inFlightCount = 0;
+    bool resetInFlight = false;
     PubSubClient mqttClient;
     float updateInterval = 10;
     uint64_t lastSendAttributes;
-    uint64_t connectionRecheckTimeout;
+    uint64_t nextConnectAttempt = 0;
+    uint64_t connectStartedAt = 0, connectedAt = 0;
+    uint32_t connectLatency = 0, readyLatency = 0;
+    uint16_t subscribeMsgId = 0;
+    bool subscribed = false, sharedKeysAnswered = false, ready = false;
+    struct ConnectSharedKeys {
+        String keys;
+        MqttCallbackJsonPayload callback;
+    };
+    std::vector<ConnectSharedKeys> connectSharedKeys;
+    uint32_t reconnectDelay = 0;
+    bool connecting = false, wasConnected = false;
+    IPAddress brokerIp;
+    bool brokerResolved = false;
+    uint64_t brokerResolvedAt = 0;
     bool isSendAttributes = false;
     String id, username, pass, url;
     uint16_t port;
@@ -101,8 +389,42 @@ private:
     DefaultMqttCallbackRawPayload defaultCallbackRaw;
     std::vector<MqttCallbackRawPayload> registeredCallbacksRaw;
     std::vector<MqttCallbackJsonPayload> registeredCallbacksJson;
-    std::map<unsigned int, MqttCallbackJsonPayload> requestsCallbacksJson;
+    PendingRequests pendingRequests;
+    ChangeFilter *telemetryFilter = nullptr, *attributesFilter = nullptr;
+    TopicRouter router;
+    std::vector<MqttRouteCallback> routeCallbacks;
+    int16_t attributesResponseRoute, rpcResponseRoute;
+    DynamicJsonDocument *inboundDoc = nullptr;
+    DynamicJsonDocument *inboundFilter = nullptr;
+    bool inboundFilterAll = false, defaultKeysDeclared = false;
+    String inboundTopic;
     SentMQTTMessageCallback sentMqttMessageCallback;
+    // Enqueue times of the messages in the last publishFromQueue() call
+    uint32_t publishedEnqueuedAt[MQTT_BATCH_MAX_MESSAGES];
+    // Messages published in this loop() for sentMqttMessageCallback, copied out of the queues under
+    // semaQueue. The buffers keep their capacity from loop to loop
+    struct SentMessage {
+        uint32_t topicOffset, payloadOffset;
+        uint16_t payloadLength;
+        uint32_t enqueuedAt, latencyMs;
+    };
+    std::vector<SentMessage> sentMessages;
+    std::vector<uint8_t> sentCopies;
+    // Registered with Metrics in the constructor. Gauges read from other objects are sampled in
+    // sendAttributesFunc(), high water marks and the latency max/avg cover one report interval
+    struct {
+        Metric *memoryQueueSize, *fsQueueSize, *fsRamSize, *fsTotalBytes, *fsUsedBytes, *fsBytesWritten;
+        Metric *memoryQueueHighWater, *fsQueueHighWater, *producerChannelHighWater;
+        Metric *producerDrops, *producerStallMax, *producerStallAvg;
+        Metric *drainRate, *drainBudget, *inFlight, *retransmits, *publishFailures;
+        Metric *connects, *connectFailures, *connectLatency, *readyLatency;
+        Metric *pendingRequests, *requestTimeouts, *batchPublishes, *batchAvgSize;
+        Metric *latencyBuckets[MQTT_LATENCY_BUCKET_COUNT], *latencyMax, *latencyAvg;
+        Metric *upTime, *freeHeap, *minHeap, *temperature, *filteredKeys;
+    } metrics;
+    uint64_t latencyTotal = 0;
+    uint32_t latencyCount = 0;
+    char *metricsBuffer = nullptr;
     uint16_t defaultTimeout, defaultBufferSize, jsonSerializeBuffer;
     uint32_t timeout, requestId;
 
@@ -112,69 +434,166 @@ private:
 
     void on_message(const char *topic, uint8_t *payload, unsigned int length);
 
+    void declareInboundKeys(std::initializer_list<const char *> keys);
+
+    void startConnect();
+
+    void onConnected();
+
+    void requestConnectSharedKeys();
+
+    void onSuback(uint16_t msgId);
+
+    void checkReady();
+
+    void scheduleReconnect(int state);
+
+    void resolveBroker();
+
+    bool queueTelemetry(const JsonDocument &data, bool queueOnMemoryOrFs, uint64_t ts);
+
+    bool queueMsgPack(const char *topic, const JsonDocument &doc, const uint8_t *prefix, size_t prefixLength,
+                      size_t prefixUsage, bool memory_fs);
+
+    bool enqueue(const char *topic, const QueuedPayload &payload, bool memory_fs);
+
+    uint32_t sendRequest(const char *topicPrefix, const String &payload, const MqttCallbackJsonPayload &callback,
+                         const RequestResultCallback &result, uint32_t timeoutMs);
+
+    bool pushToQueue(const char *topic, const QueuedPayload &payload, bool memory_fs, uint32_t enqueuedAt);
+
+    void updateHighWater(bool memory_fs);
+
+    void recordPublished(bool memory_fs, uint16_t offset, uint16_t count);
+
+    void notifySent();
+
+    void registerMetrics();
+
+    void drainProducerChannel();
+
+    uint16_t publishFromQueue(bool memory_fs, uint16_t offset, uint16_t maxCount, uint16_t &msgId, uint32_t &bytes);
+
+    bool publishPacket(const char *topic, const uint8_t *payload, uint16_t payloadLength, uint16_t &msgId);
+
+    bool publishMessage(const MQTTMessageView &message, uint16_t &msgId, uint32_t &bytes);
+
+    bool appendJson(const MQTTMessageView &message, uint32_t &length);
+
+    bool appendMsgPack(const MQTTMessageView &message, uint32_t &length);
+
+    static bool isDataTopic(const char *topic);
+
+    template<typename TInput>
+    DeserializationError parseInbound(TInput input, unsigned int length, bool filtered);
+
+    uint32_t getHeadSequence(bool memory_fs);
+
+    uint16_t getInFlightAhead(bool memory_fs);
+
+    void onPuback(uint16_t msgId);
+
+    void completeAcked();
+
+    void retransmitExpired();
+
+    void removeInFlight(uint8_t index);
+
 };
 
 void MQTTController::registerCallbackRawPayload(const MqttCallbackRawPayload &callback) {
     registeredCallbacksRaw.push_back(callback);
 }
 
-void MQTTController::registerCallbackJsonPayload(const MQTTController::MqttCallbackJsonPayload &callback) {
+void MQTTController::registerCallbackJsonPayload(const MQTTController::MqttCallbackJsonPayload &callback,
+                                                 std::initializer_list<const char *> keys) {
     registeredCallbacksJson.push_back(callback);
+    declareInboundKeys(keys);
 }
 
-void MQTTController::on_message(const char *tp, uint8_t *payload, unsigned int length) {
-    String topic = String(tp);
+void MQTTController::setDefaultCallbackKeys(std::initializer_list<const char *> keys) {
+    defaultKeysDeclared = true;
+    declareInboundKeys(keys);
+}
 
-    printDBG("On message: ");
-    printDBGln(topic);
-    printDBG("Length: ");
-    printDBGln(String(length));
+void MQTTController::registerRoute(const char *filter, const MqttRouteCallback &callback) {
+    int16_t route = router.add(filter);
+    if (route >= (int16_t) routeCallbacks.size()) routeCallbacks.resize(route + 1);
+    routeCallbacks[route] = callback;
+}
 
+void MQTTController::declareInboundKeys(std::initializer_list<const char *> keys) {
+    if (keys.size() == 0) {
+        inboundFilterAll = true;
+        return;
+    }
+    if (inboundFilter == nullptr) inboundFilter = new DynamicJsonDocument(512);
+    for (const char *key: keys)
+        (*inboundFilter)[key] = true;
+}
 
-    for (MqttCallbackRawPayload callback: registeredCallbacksRaw)
-        if (callback(tp, payload, length))
+void MQTTController::on_message(const char *tp, uint8_t *payload, unsigned int length) {
+    // Reassigning keeps the capacity, so steady state traffic does not allocate for the topic
+    inboundTopic = tp;
+    printDBGln("On message: " + inboundTopic + " Length: " + String(length));
+
+    uint32_t params[TOPIC_ROUTER_MAX_PARAMS];
+    uint8_t paramCount;
+    int16_t route = router.match(tp, params, paramCount);
+    if (route != TOPIC_ROUTER_NO_ROUTE && route < (int16_t) routeCallbacks.size() && routeCallbacks[route] != nullptr &&
+        routeCallbacks[route](inboundTopic, params, payload, length))
+        return;
+
+    for (const MqttCallbackRawPayload &callback: registeredCallbacksRaw)
+        if (callback(inboundTopic, payload, length))
             return;
 
-    char json[length + 1];
-    strncpy(json, (char *) payload, length);
-    json[length] = '\0';
+    if (inboundDoc == nullptr) inboundDoc = new DynamicJsonDocument(jsonSerializeBuffer);
 
-    printDBG("Topic: ");
-    printDBGln(tp);
-    printDBG("Message: ");
-    printDBGln(json);
+    bool request = false;
+    if (route == attributesResponseRoute || route == rpcResponseRoute) {
+        printDBGln("TopicId response: " + String(params[0]));
+        request = pendingRequests.contains(params[0]);
+    }
 
-    // Decode JSON request
-    DynamicJsonDocument data(jsonSerializeBuffer);
-    auto error = deserializeJson(data, (char *) json);
+    // Request callbacks never declare keys, neither does a default callback unless told otherwise
+    bool filtered = inboundFilter != nullptr && !inboundFilterAll && !request &&
+                    (defaultCallback == nullptr || defaultKeysDeclared);
+
+    // In place parsing leaves the strings in the receive buffer, the raw default callback needs it untouched
+    DeserializationError error = defaultCallbackRaw == nullptr ? parseInbound((char *) payload, length, filtered)
+                                                               : parseInbound((const char *) payload, length,
+                                                                              filtered);
     if (error) {
-        printDBG("deserializeJson() failed with code ");
+        printDBG("Inbound payload could not be decoded: ");
         printDBGln(error.c_str());
-        if (defaultCallbackRaw != nullptr) defaultCallbackRaw(topic, payload, length);
+        if (defaultCallbackRaw != nullptr) defaultCallbackRaw(inboundTopic, payload, length);
         return;
     }
+    const JsonDocument &data = *inboundDoc;
 
-    if (topic.indexOf("v1/devices/me/attributes/response/") == 0 || topic.indexOf("v1/devices/me/rpc/response/") == 0) {
-        unsigned int topicId = topic.substring(topic.lastIndexOf("/") + 1).toInt();
-        printDBGln("TopicId response: " + String(topicId));
-        auto it = requestsCallbacksJson.begin();
-        for (int i = 0; i < requestsCallbacksJson.size(); i++) {
-            if (it->first == topicId) {
-                if (it->second(topic, data)) {
-                    requestsCallbacksJson.erase(topicId);
-                    return;
-                } else break;
-            }
-            it++;
-        }
-    }
+    if (request && pendingRequests.complete(params[0], inboundTopic, data))
+        return;
 
-    for (MqttCallbackJsonPayload callback: registeredCallbacksJson)
-        if (callback(topic, data))
+    for (const MqttCallbackJsonPayload &callback: registeredCallbacksJson)
+        if (callback(inboundTopic, data))
             return;
 
-    if (defaultCallback != nullptr) defaultCallback(topic, data);
-    if (defaultCallbackRaw != nullptr) defaultCallbackRaw(tp, payload, length);
+    if (defaultCallback != nullptr) defaultCallback(inboundTopic, data);
+    if (defaultCallbackRaw != nullptr) defaultCallbackRaw(inboundTopic, payload, length);
+}
+
+// Inbound payloads are JSON or MessagePack, told apart by their first byte
+template<typename TInput>
+DeserializationError MQTTController::parseInbound(TInput input, unsigned int length, bool filtered) {
+    if (isMsgPackPayload((const uint8_t *) input, length)) {
+        if (filtered)
+            return deserializeMsgPack(*inboundDoc, input, length, DeserializationOption::Filter(*inboundFilter));
+        return deserializeMsgPack(*inboundDoc, input, length);
+    }
+    if (filtered)
+        return deserializeJson(*inboundDoc, input, length, DeserializationOption::Filter(*inboundFilter));
+    return deserializeJson(*inboundDoc, input, length);
 }
 
 bool MQTTController::isConnected() {
@@ -197,12 +616,21 @@ MQTTController::connect(Client &client, String Id, String username_in, String pa
     this->defaultCallback = callback;
     this->defaultCallbackRaw = callbackRaw;
 
+    nextConnectAttempt = Uptime.getMilliseconds() + random(MQTT_CONNECT_START_JITTER_MS);
+    brokerResolved = false;
+
     this->mqttClient.setClient(client);
     mqttClient.setBufferSize(2048);
     mqttClient.setServer(url.c_str(), port);
     mqttClient.setCallback([&](const char *tp, uint8_t *payload, unsigned int length) {
         on_message(tp, payload, length);
     });
+    mqttClient.setPubackCallback([&](uint16_t msgId) {
+        onPuback(msgId);
+    });
+    mqttClient.setSubackCallback([&](uint16_t msgId) {
+        onSuback(msgId);
+    });
 
 }
 
@@ -216,100 +644,533 @@ void MQTTController::init() {
         ESP.restart();
     }
     xSemaphoreGive(semaQueue);
+    controllerTask = xTaskGetCurrentTaskHandle();
 #endif
+    delete producerChannel;
+    producerChannel = new SPSCChannel(MQTT_PRODUCER_CHANNEL_SIZE);
+    if (batchBuffer == nullptr)
+        batchBuffer = (uint8_t *) malloc(MQTT_BATCH_BUFFER_SIZE);
+    if (encodeBuffer == nullptr)
+        encodeBuffer = (uint8_t *) malloc(MQTT_ENCODE_BUFFER_SIZE);
+    if (transmitDoc == nullptr)
+        transmitDoc = new DynamicJsonDocument(MQTT_TRANSMIT_DOC_SIZE);
+    if (inboundDoc == nullptr)
+        inboundDoc = new DynamicJsonDocument(jsonSerializeBuffer);
+    if (metricsBuffer == nullptr)
+        metricsBuffer = (char *) malloc(MQTT_METRICS_BUFFER_SIZE);
     delete memoryQueue;
-    memoryQueue = new Queue(50, true);
+    memoryQueue = new Queue(MQTT_MEMORY_QUEUE_SIZE, true, false, MQTT_MEMORY_QUEUE_ARENA);
     delete fsQueue;
-    fsQueue = new Queue(512, true);
+    fsQueue = new TieredQueue(MQTT_FS_QUEUE_RAM_SIZE, MQTT_FS_QUEUE_RAM_ARENA, MQTT_FS_QUEUE_SPILL_WATERMARK,
+                              MQTT_FS_QUEUE_SIZE);
 }
 
-String lastTopic = "";
-String lastPayload = "";
 unsigned short lastRetry = 0;
 
 void MQTTController::loop() {
-    if (url.isEmpty() || username.isEmpty()) return;
+    if (url.isEmpty() || username.isEmpty()) {
+        // Producers may start before connect(), their messages still move on to the queues
+        if (producerChannel == nullptr) return;
+#ifdef INC_FREERTOS_H
+        if (xSemaphoreTake(semaQueue, portMAX_DELAY)) {
+#endif
+            drainProducerChannel();
+#ifdef INC_FREERTOS_H
+            xSemaphoreGive(semaQueue);
+        }
+#endif
+        return;
+    }
 
     uint64_t millis = Uptime.getMilliseconds();
     mqttClient.loop();
+    pendingRequests.expire(Uptime.getMilliseconds());
 
 #ifdef INC_FREERTOS_H
     if (xSemaphoreTake(semaQueue, portMAX_DELAY)) {
 #endif
-        uint16_t memoryQueueSize = memoryQueue == nullptr ? 0 : memoryQueue->getSize();
-        uint16_t fsQueueSize = fsQueue == nullptr ? 0 : fsQueue->getSize();
-        bool mqttIsConnected = isConnected();
-
-        if ((memoryQueueSize > 0 || fsQueueSize > 0) && mqttIsConnected) {
-
-            if (true) {
-                bool memory_fs = memoryQueueSize > 0;
-                MQTTMessage message = memory_fs ? memoryQueue->peek() : fsQueue->peek();
-                if (message.getPayload().equalsIgnoreCase(lastPayload) &&
-                    message.getTopic().equalsIgnoreCase(lastTopic)) {
-                    lastRetry++;
-                } else {
-                    lastRetry = 0;
-                    lastTopic = message.getTopic();
-                    lastPayload = message.getPayload();
-                }
-
-                if (lastRetry >= 10) {
-                    printDBGln(String("Memory Type [" + String(memory_fs) + "] " +
-                                      "MQTT failing 10 times to send a message, remove message - queue size is: " +
-                                      String(memory_fs ? memoryQueueSize : fsQueueSize)));
-                    memory_fs ? memoryQueue->removeLastPeek() : fsQueue->removeLastPeek();
-                } else if (lastRetry >= 5) {
-                    printDBGln(String("Memory Type [" + String(memory_fs) + "] " +
-                                      "MQTT failing 5 times to send a message, disconnect - queue size is: " +
-                                      String(memory_fs ? memoryQueueSize : fsQueueSize)));
-                    disconnect();
-                }
-
-                if (mqttClient.publish(message.getTopic().c_str(), message.getPayload().c_str())) {
-                    memory_fs == 1 ? memoryQueue->removeLastPeek() : fsQueue->removeLastPeek();;
-                }
+        drainProducerChannel();
+
+        // A new session knows nothing of the old packet ids, unacknowledged messages are sent again
+        if (inFlightCount > 0 && (resetInFlight || !isConnected())) {
+            completeAcked();
+            inFlightCount = 0;
+        }
+        resetInFlight = false;
+        completeAcked();
+
+        uint64_t drainStart = Uptime.getMilliseconds();
+        uint32_t loopBytes = 0;
+        int writeSpace = mqttClient.availableForWrite();
+        drainByteBudget = writeSpace > 0 ? min((uint32_t) writeSpace, drainByteBudgetMax) : drainByteBudgetMax;
+
+        if (isConnected()) retransmitExpired();
+
+        while (isConnected() && (MQTT_QOS1_WINDOW == 0 || inFlightCount < MQTT_QOS1_WINDOW)) {
+            uint16_t memoryQueueSize = memoryQueue == nullptr ? 0 : memoryQueue->getSize();
+            uint16_t fsQueueSize = fsQueue == nullptr ? 0 : fsQueue->getSize();
+            uint16_t memoryAhead = getInFlightAhead(true);
+            uint16_t fsAhead = getInFlightAhead(false);
+            if (memoryQueueSize <= memoryAhead && fsQueueSize <= fsAhead) break;
+
+            bool memory_fs = memoryQueueSize > memoryAhead;
+            uint16_t offset = memory_fs ? memoryAhead : fsAhead;
+
+            // Only a message at the head can be dropped, anything behind an in flight publish waits for it
+            if (lastRetry >= 10 && offset == 0) {
+                printDBGln(String("Memory Type [" + String(memory_fs) + "] " +
+                                  "MQTT failing 10 times to send a message, remove message - queue size is: " +
+                                  String(memory_fs ? memoryQueueSize : fsQueueSize)));
+                memory_fs ? memoryQueue->removeLastPeek() : fsQueue->removeLastPeek();
+                lastRetry = 0;
+                break;
+            } else if (lastRetry >= 5) {
+                printDBGln(String("Memory Type [" + String(memory_fs) + "] " +
+                                  "MQTT failing 5 times to send a message, disconnect - queue size is: " +
+                                  String(memory_fs ? memoryQueueSize : fsQueueSize)));
+                disconnect();
+            }
+
+            uint16_t msgId = 0;
+            uint32_t bytes = 0;
+            uint16_t published = publishFromQueue(memory_fs, offset, MQTT_BATCH_MAX_MESSAGES, msgId, bytes);
+            if (published == 0) {
+                // A short write drops the connection, the message stays queued for the next session
+                if (!isConnected()) break;
+                lastRetry++;
+                metrics.publishFailures->add();
+                break;
+            }
+            lastRetry = 0;
+            loopBytes += bytes;
+            recordPublished(memory_fs, offset, published);
+
+            if (MQTT_QOS1_WINDOW > 0) {
+                inFlight[inFlightCount++] = {msgId, memory_fs, published, getHeadSequence(memory_fs) + offset,
+                                             Uptime.getMilliseconds(), false};
+            } else {
+                for (uint16_t i = 0; i < published; i++)
+                    memory_fs == 1 ? memoryQueue->removeLastPeek() : fsQueue->removeLastPeek();
             }
+
+            if (loopBytes >= drainByteBudget || Uptime.getMilliseconds() - drainStart >= drainTimeBudgetMs) break;
         }
+        drainedBytes += loopBytes;
+
+        if (fsQueue != nullptr)
+            fsQueue->spill(MQTT_FS_QUEUE_SPILL_PER_LOOP);
 #ifdef INC_FREERTOS_H
         xSemaphoreGive(semaQueue);
     }
 #endif
+    notifySent();
 
     if (isSendAttributes && ((millis - lastSendAttributes) > ((uint64_t) (updateInterval * 1000)))) {
         lastSendAttributes = millis;
         sendAttributesFunc();
     }
 
-    if ((millis - connectionRecheckTimeout) <= timeout) return;
-    connectionRecheckTimeout = millis;
+    // CONNECT is out, CONNACK is polled here instead of blocking the loop
+    if (connecting) {
+        int state = mqttClient.pollConnect();
+        if (state == MQTT_CONNECTING) return;
+        connecting = false;
+        if (state == MQTT_CONNECTED) onConnected();
+        else scheduleReconnect(state);
+        return;
+    }
 
-    if (!isConnected()) {
-        //todo: fixbug: not reConnect to cloud after invalid token
-        disconnect();
-        printDBG(String("Connecting to MQTT server... "));
-        if (mqttClient.connect(id.c_str(), username.c_str(), pass.c_str())) {
-            printDBGln("[Connected]");
-            if (isSendAttributes)
-                addToPublishQueue(V1_Attributes_TOPIC, getChipInfo(), true);
+    if (isConnected()) return;
+    if (wasConnected) {
+        wasConnected = false;
+        reconnectDelay = 0;
+        printDBG("MQTT connection lost ");
+        scheduleReconnect(mqttClient.state());
+        return;
+    }
+    if (millis < nextConnectAttempt) return;
+    startConnect();
+}
 
-            mqttClient.subscribe("v1/devices/me/rpc/request/+");
-            mqttClient.subscribe("v1/devices/me/attributes/response/+");
-            mqttClient.subscribe(V1_Attributes_TOPIC);
-            mqttClient.subscribe("v2/fw/response/+/chunk/+");
+void MQTTController::startConnect() {
+    //todo: fixbug: not reConnect to cloud after invalid token
+    disconnect();
+    resolveBroker();
+    printDBG(String("Connecting to MQTT server... "));
+    connectStartedAt = Uptime.getMilliseconds();
+    if (mqttClient.beginConnect(id.c_str(), username.c_str(), pass.c_str())) connecting = true;
+    else scheduleReconnect(mqttClient.state());
+}
+
+// Connect sequence: one SUBSCRIBE for every topic, the connect event, then one merged shared keys request.
+// Everything is queued at once and drained together, the session is ready once SUBACK and the keys are in
+void MQTTController::onConnected() {
+    connectedAt = Uptime.getMilliseconds();
+    connectLatency = connectedAt - connectStartedAt;
+    metrics.connects->add();
+    printDBGln("[Connected] in " + String(connectLatency) + " ms");
+    reconnectDelay = 0;
+    wasConnected = true;
+    resetInFlight = true;
+    ready = false;
+    if (isSendAttributes)
+        addToPublishQueue(V1_Attributes_TOPIC, getChipInfo(), true);
+
+    const char *topics[] = {"v1/devices/me/rpc/request/+", "v1/devices/me/rpc/response/+",
+                            "v1/devices/me/attributes/response/+", V1_Attributes_TOPIC, "v2/fw/response/+/chunk/+"};
+    subscribeMsgId = mqttClient.subscribe(topics, sizeof(topics) / sizeof(topics[0]), 0);
+    // Without a SUBSCRIBE on the wire there is no SUBACK to wait for
+    subscribed = subscribeMsgId == 0;
+
+    if (connectedEvent != nullptr) {
+        connectedEvent();
+    }
+    requestConnectSharedKeys();
+    checkReady();
+}
+
+void MQTTController::requestSharedKeysOnConnect(const String &keys, const MqttCallbackJsonPayload &callback) {
+    for (ConnectSharedKeys &entry: connectSharedKeys) {
+        if (entry.keys == keys) {
+            entry.callback = callback;
+            return;
+        }
+    }
+    connectSharedKeys.push_back({keys, callback});
+}
 
-            if (connectedEvent != nullptr) {
-                connectedEvent();
+void MQTTController::requestConnectSharedKeys() {
+    sharedKeysAnswered = connectSharedKeys.empty();
+    if (sharedKeysAnswered) return;
+
+    String merged;
+    for (ConnectSharedKeys &entry: connectSharedKeys) {
+        int start = 0;
+        while (start < (int) entry.keys.length()) {
+            int end = entry.keys.indexOf(',', start);
+            if (end < 0) end = entry.keys.length();
+            String key = entry.keys.substring(start, end);
+            key.trim();
+            if (!key.isEmpty() && (String(",") + merged + ",").indexOf("," + key + ",") < 0) {
+                if (!merged.isEmpty()) merged += ",";
+                merged += key;
             }
+            start = end + 1;
+        }
+    }
 
-        } else {
-            printDBG("[FAILED] [ rc = ");
-            printDBG(String(mqttClient.state()));
-            printDBGln(String(" : retrying in " + String(timeout / 1000) + " seconds]"));
+    DynamicJsonDocument request(64 + merged.length());
+    request["sharedKeys"] = merged;
+    uint32_t id = sendRequest("v1/devices/me/attributes/request/", request.as<String>(),
+                              [this](const String &topic, const JsonDocument &json) -> bool {
+                                  bool handled = false;
+                                  for (ConnectSharedKeys &entry: connectSharedKeys)
+                                      if (entry.callback != nullptr && entry.callback(topic, json))
+                                          handled = true;
+                                  return handled;
+                              },
+                              [this](uint32_t requestId, PendingResult result) {
+                                  if (result == PENDING_TIMED_OUT)
+                                      printDBGln("Shared keys request [" + String(requestId) + "] timed out");
+                                  sharedKeysAnswered = true;
+                                  checkReady();
+                              }, MQTT_REQUEST_TIMEOUT_MS);
+    if (id == 0) sharedKeysAnswered = true;
+}
+
+void MQTTController::onSuback(uint16_t msgId) {
+    if (msgId != subscribeMsgId) return;
+    subscribed = true;
+    checkReady();
+}
+
+void MQTTController::checkReady() {
+    if (ready || !subscribed || !sharedKeysAnswered) return;
+    ready = true;
+    readyLatency = Uptime.getMilliseconds() - connectedAt;
+    printDBGln("MQTT session ready " + String(readyLatency) + " ms after CONNACK");
+}
+
+void MQTTController::scheduleReconnect(int state) {
+    // The address may have moved, resolve it again before the next try
+    if (state == MQTT_CONNECT_FAILED || state == MQTT_CONNECTION_TIMEOUT) brokerResolved = false;
+    metrics.connectFailures->add();
+
+    reconnectDelay = reconnectDelay == 0 ? timeout : min(reconnectDelay * 2, (uint32_t) MQTT_RECONNECT_MAX_MS);
+    uint32_t wait = reconnectDelay / 2 + random(reconnectDelay / 2 + 1);
+    nextConnectAttempt = Uptime.getMilliseconds() + wait;
+
+    printDBG("[FAILED] [ rc = ");
+    printDBG(String(state));
+    printDBGln(String(" : retrying in " + String(wait / 1000.0) + " seconds]"));
+}
+
+// Resolving blocks, so it happens once per MQTT_DNS_CACHE_MS instead of inside every connect attempt
+void MQTTController::resolveBroker() {
+    uint64_t now = Uptime.getMilliseconds();
+    if (brokerResolved && now - brokerResolvedAt < MQTT_DNS_CACHE_MS) return;
+#ifdef ESP32
+    IPAddress ip;
+    if (WiFi.hostByName(url.c_str(), ip) == 1) {
+        brokerIp = ip;
+        brokerResolved = true;
+        brokerResolvedAt = now;
+        mqttClient.setServer(brokerIp, port);
+        return;
+    }
+    printDBGln("Could not resolve " + url + ", leaving it to the client");
+#endif
+    // Clients on other stacks, a modem for one, resolve the name themselves
+    mqttClient.setServer(url.c_str(), port);
+}
+
+// Publishes the message offset positions after the head of a queue and returns how many messages went out,
+// 0 on failure. A run of telemetry messages is sent as one array payload, ThingsBoard stores each element.
+uint16_t MQTTController::publishFromQueue(bool memory_fs, uint16_t offset, uint16_t maxCount, uint16_t &msgId,
+                                          uint32_t &bytes) {
+    MQTTMessageView message;
+    if (!(memory_fs ? memoryQueue->peekAt(offset, message) : fsQueue->peekAt(offset, message))) return 0;
+    publishedEnqueuedAt[0] = message.enqueuedAt;
+    if (batchBuffer == nullptr || maxCount <= 1 || strcmp(message.topic, V1_TELEMETRY_TOPIC) != 0)
+        return publishMessage(message, msgId, bytes) ? 1 : 0;
+
+    // A MessagePack batch starts with an array16 header, written once the count is known
+    bool binary = wireEncoding == WIRE_ENCODING_MSGPACK;
+    uint32_t length = binary ? 3 : 1;
+    uint16_t count = 0;
+    batchBuffer[0] = '[';
+    do {
+        if (!(binary ? appendMsgPack(message, length) : appendJson(message, length))) break;
+        publishedEnqueuedAt[count++] = message.enqueuedAt;
+    } while (count < maxCount && count < MQTT_BATCH_MAX_MESSAGES &&
+             (memory_fs ? memoryQueue->peekNext(message) : fsQueue->peekNext(message)) &&
+             strcmp(message.topic, V1_TELEMETRY_TOPIC) == 0);
+
+    if (count <= 1) {
+        // Nothing to merge, send the message on its own
+        if (!(memory_fs ? memoryQueue->peekAt(offset, message) : fsQueue->peekAt(offset, message))) return 0;
+        return publishMessage(message, msgId, bytes) ? 1 : 0;
+    }
+
+    if (binary) {
+        batchBuffer[0] = 0xdc;
+        batchBuffer[1] = count >> 8;
+        batchBuffer[2] = count & 0xFF;
+    } else {
+        batchBuffer[length++] = ']';
+    }
+    bytes = length + strlen(V1_TELEMETRY_TOPIC);
+    if (!publishPacket(V1_TELEMETRY_TOPIC, batchBuffer, length, msgId)) return 0;
+    metrics.batchPublishes->add();
+    batchedMessages += count;
+    return count;
+}
+
+// Publishes are written straight from the batch buffer, so only its own size bounds the payload.
+// One byte is kept free for the closing bracket
+bool MQTTController::appendJson(const MQTTMessageView &message, uint32_t &length) {
+    uint32_t start = length > 1 ? length + 1 : length;
+    uint32_t elementLength;
+    if (isMsgPackPayload(message.payload, message.payloadLength)) {
+        if (transmitDoc == nullptr || deserializeMsgPack(*transmitDoc, message.payload, message.payloadLength))
+            return false;
+        elementLength = measureJson(*transmitDoc);
+        if (start + elementLength + 1 > MQTT_BATCH_BUFFER_SIZE) return false;
+        // The terminator lands on the byte kept free, the next separator or the closing bracket replaces it
+        serializeJson(*transmitDoc, (char *) batchBuffer + start, elementLength + 1);
+    } else {
+        elementLength = message.payloadLength;
+        if (start + elementLength + 1 > MQTT_BATCH_BUFFER_SIZE) return false;
+        memcpy(batchBuffer + start, message.payload, elementLength);
+    }
+    // An array payload contributes its elements
+    if (elementLength >= 2 && batchBuffer[start] == '[' && batchBuffer[start + elementLength - 1] == ']') {
+        memmove(batchBuffer + start, batchBuffer + start + 1, elementLength - 2);
+        elementLength -= 2;
+    }
+    if (elementLength > 0) {
+        if (length > 1) batchBuffer[length] = ',';
+        length = start + elementLength;
+    }
+    return true;
+}
+
+// Queued MessagePack is copied as is. Array payloads end the batch, their element count would have to be
+// decoded to fix up the header
+bool MQTTController::appendMsgPack(const MQTTMessageView &message, uint32_t &length) {
+    if (isMsgPackPayload(message.payload, message.payloadLength)) {
+        uint8_t first = message.payload[0];
+        if ((first & 0xF0) == 0x90 || first == 0xdc || first == 0xdd) return false;
+        if (length + message.payloadLength > MQTT_BATCH_BUFFER_SIZE) return false;
+        memcpy(batchBuffer + length, message.payload, message.payloadLength);
+        length += message.payloadLength;
+        return true;
+    }
+
+    if (transmitDoc == nullptr ||
+        deserializeJson(*transmitDoc, (const char *) message.payload, message.payloadLength) ||
+        transmitDoc->is<JsonArray>())
+        return false;
+    size_t elementLength = measureMsgPack(*transmitDoc);
+    if (length + elementLength > MQTT_BATCH_BUFFER_SIZE) return false;
+    serializeMsgPack(*transmitDoc, batchBuffer + length, elementLength);
+    length += elementLength;
+    return true;
+}
+
+bool MQTTController::isDataTopic(const char *topic) {
+    return strcmp(topic, V1_TELEMETRY_TOPIC) == 0 || strcmp(topic, V1_Attributes_TOPIC) == 0 ||
+           strcmp(topic, V1_TELEMETRY_GATEWAY_TOPIC) == 0 || strcmp(topic, V1_Attributes_GATEWAY_TOPIC) == 0;
+}
+
+// Payloads already in the wire encoding go out as stored. Anything else is decoded and serialized straight
+// into the client, the length comes from measureJson or measureMsgPack
+bool MQTTController::publishMessage(const MQTTMessageView &message, uint16_t &msgId, uint32_t &bytes) {
+    bool binary = wireEncoding == WIRE_ENCODING_MSGPACK && isDataTopic(message.topic);
+    bool compact = isMsgPackPayload(message.payload, message.payloadLength);
+    if (binary == compact) {
+        bytes = message.payloadLength + strlen(message.topic);
+        return publishPacket(message.topic, message.payload, message.payloadLength, msgId);
+    }
+
+    if (transmitDoc == nullptr) return false;
+    DeserializationError error = compact ? deserializeMsgPack(*transmitDoc, message.payload, message.payloadLength)
+                                         : deserializeJson(*transmitDoc, (const char *) message.payload,
+                                                           message.payloadLength);
+    if (error) {
+        printDBGln(String("Queued payload could not be decoded: ") + error.c_str());
+        return false;
+    }
+    size_t length = binary ? measureMsgPack(*transmitDoc) : measureJson(*transmitDoc);
+    bytes = length + strlen(message.topic);
+
+    if (MQTT_QOS1_WINDOW == 0) {
+        if (!mqttClient.beginPublish(message.topic, length, false)) return false;
+    } else {
+        msgId = mqttClient.beginPublish_Q1(message.topic, length, false, msgId);
+        if (msgId == 0) return false;
+    }
+    PublishWriter writer(mqttClient);
+    if (binary) serializeMsgPack(*transmitDoc, writer);
+    else serializeJson(*transmitDoc, writer);
+    // A packet cut short has already dropped the connection in PubSubClient
+    if (!writer.finish()) return false;
+    return mqttClient.endPublish();
+}
+
+bool MQTTController::addToPublishQueue(const char *topic, const JsonDocument &doc, bool memory_fs) {
+    return queueMsgPack(topic, doc, nullptr, 0, 0, memory_fs);
+}
+
+// Queues doc as MessagePack after prefix, prefixUsage is what the prefix adds when the payload is decoded.
+// A document that transmitDoc could not hold again when re-encoding is refused here, it would otherwise
+// fail every publish attempt
+bool MQTTController::queueMsgPack(const char *topic, const JsonDocument &doc, const uint8_t *prefix,
+                                  size_t prefixLength, size_t prefixUsage, bool memory_fs) {
+    size_t length = prefixLength + measureMsgPack(doc);
+    size_t usage = prefixUsage + doc.memoryUsage();
+    if (length > MQTT_ENCODE_BUFFER_SIZE || usage > MQTT_TRANSMIT_DOC_SIZE) {
+        printDBGln(String("Error: message for [") + topic + "] is too large to queue: " + String((uint32_t) length) +
+                   " bytes, document " + String((uint32_t) usage) + " bytes");
+        return false;
+    }
+    return enqueue(topic, {nullptr, &doc, prefix, prefixLength, (uint16_t) length}, memory_fs);
+}
+
+bool MQTTController::publishNow(const char *topic, const uint8_t *payload, uint16_t payloadLength) {
+    return isConnected() && mqttClient.publish(topic, payload, payloadLength);
+}
+
+// msgId 0 sends a new packet and returns its id, any other id is resent as a duplicate
+bool MQTTController::publishPacket(const char *topic, const uint8_t *payload, uint16_t payloadLength,
+                                   uint16_t &msgId) {
+    if (MQTT_QOS1_WINDOW == 0)
+        return mqttClient.publish(topic, payload, payloadLength);
+    msgId = mqttClient.publish_Q1(topic, payload, payloadLength, false, msgId);
+    return msgId != 0;
+}
+
+uint32_t MQTTController::getHeadSequence(bool memory_fs) {
+    return memory_fs ? memoryQueue->getHeadSequence() : fsQueue->getHeadSequence();
+}
+
+// Messages of a queue already covered by in flight publishes, new publishes start after them
+uint16_t MQTTController::getInFlightAhead(bool memory_fs) {
+    if (inFlightCount == 0) return 0;
+    uint32_t head = getHeadSequence(memory_fs);
+    int32_t ahead = 0;
+    for (uint8_t i = 0; i < inFlightCount; i++) {
+        if (inFlight[i].memory != memory_fs) continue;
+        int32_t end = (int32_t) (inFlight[i].firstSequence + inFlight[i].count - head);
+        if (end > ahead) ahead = end;
+    }
+    return ahead;
+}
+
+void MQTTController::onPuback(uint16_t msgId) {
+    for (uint8_t i = 0; i < inFlightCount; i++) {
+        if (inFlight[i].msgId == msgId) {
+            inFlight[i].acked = true;
+            return;
         }
     }
 }
 
+void MQTTController::removeInFlight(uint8_t index) {
+    for (uint8_t i = index + 1; i < inFlightCount; i++)
+        inFlight[i - 1] = inFlight[i];
+    inFlightCount--;
+}
+
+// Removes the messages of acknowledged publishes, in order and per queue
+void MQTTController::completeAcked() {
+    for (bool memory_fs: {true, false}) {
+        while (true) {
+            uint8_t i = 0;
+            while (i < inFlightCount && inFlight[i].memory != memory_fs) i++;
+            if (i == inFlightCount || !inFlight[i].acked) break;
+
+            // Messages the queue dropped by itself in the meantime are already gone
+            int32_t pending = (int32_t) (inFlight[i].firstSequence + inFlight[i].count - getHeadSequence(memory_fs));
+            for (int32_t j = 0; j < pending; j++)
+                memory_fs ? memoryQueue->removeLastPeek() : fsQueue->removeLastPeek();
+            removeInFlight(i);
+        }
+    }
+}
+
+void MQTTController::retransmitExpired() {
+    uint64_t now = Uptime.getMilliseconds();
+    for (uint8_t i = 0; i < inFlightCount; i++) {
+        InFlightPublish &entry = inFlight[i];
+        if (entry.acked || now - entry.sentAt < MQTT_QOS1_RETRANSMIT_MS) continue;
+
+        uint32_t head = getHeadSequence(entry.memory);
+        int32_t start = (int32_t) (entry.firstSequence - head);
+        int32_t end = (int32_t) (entry.firstSequence + entry.count - head);
+        if (end <= 0) {
+            // Dropped by the queue while in flight, nothing left to deliver
+            entry.acked = true;
+            continue;
+        }
+        if (start < 0) start = 0;
+
+        uint16_t msgId = entry.msgId;
+        uint32_t bytes = 0;
+        uint16_t published = publishFromQueue(entry.memory, start, end - start, msgId, bytes);
+        if (published == 0) return;
+        metrics.retransmits->add();
+        if (published < end - start) {
+            // The batch came out shorter, later publishes of this queue are sent again from here on
+            for (uint8_t j = inFlightCount - 1; j > i; j--)
+                if (inFlight[j].memory == entry.memory) removeInFlight(j);
+        }
+        entry.firstSequence = head + start;
+        entry.count = published;
+        entry.sentAt = now;
+    }
+}
+
 #ifdef ESP32
 #ifdef __cplusplus
 extern "C" {
@@ -342,30 +1203,62 @@ String MQTTController::getChipInfo() {
 }
 
 void MQTTController::sendAttributesFunc() {
-    if (!isConnected())
+    if (!isConnected() || metricsBuffer == nullptr)
         return;
 
-    DynamicJsonDocument data(400);
-    if (memoryQueue != nullptr) {
-        DynamicJsonDocument queueStats = memoryQueue->showStoreOnDiskStatus();
-        for (const auto &kv: queueStats.as<JsonObject>())
-            data["memory_" + String(kv.key().c_str())] = queueStats[kv.key()];
-    }
+    uint64_t now = Uptime.getMilliseconds();
+    if (memoryQueue != nullptr) metrics.memoryQueueSize->set(memoryQueue->getSize());
     if (fsQueue != nullptr) {
-        DynamicJsonDocument queueStats = fsQueue->showStoreOnDiskStatus();
-        for (const auto &kv: queueStats.as<JsonObject>())
-            data["fs_" + String(kv.key().c_str())] = queueStats[kv.key()];
+        metrics.fsQueueSize->set(fsQueue->getSize());
+        metrics.fsRamSize->set(fsQueue->getFrontSize());
+        metrics.fsBytesWritten->set(fsQueue->getBytesWritten());
     }
-    data[String("upTime")] = Uptime.getSeconds();
-    data[String("ESP Free Heap")] = ESP.getFreeHeap();
-    data[String("ESP Min Heap")] = ESP.getMinFreeHeap();
+#ifdef ESP32
+    metrics.fsTotalBytes->set(LittleFS.totalBytes());
+    metrics.fsUsedBytes->set(LittleFS.usedBytes());
+#endif
+    if (producerChannel != nullptr)
+        metrics.producerDrops->set(producerChannel->getDrops());
+    uint32_t pushes = producerPushes.exchange(0, std::memory_order_relaxed);
+    uint32_t stallTotal = producerStallTotalUs.exchange(0, std::memory_order_relaxed);
+    metrics.producerStallMax->set(producerStallMaxUs.exchange(0, std::memory_order_relaxed));
+    metrics.producerStallAvg->set(pushes == 0 ? 0 : stallTotal / pushes);
+    if (now > drainRateSince)
+        metrics.drainRate->set((uint32_t) ((uint64_t) drainedBytes * 1000 / (now - drainRateSince)));
+    metrics.drainBudget->set(drainByteBudget);
+    drainedBytes = 0;
+    drainRateSince = now;
+    metrics.inFlight->set(inFlightCount);
+    metrics.connectLatency->set(connectLatency);
+    metrics.readyLatency->set(readyLatency);
+    metrics.pendingRequests->set(pendingRequests.getCount());
+    metrics.requestTimeouts->set(pendingRequests.getTimeouts());
+    metrics.latencyAvg->set(latencyCount == 0 ? 0 : (uint32_t) (latencyTotal / latencyCount));
+    uint32_t batchPublishes = metrics.batchPublishes->get();
+    metrics.batchAvgSize->setFloat(batchPublishes == 0 ? 0 : (float) batchedMessages / batchPublishes);
+    metrics.upTime->set(Uptime.getSeconds());
+    metrics.freeHeap->set(ESP.getFreeHeap());
+    metrics.minHeap->set(ESP.getMinFreeHeap());
     printDBGln("Esp free heap: " + String(ESP.getFreeHeap()));
 
 #ifdef ESP32
-    data[String("ESP32 temperature")] = (temprature_sens_read() - 32) / 1.8;
+    metrics.temperature->setFloat((temprature_sens_read() - 32) / 1.8);
 #endif
+    metrics.filteredKeys->set(Metrics.getSuppressed() +
+                              (telemetryFilter == nullptr ? 0 : telemetryFilter->getSuppressed()) +
+                              (attributesFilter == nullptr ? 0 : attributesFilter->getSuppressed()));
+
+    size_t length = Metrics.serialize(metricsBuffer, MQTT_METRICS_BUFFER_SIZE, now);
 
-    addToPublishQueue(V1_Attributes_TOPIC, data.as<String>(), true);
+    // The next interval starts from the current state
+    metrics.memoryQueueHighWater->set(memoryQueue == nullptr ? 0 : memoryQueue->getSize());
+    metrics.fsQueueHighWater->set(fsQueue == nullptr ? 0 : fsQueue->getSize());
+    metrics.producerChannelHighWater->set(0);
+    metrics.latencyMax->set(0);
+    latencyTotal = 0;
+    latencyCount = 0;
+
+    if (length > 0) addToPublishQueue(V1_Attributes_TOPIC, (const uint8_t *) metricsBuffer, length, true);
 }
 
 void MQTTController::updateSendSystemAttributesInterval(float seconds) {
@@ -377,22 +1270,74 @@ bool MQTTController::setBufferSize(uint16_t chunkSize) {
 }
 
 bool MQTTController::addToPublishQueue(const String &topic, const String &payload, bool memory_fs) {
+    return addToPublishQueue(topic.c_str(), (const uint8_t *) payload.c_str(), payload.length(), memory_fs);
+}
+
+bool MQTTController::addToPublishQueue(const char *topic, const uint8_t *payload, uint16_t payloadLength,
+                                       bool memory_fs) {
+    return enqueue(topic, {payload, nullptr, nullptr, 0, payloadLength}, memory_fs);
+}
 
+bool MQTTController::enqueue(const char *topic, const QueuedPayload &payload, bool memory_fs) {
+#if defined(INC_FREERTOS_H)
+    TaskHandle_t currentTask = xTaskGetCurrentTaskHandle();
+    if (controllerTask != nullptr && currentTask != controllerTask) {
+        uint32_t start = micros();
+        bool result;
+#ifndef MQTT_PRODUCER_USE_SEMAPHORE
+        // The first producer task owns the wait-free channel, any other one falls back to the semaphore.
+        // Documents are serialized straight into the reserved record, nothing is shared with other tasks
+        TaskHandle_t expected = nullptr;
+        producerTask.compare_exchange_strong(expected, currentTask);
+        if (producerTask.load() == currentTask && producerChannel != nullptr) {
+            uint8_t *destination = producerChannel->reserve(topic, payload.length, memory_fs, millis());
+            result = destination != nullptr;
+            if (result) {
+                payload.writeTo(destination);
+                producerChannel->commit();
+            } else {
+                printDBGln(String("Memory Type [" + String(memory_fs) + "] " + "Producer channel is full, drops: " +
+                                  String(producerChannel->getDrops())));
+            }
+        } else
+#endif
+        {
+            result = pushToQueue(topic, payload, memory_fs, millis());
+        }
+
+        uint32_t stall = micros() - start;
+        uint32_t stallMax = producerStallMaxUs.load(std::memory_order_relaxed);
+        while (stall > stallMax &&
+               !producerStallMaxUs.compare_exchange_weak(stallMax, stall, std::memory_order_relaxed)) {}
+        producerStallTotalUs.fetch_add(stall, std::memory_order_relaxed);
+        producerPushes.fetch_add(1, std::memory_order_relaxed);
+        return result;
+    }
+#endif
+    return pushToQueue(topic, payload, memory_fs, millis());
+}
+
+bool MQTTController::pushToQueue(const char *topic, const QueuedPayload &payload, bool memory_fs,
+                                 uint32_t enqueuedAt) {
     bool result = false;
 #ifdef INC_FREERTOS_H
     if (xSemaphoreTake(semaQueue, portMAX_DELAY)) {
 #endif
-        MQTTMessage message(topic, payload);
-        if (memory_fs ? memoryQueue == nullptr : fsQueue == nullptr) {
+        const uint8_t *bytes = payload.bytes;
+        if (payload.doc != nullptr && encodeBuffer != nullptr) {
+            payload.writeTo(encodeBuffer);
+            bytes = encodeBuffer;
+        }
+        if ((memory_fs ? memoryQueue == nullptr : fsQueue == nullptr) || bytes == nullptr) {
             printDBGln(String("Memory Type [" + String(memory_fs) + "] " + "Queue is null"));
             result = false;
-        } else if (memory_fs ? !memoryQueue->push(message) : !fsQueue->push(message)) {
+        } else if (memory_fs ? !memoryQueue->push(topic, bytes, payload.length, enqueuedAt)
+                             : !fsQueue->push(topic, bytes, payload.length, enqueuedAt)) {
             printDBGln(String("Memory Type [" + String(memory_fs) + "] " + "Could not pushed message: " +
                               String(memory_fs ? memoryQueue->getSize() : fsQueue->getSize())));
             result = false;
         } else {
-//            printDBGln(String("Memory Type [" + String(memory_fs) + "] " + "MQTT Queue Size after push the message: " +
-//                              String(memory_fs ? memoryQueue->getSize() : fsQueue->getSize())));
+            updateHighWater(memory_fs);
             result = true;
         }
 
@@ -403,52 +1348,176 @@ bool MQTTController::addToPublishQueue(const String &topic, const String &payloa
     return result;
 }
 
+// Runs on the controller task with semaQueue held
+void MQTTController::drainProducerChannel() {
+    if (producerChannel == nullptr) return;
+    uint32_t channelBytes = producerChannel->getUsedBytes();
+    if (channelBytes > metrics.producerChannelHighWater->get()) metrics.producerChannelHighWater->set(channelBytes);
+
+    MQTTMessageView message;
+    uint8_t memory_fs;
+    while (producerChannel->peek(message, memory_fs)) {
+        bool pushed = memory_fs ? memoryQueue->push(message.topic, message.payload, message.payloadLength,
+                                                    message.enqueuedAt)
+                                : fsQueue->push(message.topic, message.payload, message.payloadLength,
+                                                message.enqueuedAt);
+        if (pushed) updateHighWater(memory_fs);
+        else printDBGln(String("Memory Type [" + String(memory_fs) + "] " + "Could not move message from channel"));
+        producerChannel->pop();
+    }
+}
+
+void MQTTController::updateHighWater(bool memory_fs) {
+    Metric *highWater = memory_fs ? metrics.memoryQueueHighWater : metrics.fsQueueHighWater;
+    uint16_t size = memory_fs ? memoryQueue->getSize() : fsQueue->getSize();
+    if (size > highWater->get()) highWater->set(size);
+}
+
+// Counts the messages of a new publish into the latency histogram. The callback needs the messages
+// themselves, they are only peeked again and copied when one is registered
+void MQTTController::recordPublished(bool memory_fs, uint16_t offset, uint16_t count) {
+    uint32_t now = millis();
+    for (uint16_t i = 0; i < count; i++) {
+        if (publishedEnqueuedAt[i] == 0) continue;
+        uint32_t latency = now - publishedEnqueuedAt[i];
+        uint8_t bucket = 0;
+        while (bucket < MQTT_LATENCY_BUCKET_COUNT - 1 && latency > mqttLatencyBucketBounds[bucket]) bucket++;
+        metrics.latencyBuckets[bucket]->add();
+        latencyTotal += latency;
+        latencyCount++;
+        if (latency > metrics.latencyMax->get()) metrics.latencyMax->set(latency);
+    }
+
+    if (sentMqttMessageCallback == nullptr) return;
+    MQTTMessageView message;
+    bool found = memory_fs ? memoryQueue->peekAt(offset, message) : fsQueue->peekAt(offset, message);
+    for (uint16_t i = 0; i < count && found; i++) {
+        size_t topicLength = strlen(message.topic) + 1;
+        SentMessage sent = {(uint32_t) sentCopies.size(), (uint32_t) (sentCopies.size() + topicLength),
+                            message.payloadLength, message.enqueuedAt,
+                            publishedEnqueuedAt[i] == 0 ? 0 : now - publishedEnqueuedAt[i]};
+        sentCopies.insert(sentCopies.end(), (const uint8_t *) message.topic,
+                          (const uint8_t *) message.topic + topicLength);
+        sentCopies.insert(sentCopies.end(), message.payload, message.payload + message.payloadLength);
+        sentMessages.push_back(sent);
+        found = memory_fs ? memoryQueue->peekNext(message) : fsQueue->peekNext(message);
+    }
+}
+
+// Runs on the controller task with semaQueue given back. A callback queueing a message takes it again
+void MQTTController::notifySent() {
+    if (sentMessages.empty()) return;
+    for (const SentMessage &sent: sentMessages) {
+        if (sentMqttMessageCallback == nullptr) break;
+        MQTTMessageView message = {(const char *) sentCopies.data() + sent.topicOffset,
+                                   sentCopies.data() + sent.payloadOffset, sent.payloadLength, sent.enqueuedAt};
+        sentMqttMessageCallback(message, sent.latencyMs);
+    }
+    sentMessages.clear();
+    sentCopies.clear();
+}
+
+// The names are the attribute keys reported by earlier versions, dashboards keep working
+void MQTTController::registerMetrics() {
+    metrics.memoryQueueSize = Metrics.gauge("memory_QueueSize");
+    metrics.fsQueueSize = Metrics.gauge("fs_QueueSize");
+    metrics.fsRamSize = Metrics.gauge("fs_RamSize");
+    metrics.fsTotalBytes = Metrics.gauge("fs_FS TotalSize");
+    metrics.fsUsedBytes = Metrics.gauge("fs_FS UsedSize");
+    metrics.fsBytesWritten = Metrics.gauge("fs_FS BytesWritten");
+    metrics.memoryQueueHighWater = Metrics.gauge("memory_QueueHighWater");
+    metrics.fsQueueHighWater = Metrics.gauge("fs_QueueHighWater");
+    metrics.producerChannelHighWater = Metrics.gauge("Producer Channel High Water Bytes");
+    metrics.producerDrops = Metrics.gauge("Producer Drops");
+    metrics.producerStallMax = Metrics.gauge("Producer Stall Max us");
+    metrics.producerStallAvg = Metrics.gauge("Producer Stall Avg us");
+    metrics.drainRate = Metrics.gauge("Drain Rate Bps");
+    metrics.drainBudget = Metrics.gauge("Drain Budget Bytes");
+    metrics.inFlight = Metrics.gauge("QoS1 In Flight");
+    metrics.retransmits = Metrics.counter("QoS1 Retransmits");
+    metrics.publishFailures = Metrics.counter("Publish Failures");
+    metrics.connects = Metrics.counter("MQTT Connects");
+    metrics.connectFailures = Metrics.counter("MQTT Connect Failures");
+    metrics.connectLatency = Metrics.gauge("Connect Latency ms");
+    metrics.readyLatency = Metrics.gauge("Ready Latency ms");
+    metrics.pendingRequests = Metrics.gauge("Pending Requests");
+    metrics.requestTimeouts = Metrics.gauge("Request Timeouts");
+    metrics.batchPublishes = Metrics.counter("Batch Publishes");
+    metrics.batchAvgSize = Metrics.gaugeFloat("Batch Avg Size");
+    for (uint8_t i = 0; i < MQTT_LATENCY_BUCKET_COUNT; i++)
+        metrics.latencyBuckets[i] = Metrics.counter(mqttLatencyBucketNames[i]);
+    metrics.latencyMax = Metrics.gauge("Queue Latency Max ms");
+    metrics.latencyAvg = Metrics.gauge("Queue Latency Avg ms");
+    metrics.upTime = Metrics.gauge("upTime");
+    metrics.freeHeap = Metrics.gauge("ESP Free Heap");
+    metrics.minHeap = Metrics.gauge("ESP Min Heap");
+    metrics.temperature = Metrics.gaugeFloat("ESP32 temperature");
+    metrics.filteredKeys = Metrics.gauge("Filtered Keys");
+    Metrics.setDeadband(MQTT_SYSTEM_ATTRIBUTES_DEADBAND, MQTT_SYSTEM_ATTRIBUTES_MAX_SILENCE_MS);
+}
+
 MQTTController::MQTTController() {
     defaultTimeout = 3000;
     defaultBufferSize = 5120;
     timeout = defaultTimeout;
     requestId = 0;
     jsonSerializeBuffer = 1024;
+    attributesResponseRoute = router.add("v1/devices/me/attributes/response/+");
+    rpcResponseRoute = router.add("v1/devices/me/rpc/response/+");
+    registerMetrics();
 }
 
-bool
-MQTTController::requestAttributesJson(const String &keysJson, const MQTTController::MqttCallbackJsonPayload &callback) {
-    requestId++;
-    if (callback != nullptr)
-        requestsCallbacksJson[requestId] = callback;
+uint32_t MQTTController::requestAttributesJson(const String &keysJson,
+                                               const MQTTController::MqttCallbackJsonPayload &callback,
+                                               const MQTTController::RequestResultCallback &result,
+                                               uint32_t timeoutMs) {
+    return sendRequest("v1/devices/me/attributes/request/", keysJson, callback, result, timeoutMs);
+}
 
-    return addToPublishQueue(String("v1/devices/me/attributes/request/" + String(requestId)), keysJson, true);
+uint32_t MQTTController::requestRPC(const String &payload, const MQTTController::MqttCallbackJsonPayload &callback,
+                                    const MQTTController::RequestResultCallback &result, uint32_t timeoutMs) {
+    return sendRequest("v1/devices/me/rpc/request/", payload, callback, result, timeoutMs);
 }
 
-bool
-MQTTController::requestRPC(const String &payload, const MQTTController::MqttCallbackJsonPayload &callback) {
+uint32_t MQTTController::sendRequest(const char *topicPrefix, const String &payload,
+                                     const MQTTController::MqttCallbackJsonPayload &callback,
+                                     const MQTTController::RequestResultCallback &result, uint32_t timeoutMs) {
     requestId++;
-    if (callback != nullptr)
-        requestsCallbacksJson[requestId] = callback;
+    if (requestId == 0) requestId++;
 
-    return addToPublishQueue(String("v1/devices/me/rpc/request/" + String(requestId)), payload, true);
+    bool tracked = callback != nullptr || result != nullptr;
+    if (tracked &&
+        !pendingRequests.add(requestId, timeoutMs, callback, result, Uptime.getMilliseconds())) {
+        printDBGln("Too many outstanding requests, request [" + String(requestId) + "] not sent");
+        return 0;
+    }
+    if (!addToPublishQueue(String(topicPrefix) + String(requestId), payload, true)) {
+        if (tracked) pendingRequests.cancel(requestId);
+        return 0;
+    }
+    return requestId;
 }
 
 bool MQTTController::sendAttributes(DynamicJsonDocument json, bool queueOnMemoryOrFs, const String &deviceName) {
     if (!deviceName.isEmpty()) {
         DynamicJsonDocument newData(json.capacity() + 200);
         newData[deviceName] = json;
-        newData.shrinkToFit();
-        return addToPublishQueue(V1_Attributes_GATEWAY_TOPIC, newData.as<String>(), queueOnMemoryOrFs);
+        return addToPublishQueue(V1_Attributes_GATEWAY_TOPIC, newData, queueOnMemoryOrFs);
     }
-    json.shrinkToFit();
-    return addToPublishQueue(V1_Attributes_TOPIC, json.as<String>(), queueOnMemoryOrFs);
+    if (attributesFilter != nullptr && attributesFilter->filter(json.as<JsonObject>(), Uptime.getMilliseconds()) == 0)
+        return true;
+    return addToPublishQueue(V1_Attributes_TOPIC, json, queueOnMemoryOrFs);
 }
 
 bool MQTTController::sendTelemetry(DynamicJsonDocument json, bool queueOnMemoryOrFs, const String &deviceName) {
     if (!deviceName.isEmpty()) {
         DynamicJsonDocument newData(json.capacity() + 200);
         newData[deviceName].add(json);
-        newData.shrinkToFit();
-        return addToPublishQueue(V1_TELEMETRY_GATEWAY_TOPIC, newData.as<String>(), queueOnMemoryOrFs);
+        return addToPublishQueue(V1_TELEMETRY_GATEWAY_TOPIC, newData, queueOnMemoryOrFs);
     }
-    json.shrinkToFit();
-    return addToPublishQueue(V1_TELEMETRY_TOPIC, json.as<String>(), queueOnMemoryOrFs);
+    if (telemetryFilter != nullptr && telemetryFilter->filter(json.as<JsonObject>(), Uptime.getMilliseconds()) == 0)
+        return true;
+    return addToPublishQueue(V1_TELEMETRY_TOPIC, json, queueOnMemoryOrFs);
 }
 
 bool MQTTController::sendAttributes(const String &json, bool queueOnMemoryOrFs) {
@@ -460,14 +1529,32 @@ bool MQTTController::sendTelemetry(const String &json, bool queueOnMemoryOrFs) {
 }
 
 bool MQTTController::sendTelemetry(const DynamicJsonDocument &data, bool queueOnMemoryOrFs, uint64_t ts) {
+    if (telemetryFilter == nullptr) return queueTelemetry(data, queueOnMemoryOrFs, ts);
+
+    DynamicJsonDocument changed(data.capacity());
+    changed.set(data);
+    if (telemetryFilter->filter(changed.as<JsonObject>(), Uptime.getMilliseconds()) == 0) return true;
+    return queueTelemetry(changed, queueOnMemoryOrFs, ts);
+}
+
+bool MQTTController::queueTelemetry(const JsonDocument &data, bool queueOnMemoryOrFs, uint64_t ts) {
     if (ts > 946713600000) {  // If ts greater than 2000
-        DynamicJsonDocument dataWithTs(data.capacity() + 300);
-        dataWithTs["ts"] = String(ts);
-        dataWithTs["values"] = data;
-        dataWithTs.shrinkToFit();
-        return addToPublishQueue(V1_TELEMETRY_TOPIC, dataWithTs.as<String>(), queueOnMemoryOrFs);
+        // {"ts": ts, "values": data} as MessagePack, the envelope is written by hand in front of the readings
+        uint8_t envelope[20];
+        size_t length = 0;
+        envelope[length++] = 0x82;
+        envelope[length++] = 0xa2;
+        envelope[length++] = 't';
+        envelope[length++] = 's';
+        envelope[length++] = 0xcf;
+        for (int i = 7; i >= 0; i--)
+            envelope[length++] = (uint8_t) (ts >> (i * 8));
+        envelope[length++] = 0xa6;
+        memcpy(envelope + length, "values", 6);
+        length += 6;
+        return queueMsgPack(V1_TELEMETRY_TOPIC, data, envelope, length, MQTT_TS_ENVELOPE_USAGE, queueOnMemoryOrFs);
     }
-    return addToPublishQueue(V1_TELEMETRY_TOPIC, data.as<String>(), queueOnMemoryOrFs);
+    return addToPublishQueue(V1_TELEMETRY_TOPIC, data, queueOnMemoryOrFs);
 }
 
 bool MQTTController::sendClaimRequest(const String &key, uint32_t duration_ms, const String &deviceName) {
@@ -480,10 +1567,10 @@ bool MQTTController::sendClaimRequest(const String &key, uint32_t duration_ms, c
         DynamicJsonDocument deviceData(1024);
         deviceData[deviceName] = data.as<String>();
         deviceData.shrinkToFit();
-        return addToPublishQueue("v1/gateway/claim", deviceData.as<String>(), false);
+        return addToPublishQueue("v1/gateway/claim", deviceData, false);
     }
 
-    return addToPublishQueue("v1/devices/me/claim", data.as<String>(), false);
+    return addToPublishQueue("v1/devices/me/claim", data, false);
 }
 
 void MQTTController::setTimeout(int timeout_ms) {
@@ -502,6 +1589,12 @@ void MQTTController::sendSystemAttributes(bool value) {
     MQTTController::isSendAttributes = value;
 }
 
+void MQTTController::setDrainBudget(uint16_t timeMs, uint32_t bytes) {
+    drainTimeBudgetMs = timeMs;
+    drainByteBudgetMax = max(bytes, (uint32_t) 1);
+    drainByteBudget = drainByteBudgetMax;
+}
+
 bool MQTTController::sendGatewayConnectEvent(const String &deviceName) {
     DynamicJsonDocument data(200);
     data["device"] = deviceName;
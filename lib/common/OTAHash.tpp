@@ -0,0 +1,238 @@
+#ifndef SENSENET_OTAHASH_TPP
+#define SENSENET_OTAHASH_TPP
+
+#include <Arduino.h>
+#include <esp_rom_md5.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/sha512.h>
+#include <mbedtls/version.h>
+
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define mbedtls_sha256_starts_ret mbedtls_sha256_starts
+#define mbedtls_sha256_update_ret mbedtls_sha256_update
+#define mbedtls_sha256_finish_ret mbedtls_sha256_finish
+#define mbedtls_sha512_starts_ret mbedtls_sha512_starts
+#define mbedtls_sha512_update_ret mbedtls_sha512_update
+#define mbedtls_sha512_finish_ret mbedtls_sha512_finish
+#endif
+
+// On the ESP32 the accelerator keeps the running SHA-2 state in the peripheral, a clone reads it back into the
+// context and an imported state has to go on in software. Other accelerator contexts are not resumed
+#if !defined(MBEDTLS_SHA256_ALT) && !defined(MBEDTLS_SHA512_ALT)
+#define OTA_HASH_RESUMABLE 1
+#else
+#include <soc/soc_caps.h>
+#if SOC_SHA_SUPPORT_PARALLEL_ENG
+#define OTA_HASH_RESUMABLE 1
+#define OTA_HASH_IMPORTED(context, SHA) (context).mode = ESP_MBEDTLS_##SHA##_SOFTWARE
+#else
+#define OTA_HASH_RESUMABLE 0
+#endif
+#endif
+
+#ifndef OTA_HASH_IMPORTED
+#define OTA_HASH_IMPORTED(context, SHA)
+#endif
+
+// Longest lower case hex digest plus its terminator
+#define OTA_HASH_HEX_SIZE 129
+
+// Layout version of OTAHash::State, a checkpoint saved with another one is not resumed
+#define OTA_HASH_STATE_VERSION 1
+
+enum OTAHashType : uint8_t {
+    OTA_HASH_MD5,
+    OTA_HASH_SHA256,
+    OTA_HASH_SHA384,
+    OTA_HASH_SHA512
+};
+
+/*
+ * MD5 or SHA-2 computed while the image is written, so the digest is ready with the last chunk.
+ *
+ * MD5 runs on the ROM implementation, SHA-2 on mbedTLS. Checkpoints never hold a library context, whose
+ * layout changes with the framework and on the ESP32 points into the accelerator. save() exports the
+ * chaining values, length and partial block from a clone into a State spelled out field by field, restore()
+ * imports them into a fresh context.
+ */
+class OTAHash {
+public:
+    struct State {
+        uint8_t version;
+        OTAHashType type;
+        uint8_t reserved[6];
+        // Bytes hashed so far, the unprocessed tail of them is at the start of block
+        uint64_t length;
+        // Chaining values, MD5 and SHA-256 keep theirs in the low 32 bits
+        uint64_t h[8];
+        uint8_t block[128];
+    };
+
+    // Accepts the fw_checksum_algorithm names ThingsBoard uses, with or without a dash
+    static bool parseType(const String &name, OTAHashType &type);
+
+    static uint8_t digestLength(OTAHashType type) {
+        return type == OTA_HASH_MD5 ? 16 : type == OTA_HASH_SHA256 ? 32 : type == OTA_HASH_SHA384 ? 48 : 64;
+    }
+
+    void begin(OTAHashType type);
+
+    void update(const uint8_t *data, size_t len);
+
+    // Writes the lower case hex digest and ends the hash
+    void finish(char hex[OTA_HASH_HEX_SIZE]);
+
+    // Raw digest of digestLength() bytes, ends the hash
+    void finish(uint8_t digest[64]);
+
+    void save(State &saved) const;
+
+    // False when saved is not a state of this version and type, the hash is left ended then
+    bool restore(OTAHashType type, const State &saved);
+
+    // Drops the hash without a digest
+    void end();
+
+    OTAHashType getType() const {
+        return type;
+    }
+
+    OTAHash() = default;
+
+    // A context may hold the SHA accelerator, it is not copied
+    OTAHash(const OTAHash &) = delete;
+
+    OTAHash &operator=(const OTAHash &) = delete;
+
+    ~OTAHash() {
+        end();
+    }
+
+private:
+    OTAHashType type = OTA_HASH_MD5;
+    bool active = false;
+    md5_context_t md5;
+    mbedtls_sha256_context sha256;
+    mbedtls_sha512_context sha512;
+};
+
+bool OTAHash::parseType(const String &name, OTAHashType &type) {
+    String normalized = name;
+    normalized.toUpperCase();
+    normalized.replace("-", "");
+    if (normalized == "MD5") type = OTA_HASH_MD5;
+    else if (normalized == "SHA256") type = OTA_HASH_SHA256;
+    else if (normalized == "SHA384") type = OTA_HASH_SHA384;
+    else if (normalized == "SHA512") type = OTA_HASH_SHA512;
+    else return false;
+    return true;
+}
+
+void OTAHash::begin(OTAHashType type) {
+    end();
+    this->type = type;
+    active = true;
+    if (type == OTA_HASH_MD5) {
+        esp_rom_md5_init(&md5);
+    } else if (type == OTA_HASH_SHA256) {
+        mbedtls_sha256_init(&sha256);
+        mbedtls_sha256_starts_ret(&sha256, 0);
+    } else {
+        mbedtls_sha512_init(&sha512);
+        mbedtls_sha512_starts_ret(&sha512, type == OTA_HASH_SHA384);
+    }
+}
+
+void OTAHash::update(const uint8_t *data, size_t len) {
+    if (!active) return;
+    if (type == OTA_HASH_MD5) esp_rom_md5_update(&md5, data, len);
+    else if (type == OTA_HASH_SHA256) mbedtls_sha256_update_ret(&sha256, data, len);
+    else mbedtls_sha512_update_ret(&sha512, data, len);
+}
+
+void OTAHash::finish(char hex[OTA_HASH_HEX_SIZE]) {
+    uint8_t digest[64];
+    finish(digest);
+    uint8_t length = digestLength(type);
+    for (uint8_t i = 0; i < length; i++) sprintf(hex + i * 2, "%02x", digest[i]);
+    hex[length * 2] = '\0';
+}
+
+void OTAHash::finish(uint8_t digest[64]) {
+    memset(digest, 0, 64);
+    if (!active) return;
+    if (type == OTA_HASH_MD5) esp_rom_md5_final(digest, &md5);
+    else if (type == OTA_HASH_SHA256) mbedtls_sha256_finish_ret(&sha256, digest);
+    else mbedtls_sha512_finish_ret(&sha512, digest);
+    end();
+}
+
+void OTAHash::end() {
+    if (!active) return;
+    active = false;
+    if (type == OTA_HASH_SHA256) mbedtls_sha256_free(&sha256);
+    else if (type != OTA_HASH_MD5) mbedtls_sha512_free(&sha512);
+}
+
+// The ROM MD5 context is copied field by field, SHA-2 from a clone so the running hash is left as it is
+void OTAHash::save(State &saved) const {
+    saved = {};
+    saved.version = OTA_HASH_STATE_VERSION;
+    saved.type = type;
+    if (type == OTA_HASH_MD5) {
+        saved.length = (((uint64_t) md5.bits[1] << 32) | md5.bits[0]) / 8;
+        for (uint8_t i = 0; i < 4; i++) saved.h[i] = md5.buf[i];
+        memcpy(saved.block, md5.in, sizeof(md5.in));
+    } else if (type == OTA_HASH_SHA256) {
+        mbedtls_sha256_context clone;
+        mbedtls_sha256_init(&clone);
+        mbedtls_sha256_clone(&clone, &sha256);
+        saved.length = (uint64_t) clone.total[1] << 32 | clone.total[0];
+        for (uint8_t i = 0; i < 8; i++) saved.h[i] = clone.state[i];
+        memcpy(saved.block, clone.buffer, sizeof(clone.buffer));
+        mbedtls_sha256_free(&clone);
+    } else {
+        mbedtls_sha512_context clone;
+        mbedtls_sha512_init(&clone);
+        mbedtls_sha512_clone(&clone, &sha512);
+        saved.length = clone.total[0];
+        memcpy(saved.h, clone.state, sizeof(saved.h));
+        memcpy(saved.block, clone.buffer, sizeof(clone.buffer));
+        mbedtls_sha512_free(&clone);
+    }
+}
+
+bool OTAHash::restore(OTAHashType type, const State &saved) {
+    end();
+    this->type = type;
+    if (saved.version != OTA_HASH_STATE_VERSION || saved.type != type || type > OTA_HASH_SHA512) return false;
+    if (type == OTA_HASH_MD5) {
+        uint64_t bits = saved.length * 8;
+        md5.bits[0] = (uint32_t) bits;
+        md5.bits[1] = (uint32_t) (bits >> 32);
+        for (uint8_t i = 0; i < 4; i++) md5.buf[i] = (uint32_t) saved.h[i];
+        memcpy(md5.in, saved.block, sizeof(md5.in));
+    } else if (!OTA_HASH_RESUMABLE) {
+        return false;
+    } else if (type == OTA_HASH_SHA256) {
+        mbedtls_sha256_init(&sha256);
+        mbedtls_sha256_starts_ret(&sha256, 0);
+        sha256.total[0] = (uint32_t) saved.length;
+        sha256.total[1] = (uint32_t) (saved.length >> 32);
+        for (uint8_t i = 0; i < 8; i++) sha256.state[i] = (uint32_t) saved.h[i];
+        memcpy(sha256.buffer, saved.block, sizeof(sha256.buffer));
+        OTA_HASH_IMPORTED(sha256, SHA256);
+    } else {
+        mbedtls_sha512_init(&sha512);
+        mbedtls_sha512_starts_ret(&sha512, type == OTA_HASH_SHA384);
+        sha512.total[0] = saved.length;
+        sha512.total[1] = 0;
+        memcpy(sha512.state, saved.h, sizeof(sha512.state));
+        memcpy(sha512.buffer, saved.block, sizeof(sha512.buffer));
+        OTA_HASH_IMPORTED(sha512, SHA512);
+    }
+    active = true;
+    return true;
+}
+
+#endif //SENSENET_OTAHASH_TPP
@@ -0,0 +1,218 @@
+#ifndef SENSENET_OTAIMAGE_TPP
+#define SENSENET_OTAIMAGE_TPP
+
+#include <Arduino.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <functional>
+
+#define OTA_IMAGE_MAGIC "SNZ1"
+#define OTA_IMAGE_HEADER_SIZE 48
+#define OTA_IMAGE_TYPE_LZ 0
+#define OTA_IMAGE_TYPE_DELTA 1
+
+#define IMAGE_CORRUPT               (-112)
+#define IMAGE_BASE_MISMATCH         (-113)
+#define IMAGE_WINDOW_TOO_LARGE      (-114)
+
+// Largest back reference window an image may ask for, it stays allocated for the whole update
+#ifndef OTA_IMAGE_MAX_WINDOW_BITS
+#define OTA_IMAGE_MAX_WINDOW_BITS 12
+#endif
+
+// Decoded bytes are handed to the writer in blocks of this size
+#ifndef OTA_IMAGE_STAGE_SIZE
+#define OTA_IMAGE_STAGE_SIZE 256
+#endif
+
+/*
+ * Streaming decoder for the compressed firmware images made by tools/ota_image.py.
+ *
+ * The 48 byte header holds "SNZ1", the type, the window bits, the size and MD5 of the decoded image and,
+ * for deltas, the size and MD5 of the running image they apply to. Opcodes follow:
+ *   0x00-0x7F  op + 1 literal bytes
+ *   0x80-0xBF  copy (op & 0x3F) + 3 bytes from a u16 distance back in the output
+ *   0xC0-0xFF  copy ((op & 0x3F) << 8 | u8) + 1 bytes from a u32 offset in the running image, deltas only
+ * Numbers are little endian. Input can be cut anywhere. Only the window lives outside State, so
+ * State alone is enough to checkpoint between calls, and restore() reads the window back from the
+ * written image.
+ */
+class OTAImageDecoder {
+public:
+    // Takes decoded bytes, returns 0 or an error code that stops decoding
+    typedef std::function<int(const uint8_t *data, size_t len)> Writer;
+
+    struct State {
+        uint8_t header[OTA_IMAGE_HEADER_SIZE];
+        uint8_t headerLength;
+        uint8_t op;
+        uint8_t need;
+        uint8_t argsLength;
+        uint8_t args[5];
+        uint8_t literals;
+        uint32_t produced;
+    };
+
+    ~OTAImageDecoder() {
+        end();
+    }
+
+    static bool isCompressed(const uint8_t *data, size_t len) {
+        return len && data[0] == OTA_IMAGE_MAGIC[0];
+    }
+
+    void begin() {
+        end();
+        state = {};
+    }
+
+    // target holds the output decoded so far
+    int restore(const State &saved, const esp_partition_t *target);
+
+    // Everything decoded is passed to writer before it returns
+    int decode(const uint8_t *data, size_t len, const Writer &writer);
+
+    void end() {
+        free(window);
+        window = nullptr;
+        source = nullptr;
+        staged = 0;
+    }
+
+    // True when the input stopped between two opcodes
+    bool isComplete() const {
+        return state.headerLength == OTA_IMAGE_HEADER_SIZE && state.literals == 0 && state.need == 0;
+    }
+
+    uint32_t getImageSize() const {
+        return readU32(state.header + 8);
+    }
+
+    const uint8_t *getImageMD5() const {
+        return state.header + 12;
+    }
+
+    const State &getState() const {
+        return state;
+    }
+
+private:
+    State state = {};
+    uint8_t *window = nullptr;
+    uint32_t windowMask = 0;
+    const esp_partition_t *source = nullptr;
+    uint8_t stage[OTA_IMAGE_STAGE_SIZE];
+    uint16_t staged = 0;
+
+    int parseHeader();
+
+    int runOp(const Writer &writer);
+
+    int emit(uint8_t byte, const Writer &writer) {
+        window[state.produced & windowMask] = byte;
+        state.produced++;
+        stage[staged++] = byte;
+        return staged == OTA_IMAGE_STAGE_SIZE ? flush(writer) : 0;
+    }
+
+    int flush(const Writer &writer) {
+        if (staged == 0) return 0;
+        uint16_t length = staged;
+        staged = 0;
+        return writer(stage, length);
+    }
+
+    static uint32_t readU32(const uint8_t *data) {
+        return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+    }
+};
+
+int OTAImageDecoder::restore(const State &saved, const esp_partition_t *target) {
+    end();
+    state = saved;
+    if (state.headerLength < OTA_IMAGE_HEADER_SIZE) return 0;
+    int err = parseHeader();
+    if (err) return err;
+
+    uint32_t length = min(state.produced, windowMask + 1);
+    for (uint32_t position = state.produced - length; position < state.produced;) {
+        uint32_t block = min(state.produced - position, (uint32_t) OTA_IMAGE_STAGE_SIZE);
+        if (esp_partition_read(target, position, stage, block) != ESP_OK) return IMAGE_CORRUPT;
+        for (uint32_t i = 0; i < block; i++) window[(position + i) & windowMask] = stage[i];
+        position += block;
+    }
+    return 0;
+}
+
+int OTAImageDecoder::decode(const uint8_t *data, size_t len, const Writer &writer) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t byte = data[i];
+        int err = 0;
+        if (state.headerLength < OTA_IMAGE_HEADER_SIZE) {
+            state.header[state.headerLength++] = byte;
+            if (state.headerLength == OTA_IMAGE_HEADER_SIZE) err = parseHeader();
+        } else if (state.literals) {
+            state.literals--;
+            err = emit(byte, writer);
+        } else if (state.need) {
+            state.args[state.argsLength++] = byte;
+            if (--state.need == 0) err = runOp(writer);
+        } else if (byte < 0x80) {
+            state.literals = byte + 1;
+        } else {
+            state.op = byte;
+            state.argsLength = 0;
+            state.need = byte < 0xC0 ? 2 : 5;
+        }
+        if (err) return err;
+    }
+    return flush(writer);
+}
+
+int OTAImageDecoder::parseHeader() {
+    const uint8_t *header = state.header;
+    if (memcmp(header, OTA_IMAGE_MAGIC, 4) != 0 || header[4] > OTA_IMAGE_TYPE_DELTA || header[5] < 8)
+        return IMAGE_CORRUPT;
+    if (header[5] > OTA_IMAGE_MAX_WINDOW_BITS) return IMAGE_WINDOW_TOO_LARGE;
+
+    if (header[4] == OTA_IMAGE_TYPE_DELTA) {
+        // Offsets point into the exact image the delta was made from
+        char md5[33];
+        for (uint8_t i = 0; i < 16; i++) sprintf(md5 + i * 2, "%02x", header[32 + i]);
+        source = esp_ota_get_running_partition();
+        if (source == nullptr || readU32(header + 28) > source->size || !ESP.getSketchMD5().equalsIgnoreCase(md5))
+            return IMAGE_BASE_MISMATCH;
+    }
+
+    windowMask = (1UL << header[5]) - 1;
+    window = (uint8_t *) malloc(windowMask + 1);
+    return window == nullptr ? IMAGE_WINDOW_TOO_LARGE : 0;
+}
+
+int OTAImageDecoder::runOp(const Writer &writer) {
+    int err = 0;
+    if (state.op < 0xC0) {
+        uint32_t length = (state.op & 0x3F) + 3;
+        uint32_t distance = state.args[0] | state.args[1] << 8;
+        if (distance == 0 || distance > windowMask + 1 || distance > state.produced) return IMAGE_CORRUPT;
+        // Byte by byte, a copy may overlap its own output
+        while (length-- && !err)
+            err = emit(window[(state.produced - distance) & windowMask], writer);
+        return err;
+    }
+
+    uint32_t length = (((state.op & 0x3F) << 8) | state.args[0]) + 1;
+    uint32_t offset = readU32(state.args + 1);
+    if (source == nullptr || offset + length > readU32(state.header + 28)) return IMAGE_CORRUPT;
+    while (length && !err) {
+        uint8_t block[64];
+        uint32_t count = min(length, (uint32_t) sizeof(block));
+        if (esp_partition_read(source, offset, block, count) != ESP_OK) return IMAGE_BASE_MISMATCH;
+        for (uint32_t i = 0; i < count && !err; i++) err = emit(block[i], writer);
+        offset += count;
+        length -= count;
+    }
+    return err;
+}
+
+#endif //SENSENET_OTAIMAGE_TPP
@@ -4,18 +4,34 @@
 //region .h
 
 #include <Arduino.h>
+#include "PrintDBG.tpp"
 
-#if defined(ESP8266)
-#include <Updater.h>
-#elif defined(ESP32)
-
-#include <Update.h>
-
-#endif
+#include <Preferences.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_image_format.h>
+#include "OTAHash.tpp"
+#include "OTAImage.tpp"
 
 #define TOO_LESS_SPACE              (-100)
 #define SERVER_FAULTY_MD5           (-105)
+#define CHECKSUM_MISMATCH           (-106)
+#define WRONG_MAGIC_BYTE            (-107)
 #define NO_PARTITION                (-108)
+#define FLASH_ERROR                 (-109)
+#define SIZE_MISMATCH               (-110)
+#define ACTIVATE_FAILED             (-111)
+
+// Received bytes between two progress checkpoints in NVS
+#ifndef OTA_CHECKPOINT_INTERVAL
+#define OTA_CHECKPOINT_INTERVAL 32768
+#endif
+
+#define OTA_CHECKPOINT_NAMESPACE "ota"
+#define OTA_CHECKPOINT_KEY "progress"
+// Layout version of the checkpoint blob, one saved by another firmware layout is not resumed
+#define OTA_CHECKPOINT_VERSION 2
+#define OTA_INSTALLED_KEY "installed"
 
 using OTAUpdateStartCB = std::function<void()>;
 using OTAUpdateEndCB = std::function<void(bool)>;
@@ -32,12 +48,30 @@ public:
         _rebootOnUpdate = reboot;
     }
 
-    bool startUpdate(const uint32_t size, const String &md5);
+    // size and checksum describe the bytes received, either a plain application image or one packed by
+    // tools/ota_image.py. An update of the same file that was cut off by a reboot continues from its last
+    // checkpoint, as long as that offset is a multiple of resumeBoundary
+    bool startUpdate(const uint32_t size, const String &checksum, OTAHashType hashType = OTA_HASH_MD5,
+                     uint32_t resumeBoundary = 1);
 
     bool writeUpdateChunk(uint8_t *data, size_t len);
 
     bool endUpdate();
 
+    // Stops writing without an error, the checkpoint is kept so the next start of the same image resumes
+    void abortUpdate() {
+        updating = false;
+        fileHash.end();
+        imageHash.end();
+        decoder.end();
+    }
+
+    // True when checksum is the running image, or the packed file it was installed from
+    bool isInstalled(const String &checksum, OTAHashType hashType);
+
+    // Hash of the running image over the same path as a download, computed once per algorithm
+    String getRunningChecksum(OTAHashType hashType);
+
     // Notification callbacks
     void onStart(OTAUpdateStartCB cbOnStart) { _cbStart = cbOnStart; }
 
@@ -53,10 +87,37 @@ public:
 
     bool isUpdating() const;
 
+    uint32_t getReceived() const {
+        return received;
+    }
+
+    const String &getChecksum() const {
+        return checksum;
+    }
+
 protected:
-    bool handleStartUpdate(uint32_t size, const String &md5);
+    bool handleStartUpdate(uint32_t size, const String &checksum, OTAHashType hashType, uint32_t resumeBoundary);
+
+    bool startUpdateProcess(uint32_t size, const String &checksum, OTAHashType hashType, uint32_t resumeBoundary);
+
+    bool resumeFromCheckpoint(uint32_t resumeBoundary);
+
+    void saveCheckpoint();
+
+    void clearCheckpoint();
+
+    bool writeFlash(const uint8_t *data, size_t len);
 
-    bool startUpdateProcess(uint32_t size, const String &md5);
+    int writeImage(const uint8_t *data, size_t len);
+
+    void fail(int err) {
+        updating = false;
+        fileHash.end();
+        imageHash.end();
+        decoder.end();
+        clearCheckpoint();
+        _setLastError(err);
+    }
 
     // Set the error and potentially use a CB to notify the application
     void _setLastError(int err) {
@@ -74,10 +135,43 @@ private:
     OTAUpdateErrorCB _cbError;
     OTAUpdateProgressCB _cbProgress;
 
+    // Stored as one blob so a reset while saving never pairs an offset with the wrong hash state. The hashes
+    // are explicit OTAHash::State, no library context is written to NVS
+    struct Checkpoint {
+        uint8_t version;
+        char checksum[OTA_HASH_HEX_SIZE];
+        OTAHashType hashType;
+        bool compressed;
+        uint32_t size, partition, received, written;
+        OTAHash::State hash;
+        OTAHash::State imageHash;
+        OTAImageDecoder::State decoder;
+    };
+
+    struct Installed {
+        char checksum[OTA_HASH_HEX_SIZE];
+        OTAHashType hashType;
+        char imageMD5[33];
+    };
+
     int _lastError;
     bool _rebootOnUpdate = true;
     size_t _size;
-    bool updating;
+    bool updating = false;
+    const esp_partition_t *partition = nullptr;
+    // fileHash covers the bytes received, imageHash the image a packed file decodes to
+    OTAHash fileHash;
+    OTAHash imageHash;
+    String checksum;
+    OTAHashType hashType = OTA_HASH_MD5;
+    String runningChecksums[OTA_HASH_SHA512 + 1];
+    bool compressed = false;
+    OTAImageDecoder decoder;
+    OTAImageDecoder::Writer imageWriter = [this](const uint8_t *data, size_t len) -> int {
+        return writeImage(data, len);
+    };
+    // received counts the bytes of the file, written the bytes of the image in flash
+    uint32_t received = 0, written = 0, erasedTo = 0, checkpointedAt = 0;
 };
 
 #if !defined(NO_GLOBAL_INSTANCES) && !defined(NO_GLOBAL_HTTPUPDATE)
@@ -88,16 +182,15 @@ extern OTAUpdateClass OTAUpdate;
 
 //region .cpp
 
-#include <StreamString.h>
-
 OTAUpdateClass::OTAUpdateClass(void) {
 }
 
 OTAUpdateClass::~OTAUpdateClass(void) {
 }
 
-bool OTAUpdateClass::startUpdate(const uint32_t size, const String &md5) {
-    return handleStartUpdate(size, md5);
+bool OTAUpdateClass::startUpdate(const uint32_t size, const String &checksum, OTAHashType hashType,
+                                 uint32_t resumeBoundary) {
+    return handleStartUpdate(size, checksum, hashType, resumeBoundary ? resumeBoundary : 1);
 }
 
 int OTAUpdateClass::getLastError(void) {
@@ -110,27 +203,36 @@ String OTAUpdateClass::getLastErrorString(void) {
         return String(); // no error
     }
 
-    // error from Update class
-    if (_lastError > 0) {
-        StreamString error;
-        Update.printError(error);
-        error.trim(); // remove line ending
-        return String("Update error: ") + error;
-    }
-
     switch (_lastError) {
         case TOO_LESS_SPACE:
             return "Not Enough space";
         case SERVER_FAULTY_MD5:
-            return "Wrong MD5";
+            return "Wrong Checksum";
+        case CHECKSUM_MISMATCH:
+            return "Checksum Check Failed";
+        case WRONG_MAGIC_BYTE:
+            return "Wrong Magic Byte";
         case NO_PARTITION:
             return "Partition Could Not be Found";
+        case FLASH_ERROR:
+            return "Flash Write Failed";
+        case SIZE_MISMATCH:
+            return "Wrong Image Size";
+        case ACTIVATE_FAILED:
+            return "Could Not Activate Image";
+        case IMAGE_CORRUPT:
+            return "Corrupt Compressed Image";
+        case IMAGE_BASE_MISMATCH:
+            return "Delta Does Not Match Running Image";
+        case IMAGE_WINDOW_TOO_LARGE:
+            return "Image Window Too Large";
     }
 
     return String();
 }
 
-bool OTAUpdateClass::handleStartUpdate(const uint32_t size, const String &md5) {
+bool OTAUpdateClass::handleStartUpdate(const uint32_t size, const String &checksum, OTAHashType hashType,
+                                       uint32_t resumeBoundary) {
 
 
     int sketchFreeSpace = ESP.getFreeSketchSpace();
@@ -144,21 +246,67 @@ bool OTAUpdateClass::handleStartUpdate(const uint32_t size, const String &md5) {
         return false;
     }
 
-    return startUpdateProcess(size, md5);
+    if (checksum.length() && checksum.length() != OTAHash::digestLength(hashType) * 2) {
+        _lastError = SERVER_FAULTY_MD5;
+        return false;
+    }
+
+    return startUpdateProcess(size, checksum, hashType, resumeBoundary);
 }
 
 bool OTAUpdateClass::endUpdate() {
+    if (!updating) return false;
+
+    if (received != _size || (compressed && (!decoder.isComplete() || written != decoder.getImageSize()))) {
+        fail(SIZE_MISMATCH);
+        return false;
+    }
+
+    // Hashed while the chunks were written, nothing is read back from flash
+    char hex[OTA_HASH_HEX_SIZE];
+    fileHash.finish(hex);
+    if (checksum.length() && !checksum.equalsIgnoreCase(hex)) {
+        fail(CHECKSUM_MISMATCH);
+        return false;
+    }
+
+    // A packed file is checked once more on what it decoded to
+    uint8_t digest[64];
+    char imageHex[33];
+    if (compressed) {
+        imageHash.finish(digest);
+        if (memcmp(digest, decoder.getImageMD5(), 16) != 0) {
+            fail(CHECKSUM_MISMATCH);
+            return false;
+        }
+        for (uint8_t i = 0; i < 16; i++) sprintf(imageHex + i * 2, "%02x", digest[i]);
+    }
 
-    StreamString error;
-    if (!Update.end()) {
-        _lastError = Update.getError();
-        Update.printError(error);
-        error.trim(); // remove line ending
-        if (_cbError) _cbError(_lastError);
+    // The image is validated again by the bootloader API before it is selected
+    if (esp_ota_set_boot_partition(partition) != ESP_OK) {
+        fail(ACTIVATE_FAILED);
         return false;
     }
 
     updating = false;
+    decoder.end();
+    clearCheckpoint();
+
+    // The file checksum no longer matches the running image, isInstalled() needs to know what it became
+    Preferences preferences;
+    if (preferences.begin(OTA_CHECKPOINT_NAMESPACE)) {
+        if (compressed && checksum.length()) {
+            Installed installed = {};
+            strncpy(installed.checksum, checksum.c_str(), sizeof(installed.checksum) - 1);
+            installed.hashType = hashType;
+            memcpy(installed.imageMD5, imageHex, sizeof(installed.imageMD5));
+            preferences.putBytes(OTA_INSTALLED_KEY, &installed, sizeof(installed));
+        } else if (preferences.isKey(OTA_INSTALLED_KEY)) {
+            preferences.remove(OTA_INSTALLED_KEY);
+        }
+        preferences.end();
+    }
+
     if (_cbEnd) _cbEnd(true);
 
     if (_rebootOnUpdate) {
@@ -168,51 +316,197 @@ bool OTAUpdateClass::endUpdate() {
     return true;
 }
 
-bool OTAUpdateClass::startUpdateProcess(uint32_t size, const String &md5) {
+// The image is written straight into the next OTA partition, unlike Update it can pick up a half written one.
+// Nothing boots from that partition before endUpdate() verified it
+bool OTAUpdateClass::startUpdateProcess(uint32_t size, const String &checksum, OTAHashType hashType,
+                                        uint32_t resumeBoundary) {
+    updating = false;
+    partition = esp_ota_get_next_update_partition(nullptr);
+    if (partition == nullptr) {
+        _lastError = NO_PARTITION;
+        return false;
+    }
 
     _size = size;
+    this->checksum = checksum;
+    this->hashType = hashType;
+
+    if (resumeFromCheckpoint(resumeBoundary)) {
+        printDBGln("OTA resuming at byte [" + String(received) + "]");
+    } else {
+        received = 0;
+        written = 0;
+        erasedTo = 0;
+        compressed = false;
+        fileHash.begin(hashType);
+        imageHash.begin(OTA_HASH_MD5);
+        decoder.begin();
+        clearCheckpoint();
+    }
+    checkpointedAt = received;
 
-    StreamString error;
+    updating = true;
+    if (_cbStart) _cbStart();
+    return true;
+}
 
-    if (_cbProgress) Update.onProgress(_cbProgress);
+bool OTAUpdateClass::resumeFromCheckpoint(uint32_t resumeBoundary) {
+    if (checksum.isEmpty()) return false;
 
-    if (Update.isRunning()) {
-        Update.abort();
-    }
+    Checkpoint checkpoint;
+    Preferences preferences;
+    if (!preferences.begin(OTA_CHECKPOINT_NAMESPACE, true)) return false;
+    size_t length = preferences.getBytes(OTA_CHECKPOINT_KEY, &checkpoint, sizeof(checkpoint));
+    preferences.end();
 
-    if (!Update.begin(size, U_FLASH)) {
-        _lastError = Update.getError();
-        Update.printError(error);
-        error.trim(); // remove line ending
+    if (length != sizeof(checkpoint) || checkpoint.version != OTA_CHECKPOINT_VERSION ||
+        !checksum.equalsIgnoreCase(checkpoint.checksum) ||
+        checkpoint.hashType != hashType || checkpoint.size != _size ||
+        checkpoint.partition != partition->address || checkpoint.received == 0 || checkpoint.received >= _size ||
+        checkpoint.received % resumeBoundary != 0)
         return false;
+    // Checked before anything in flash is touched, a fresh start begins both hashes again
+    if (!fileHash.restore(hashType, checkpoint.hash) || !imageHash.restore(OTA_HASH_MD5, checkpoint.imageHash))
+        return false;
+
+    // Data past the checkpoint may have reached the flash before the reset and has to be erased before it is
+    // written again. The part of its sector in front of the checkpoint is read back and kept
+    uint32_t sector = checkpoint.written - checkpoint.written % SPI_FLASH_SEC_SIZE;
+    uint32_t kept = checkpoint.written - sector;
+    if (kept) {
+        uint8_t *buffer = (uint8_t *) malloc(kept);
+        if (buffer == nullptr) return false;
+        bool restored = esp_partition_read(partition, sector, buffer, kept) == ESP_OK &&
+                        esp_partition_erase_range(partition, sector, SPI_FLASH_SEC_SIZE) == ESP_OK &&
+                        esp_partition_write(partition, sector, buffer, kept) == ESP_OK;
+        free(buffer);
+        if (!restored) return false;
+        sector += SPI_FLASH_SEC_SIZE;
     }
 
-    if (md5.length()) {
-        if (!Update.setMD5(md5.c_str())) {
-            _lastError = SERVER_FAULTY_MD5;
-            return false;
-        }
+    // The decoder window is read back from what is already in flash
+    if (checkpoint.compressed && decoder.restore(checkpoint.decoder, partition) != 0) {
+        decoder.end();
+        return false;
     }
 
-    updating = true;
-    if (_cbStart) _cbStart();
+    received = checkpoint.received;
+    written = checkpoint.written;
+    erasedTo = sector;
+    compressed = checkpoint.compressed;
     return true;
 }
 
+void OTAUpdateClass::saveCheckpoint() {
+    if (checksum.isEmpty()) return;
+
+    Checkpoint checkpoint = {};
+    checkpoint.version = OTA_CHECKPOINT_VERSION;
+    strncpy(checkpoint.checksum, checksum.c_str(), sizeof(checkpoint.checksum) - 1);
+    checkpoint.hashType = hashType;
+    checkpoint.size = _size;
+    checkpoint.compressed = compressed;
+    checkpoint.partition = partition->address;
+    checkpoint.received = received;
+    checkpoint.written = written;
+    fileHash.save(checkpoint.hash);
+    imageHash.save(checkpoint.imageHash);
+    checkpoint.decoder = decoder.getState();
+
+    Preferences preferences;
+    if (!preferences.begin(OTA_CHECKPOINT_NAMESPACE)) return;
+    if (preferences.putBytes(OTA_CHECKPOINT_KEY, &checkpoint, sizeof(checkpoint)) == sizeof(checkpoint))
+        checkpointedAt = received;
+    preferences.end();
+}
+
+void OTAUpdateClass::clearCheckpoint() {
+    Preferences preferences;
+    if (!preferences.begin(OTA_CHECKPOINT_NAMESPACE)) return;
+    if (preferences.isKey(OTA_CHECKPOINT_KEY)) preferences.remove(OTA_CHECKPOINT_KEY);
+    preferences.end();
+}
+
+// Sectors are erased just ahead of the data
+bool OTAUpdateClass::writeFlash(const uint8_t *data, size_t len) {
+    uint32_t end = written + len;
+    if (end > erasedTo) {
+        uint32_t eraseEnd = (end + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+        if (esp_partition_erase_range(partition, erasedTo, eraseEnd - erasedTo) != ESP_OK) return false;
+        erasedTo = eraseEnd;
+    }
+    return esp_partition_write(partition, written, data, len) == ESP_OK;
+}
+
+// A packed file is decoded on the way in, only the decoded image reaches the flash
 bool OTAUpdateClass::writeUpdateChunk(uint8_t *data, size_t len) {
-    StreamString error;
+    if (!updating) return true;
 
-    if (updating && Update.write(data, len) != len) {
-        updating = false;
-        _lastError = Update.getError();
-        Update.printError(error);
-        error.trim(); // remove line ending
-        if (_cbError) _cbError(_lastError);
+    if (received + len > _size) {
+        fail(SIZE_MISMATCH);
+        return false;
+    }
+
+    if (received == 0) compressed = OTAImageDecoder::isCompressed(data, len);
+    fileHash.update(data, len);
+    int err = compressed ? decoder.decode(data, len, imageWriter) : writeImage(data, len);
+    if (err) {
+        fail(err);
         return false;
     }
+    received += len;
+
+    if (received < _size && received - checkpointedAt >= OTA_CHECKPOINT_INTERVAL) saveCheckpoint();
+    if (_cbProgress) _cbProgress(received, _size);
     return true;
 }
 
+int OTAUpdateClass::writeImage(const uint8_t *data, size_t len) {
+    if (written + len > partition->size) return TOO_LESS_SPACE;
+    if (compressed && written + len > decoder.getImageSize()) return SIZE_MISMATCH;
+    if (written == 0 && len && data[0] != ESP_IMAGE_HEADER_MAGIC) return WRONG_MAGIC_BYTE;
+
+    if (!writeFlash(data, len)) return FLASH_ERROR;
+    if (compressed) imageHash.update(data, len);
+    written += len;
+    return 0;
+}
+
+bool OTAUpdateClass::isInstalled(const String &checksum, OTAHashType hashType) {
+    if (checksum.equalsIgnoreCase(getRunningChecksum(hashType))) return true;
+
+    Installed installed;
+    Preferences preferences;
+    if (!preferences.begin(OTA_CHECKPOINT_NAMESPACE, true)) return false;
+    size_t length = preferences.getBytes(OTA_INSTALLED_KEY, &installed, sizeof(installed));
+    preferences.end();
+    return length == sizeof(installed) && installed.hashType == hashType &&
+           checksum.equalsIgnoreCase(installed.checksum) &&
+           getRunningChecksum(OTA_HASH_MD5).equalsIgnoreCase(installed.imageMD5);
+}
+
+String OTAUpdateClass::getRunningChecksum(OTAHashType hashType) {
+    String &cached = runningChecksums[hashType];
+    if (cached.length()) return cached;
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    uint32_t size = ESP.getSketchSize();
+    if (running == nullptr || size == 0) return cached;
+
+    OTAHash hash;
+    hash.begin(hashType);
+    uint8_t block[512];
+    for (uint32_t offset = 0; offset < size; offset += sizeof(block)) {
+        uint32_t length = min(size - offset, (uint32_t) sizeof(block));
+        if (esp_partition_read(running, offset, block, length) != ESP_OK) return cached;
+        hash.update(block, length);
+    }
+    char hex[OTA_HASH_HEX_SIZE];
+    hash.finish(hex);
+    cached = hex;
+    return cached;
+}
+
 bool OTAUpdateClass::isUpdating() const {
     return updating;
 }
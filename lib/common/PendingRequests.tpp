@@ -0,0 +1,202 @@
+#ifndef SENSENET_PENDING_REQUESTS_TPP
+#define SENSENET_PENDING_REQUESTS_TPP
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <functional>
+
+#ifndef PENDING_REQUESTS_MAX
+#define PENDING_REQUESTS_MAX 16
+#endif
+
+#ifndef PENDING_WHEEL_SLOTS
+#define PENDING_WHEEL_SLOTS 32
+#endif
+
+#ifndef PENDING_WHEEL_TICK_MS
+#define PENDING_WHEEL_TICK_MS 250
+#endif
+
+enum PendingResult {
+    PENDING_COMPLETED,
+    PENDING_TIMED_OUT
+};
+
+/*
+ * Outstanding attribute and RPC requests, each with its own deadline.
+ *
+ * Requests live in a fixed pool and are hashed into a timer wheel by deadline tick, so expire()
+ * only looks at the slots whose tick passed since the last call. A deadline further away than one
+ * turn of the wheel simply stays in its slot until the turn where it is due.
+ */
+class PendingRequests {
+public:
+    typedef std::function<bool(const String &topic, const JsonDocument &json)> ResponseCallback;
+
+    typedef std::function<void(uint32_t requestId, PendingResult result)> ResultCallback;
+
+    PendingRequests();
+
+    // False when PENDING_REQUESTS_MAX requests are already outstanding
+    bool add(uint32_t id, uint32_t timeoutMs, const ResponseCallback &callback, const ResultCallback &result,
+             uint64_t now);
+
+    bool contains(uint32_t id) const {
+        return find(id) >= 0;
+    }
+
+    // Completes the request whatever the callback returns, the return value is the callback's
+    bool complete(uint32_t id, const String &topic, const JsonDocument &json);
+
+    bool cancel(uint32_t id);
+
+    uint16_t expire(uint64_t now);
+
+    uint16_t getCount() const {
+        return count;
+    }
+
+    uint32_t getTimeouts() const {
+        return timeouts;
+    }
+
+private:
+    struct Entry {
+        uint32_t id;
+        uint64_t deadline;
+        ResponseCallback callback;
+        ResultCallback result;
+        int8_t next;
+        bool used;
+    };
+
+    Entry entries[PENDING_REQUESTS_MAX];
+    int8_t wheel[PENDING_WHEEL_SLOTS];
+    uint64_t wheelTick = 0;
+    uint16_t count = 0;
+    uint32_t timeouts = 0;
+
+    int8_t find(uint32_t id) const;
+
+    static uint8_t slotOf(uint64_t deadline) {
+        return (deadline / PENDING_WHEEL_TICK_MS) % PENDING_WHEEL_SLOTS;
+    }
+
+    void unlink(int8_t index);
+
+    void release(int8_t index);
+};
+
+PendingRequests::PendingRequests() {
+    for (int8_t &slot: wheel) slot = -1;
+    for (Entry &entry: entries) {
+        entry.used = false;
+        entry.next = -1;
+    }
+}
+
+bool PendingRequests::add(uint32_t id, uint32_t timeoutMs, const ResponseCallback &callback,
+                          const ResultCallback &result, uint64_t now) {
+    int8_t index = -1;
+    for (int8_t i = 0; i < PENDING_REQUESTS_MAX; i++) {
+        if (!entries[i].used) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0) return false;
+
+    if (count == 0) wheelTick = now / PENDING_WHEEL_TICK_MS;
+    Entry &entry = entries[index];
+    entry.id = id;
+    entry.deadline = now + timeoutMs;
+    entry.callback = callback;
+    entry.result = result;
+    entry.used = true;
+
+    uint8_t slot = slotOf(entry.deadline);
+    entry.next = wheel[slot];
+    wheel[slot] = index;
+    count++;
+    return true;
+}
+
+bool PendingRequests::complete(uint32_t id, const String &topic, const JsonDocument &json) {
+    int8_t index = find(id);
+    if (index < 0) return false;
+
+    // Callbacks may issue new requests, so the slot is released before they run
+    ResponseCallback callback = std::move(entries[index].callback);
+    ResultCallback result = std::move(entries[index].result);
+    unlink(index);
+    release(index);
+
+    bool handled = callback != nullptr && callback(topic, json);
+    if (result != nullptr) result(id, PENDING_COMPLETED);
+    return handled;
+}
+
+bool PendingRequests::cancel(uint32_t id) {
+    int8_t index = find(id);
+    if (index < 0) return false;
+    unlink(index);
+    release(index);
+    return true;
+}
+
+uint16_t PendingRequests::expire(uint64_t now) {
+    if (count == 0) return 0;
+
+    uint32_t expiredIds[PENDING_REQUESTS_MAX];
+    ResultCallback results[PENDING_REQUESTS_MAX];
+    uint16_t expired = 0;
+
+    uint64_t tick = now / PENDING_WHEEL_TICK_MS;
+    uint64_t steps = tick - wheelTick + 1;
+    if (steps > PENDING_WHEEL_SLOTS) steps = PENDING_WHEEL_SLOTS;
+    for (uint64_t step = 0; step < steps; step++) {
+        uint8_t slot = (wheelTick + step) % PENDING_WHEEL_SLOTS;
+        int8_t index = wheel[slot];
+        while (index >= 0) {
+            int8_t next = entries[index].next;
+            if (entries[index].deadline <= now) {
+                expiredIds[expired] = entries[index].id;
+                results[expired] = std::move(entries[index].result);
+                expired++;
+                unlink(index);
+                release(index);
+            }
+            index = next;
+        }
+    }
+    // The current tick is visited again, later deadlines in it are not due yet
+    wheelTick = tick;
+
+    timeouts += expired;
+    for (uint16_t i = 0; i < expired; i++)
+        if (results[i] != nullptr) results[i](expiredIds[i], PENDING_TIMED_OUT);
+    return expired;
+}
+
+int8_t PendingRequests::find(uint32_t id) const {
+    for (int8_t i = 0; i < PENDING_REQUESTS_MAX; i++)
+        if (entries[i].used && entries[i].id == id) return i;
+    return -1;
+}
+
+void PendingRequests::unlink(int8_t index) {
+    int8_t *link = &wheel[slotOf(entries[index].deadline)];
+    while (*link >= 0 && *link != index)
+        link = &entries[*link].next;
+    if (*link == index) *link = entries[index].next;
+    entries[index].next = -1;
+}
+
+void PendingRequests::release(int8_t index) {
+    entries[index].used = false;
+    entries[index].callback = nullptr;
+    entries[index].result = nullptr;
+    count--;
+}
+
+#endif //SENSENET_PENDING_REQUESTS_TPP
@@ -3,8 +3,10 @@
 
 #include <Arduino.h>
 #include <vector>
+#include <algorithm>
 #include "PrintDBG.tpp"
 #include "MQTTMessage.tpp"
+#include "SegmentedLog.tpp"
 
 #ifdef ESP32
 
@@ -21,34 +23,81 @@ private:
     uint16_t size;
     bool storeOnMemory;
 
+    // Ring buffer mode: message slots and one contiguous byte arena, both allocated once
+    struct Slot {
+        uint32_t offset;
+        uint16_t topicLength;
+        uint16_t payloadLength;
+        uint32_t enqueuedAt;
+    };
+    Slot *slots = nullptr;
+    uint8_t *arena = nullptr;
+    uint32_t arenaSize = 0;
+    uint32_t arenaHead = 0, arenaTail = 0;
+    uint16_t firstSlot = 0, slotCount = 0;
+    // Position of the last peeked message, relative to the head
+    uint16_t cursor = 0;
+    // Messages accepted since construction, head sequence = pushedCount - size
+    uint32_t pushedCount = 0;
+
+    bool isRing() const {
+        return arena != nullptr;
+    }
+
+    int32_t allocateInArena(uint32_t length);
+
 #ifdef ESP32
     String queueDirString = "NON_INIT";  //write a stupid without "/" in starting to create error
-    uint32_t maxIndex = 1;
-    uint32_t minIndex = -1;
-    uint16_t currentSize = 0;
-    String lastPeekFilePath = "";
-
-    bool writeToFile(const char *message, String filename) {
-        filename = queueDirString + String("/") + filename;
-        printDBGln(String("Writing [" + String(message) + "] to [" + filename + "]"));
-        File file = LittleFS.open(filename, FILE_WRITE, true);
-        if (!file) {
-            printDBGln("failed to open file for writing");
-            return false;
+    SegmentedLog *segmentLog = nullptr;
+
+    // Moves messages left behind by the old file-per-message layout into the log
+    void migrateLegacyFiles() {
+        vector<uint32_t> indexes;
+        File queueDir = LittleFS.open(queueDirString, FILE_READ);
+        String file = queueDir.getNextFileName();
+        while (file != nullptr && !file.isEmpty()) {
+            uint32_t i = strtol(pathToFileName(file.c_str()), NULL, 10);
+            if (i != 0) indexes.push_back(i);
+            file = queueDir.getNextFileName();
+        }
+        queueDir.close();
+        if (indexes.empty()) return;
+
+        sort(indexes.begin(), indexes.end());
+        printDBGln("Migrating [" + String((uint32_t) indexes.size()) + "] legacy queue files");
+        for (uint32_t i: indexes) {
+            String path = queueDirString + "/" + String(i);
+            File legacy = LittleFS.open(path, FILE_READ);
+            DynamicJsonDocument doc(1024);
+            if (legacy && !deserializeJson(doc, legacy)) {
+                String topic = doc["topic"].as<String>();
+                String payload = doc["payload"].as<String>();
+                segmentLog->append(topic.c_str(), topic.length(), (const uint8_t *) payload.c_str(), payload.length());
+            }
+            legacy.close();
+            LittleFS.remove(path);
         }
-        bool result = file.print(message);
-        file.close();
-        printDBGln("file written result: " + String(result));
-        return result;
     }
 
 #endif
 
 public:
-    Queue(uint16_t size_t, bool storeOnMemory = true, bool format = false) {
+    Queue(uint16_t size_t, bool storeOnMemory = true, bool format = false, uint32_t arenaSize = 0) {
         this->size = size_t;
         this->storeOnMemory = true;
 
+        if (storeOnMemory && arenaSize > 0) {
+            slots = new Slot[size_t];
+            arena = (uint8_t *) malloc(arenaSize);
+            if (arena == nullptr) {
+                printDBGln("Queue arena allocation failed, using vector");
+                delete[] slots;
+                slots = nullptr;
+            } else {
+                this->arenaSize = arenaSize;
+            }
+        }
+
 #ifdef ESP32
         if (!storeOnMemory) {
             if (!LittleFS.begin(true)) {
@@ -78,26 +127,17 @@ public:
                 }
                 queueDir.close();
 
-                queueDir = LittleFS.open(queueDirPath, FILE_READ);
-                String file = queueDir.getNextFileName();
-                while (file != nullptr && !file.isEmpty()) {
-                    uint32_t i = strtol(pathToFileName(file.c_str()), NULL, 10);
-                    if (i == 0) {
-                        LittleFS.rmdir(file);
-                        LittleFS.remove(file);
-                    } else {
-                        currentSize++;
-                        if (i > maxIndex) maxIndex = i;
-                        if (i < minIndex) minIndex = i;
-                    }
-                    file = queueDir.getNextFileName();
+                queueDirString = queueDirPath;
+                segmentLog = new SegmentedLog(queueDirPath);
+                if (!segmentLog->begin()) {
+                    printDBGln("Segmented log init failed, falling back to memory");
+                    delete segmentLog;
+                    segmentLog = nullptr;
+                    return;
                 }
-                if (minIndex > maxIndex) minIndex = maxIndex;
-                queueDir.close();
+                migrateLegacyFiles();
+                pushedCount = segmentLog->getCount();
 
-//                printDBGln("Queue Size is [" + String(currentSize) +
-//                           "] and maxIndex is [" + String(maxIndex) + "] and minIndex is [" + String(minIndex) + "]");
-                queueDirString = queueDirPath;
                 this->storeOnMemory = false;
             }
         }
@@ -105,48 +145,54 @@ public:
     }
 
     ~Queue() {
-        clear();
+#ifdef ESP32
+        delete segmentLog;
+#endif
+        delete[] slots;
+        free(arena);
     }
 
     uint16_t getSize();
 
     bool push(const MQTTMessage &item);
 
+    // enqueuedAt is kept with the message and handed back in its views
+    bool push(const char *topic, const uint8_t *payload, uint16_t payloadLength, uint32_t enqueuedAt = 0);
+
     MQTTMessage peek();
 
+    bool peek(MQTTMessageView &view);
+
+    // Looks at the message after the last peeked one, the previous view may be invalidated
+    bool peekNext(MQTTMessageView &view);
+
+    // Looks at the message index positions after the head, following peekNext() calls continue from it
+    bool peekAt(uint16_t index, MQTTMessageView &view);
+
+    // Sequence number of the head message, it grows by one for every message leaving the queue for any reason
+    uint32_t getHeadSequence() {
+        return pushedCount - getSize();
+    }
+
     void clear();
 
     bool removeLastPeek();
 
+    // Bytes written to flash since boot, 0 for a memory queue
+    uint32_t getBytesWritten() const {
 #ifdef ESP32
-
-    DynamicJsonDocument showStoreOnDiskStatus() {
-        DynamicJsonDocument data(1024);
-#ifdef ESP32
-        if (!storeOnMemory) {
-            data["FS TotalSize"] = String(LittleFS.totalBytes());
-            data["FS UsedSize"] = String(LittleFS.usedBytes());
-            data["QueueSize"] = String(getSize());
-            data.shrinkToFit();
-            return data;
-        }
+        if (!storeOnMemory) return segmentLog->getBytesWritten();
 #endif
-        data["QueueSize"] = String(getSize());
-        data.shrinkToFit();
-        return data;
+        return 0;
     }
 
+#ifdef ESP32
+
     void listDir() const {
 #ifdef ESP32
         if (!storeOnMemory) {
             printDBGln("List Dir: " + queueDirString);
-            File queueDir = LittleFS.open(queueDirString, FILE_READ);
-            String file = queueDir.getNextFileName();
-            while (file != nullptr && !file.isEmpty()) {
-                printDBGln("File: " + file);
-                file = queueDir.getNextFileName();
-            }
-            queueDir.close();
+            segmentLog->listSegments();
         }
 #endif
     }
@@ -160,122 +206,201 @@ bool Queue::removeLastPeek() {
         return false;
     }
 #ifdef ESP32
-    if (!storeOnMemory) {
-        if (!lastPeekFilePath.isEmpty()) {
-            bool result = LittleFS.remove(lastPeekFilePath);
-            if (result) {
-                currentSize--;
-                int i = strtol(pathToFileName(lastPeekFilePath.c_str()), NULL, 10);
-                if (i >= minIndex) minIndex = i + 1;
-            }
-            return result;
-        }
-        return false;
-    }
+    if (!storeOnMemory)
+        return segmentLog->removeFirst();
 #endif
 
+    if (isRing()) {
+        firstSlot = (firstSlot + 1) % size;
+        slotCount--;
+        if (slotCount == 0) arenaHead = arenaTail = 0;
+        else arenaTail = slots[firstSlot].offset;
+        return true;
+    }
+
     list.erase(list.begin());
     return true;
 }
 
 uint16_t Queue::getSize() {
 #ifdef ESP32
-    if (!storeOnMemory) {
-        if (currentSize == 0) {
-            maxIndex = 1;
-            minIndex = 1;
-        }
-        return currentSize;
-    }
+    if (!storeOnMemory)
+        return segmentLog->getCount();
 #endif
+    if (isRing()) return slotCount;
     return list.size();
 }
 
 bool Queue::push(const MQTTMessage &item) {
+    return push(item.getTopic().c_str(), (const uint8_t *) item.getPayload().c_str(), item.getPayload().length(),
+                item.getEnqueuedAt());
+}
+
+bool Queue::push(const char *topic, const uint8_t *payload, uint16_t payloadLength, uint32_t enqueuedAt) {
     int _size = getSize();
     if (_size == size) {
-        printDBGln(String("Queue is full and it's size is: " + String(currentSize)));
-        if (peek().getPayload().isEmpty() || !removeLastPeek()) {
+        printDBGln(String("Queue is full and it's size is: " + String(_size)));
+        if (!removeLastPeek()) {
             printDBGln(String("Error: Can not peek one and continue round robin: "));
             listDir();
             return false;
         }
     }
 
+    uint16_t topicLength = strlen(topic);
 #ifdef ESP32
     if (!storeOnMemory) {
-        DynamicJsonDocument data(1024);
-        data["payload"] = item.getPayload();
-        data["topic"] = item.getTopic();
-        data.shrinkToFit();
-        bool result = writeToFile(data.as<String>().c_str(), String(maxIndex));
-        if (result) {
-            maxIndex++;
-            currentSize++;
-            if (maxIndex == 0 || minIndex == 0) {
-                printDBGln("Error: End of world in queue!");
-                LittleFS.format();
-                ESP.restart();
-            }
-        }
-        return result;
+        if (!segmentLog->append(topic, topicLength, payload, payloadLength, enqueuedAt)) return false;
+        pushedCount++;
+        return true;
     }
 #endif
 
-    list.push_back(item);
+    if (isRing()) {
+        int32_t offset = allocateInArena(topicLength + payloadLength + 2);
+        while (offset < 0 && slotCount > 0) {
+            printDBGln("Queue arena is full, dropping the oldest message");
+            removeLastPeek();
+            offset = allocateInArena(topicLength + payloadLength + 2);
+        }
+        if (offset < 0) {
+            printDBGln("Error: message does not fit in queue arena [" + String(payloadLength) + "]");
+            return false;
+        }
+        uint8_t *record = arena + offset;
+        memcpy(record, topic, topicLength);
+        record[topicLength] = '\0';
+        memcpy(record + topicLength + 1, payload, payloadLength);
+        record[topicLength + 1 + payloadLength] = '\0';
+        slots[(firstSlot + slotCount) % size] = {(uint32_t) offset, topicLength, payloadLength, enqueuedAt};
+        slotCount++;
+        pushedCount++;
+        return true;
+    }
+
+    String payloadString;
+    payloadString.concat((const char *) payload, payloadLength);
+    list.push_back(MQTTMessage(topic, payloadString, enqueuedAt));
+    pushedCount++;
     return true;
 }
 
+// Records never wrap, a record that does not fit before the end of the arena starts at 0
+int32_t Queue::allocateInArena(uint32_t length) {
+    if (length > arenaSize) return -1;
+    if (slotCount == 0) arenaHead = arenaTail = 0;
+
+    if (slotCount == 0 || arenaHead > arenaTail) {
+        if (arenaSize - arenaHead >= length) {
+            arenaHead += length;
+            return arenaHead - length;
+        }
+        if (arenaTail >= length) {
+            arenaHead = length;
+            return 0;
+        }
+        return -1;
+    }
+
+    if (arenaTail - arenaHead >= length) {
+        arenaHead += length;
+        return arenaHead - length;
+    }
+    return -1;
+}
+
 MQTTMessage Queue::peek() {
+    MQTTMessageView view;
+    if (!peek(view)) return {};
+    String payload;
+    payload.concat((const char *) view.payload, view.payloadLength);
+    return {view.topic, payload, view.enqueuedAt};
+}
+
+bool Queue::peek(MQTTMessageView &view) {
     int _size = getSize();
-    if (_size == 0) return {};
+    if (_size == 0) return false;
+    cursor = 0;
 
 #ifdef ESP32
     if (!storeOnMemory) {
-        if (minIndex > maxIndex) {
-            printDBGln("Error: minIndex > maxIndex");
-            listDir();
-            delay(1000);
-            ESP.restart();
-        }
+        if (!segmentLog->peek()) return false;
+        view = {segmentLog->getPeekedTopic(), segmentLog->getPeekedPayload(), segmentLog->getPeekedPayloadLength(),
+                segmentLog->getPeekedEnqueuedAt()};
+        return true;
+    }
+#endif
 
-        bool found = false;
-        while (minIndex <= maxIndex) {
-            if (LittleFS.exists(queueDirString + "/" + String(minIndex))) {
-                found = true;
-                break;
-            }
-            minIndex++;
-        }
+    if (isRing()) {
+        const Slot &slot = slots[firstSlot];
+        view = {(const char *) arena + slot.offset, arena + slot.offset + slot.topicLength + 1, slot.payloadLength,
+                slot.enqueuedAt};
+        return true;
+    }
 
-        if (!found) {
-            printDBGln("Error: could not find any file but current size is: " + String(currentSize));
-            listDir();
-            delay(1000);
-            ESP.restart();
-        }
+    const MQTTMessage &message = list.front();
+    view = {message.getTopic().c_str(), (const uint8_t *) message.getPayload().c_str(),
+            (uint16_t) message.getPayload().length(), message.getEnqueuedAt()};
+    return true;
+}
 
-        File file = LittleFS.open(queueDirString + "/" + String(minIndex), FILE_READ);
-        DynamicJsonDocument doc(1024);
-        deserializeJson(doc, file.readString());
-        lastPeekFilePath = file.path();
-        MQTTMessage message = MQTTMessage(doc["topic"].as<String>(), doc["payload"].as<String>());
-        printDBGln("Peek file: " + String(file.path()));
-        file.close();
-        return message;
+bool Queue::peekNext(MQTTMessageView &view) {
+#ifdef ESP32
+    if (!storeOnMemory) {
+        if (!segmentLog->peekNext()) return false;
+        view = {segmentLog->getPeekedTopic(), segmentLog->getPeekedPayload(), segmentLog->getPeekedPayloadLength(),
+                segmentLog->getPeekedEnqueuedAt()};
+        return true;
     }
 #endif
+    if (cursor + 1 >= getSize()) return false;
+    cursor++;
+
+    if (isRing()) {
+        const Slot &slot = slots[(firstSlot + cursor) % size];
+        view = {(const char *) arena + slot.offset, arena + slot.offset + slot.topicLength + 1, slot.payloadLength,
+                slot.enqueuedAt};
+        return true;
+    }
 
-    return list.front();
+    const MQTTMessage &message = list[cursor];
+    view = {message.getTopic().c_str(), (const uint8_t *) message.getPayload().c_str(),
+            (uint16_t) message.getPayload().length(), message.getEnqueuedAt()};
+    return true;
 }
 
-void Queue::clear() {
+bool Queue::peekAt(uint16_t index, MQTTMessageView &view) {
+    if (index >= getSize()) return false;
 #ifdef ESP32
     if (!storeOnMemory) {
-        LittleFS.rmdir(queueDirString);
-        getSize();
+        if (!segmentLog->peekAt(index)) return false;
+        view = {segmentLog->getPeekedTopic(), segmentLog->getPeekedPayload(), segmentLog->getPeekedPayloadLength(),
+                segmentLog->getPeekedEnqueuedAt()};
+        return true;
     }
 #endif
+    cursor = index;
+
+    if (isRing()) {
+        const Slot &slot = slots[(firstSlot + cursor) % size];
+        view = {(const char *) arena + slot.offset, arena + slot.offset + slot.topicLength + 1, slot.payloadLength,
+                slot.enqueuedAt};
+        return true;
+    }
+
+    const MQTTMessage &message = list[cursor];
+    view = {message.getTopic().c_str(), (const uint8_t *) message.getPayload().c_str(),
+            (uint16_t) message.getPayload().length(), message.getEnqueuedAt()};
+    return true;
+}
+
+void Queue::clear() {
+#ifdef ESP32
+    if (!storeOnMemory)
+        segmentLog->clear();
+#endif
+    firstSlot = slotCount = 0;
+    arenaHead = arenaTail = 0;
     list.clear();
 }
 
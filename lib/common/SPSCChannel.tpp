@@ -0,0 +1,167 @@
+#ifndef SENSENET_SPSC_CHANNEL_TPP
+#define SENSENET_SPSC_CHANNEL_TPP
+
+#include <Arduino.h>
+#include <atomic>
+#include "PrintDBG.tpp"
+#include "MQTTMessage.tpp"
+
+#define SPSC_RECORD_HEADER_SIZE 12
+#define SPSC_WRAP_MARKER 0xFFFF
+
+/*
+ * Wait-free single producer / single consumer message channel over a preallocated byte ring.
+ *
+ * Record: [topicLength u16][payloadLength u16][flags u8][pad 3][enqueuedAt u32][topic\0][payload\0],
+ * 4 byte aligned.
+ * head is only written by the producer and tail only by the consumer, so neither side ever waits
+ * for the other. A full channel rejects the message and counts a drop.
+ */
+class SPSCChannel {
+public:
+    // capacity is rounded up to a power of two
+    explicit SPSCChannel(uint32_t capacity);
+
+    ~SPSCChannel();
+
+    // Producer side
+    bool push(const char *topic, const uint8_t *payload, uint16_t payloadLength, uint8_t flags,
+              uint32_t enqueuedAt = 0);
+
+    // Producer side in two steps, for payloads serialized in place: reserve() returns where the
+    // payloadLength bytes go, commit() hands the record to the consumer. nullptr counts a drop
+    uint8_t *reserve(const char *topic, uint16_t payloadLength, uint8_t flags, uint32_t enqueuedAt = 0);
+
+    void commit();
+
+    // Consumer side, the view stays valid until pop()
+    bool peek(MQTTMessageView &view, uint8_t &flags);
+
+    void pop();
+
+    uint32_t getDrops() const {
+        return drops.load(std::memory_order_relaxed);
+    }
+
+    uint32_t getUsedBytes() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+private:
+    uint8_t *ring;
+    uint32_t capacity, mask;
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    std::atomic<uint32_t> drops{0};
+    uint32_t peekedLength = 0;
+    // Head after the reserved record, only touched by the producer
+    uint32_t reservedHead = 0;
+    bool reserved = false;
+
+    static uint32_t align4(uint32_t length) {
+        return (length + 3) & ~((uint32_t) 3);
+    }
+};
+
+SPSCChannel::SPSCChannel(uint32_t capacity) {
+    uint32_t size = 64;
+    while (size < capacity) size <<= 1;
+    this->capacity = size;
+    this->mask = size - 1;
+    ring = (uint8_t *) malloc(size);
+    if (ring == nullptr) {
+        printDBGln("SPSCChannel: allocation failed");
+        this->capacity = 0;
+        this->mask = 0;
+    }
+}
+
+SPSCChannel::~SPSCChannel() {
+    free(ring);
+}
+
+bool SPSCChannel::push(const char *topic, const uint8_t *payload, uint16_t payloadLength, uint8_t flags,
+                       uint32_t enqueuedAt) {
+    uint8_t *destination = reserve(topic, payloadLength, flags, enqueuedAt);
+    if (destination == nullptr) return false;
+    memcpy(destination, payload, payloadLength);
+    commit();
+    return true;
+}
+
+uint8_t *SPSCChannel::reserve(const char *topic, uint16_t payloadLength, uint8_t flags, uint32_t enqueuedAt) {
+    uint16_t topicLength = strlen(topic);
+    uint32_t length = align4(SPSC_RECORD_HEADER_SIZE + topicLength + 1 + payloadLength + 1);
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t t = tail.load(std::memory_order_acquire);
+
+    uint32_t position = h & mask;
+    uint32_t padding = capacity - position < length ? capacity - position : 0;
+    if (ring == nullptr || capacity - (h - t) < length + padding) {
+        drops.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    // Records never wrap, the rest of the ring is skipped with a marker
+    if (padding > 0) {
+        uint16_t marker = SPSC_WRAP_MARKER;
+        memcpy(ring + position, &marker, sizeof(marker));
+        h += padding;
+        position = 0;
+    }
+
+    uint8_t *record = ring + position;
+    memcpy(record, &topicLength, 2);
+    memcpy(record + 2, &payloadLength, 2);
+    record[4] = flags;
+    memcpy(record + 8, &enqueuedAt, 4);
+    memcpy(record + SPSC_RECORD_HEADER_SIZE, topic, topicLength);
+    record[SPSC_RECORD_HEADER_SIZE + topicLength] = '\0';
+    record[SPSC_RECORD_HEADER_SIZE + topicLength + 1 + payloadLength] = '\0';
+
+    reservedHead = h + length;
+    reserved = true;
+    return record + SPSC_RECORD_HEADER_SIZE + topicLength + 1;
+}
+
+void SPSCChannel::commit() {
+    if (!reserved) return;
+    head.store(reservedHead, std::memory_order_release);
+    reserved = false;
+}
+
+bool SPSCChannel::peek(MQTTMessageView &view, uint8_t &flags) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    uint32_t h = head.load(std::memory_order_acquire);
+    if (t == h) return false;
+
+    uint32_t position = t & mask;
+    uint16_t topicLength;
+    memcpy(&topicLength, ring + position, 2);
+    if (topicLength == SPSC_WRAP_MARKER) {
+        t += capacity - position;
+        tail.store(t, std::memory_order_release);
+        if (t == h) return false;
+        position = 0;
+        memcpy(&topicLength, ring, 2);
+    }
+
+    const uint8_t *record = ring + position;
+    uint16_t payloadLength;
+    memcpy(&payloadLength, record + 2, 2);
+    flags = record[4];
+    uint32_t enqueuedAt;
+    memcpy(&enqueuedAt, record + 8, 4);
+    view = {(const char *) record + SPSC_RECORD_HEADER_SIZE, record + SPSC_RECORD_HEADER_SIZE + topicLength + 1,
+            payloadLength, enqueuedAt};
+    peekedLength = align4(SPSC_RECORD_HEADER_SIZE + topicLength + 1 + payloadLength + 1);
+    return true;
+}
+
+void SPSCChannel::pop() {
+    if (peekedLength == 0) return;
+    tail.store(tail.load(std::memory_order_relaxed) + peekedLength, std::memory_order_release);
+    peekedLength = 0;
+}
+
+#endif //SENSENET_SPSC_CHANNEL_TPP
@@ -0,0 +1,628 @@
+#ifndef SENSENET_SEGMENTED_LOG_TPP
+#define SENSENET_SEGMENTED_LOG_TPP
+
+#include <Arduino.h>
+#include "PrintDBG.tpp"
+
+#ifdef ESP32
+
+#include "LittleFS.h"
+#include "FS.h"
+
+// Number of fixed-size segment files the log rotates through (at least 2)
+#ifndef QUEUE_SEGMENT_COUNT
+#define QUEUE_SEGMENT_COUNT 4
+#endif
+
+// Size of each segment file in bytes, including the segment header
+#ifndef QUEUE_SEGMENT_SIZE
+#define QUEUE_SEGMENT_SIZE 32768
+#endif
+
+// Largest topic + payload a single record can hold
+#ifndef QUEUE_MAX_RECORD_SIZE
+#define QUEUE_MAX_RECORD_SIZE 2048
+#endif
+
+// Persist the tail pointer every N removed records. After a power loss at most N
+// already-sent records are delivered again.
+#ifndef QUEUE_TAIL_CHECKPOINT
+#define QUEUE_TAIL_CHECKPOINT 16
+#endif
+
+#define SEGMENT_MAGIC 0x32514E53           // "SNQ2"
+#define SEGMENT_LEGACY_MAGIC 0x31514E53    // "SNQ1", records without enqueue time
+#define SEGMENT_TAIL_MAGIC 0x54514E53      // "SNQT"
+#define SEGMENT_HEADER_SIZE 8
+#define SEGMENT_RECORD_HEADER_SIZE 12
+#define SEGMENT_LEGACY_RECORD_HEADER_SIZE 8
+
+/*
+ * Append-only message log stored in a ring of fixed-size segment files.
+ *
+ * Segment: [magic u32][sequence u32][record]...
+ * Record:  [topicLength u16][payloadLength u16][crc32 u32][enqueuedAt u32][topic][payload]
+ *
+ * enqueuedAt is millis() at the time of the append, records recovered by begin() report 0 since
+ * they were stamped by an earlier boot. Segments of the older format are still read and are never
+ * appended to.
+ *
+ * New records are appended to the head segment through a file handle that stays open,
+ * the tail pointer only moves forward in RAM and is checkpointed to a small file, and
+ * a segment is recycled as a whole once every record in it has been consumed.
+ */
+class SegmentedLog {
+public:
+    SegmentedLog(const String &dirPath, uint8_t segmentCount = QUEUE_SEGMENT_COUNT,
+                 uint32_t segmentSize = QUEUE_SEGMENT_SIZE);
+
+    ~SegmentedLog();
+
+    bool begin();
+
+    bool append(const char *topic, uint16_t topicLength, const uint8_t *payload, uint16_t payloadLength,
+                uint32_t enqueuedAt = 0);
+
+    bool peek();
+
+    bool peekNext();
+
+    // Reads the record index positions after the oldest one, skipped records are not loaded
+    bool peekAt(uint32_t index);
+
+    bool removeFirst();
+
+    void clear();
+
+    uint32_t getCount() const {
+        return count;
+    }
+
+    uint32_t getBytesWritten() const {
+        return bytesWritten;
+    }
+
+    const char *getPeekedTopic() const {
+        return (const char *) scratch;
+    }
+
+    const uint8_t *getPeekedPayload() const {
+        return scratch + peekedTopicLength + 1;
+    }
+
+    uint16_t getPeekedPayloadLength() const {
+        return peekedPayloadLength;
+    }
+
+    uint32_t getPeekedEnqueuedAt() const {
+        return peekedIndex < staleRecords ? 0 : peekedEnqueuedAt;
+    }
+
+    void listSegments() const;
+
+private:
+    struct Segment {
+        bool used;
+        bool sealed;
+        uint32_t sequence;
+        uint32_t end;
+        uint32_t records;
+        uint8_t recordHeaderSize;
+    };
+
+    String dirPath;
+    uint8_t segmentCount;
+    uint32_t segmentSize;
+    Segment *segments;
+    uint8_t head = 0, tail = 0;
+    uint32_t tailOffset = SEGMENT_HEADER_SIZE;
+    uint32_t nextSequence = 1;
+    uint32_t count = 0;
+    // The oldest records were recovered from flash, their enqueue time is meaningless after a reboot
+    uint32_t staleRecords = 0;
+    uint32_t bytesWritten = 0;
+    uint16_t removalsSinceCheckpoint = 0;
+    bool headOpen = false;
+    File headFile;
+
+    int16_t readerSegment = -1;
+    uint32_t readerSize = 0;
+    File readerFile;
+
+    uint8_t *scratch = nullptr;
+    int16_t peekedSegment = -1;
+    uint32_t peekedOffset = 0;
+    uint16_t peekedTopicLength = 0, peekedPayloadLength = 0;
+    uint32_t peekedIndex = 0, peekedEnqueuedAt = 0;
+
+    String segmentPath(uint8_t index) const {
+        return dirPath + "/seg" + String(index);
+    }
+
+    String tailPath() const {
+        return dirPath + "/tail";
+    }
+
+    static uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length);
+
+    static uint32_t recordCrc(uint16_t topicLength, uint16_t payloadLength, const uint8_t *topic,
+                              const uint8_t *payload, uint8_t headerSize, uint32_t enqueuedAt);
+
+    static void parseRecordHeader(const uint8_t *recordHeader, uint8_t headerSize, uint16_t &topicLength,
+                                  uint16_t &payloadLength, uint32_t &crc, uint32_t &enqueuedAt);
+
+    void forgetRecords(uint32_t records) {
+        count -= records;
+        staleRecords = staleRecords > records ? staleRecords - records : 0;
+    }
+
+    bool scanSegment(uint8_t index, uint32_t fromOffset, uint32_t &firstRecord);
+
+    bool openSegmentForAppend(uint8_t index);
+
+    bool openReader(uint8_t index, uint32_t neededSize);
+
+    bool readRecord(uint8_t index, uint32_t offset, bool body = true);
+
+    bool advance(bool body);
+
+    void closeReader();
+
+    void releaseSegment(uint8_t index);
+
+    void dropTailSegment();
+
+    void checkpointTail();
+};
+
+SegmentedLog::SegmentedLog(const String &dirPath, uint8_t segmentCount, uint32_t segmentSize) :
+        dirPath(dirPath), segmentCount(segmentCount < 2 ? 2 : segmentCount), segmentSize(segmentSize) {
+    segments = new Segment[this->segmentCount]();
+}
+
+SegmentedLog::~SegmentedLog() {
+    if (headOpen) headFile.close();
+    closeReader();
+    delete[] segments;
+    free(scratch);
+}
+
+uint32_t SegmentedLog::crc32Update(uint32_t crc, const uint8_t *data, size_t length) {
+    static const uint32_t table[16] = {
+            0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+            0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+uint32_t SegmentedLog::recordCrc(uint16_t topicLength, uint16_t payloadLength, const uint8_t *topic,
+                                 const uint8_t *payload, uint8_t headerSize, uint32_t enqueuedAt) {
+    uint8_t lengths[4] = {(uint8_t) (topicLength & 0xFF), (uint8_t) (topicLength >> 8),
+                          (uint8_t) (payloadLength & 0xFF), (uint8_t) (payloadLength >> 8)};
+    uint32_t crc = crc32Update(0, lengths, sizeof(lengths));
+    crc = crc32Update(crc, topic, topicLength);
+    crc = crc32Update(crc, payload, payloadLength);
+    if (headerSize == SEGMENT_LEGACY_RECORD_HEADER_SIZE) return crc;
+    return crc32Update(crc, (const uint8_t *) &enqueuedAt, 4);
+}
+
+void SegmentedLog::parseRecordHeader(const uint8_t *recordHeader, uint8_t headerSize, uint16_t &topicLength,
+                                     uint16_t &payloadLength, uint32_t &crc, uint32_t &enqueuedAt) {
+    topicLength = recordHeader[0] | (recordHeader[1] << 8);
+    payloadLength = recordHeader[2] | (recordHeader[3] << 8);
+    memcpy(&crc, recordHeader + 4, 4);
+    enqueuedAt = 0;
+    if (headerSize > SEGMENT_LEGACY_RECORD_HEADER_SIZE) memcpy(&enqueuedAt, recordHeader + 8, 4);
+}
+
+bool SegmentedLog::begin() {
+    if (scratch == nullptr)
+        scratch = (uint8_t *) malloc(QUEUE_MAX_RECORD_SIZE + 2);
+    if (scratch == nullptr) {
+        printDBGln("SegmentedLog: not enough RAM for scratch buffer");
+        return false;
+    }
+
+    uint32_t maxSequence = 0;
+    int16_t newest = -1;
+    for (uint8_t i = 0; i < segmentCount; i++) {
+        uint32_t firstRecord;
+        segments[i] = {};
+        if (!scanSegment(i, SEGMENT_HEADER_SIZE, firstRecord)) continue;
+        if (segments[i].sequence >= maxSequence) {
+            maxSequence = segments[i].sequence;
+            newest = i;
+        }
+    }
+    nextSequence = maxSequence + 1;
+
+    if (newest == -1) {
+        head = tail = 0;
+        tailOffset = SEGMENT_HEADER_SIZE;
+        count = 0;
+        printDBGln("SegmentedLog: empty log in " + dirPath);
+        return true;
+    }
+
+    // Restore the tail checkpoint, fall back to the oldest segment if it was recycled meanwhile
+    uint32_t tailRecord[4] = {0, 0, 0, 0};
+    File tailFile = LittleFS.open(tailPath(), FILE_READ);
+    if (tailFile) {
+        if (tailFile.read((uint8_t *) tailRecord, sizeof(tailRecord)) != sizeof(tailRecord) ||
+            tailRecord[0] != SEGMENT_TAIL_MAGIC ||
+            tailRecord[3] != crc32Update(0, (const uint8_t *) tailRecord, 12))
+            tailRecord[0] = 0;
+        tailFile.close();
+    }
+
+    head = newest;
+    int16_t tailIndex = -1;
+    if (tailRecord[0] == SEGMENT_TAIL_MAGIC) {
+        for (uint8_t i = 0; i < segmentCount; i++)
+            if (segments[i].used && segments[i].sequence == tailRecord[1]) tailIndex = i;
+    }
+    if (tailIndex == -1) {
+        // Oldest used segment in ring order walking backwards from the head
+        tailIndex = head;
+        for (uint8_t n = 1; n < segmentCount; n++) {
+            uint8_t i = (head + segmentCount - n) % segmentCount;
+            if (!segments[i].used || segments[i].sequence > segments[tailIndex].sequence) break;
+            tailIndex = i;
+        }
+        tailRecord[2] = SEGMENT_HEADER_SIZE;
+    }
+    tail = tailIndex;
+
+    uint32_t firstRecord;
+    scanSegment(tail, tailRecord[2], firstRecord);
+    tailOffset = firstRecord;
+
+    // Segments outside tail..head hold consumed records only
+    count = 0;
+    bool inRange = false;
+    for (uint8_t n = 0; n < segmentCount; n++) {
+        uint8_t i = (tail + n) % segmentCount;
+        if (i == tail) inRange = true;
+        if (inRange && segments[i].used) count += segments[i].records;
+        else if (segments[i].used) releaseSegment(i);
+        if (i == head) inRange = false;
+    }
+
+    staleRecords = count;
+    printDBGln("SegmentedLog: recovered [" + String(count) + "] records, tail segment [" + String(tail) +
+               "] offset [" + String(tailOffset) + "] head segment [" + String(head) + "]");
+    return true;
+}
+
+// Validates the segment header and every record, records after fromOffset are counted as unread
+bool SegmentedLog::scanSegment(uint8_t index, uint32_t fromOffset, uint32_t &firstRecord) {
+    Segment &segment = segments[index];
+    File file = LittleFS.open(segmentPath(index), FILE_READ);
+    if (!file) return false;
+
+    uint32_t header[2];
+    uint32_t size = file.size();
+    if (size < SEGMENT_HEADER_SIZE || file.read((uint8_t *) header, sizeof(header)) != sizeof(header) ||
+        (header[0] != SEGMENT_MAGIC && header[0] != SEGMENT_LEGACY_MAGIC)) {
+        file.close();
+        return false;
+    }
+
+    segment.used = true;
+    segment.sealed = false;
+    segment.sequence = header[1];
+    segment.records = 0;
+    segment.recordHeaderSize =
+            header[0] == SEGMENT_MAGIC ? SEGMENT_RECORD_HEADER_SIZE : SEGMENT_LEGACY_RECORD_HEADER_SIZE;
+    firstRecord = 0;
+
+    uint8_t headerSize = segment.recordHeaderSize;
+    uint32_t position = SEGMENT_HEADER_SIZE;
+    uint8_t recordHeader[SEGMENT_RECORD_HEADER_SIZE];
+    while (position + headerSize <= size) {
+        if (file.read(recordHeader, headerSize) != headerSize) break;
+        uint16_t topicLength, payloadLength;
+        uint32_t crc, enqueuedAt;
+        parseRecordHeader(recordHeader, headerSize, topicLength, payloadLength, crc, enqueuedAt);
+        uint32_t bodyLength = topicLength + payloadLength;
+        if (bodyLength > QUEUE_MAX_RECORD_SIZE || position + headerSize + bodyLength > size ||
+            file.read(scratch, bodyLength) != bodyLength ||
+            recordCrc(topicLength, payloadLength, scratch, scratch + topicLength, headerSize, enqueuedAt) != crc)
+            break;
+
+        if (position >= fromOffset) {
+            if (firstRecord == 0) firstRecord = position;
+            segment.records++;
+        }
+        position += headerSize + bodyLength;
+    }
+    file.close();
+
+    // A torn or corrupted record ends the segment, never append behind it. Old format segments are
+    // only read
+    segment.end = position;
+    segment.sealed = position != size || headerSize != SEGMENT_RECORD_HEADER_SIZE;
+    if (firstRecord == 0) firstRecord = position;
+    return true;
+}
+
+bool SegmentedLog::openSegmentForAppend(uint8_t index) {
+    if (headOpen) {
+        headFile.close();
+        headOpen = false;
+    }
+    if (readerSegment == index) closeReader();
+
+    headFile = LittleFS.open(segmentPath(index), FILE_WRITE, true);
+    if (!headFile) {
+        printDBGln("SegmentedLog: failed to open segment " + String(index));
+        return false;
+    }
+    uint32_t header[2] = {SEGMENT_MAGIC, nextSequence};
+    if (headFile.write((const uint8_t *) header, sizeof(header)) != sizeof(header)) {
+        headFile.close();
+        return false;
+    }
+    headFile.flush();
+    bytesWritten += sizeof(header);
+    headOpen = true;
+
+    segments[index] = {true, false, nextSequence++, SEGMENT_HEADER_SIZE, 0, SEGMENT_RECORD_HEADER_SIZE};
+    return true;
+}
+
+bool SegmentedLog::append(const char *topic, uint16_t topicLength, const uint8_t *payload, uint16_t payloadLength,
+                          uint32_t enqueuedAt) {
+    uint32_t bodyLength = topicLength + payloadLength;
+    uint32_t recordLength = SEGMENT_RECORD_HEADER_SIZE + bodyLength;
+    if (bodyLength > QUEUE_MAX_RECORD_SIZE || recordLength > segmentSize - SEGMENT_HEADER_SIZE) {
+        printDBGln("SegmentedLog: record too large [" + String(bodyLength) + "]");
+        return false;
+    }
+
+    Segment &current = segments[head];
+    if (!current.used || current.sealed || current.end + recordLength > segmentSize) {
+        uint8_t next = current.used ? (head + 1) % segmentCount : head;
+        if (segments[next].used && count > 0 && next == tail) {
+            printDBGln("SegmentedLog: log is full, dropping [" + String(segments[next].records) + "] records");
+            dropTailSegment();
+        }
+        if (!openSegmentForAppend(next)) return false;
+        head = next;
+    } else if (!headOpen) {
+        headFile = LittleFS.open(segmentPath(head), FILE_APPEND);
+        if (!headFile) return false;
+        headOpen = true;
+    }
+
+    if (count == 0) {
+        for (uint8_t i = 0; i < segmentCount; i++)
+            if (i != head && segments[i].used) releaseSegment(i);
+        tail = head;
+        tailOffset = segments[head].end;
+        removalsSinceCheckpoint = QUEUE_TAIL_CHECKPOINT;
+    }
+
+    uint32_t crc = recordCrc(topicLength, payloadLength, (const uint8_t *) topic, payload, SEGMENT_RECORD_HEADER_SIZE,
+                             enqueuedAt);
+    uint8_t recordHeader[SEGMENT_RECORD_HEADER_SIZE] = {(uint8_t) (topicLength & 0xFF), (uint8_t) (topicLength >> 8),
+                                                        (uint8_t) (payloadLength & 0xFF),
+                                                        (uint8_t) (payloadLength >> 8)};
+    memcpy(recordHeader + 4, &crc, 4);
+    memcpy(recordHeader + 8, &enqueuedAt, 4);
+
+    size_t written = headFile.write(recordHeader, SEGMENT_RECORD_HEADER_SIZE);
+    written += headFile.write((const uint8_t *) topic, topicLength);
+    written += headFile.write(payload, payloadLength);
+    headFile.flush();
+
+    if (written != recordLength) {
+        printDBGln("SegmentedLog: short write, sealing segment " + String(head));
+        segments[head].sealed = true;
+        headFile.close();
+        headOpen = false;
+        return false;
+    }
+
+    segments[head].end += recordLength;
+    segments[head].records++;
+    count++;
+    bytesWritten += recordLength;
+    if (removalsSinceCheckpoint >= QUEUE_TAIL_CHECKPOINT) checkpointTail();
+    return true;
+}
+
+bool SegmentedLog::openReader(uint8_t index, uint32_t neededSize) {
+    if (readerSegment == index && readerSize >= neededSize) return true;
+    closeReader();
+    // Data appended through the head handle is flushed, a fresh handle sees it
+    readerFile = LittleFS.open(segmentPath(index), FILE_READ);
+    if (!readerFile) return false;
+    readerSegment = index;
+    readerSize = readerFile.size();
+    return readerSize >= neededSize;
+}
+
+void SegmentedLog::closeReader() {
+    if (readerSegment != -1) readerFile.close();
+    readerSegment = -1;
+    readerSize = 0;
+}
+
+bool SegmentedLog::peek() {
+    while (count > 0) {
+        if (tailOffset >= segments[tail].end) {
+            if (tail == head) return false;
+            releaseSegment(tail);
+            tail = (tail + 1) % segmentCount;
+            tailOffset = SEGMENT_HEADER_SIZE;
+            continue;
+        }
+
+        if (peekedSegment == tail && peekedOffset == tailOffset) {
+            peekedIndex = 0;
+            return true;
+        }
+        if (readRecord(tail, tailOffset)) {
+            peekedIndex = 0;
+            return true;
+        }
+
+        printDBGln("SegmentedLog: corrupted record in segment " + String(tail) + ", dropping [" +
+                   String(segments[tail].records) + "] records");
+        if (tail == head) {
+            forgetRecords(segments[tail].records);
+            segments[tail].records = 0;
+            segments[tail].sealed = true;
+            tailOffset = segments[tail].end;
+            return false;
+        }
+        dropTailSegment();
+    }
+    return false;
+}
+
+// Reads the record following the last peeked one, used to look ahead without consuming
+bool SegmentedLog::peekNext() {
+    return advance(true);
+}
+
+bool SegmentedLog::peekAt(uint32_t index) {
+    if (index >= count || !peek()) return false;
+    for (uint32_t i = 0; i < index; i++)
+        if (!advance(i + 1 == index)) return false;
+    return true;
+}
+
+bool SegmentedLog::advance(bool body) {
+    if (peekedSegment == -1) return false;
+    uint8_t index = peekedSegment;
+    uint32_t offset = peekedOffset + segments[index].recordHeaderSize + peekedTopicLength + peekedPayloadLength;
+    if (offset >= segments[index].end) {
+        if (index == head) return false;
+        index = (index + 1) % segmentCount;
+        offset = SEGMENT_HEADER_SIZE;
+        if (!segments[index].used || offset >= segments[index].end) return false;
+    }
+    if (readRecord(index, offset, body)) {
+        peekedIndex++;
+        return true;
+    }
+    peekedSegment = -1;
+    return false;
+}
+
+// Without body only the lengths are loaded, enough to step over the record
+bool SegmentedLog::readRecord(uint8_t index, uint32_t offset, bool body) {
+    uint8_t headerSize = segments[index].recordHeaderSize;
+    uint8_t recordHeader[SEGMENT_RECORD_HEADER_SIZE];
+    bool valid = openReader(index, offset + headerSize) && readerFile.seek(offset) &&
+                 readerFile.read(recordHeader, headerSize) == headerSize;
+    uint16_t topicLength, payloadLength;
+    uint32_t crc, enqueuedAt;
+    parseRecordHeader(recordHeader, headerSize, topicLength, payloadLength, crc, enqueuedAt);
+    uint32_t bodyLength = topicLength + payloadLength;
+
+    valid = valid && bodyLength <= QUEUE_MAX_RECORD_SIZE && offset + headerSize + bodyLength <= segments[index].end;
+    if (valid && body) {
+        valid = openReader(index, offset + headerSize + bodyLength) &&
+                readerFile.seek(offset + headerSize) &&
+                readerFile.read(scratch, topicLength) == topicLength &&
+                readerFile.read(scratch + topicLength + 1, payloadLength) == payloadLength &&
+                recordCrc(topicLength, payloadLength, scratch, scratch + topicLength + 1, headerSize, enqueuedAt) ==
+                crc;
+        scratch[topicLength] = '\0';
+        scratch[topicLength + 1 + payloadLength] = '\0';
+    }
+    if (!valid) return false;
+
+    peekedSegment = index;
+    peekedOffset = offset;
+    peekedTopicLength = topicLength;
+    peekedPayloadLength = payloadLength;
+    peekedEnqueuedAt = enqueuedAt;
+    return true;
+}
+
+bool SegmentedLog::removeFirst() {
+    if (count == 0 || !peek()) return false;
+
+    tailOffset += segments[tail].recordHeaderSize + peekedTopicLength + peekedPayloadLength;
+    peekedSegment = -1;
+    segments[tail].records--;
+    forgetRecords(1);
+    removalsSinceCheckpoint++;
+
+    if (tailOffset >= segments[tail].end && tail != head) {
+        releaseSegment(tail);
+        tail = (tail + 1) % segmentCount;
+        tailOffset = SEGMENT_HEADER_SIZE;
+        checkpointTail();
+    } else if (removalsSinceCheckpoint >= QUEUE_TAIL_CHECKPOINT) {
+        checkpointTail();
+    }
+    return true;
+}
+
+void SegmentedLog::releaseSegment(uint8_t index) {
+    if (readerSegment == index) closeReader();
+    if (peekedSegment == index) peekedSegment = -1;
+    segments[index].used = false;
+    segments[index].records = 0;
+}
+
+void SegmentedLog::dropTailSegment() {
+    forgetRecords(segments[tail].records);
+    releaseSegment(tail);
+    tail = (tail + 1) % segmentCount;
+    tailOffset = SEGMENT_HEADER_SIZE;
+    checkpointTail();
+}
+
+void SegmentedLog::checkpointTail() {
+    uint32_t tailRecord[4] = {SEGMENT_TAIL_MAGIC, segments[tail].sequence, tailOffset, 0};
+    tailRecord[3] = crc32Update(0, (const uint8_t *) tailRecord, 12);
+    File file = LittleFS.open(tailPath(), FILE_WRITE, true);
+    if (!file) {
+        printDBGln("SegmentedLog: failed to write tail checkpoint");
+        return;
+    }
+    file.write((const uint8_t *) tailRecord, sizeof(tailRecord));
+    file.close();
+    bytesWritten += sizeof(tailRecord);
+    removalsSinceCheckpoint = 0;
+}
+
+void SegmentedLog::clear() {
+    if (headOpen) headFile.close();
+    headOpen = false;
+    closeReader();
+    for (uint8_t i = 0; i < segmentCount; i++) {
+        LittleFS.remove(segmentPath(i));
+        segments[i] = {};
+    }
+    LittleFS.remove(tailPath());
+    head = tail = 0;
+    tailOffset = SEGMENT_HEADER_SIZE;
+    count = 0;
+    staleRecords = 0;
+    peekedSegment = -1;
+    removalsSinceCheckpoint = 0;
+}
+
+void SegmentedLog::listSegments() const {
+    for (uint8_t i = 0; i < segmentCount; i++) {
+        printDBGln("Segment [" + String(i) + "] used [" + String(segments[i].used) + "] sequence [" +
+                   String(segments[i].sequence) + "] end [" + String(segments[i].end) + "] records [" +
+                   String(segments[i].records) + "]" + (i == head ? " HEAD" : "") + (i == tail ? " TAIL" : ""));
+    }
+}
+
+#endif
+
+#endif //SENSENET_SEGMENTED_LOG_TPP
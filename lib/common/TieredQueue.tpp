@@ -0,0 +1,171 @@
+#ifndef SENSENET_TIERED_QUEUE_TPP
+#define SENSENET_TIERED_QUEUE_TPP
+
+#include <Arduino.h>
+#include "PrintDBG.tpp"
+#include "MQTTMessage.tpp"
+#include "Queue.tpp"
+
+/*
+ * Two tier FIFO: a small RAM front buffer absorbs bursts and the oldest messages are spilled
+ * into a persistent flash queue once the front passes its watermark.
+ *
+ * Every message in the flash tier is older than every message in RAM, so draining the flash
+ * tier first keeps the overall order FIFO.
+ */
+class TieredQueue {
+public:
+    TieredQueue(uint16_t frontSize, uint32_t frontArenaSize, uint16_t spillWatermark, uint16_t backSize,
+                bool format = false);
+
+    ~TieredQueue();
+
+    uint16_t getSize();
+
+    bool push(const MQTTMessage &item);
+
+    bool push(const char *topic, const uint8_t *payload, uint16_t payloadLength, uint32_t enqueuedAt = 0);
+
+    MQTTMessage peek();
+
+    bool peek(MQTTMessageView &view);
+
+    // Continues after the last peeked message, crossing from the flash tier into RAM
+    bool peekNext(MQTTMessageView &view);
+
+    bool peekAt(uint16_t index, MQTTMessageView &view);
+
+    // Spilling keeps the order, so the pair is addressed like a single queue
+    uint32_t getHeadSequence() {
+        return pushedCount - getSize();
+    }
+
+    bool removeLastPeek();
+
+    void clear();
+
+    uint16_t spill(uint16_t maxMessages);
+
+    uint16_t getFrontSize() {
+        return front->getSize();
+    }
+
+    uint16_t getBackSize() {
+        return back->getSize();
+    }
+
+    uint32_t getBytesWritten() {
+        return back->getBytesWritten();
+    }
+
+    void listDir() {
+#ifdef ESP32
+        back->listDir();
+#endif
+    }
+
+private:
+    Queue *front;
+    Queue *back;
+    uint16_t frontSize;
+    uint16_t spillWatermark;
+    bool cursorInBack = false;
+    uint16_t backPeeked = 0;
+    uint32_t pushedCount = 0;
+
+    bool spillOne();
+};
+
+TieredQueue::TieredQueue(uint16_t frontSize, uint32_t frontArenaSize, uint16_t spillWatermark, uint16_t backSize,
+                         bool format) :
+        frontSize(frontSize), spillWatermark(spillWatermark < frontSize ? spillWatermark : frontSize - 1) {
+    front = new Queue(frontSize, true, false, frontArenaSize);
+    back = new Queue(backSize, false, format);
+    pushedCount = back->getSize();
+}
+
+TieredQueue::~TieredQueue() {
+    delete front;
+    delete back;
+}
+
+uint16_t TieredQueue::getSize() {
+    return front->getSize() + back->getSize();
+}
+
+bool TieredQueue::push(const MQTTMessage &item) {
+    return push(item.getTopic().c_str(), (const uint8_t *) item.getPayload().c_str(), item.getPayload().length(),
+                item.getEnqueuedAt());
+}
+
+bool TieredQueue::push(const char *topic, const uint8_t *payload, uint16_t payloadLength, uint32_t enqueuedAt) {
+    // Never let the RAM tier run its own round robin while the flash tier can take the oldest one
+    if (front->getSize() >= frontSize && !spillOne())
+        printDBGln("TieredQueue: spill failed, RAM tier drops its oldest message");
+    if (!front->push(topic, payload, payloadLength, enqueuedAt)) return false;
+    pushedCount++;
+    return true;
+}
+
+MQTTMessage TieredQueue::peek() {
+    if (back->getSize() > 0) return back->peek();
+    return front->peek();
+}
+
+bool TieredQueue::peek(MQTTMessageView &view) {
+    cursorInBack = back->getSize() > 0;
+    backPeeked = 1;
+    if (cursorInBack) return back->peek(view);
+    return front->peek(view);
+}
+
+bool TieredQueue::peekNext(MQTTMessageView &view) {
+    if (!cursorInBack) return front->peekNext(view);
+    if (back->peekNext(view)) {
+        backPeeked++;
+        return true;
+    }
+    // Only step into RAM once every flash message was seen, removal order depends on it
+    if (backPeeked < back->getSize()) return false;
+    cursorInBack = false;
+    return front->peek(view);
+}
+
+bool TieredQueue::peekAt(uint16_t index, MQTTMessageView &view) {
+    uint16_t backSize = back->getSize();
+    cursorInBack = index < backSize;
+    if (cursorInBack) {
+        backPeeked = index + 1;
+        return back->peekAt(index, view);
+    }
+    return front->peekAt(index - backSize, view);
+}
+
+bool TieredQueue::removeLastPeek() {
+    if (back->getSize() > 0) return back->removeLastPeek();
+    return front->removeLastPeek();
+}
+
+void TieredQueue::clear() {
+    front->clear();
+    back->clear();
+}
+
+bool TieredQueue::spillOne() {
+    MQTTMessageView message;
+    if (!front->peek(message)) return false;
+    if (!back->push(message.topic, message.payload, message.payloadLength, message.enqueuedAt)) return false;
+    return front->removeLastPeek();
+}
+
+// Moves the oldest RAM messages above the watermark into flash, at most maxMessages per call
+uint16_t TieredQueue::spill(uint16_t maxMessages) {
+    uint16_t spilled = 0;
+    while (spilled < maxMessages && front->getSize() > spillWatermark) {
+        if (!spillOne()) break;
+        spilled++;
+    }
+    return spilled;
+}
+
+#endif //SENSENET_TIERED_QUEUE_TPP
@@ -0,0 +1,132 @@
+#ifndef SENSENET_TOPIC_ROUTER_TPP
+#define SENSENET_TOPIC_ROUTER_TPP
+
+#include <Arduino.h>
+#include <vector>
+
+#define TOPIC_ROUTER_MAX_PARAMS 4
+#define TOPIC_ROUTER_NO_ROUTE -1
+
+/*
+ * Trie of MQTT subscription filters, one node per topic level.
+ *
+ * '+' levels match a single level and are handed back as integers, '#' matches the rest of the topic.
+ * An exact level is tried before '+' and '+' before '#', the next branch is only taken when the
+ * previous one dead ends. With the disjoint filters used here a topic is walked once.
+ */
+class TopicRouter {
+public:
+    // Returns the route of the filter, a known filter keeps its route
+    int16_t add(const char *filter);
+
+    // Route of the matching filter or TOPIC_ROUTER_NO_ROUTE, params get the '+' levels in order
+    int16_t match(const char *topic, uint32_t *params, uint8_t &paramCount) const;
+
+    const char *getFilter(int16_t route) const {
+        return filters[route].c_str();
+    }
+
+    uint16_t getRouteCount() const {
+        return filters.size();
+    }
+
+private:
+    struct Node {
+        String level;
+        int16_t firstChild = -1, nextSibling = -1, plusChild = -1;
+        int16_t route = TOPIC_ROUTER_NO_ROUTE, hashRoute = TOPIC_ROUTER_NO_ROUTE;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<String> filters;
+
+    int16_t findChild(int16_t node, const char *level, size_t length) const;
+
+    int16_t matchFrom(int16_t node, const char *level, uint32_t *params, uint8_t &paramCount) const;
+};
+
+int16_t TopicRouter::add(const char *filter) {
+    for (size_t i = 0; i < filters.size(); i++)
+        if (filters[i] == filter) return i;
+
+    if (nodes.empty()) nodes.emplace_back();
+    int16_t route = filters.size();
+    int16_t node = 0;
+    const char *level = filter;
+    while (true) {
+        const char *end = strchr(level, '/');
+        size_t length = end != nullptr ? end - level : strlen(level);
+        if (length == 1 && level[0] == '#') {
+            nodes[node].hashRoute = route;
+            break;
+        }
+
+        int16_t next;
+        if (length == 1 && level[0] == '+') {
+            next = nodes[node].plusChild;
+            if (next < 0) {
+                next = nodes.size();
+                nodes.emplace_back();
+                nodes[node].plusChild = next;
+            }
+        } else {
+            next = findChild(node, level, length);
+            if (next < 0) {
+                next = nodes.size();
+                nodes.emplace_back();
+                nodes[next].level.concat(level, length);
+                nodes[next].nextSibling = nodes[node].firstChild;
+                nodes[node].firstChild = next;
+            }
+        }
+
+        node = next;
+        if (end == nullptr) {
+            nodes[node].route = route;
+            break;
+        }
+        level = end + 1;
+    }
+    filters.push_back(filter);
+    return route;
+}
+
+int16_t TopicRouter::match(const char *topic, uint32_t *params, uint8_t &paramCount) const {
+    paramCount = 0;
+    if (nodes.empty()) return TOPIC_ROUTER_NO_ROUTE;
+    return matchFrom(0, topic, params, paramCount);
+}
+
+int16_t TopicRouter::findChild(int16_t node, const char *level, size_t length) const {
+    for (int16_t child = nodes[node].firstChild; child >= 0; child = nodes[child].nextSibling)
+        if (nodes[child].level.length() == length && memcmp(nodes[child].level.c_str(), level, length) == 0)
+            return child;
+    return -1;
+}
+
+// level is nullptr once the whole topic was consumed
+int16_t TopicRouter::matchFrom(int16_t node, const char *level, uint32_t *params, uint8_t &paramCount) const {
+    if (level == nullptr)
+        return nodes[node].route != TOPIC_ROUTER_NO_ROUTE ? nodes[node].route : nodes[node].hashRoute;
+
+    const char *end = strchr(level, '/');
+    size_t length = end != nullptr ? end - level : strlen(level);
+    const char *next = end != nullptr ? end + 1 : nullptr;
+
+    int16_t child = findChild(node, level, length);
+    if (child >= 0) {
+        int16_t route = matchFrom(child, next, params, paramCount);
+        if (route != TOPIC_ROUTER_NO_ROUTE) return route;
+    }
+
+    if (nodes[node].plusChild >= 0 && paramCount < TOPIC_ROUTER_MAX_PARAMS) {
+        params[paramCount++] = strtoul(level, nullptr, 10);
+        int16_t route = matchFrom(nodes[node].plusChild, next, params, paramCount);
+        if (route != TOPIC_ROUTER_NO_ROUTE) return route;
+        paramCount--;
+    }
+
+    return nodes[node].hashRoute;
+}
+
+#endif //SENSENET_TOPIC_ROUTER_TPP
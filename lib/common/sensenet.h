@@ -7,6 +7,7 @@
 #include "Uptime.h"
 #include "PrintDBG.tpp"
 #include "Queue.tpp"
+#include "TieredQueue.tpp"
 #include "MqttController.tpp"
 #include "OTAUpdate.tpp"
 #include "MQTTOTA.tpp"
@@ -8,6 +8,11 @@
 #include "PubSubClient.h"
 #include "Arduino.h"
 
+// States of the inbound packet decoder
+#define MQTT_RX_HEADER  0
+#define MQTT_RX_LENGTH  1
+#define MQTT_RX_BODY    2
+
 PubSubClient::PubSubClient() {
     this->_state = MQTT_DISCONNECTED;
     this->_client = NULL;
@@ -160,6 +165,7 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGN
 
 PubSubClient::~PubSubClient() {
   free(this->buffer);
+  free(this->rxBuffer);
 }
 
 boolean PubSubClient::connect(const char *id) {
@@ -179,6 +185,21 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 }
 
 boolean PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    if (!beginConnect(id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession)) {
+        return false;
+    }
+    int state;
+    while ((state = pollConnect()) == MQTT_CONNECTING) {
+        yield();
+    }
+    return state == MQTT_CONNECTED;
+}
+
+boolean PubSubClient::beginConnect(const char *id, const char *user, const char *pass) {
+    return beginConnect(id,user,pass,0,0,0,0,1);
+}
+
+boolean PubSubClient::beginConnect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
     if (!connected()) {
         int result = 0;
 
@@ -186,7 +207,6 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
         if(_client->connected()) {
             result = 1;
         } else {
-            _QOS1Acknowledged=true;
             if (domain != NULL) {
                 result = _client->connect(this->domain, this->port);
             } else {
@@ -251,32 +271,14 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
                 }
             }
 
-            write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE);
-
-            lastInActivity = lastOutActivity = millis();
-
-            while (!_client->available()) {
-                unsigned long t = millis();
-                if (t-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
-                    _state = MQTT_CONNECTION_TIMEOUT;
-                    _client->stop();
-                    return false;
-                }
+            if (!write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE)) {
+                return false;
             }
-            uint8_t llen;
-            uint32_t len = readPacket(&llen);
 
-            if (len == 4) {
-                if (buffer[3] == 0) {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    _state = MQTT_CONNECTED;
-                    return true;
-                } else {
-                    _state = buffer[3];
-                }
-            }
-            _client->stop();
+            lastInActivity = lastOutActivity = millis();
+            resetPacket();
+            _state = MQTT_CONNECTING;
+            return true;
         } else {
             _state = MQTT_CONNECT_FAILED;
         }
@@ -285,85 +287,117 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
     return true;
 }
 
-// reads a byte into result
-boolean PubSubClient::readByte(uint8_t * result) {
-   uint32_t previousMillis = millis();
-   while(!_client->available()) {
-     yield();
-     uint32_t currentMillis = millis();
-     if(currentMillis - previousMillis >= ((int32_t) this->socketTimeout * 1000)){
-       return false;
-     }
-   }
-   *result = _client->read();
-   return true;
-}
-
-// reads a byte into result[*index] and increments index
-boolean PubSubClient::readByte(uint8_t * result, uint16_t * index){
-  uint16_t current_index = *index;
-  uint8_t * write_address = &(result[current_index]);
-  if(readByte(write_address)){
-    *index = current_index + 1;
-    return true;
-  }
-  return false;
-}
-
-uint32_t PubSubClient::readPacket(uint8_t* lengthLength) {
-    uint16_t len = 0;
-    if(!readByte(this->buffer, &len)) return 0;
-    bool isPublish = (this->buffer[0]&0xF0) == MQTTPUBLISH;
-    uint32_t multiplier = 1;
-    uint32_t length = 0;
-    uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint32_t start = 0;
-
-    do {
-        if (len == 5) {
-            // Invalid remaining length encoding - kill the connection
-            _state = MQTT_DISCONNECTED;
+int PubSubClient::pollConnect() {
+    if (_state != MQTT_CONNECTING) {
+        return _state;
+    }
+    uint8_t llen;
+    uint32_t len = pollPacket(&llen);
+    if (len == 0) {
+        unsigned long t = millis();
+        if (!_client->connected() || t-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
+            _state = MQTT_CONNECTION_TIMEOUT;
             _client->stop();
-            return 0;
-        }
-        if(!readByte(&digit)) return 0;
-        this->buffer[len++] = digit;
-        length += (digit & 127) * multiplier;
-        multiplier <<=7; //multiplier *= 128
-    } while ((digit & 128) != 0);
-    *lengthLength = len-1;
-
-    if (isPublish) {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        if(!readByte(this->buffer, &len)) return 0;
-        if(!readByte(this->buffer, &len)) return 0;
-        skip = (this->buffer[*lengthLength+1]<<8)+this->buffer[*lengthLength+2];
-        start = 2;
-        if (this->buffer[0]&MQTTQOS1) {
-            // skip message id
-            skip += 2;
         }
+        return _state;
     }
-    uint32_t idx = len;
 
-    for (uint32_t i = start;i<length;i++) {
-        if(!readByte(&digit)) return 0;
-        if (this->stream) {
-            if (isPublish && idx-*lengthLength-2>skip) {
-                this->stream->write(digit);
+    if (len == 4 && rxBuffer[3] == 0) {
+        lastInActivity = millis();
+        pingOutstanding = false;
+        _state = MQTT_CONNECTED;
+        return _state;
+    }
+    _state = len == 4 ? rxBuffer[3] : MQTT_DISCONNECTED;
+    _client->stop();
+    return _state;
+}
+
+void PubSubClient::resetPacket() {
+    rxState = MQTT_RX_HEADER;
+    rxPos = 0;
+}
+
+// Consumes whatever bytes the client has buffered and never waits for more.
+// Returns the length of the packet in rxBuffer once it is complete, 0 while it is still incomplete
+// or when a packet larger than the buffer was dropped.
+uint32_t PubSubClient::pollPacket(uint8_t* lengthLength) {
+    uint8_t scratch[64];
+    int available;
+    while ((available = _client->available()) > 0) {
+        if (rxState != MQTT_RX_BODY) {
+            int c = _client->read();
+            if (c < 0) return 0;
+            if (rxState == MQTT_RX_HEADER) {
+                rxBuffer[0] = c;
+                rxPos = 1;
+                rxLength = 0;
+                rxMultiplier = 1;
+                rxState = MQTT_RX_LENGTH;
+                continue;
             }
+            if (rxPos == 5) {
+                // Invalid remaining length encoding - kill the connection
+                _state = MQTT_DISCONNECTED;
+                _client->stop();
+                resetPacket();
+                return 0;
+            }
+            rxBuffer[rxPos++] = c;
+            rxLength += (c & 127) * rxMultiplier;
+            rxMultiplier <<= 7;
+            if (c & 128) continue;
+
+            rxLengthLength = rxPos - 1;
+            rxRemaining = rxLength;
+            rxRead = 0;
+            rxPayloadStart = 0xFFFFFFFF;
+            rxState = MQTT_RX_BODY;
+            if (rxRemaining == 0) break;
+            continue;
         }
 
-        if (len < this->bufferSize) {
-            this->buffer[len] = digit;
-            len++;
+        // Bulk copy straight into the buffer, bytes past its end are only passed on to the stream
+        uint32_t want = (uint32_t) available < rxRemaining ? available : rxRemaining;
+        uint8_t* dest = scratch;
+        if (rxPos < this->bufferSize) {
+            if (want > (uint32_t) (this->bufferSize - rxPos)) want = this->bufferSize - rxPos;
+            dest = rxBuffer + rxPos;
+        } else if (want > sizeof(scratch)) {
+            want = sizeof(scratch);
+        }
+        int n = _client->read(dest, want);
+        if (n <= 0) return 0;
+
+        bool isPublish = (rxBuffer[0]&0xF0) == MQTTPUBLISH;
+        if (this->stream && isPublish) {
+            if (rxPayloadStart == 0xFFFFFFFF && rxRead + n >= 2 && rxLengthLength + 3u <= this->bufferSize) {
+                rxPayloadStart = 2 + (rxBuffer[rxLengthLength+1]<<8) + rxBuffer[rxLengthLength+2];
+                if (rxBuffer[0]&MQTTQOS1) {
+                    // skip message id
+                    rxPayloadStart += 2;
+                }
+            }
+            if (rxPayloadStart != 0xFFFFFFFF && rxRead + n > rxPayloadStart) {
+                uint32_t from = rxRead > rxPayloadStart ? 0 : rxPayloadStart - rxRead;
+                this->stream->write(dest + from, n - from);
+            }
         }
-        idx++;
+
+        if (dest != scratch) rxPos += n;
+        rxRead += n;
+        rxRemaining -= n;
+        if (rxRemaining == 0) break;
     }
 
-    if (!this->stream && idx > this->bufferSize) {
-        len = 0; // This will cause the packet to be ignored.
+    if (rxState != MQTT_RX_BODY || rxRemaining != 0) return 0;
+
+    *lengthLength = rxLengthLength;
+    uint32_t len = rxPos;
+    bool truncated = 1 + rxLengthLength + rxLength > this->bufferSize;
+    resetPacket();
+    if (!this->stream && truncated) {
+        return 0; // This will cause the packet to be ignored.
     }
     return len;
 }
@@ -379,64 +413,71 @@ boolean PubSubClient::loop() {
             } else {
                 this->buffer[0] = MQTTPINGREQ;
                 this->buffer[1] = 0;
-                _client->write(this->buffer,2);
+                if (!writeRegion(this->buffer,2)) {
+                    return false;
+                }
                 lastOutActivity = t;
                 lastInActivity = t;
                 pingOutstanding = true;
             }
         }
-/*        if ((t - _QOS1_SENT_TIME >= MQTT_QOS1_WAIT_TIME) && (_QOS1Acknowledged==false)){  // Resend QOS1 message if not acknowledged
-            //debug   Serial.print("*MQQT q1 RESENDING");
-            publish_Q1(_SentQOS1Topic, _SentQOS1buffer, _SENTQOS1Length, false,true);   // send last message again
-            _QOS1_SENT_TIME=millis();                                                   //Reset timer
-        }*/
-
-        if (_client->available()) {
+        for (uint8_t packets = 0; packets < MQTT_MAX_PACKETS_PER_LOOP && _client->available(); packets++) {
             uint8_t llen;
-            uint16_t len = readPacket(&llen);
+            uint16_t len = pollPacket(&llen);
             uint16_t msgId = 0;
             uint8_t *payload;
             if (len > 0) {
                 lastInActivity = t;
-                uint8_t type = this->buffer[0]&0xF0;
+                uint8_t type = this->rxBuffer[0]&0xF0;
                 if (type == MQTTPUBLISH) {
                     if (callback) {
-                        uint16_t tl = (this->buffer[llen+1]<<8)+this->buffer[llen+2]; /* topic length in bytes */
-                        memmove(this->buffer+llen+2,this->buffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
-                        this->buffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
-                        char *topic = (char*) this->buffer+llen+2;
+                        uint16_t tl = (this->rxBuffer[llen+1]<<8)+this->rxBuffer[llen+2]; /* topic length in bytes */
+                        memmove(this->rxBuffer+llen+2,this->rxBuffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
+                        this->rxBuffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
+                        char *topic = (char*) this->rxBuffer+llen+2;
                         // msgId only present for QOS>0
-                        if ((this->buffer[0]&0x06) == MQTTQOS1) {
-                            msgId = (this->buffer[llen+3+tl]<<8)+this->buffer[llen+3+tl+1];
-                            payload = this->buffer+llen+3+tl+2;
+                        if ((this->rxBuffer[0]&0x06) == MQTTQOS1) {
+                            msgId = (this->rxBuffer[llen+3+tl]<<8)+this->rxBuffer[llen+3+tl+1];
+                            payload = this->rxBuffer+llen+3+tl+2;
                             callback(topic,payload,len-llen-3-tl-2);
 
                             this->buffer[0] = MQTTPUBACK;
                             this->buffer[1] = 2;
                             this->buffer[2] = (msgId >> 8);
                             this->buffer[3] = (msgId & 0xFF);
-                            _client->write(this->buffer,4);
+                            if (!writeRegion(this->buffer,4)) {
+                                return false;
+                            }
                             lastOutActivity = t;
 
                         } else {
-                            payload = this->buffer+llen+3+tl;
+                            payload = this->rxBuffer+llen+3+tl;
                             callback(topic,payload,len-llen-3-tl);
                         }
                     }
                 } else if (type == MQTTPINGREQ) {
                     this->buffer[0] = MQTTPINGRESP;
                     this->buffer[1] = 0;
-                    _client->write(this->buffer,2);
+                    if (!writeRegion(this->buffer,2)) {
+                        return false;
+                    }
                 } else if (type == MQTTPINGRESP) {
                     pingOutstanding = false;
-                }else if (type == MQTTPUBACK) {
-                    //debug      Serial.print("*MQQT PUBACK mid:"); Serial.println(((buffer[2]<<8)+ buffer[3])); Serial.print(" looking for:"); Serial.println(_QOS1MSGID);
-                    if (((buffer[2]<<8)+ buffer[3])==_QOS1MSGID){
-                        //debug          Serial.println(" --- PUBACK SEEN:----");
-                        _QOS1Acknowledged=true; }   }
+                } else if (type == MQTTPUBACK) {
+                    if (pubackCallback) {
+                        pubackCallback((this->rxBuffer[2]<<8)+this->rxBuffer[3]);
+                    }
+                } else if (type == MQTTSUBACK) {
+                    if (subackCallback) {
+                        subackCallback((this->rxBuffer[2]<<8)+this->rxBuffer[3]);
+                    }
+                }
             } else if (!connected()) {
-                // readPacket has closed the connection
+                // pollPacket has closed the connection
                 return false;
+            } else {
+                // Incomplete, the rest is picked up by a later call
+                break;
             }
         }
         return true;
@@ -445,11 +486,11 @@ boolean PubSubClient::loop() {
 }
 
 boolean PubSubClient::publish(const char* topic, const char* payload) {
-    return publish(topic,(const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0,false);
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,false);
 }
 
 boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained) {
-    return publish(topic,(const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0,retained);
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,retained);
 }
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength) {
@@ -458,70 +499,101 @@ boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigne
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
     if (connected()) {
-        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2+strnlen(topic, this->bufferSize) + plength) {
-            // Too long
-            return false;
-        }
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
-
-        // Add payload
-        uint16_t i;
-        for (i=0;i<plength;i++) {
-            this->buffer[length++] = payload[i];
-        }
-
-        // Write the header
         uint8_t header = MQTTPUBLISH;
         if (retained) {
             header |= 1;
         }
-        return write(header,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+        return writePublish(header,topic,0,payload,plength);
     }
     return false;
 }
 
 boolean PubSubClient::publish_Q1(const char* topic, const char* payload) {
-    return publish_Q1(topic,(const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0);
+    return publish_Q1(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0);
 }
 
 boolean PubSubClient::publish_Q1(const char* topic, const uint8_t* payload, unsigned int plength) {
-    return publish_Q1(topic, payload, plength, false,false);
+    return publish_Q1(topic, payload, plength, false, 0) != 0;
 }
 
-boolean PubSubClient::publish_Q1(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, boolean QOS1_MSG_Repeat) {
+uint16_t PubSubClient::publish_Q1(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, uint16_t msgId) {
     if (connected()) {
-        if (MQTT_MAX_PACKET_SIZE < 5 + 2+strlen(topic) + plength) {
-            // Too long
-            return false;
+        uint8_t header = qos1Header(retained, &msgId);
+        return writePublish(header,topic,msgId,payload,plength) ? msgId : 0;
+    }
+    return 0;
+}
+
+// A msgId of 0 allocates the next packet identifier, any other one marks the packet as a duplicate
+uint8_t PubSubClient::qos1Header(boolean retained, uint16_t* msgId) {
+    uint8_t header = MQTTPUBLISH | MQTTQOS1;
+    if (*msgId == 0) {
+        nextMsgId++;
+        if (nextMsgId == 0) {
+            nextMsgId = 1;
         }
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = 5;
-        length = writeString(topic,buffer,length);
-        uint16_t i;
-        strncpy(_SentQOS1Topic,topic,20);
-        for (i=0;i<plength;i++) { _SentQOS1buffer[i]=payload[i];}
-        _SentQOS1buffer[sizeof(payload)-1]='\0';
-        _SENTQOS1Length=plength;
-        if(QOS1_MSG_Repeat==false) {_QOS1MSGID= _QOS1MSGID +1 ;}     // If last msg was acknowledged then increment id , else we are retransmitting, so use last msgid
-        if (_QOS1MSGID==0){_QOS1MSGID=1;}                            // msgid 0 is a disconnect
-        buffer[length]=(_QOS1MSGID >> 8);                            //add msg id for qos1
-        buffer[length+1]= (_QOS1MSGID & 0xFF);                       //
-        length=length+2;                                             //
-//        _QOS1_SENT_TIME=millis();                                    // set time for PUBACK check
-        _QOS1Acknowledged=false;                                     // set Acknowledged flag false
-        //debug      Serial.print("*MQQT qos1 publish mid:"); Serial.println(_QOS1MSGID);
-        for (i=0;i<plength;i++) {
-            buffer[length++] = payload[i];
+        *msgId = nextMsgId;
+    } else {
+        header |= 8; // DUP
+    }
+    if (retained) {
+        header |= 1;
+    }
+    return header;
+}
+
+boolean PubSubClient::writePublish(uint8_t header, const char* topic, uint16_t msgId, const uint8_t* payload, unsigned int plength) {
+    boolean result = writePublishHeader(header,topic,msgId,plength) && writeRegion(payload,plength);
+    lastOutActivity = millis();
+    return result;
+}
+
+boolean PubSubClient::writePublishHeader(uint8_t header, const char* topic, uint16_t msgId, unsigned int plength) {
+    size_t tlen = strlen(topic);
+    uint32_t length = 2 + tlen + (msgId ? 2 : 0) + plength;
+    if (tlen > 0xFFFF || length > 268435455UL) {
+        // Too long
+        return false;
+    }
+
+    // Fixed header and topic length, then the msgId after the topic
+    uint8_t head[MQTT_MAX_HEADER_SIZE + 2];
+    size_t hlen = buildHeader(header, head, length);
+    head[MQTT_MAX_HEADER_SIZE] = (tlen >> 8);
+    head[MQTT_MAX_HEADER_SIZE+1] = (tlen & 0xFF);
+    uint8_t id[2] = {(uint8_t) (msgId >> 8), (uint8_t) (msgId & 0xFF)};
+
+    boolean result = writeRegion(head+(MQTT_MAX_HEADER_SIZE-hlen),hlen+2) &&
+                     writeRegion((const uint8_t*)topic,tlen) &&
+                     (msgId == 0 || writeRegion(id,2));
+    lastOutActivity = millis();
+    return result;
+}
+
+boolean PubSubClient::writeRegion(const uint8_t* buf, size_t length) {
+    while (length > 0) {
+#ifdef MQTT_MAX_TRANSFER_SIZE
+        size_t bytesToWrite = (length > MQTT_MAX_TRANSFER_SIZE)?MQTT_MAX_TRANSFER_SIZE:length;
+#else
+        size_t bytesToWrite = length;
+#endif
+        size_t rc = _client->write(buf,bytesToWrite);
+        if (rc != bytesToWrite) {
+            tornPacket();
+            return false;
         }
-        uint8_t header = MQTTPUBLISH|MQTTQOS1;                             // Main change so it sends qos 1
-        if (retained) { header |= 1; }
-        _QOS1Acknowledged=false;                                           // set for follow up
-        //debug  if((_QOS1MSGID>=10)&&(QOS1_MSG_Repeat==false)) {Serial.print("testing retry");return true;}    // test - deliberately do not send - so that retry will be activated
-        return write(header,buffer,length-5);
+        buf += rc;
+        length -= rc;
     }
-    return false;
+    return true;
+}
+
+// Part of a packet is on the wire and the rest can never follow it, the stream is only resynchronised
+// by a new connection
+void PubSubClient::tornPacket() {
+    shortWrites++;
+    _client->stop();
+    _state = MQTT_CONNECTION_LOST;
 }
 
 boolean PubSubClient::publish_P(const char* topic, const char* payload, boolean retained) {
@@ -543,7 +615,11 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
         return false;
     }
 
-    tlen = strnlen(topic, this->bufferSize);
+    tlen = strnlen(topic, MQTT_TX_BUFFER_SIZE);
+    if (MQTT_MAX_HEADER_SIZE + 2 + tlen > MQTT_TX_BUFFER_SIZE) {
+        // Too long
+        return false;
+    }
 
     header = MQTTPUBLISH;
     if (retained) {
@@ -572,47 +648,60 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
     lastOutActivity = millis();
 
     expectedLength = 1 + llen + 2 + tlen + plength;
-
-    return (rc == expectedLength);
+    if (rc != expectedLength) {
+        tornPacket();
+        return false;
+    }
+    return true;
 }
 
 boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) {
     if (connected()) {
         // Send the header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
         uint8_t header = MQTTPUBLISH;
         if (retained) {
             header |= 1;
         }
-        size_t hlen = buildHeader(header, this->buffer, plength+length-MQTT_MAX_HEADER_SIZE);
-        uint16_t rc = _client->write(this->buffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
-        lastOutActivity = millis();
-        return (rc == (length-(MQTT_MAX_HEADER_SIZE-hlen)));
+        return writePublishHeader(header,topic,0,plength);
     }
     return false;
 }
 
+uint16_t PubSubClient::beginPublish_Q1(const char* topic, unsigned int plength, boolean retained, uint16_t msgId) {
+    if (connected()) {
+        uint8_t header = qos1Header(retained, &msgId);
+        return writePublishHeader(header,topic,msgId,plength) ? msgId : 0;
+    }
+    return 0;
+}
+
 int PubSubClient::endPublish() {
  return 1;
 }
 
 size_t PubSubClient::write(uint8_t data) {
-    lastOutActivity = millis();
-    return _client->write(data);
+    return write(&data,1);
 }
 
 size_t PubSubClient::write(const uint8_t *buffer, size_t size) {
     lastOutActivity = millis();
-    return _client->write(buffer,size);
+    size_t rc = _client->write(buffer,size);
+    if (rc != size) {
+        tornPacket();
+    }
+    return rc;
+}
+
+int PubSubClient::availableForWrite() {
+    return _client == NULL ? 0 : _client->availableForWrite();
 }
 
-size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint16_t length) {
+size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint32_t length) {
     uint8_t lenBuf[4];
     uint8_t llen = 0;
     uint8_t digit;
     uint8_t pos = 0;
-    uint16_t len = length;
+    uint32_t len = length;
     do {
 
         digit = len  & 127; //digit = len %128
@@ -644,6 +733,7 @@ boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length) {
         bytesToWrite = (bytesRemaining > MQTT_MAX_TRANSFER_SIZE)?MQTT_MAX_TRANSFER_SIZE:bytesRemaining;
         rc = _client->write(writeBuf,bytesToWrite);
         result = (rc == bytesToWrite);
+        if (!result) tornPacket();
         bytesRemaining -= rc;
         writeBuf += rc;
     }
@@ -651,7 +741,11 @@ boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length) {
 #else
     rc = _client->write(buf+(MQTT_MAX_HEADER_SIZE-hlen),length+hlen);
     lastOutActivity = millis();
-    return (rc == hlen+length);
+    if (rc != hlen+length) {
+        tornPacket();
+        return false;
+    }
+    return true;
 #endif
 }
 
@@ -660,14 +754,14 @@ boolean PubSubClient::subscribe(const char* topic) {
 }
 
 boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
-    size_t topicLength = strnlen(topic, this->bufferSize);
+    size_t topicLength = strnlen(topic, MQTT_TX_BUFFER_SIZE);
     if (topic == 0) {
         return false;
     }
     if (qos > 1) {
         return false;
     }
-    if (this->bufferSize < 9 + topicLength) {
+    if (MQTT_TX_BUFFER_SIZE < 9 + topicLength) {
         // Too long
         return false;
     }
@@ -687,12 +781,47 @@ boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
     return false;
 }
 
+uint16_t PubSubClient::subscribe(const char* topics[], uint8_t count, uint8_t qos) {
+    if (qos > 1 || count == 0) {
+        return 0;
+    }
+    size_t needed = MQTT_MAX_HEADER_SIZE + 2;
+    for (uint8_t i = 0; i < count; i++) {
+        if (topics[i] == 0) {
+            return 0;
+        }
+        needed += 2 + strnlen(topics[i], MQTT_TX_BUFFER_SIZE) + 1;
+    }
+    if (needed > MQTT_TX_BUFFER_SIZE) {
+        // Too long
+        return 0;
+    }
+    if (connected()) {
+        uint16_t length = MQTT_MAX_HEADER_SIZE;
+        nextMsgId++;
+        if (nextMsgId == 0) {
+            nextMsgId = 1;
+        }
+        uint16_t msgId = nextMsgId;
+        this->buffer[length++] = (msgId >> 8);
+        this->buffer[length++] = (msgId & 0xFF);
+        for (uint8_t i = 0; i < count; i++) {
+            length = writeString(topics[i], this->buffer,length);
+            this->buffer[length++] = qos;
+        }
+        if (write(MQTTSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE)) {
+            return msgId;
+        }
+    }
+    return 0;
+}
+
 boolean PubSubClient::unsubscribe(const char* topic) {
-	size_t topicLength = strnlen(topic, this->bufferSize);
+	size_t topicLength = strnlen(topic, MQTT_TX_BUFFER_SIZE);
     if (topic == 0) {
         return false;
     }
-    if (this->bufferSize < 9 + topicLength) {
+    if (MQTT_TX_BUFFER_SIZE < 9 + topicLength) {
         // Too long
         return false;
     }
@@ -776,6 +905,16 @@ PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
     return *this;
 }
 
+PubSubClient& PubSubClient::setPubackCallback(MQTT_PUBACK_CALLBACK_SIGNATURE) {
+    this->pubackCallback = pubackCallback;
+    return *this;
+}
+
+PubSubClient& PubSubClient::setSubackCallback(MQTT_SUBACK_CALLBACK_SIGNATURE) {
+    this->subackCallback = subackCallback;
+    return *this;
+}
+
 PubSubClient& PubSubClient::setClient(Client& client){
     this->_client = &client;
     return *this;
@@ -795,23 +934,38 @@ boolean PubSubClient::setBufferSize(uint16_t size) {
         // Cannot set it back to 0
         return false;
     }
-    if (this->bufferSize == 0) {
-        this->buffer = (uint8_t*)malloc(size);
-    } else {
-        uint8_t* newBuffer = (uint8_t*)realloc(this->buffer, size);
-        if (newBuffer != NULL) {
-            this->buffer = newBuffer;
-        } else {
+    // Both buffers exist before either is committed, a failed allocation leaves the client as it was
+    uint8_t* newBuffer = this->buffer;
+    if (newBuffer == NULL) {
+        newBuffer = (uint8_t*)malloc(MQTT_TX_BUFFER_SIZE);
+        if (newBuffer == NULL) {
             return false;
         }
     }
+    uint8_t* newRxBuffer = (uint8_t*)realloc(this->rxBuffer, size);
+    if (newRxBuffer == NULL) {
+        if (newBuffer != this->buffer) {
+            free(newBuffer);
+        }
+        return false;
+    }
+    this->buffer = newBuffer;
+    this->rxBuffer = newRxBuffer;
+    if (rxPos > size) {
+        // The packet being received no longer fits and is dropped once complete
+        rxPos = size;
+    }
     this->bufferSize = size;
-    return (this->buffer != NULL);
+    return true;
 }
 
 uint16_t PubSubClient::getBufferSize() {
     return this->bufferSize;
 }
+
+uint32_t PubSubClient::getShortWrites() {
+    return this->shortWrites;
+}
 PubSubClient& PubSubClient::setKeepAlive(uint16_t keepAlive) {
     this->keepAlive = keepAlive;
     return *this;
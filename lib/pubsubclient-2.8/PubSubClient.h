@@ -21,19 +21,25 @@
 #define MQTT_VERSION MQTT_VERSION_3_1_1
 #endif
 
-// MQTT_MAX_PACKET_SIZE : Maximum packet size. Override with setBufferSize().
+// MQTT_MAX_PACKET_SIZE : Maximum inbound packet size. Override with setBufferSize().
 #ifndef MQTT_MAX_PACKET_SIZE
 #define MQTT_MAX_PACKET_SIZE 256
 #endif
 
+// MQTT_TX_BUFFER_SIZE : Buffer for the control packets built locally (CONNECT, SUBSCRIBE, ...),
+//  PUBLISH payloads are written from caller memory and never go through it
+#ifndef MQTT_TX_BUFFER_SIZE
+#define MQTT_TX_BUFFER_SIZE 512
+#endif
+
 // MQTT_KEEPALIVE : keepAlive interval in Seconds. Override with setKeepAlive()
 #ifndef MQTT_KEEPALIVE
 #define MQTT_KEEPALIVE 15
 #endif
 
-//     MQTT_QOS1_WAIT_TIME:  timeout for wait for QOS1 PUBACK interval in ms
-#ifndef MQTT_QOS1_WAIT_TIME                                     //
-#define MQTT_QOS1_WAIT_TIME 100                                 //
+// MQTT_MAX_PACKETS_PER_LOOP: complete inbound packets handled by one loop() call
+#ifndef MQTT_MAX_PACKETS_PER_LOOP
+#define MQTT_MAX_PACKETS_PER_LOOP 8
 #endif
 
 // MQTT_SOCKET_TIMEOUT: socket timeout interval in Seconds. Override with setSocketTimeout()
@@ -47,6 +53,7 @@
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
 // Possible values for client.state()
+#define MQTT_CONNECTING             -5
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -84,16 +91,22 @@
 #if defined(ESP8266) || defined(ESP32)
 #include <functional>
 #define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+#define MQTT_PUBACK_CALLBACK_SIGNATURE std::function<void(uint16_t)> pubackCallback
+#define MQTT_SUBACK_CALLBACK_SIGNATURE std::function<void(uint16_t)> subackCallback
 #else
 #define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+#define MQTT_PUBACK_CALLBACK_SIGNATURE void (*pubackCallback)(uint16_t)
+#define MQTT_SUBACK_CALLBACK_SIGNATURE void (*subackCallback)(uint16_t)
 #endif
 
-#define CHECK_STRING_LENGTH(l,s) if (l+2+strnlen(s, this->bufferSize) > this->bufferSize) {_client->stop();return false;}
+#define CHECK_STRING_LENGTH(l,s) if (l+2+strnlen(s, MQTT_TX_BUFFER_SIZE) > MQTT_TX_BUFFER_SIZE) {_client->stop();return false;}
 
 class PubSubClient : public Print {
 private:
    Client* _client;
-   uint8_t* buffer;
+   // Outbound control packets, always MQTT_TX_BUFFER_SIZE bytes
+   uint8_t* buffer = NULL;
+   // Size of rxBuffer, the largest inbound packet that is delivered whole
    uint16_t bufferSize;
    uint16_t keepAlive;
    uint16_t socketTimeout;
@@ -102,21 +115,40 @@ private:
    unsigned long lastInActivity;
    bool pingOutstanding;
    MQTT_CALLBACK_SIGNATURE;
-   uint32_t readPacket(uint8_t*);
-   boolean readByte(uint8_t * result);
-   boolean readByte(uint8_t * result, uint16_t * index);
+   MQTT_PUBACK_CALLBACK_SIGNATURE = nullptr;
+   MQTT_SUBACK_CALLBACK_SIGNATURE = nullptr;
+   // Inbound packets are assembled in their own buffer, a partial packet survives publishes between loop() calls
+   uint8_t* rxBuffer = NULL;
+   uint8_t rxState = 0;
+   uint8_t rxLengthLength = 0;
+   uint32_t rxMultiplier = 1;
+   uint32_t rxLength = 0;
+   uint32_t rxRemaining = 0;
+   uint32_t rxRead = 0;
+   uint32_t rxPayloadStart = 0;
+   uint16_t rxPos = 0;
+   uint32_t pollPacket(uint8_t* lengthLength);
+   void resetPacket();
    boolean write(uint8_t header, uint8_t* buf, uint16_t length);
    uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos);
    // Build up the header ready to send
    // Returns the size of the header
    // Note: the header is built at the end of the first MQTT_MAX_HEADER_SIZE bytes, so will start
    //       (MQTT_MAX_HEADER_SIZE - <returned size>) bytes into the buffer
-   size_t buildHeader(uint8_t header, uint8_t* buf, uint16_t length);
+   size_t buildHeader(uint8_t header, uint8_t* buf, uint32_t length);
+   // Writes a PUBLISH whose topic and payload stay in caller memory, only the header is built locally
+   boolean writePublish(uint8_t header, const char* topic, uint16_t msgId, const uint8_t* payload, unsigned int plength);
+   boolean writePublishHeader(uint8_t header, const char* topic, uint16_t msgId, unsigned int plength);
+   uint8_t qos1Header(boolean retained, uint16_t* msgId);
+   // Writes all of buf or drops the connection, a packet cut short cannot be completed later
+   boolean writeRegion(const uint8_t* buf, size_t length);
+   void tornPacket();
    IPAddress ip;
    const char* domain;
    uint16_t port;
    Stream* stream;
    int _state;
+   uint32_t shortWrites = 0;
 
 public:
    PubSubClient();
@@ -140,19 +172,32 @@ public:
    PubSubClient& setServer(uint8_t * ip, uint16_t port);
    PubSubClient& setServer(const char * domain, uint16_t port);
    PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
+   // Called with the packet identifier of every PUBACK received
+   PubSubClient& setPubackCallback(MQTT_PUBACK_CALLBACK_SIGNATURE);
+   // Called with the packet identifier of every SUBACK received
+   PubSubClient& setSubackCallback(MQTT_SUBACK_CALLBACK_SIGNATURE);
    PubSubClient& setClient(Client& client);
    PubSubClient& setStream(Stream& stream);
    PubSubClient& setKeepAlive(uint16_t keepAlive);
    PubSubClient& setSocketTimeout(uint16_t timeout);
 
+   // Sizes the inbound buffer only, the outbound one stays at MQTT_TX_BUFFER_SIZE.
+   // On failure the previous buffers are kept and false is returned
    boolean setBufferSize(uint16_t size);
    uint16_t getBufferSize();
+   // Number of packets the client accepted only partially. Each one ends the connection with
+   // MQTT_CONNECTION_LOST, as the broker cannot find the next packet boundary after it
+   uint32_t getShortWrites();
 
    boolean connect(const char* id);
    boolean connect(const char* id, const char* user, const char* pass);
    boolean connect(const char* id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // Sends CONNECT without waiting, pollConnect() then returns MQTT_CONNECTING until CONNACK or socketTimeout
+   boolean beginConnect(const char* id, const char* user, const char* pass);
+   boolean beginConnect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   int pollConnect();
    void disconnect();
    boolean publish(const char* topic, const char* payload);
    boolean publish(const char* topic, const char* payload, boolean retained);
@@ -160,7 +205,10 @@ public:
    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
    boolean publish_Q1(const char* topic, const char* payload);
    boolean publish_Q1(const char* topic, const uint8_t * payload, unsigned int plength);
-   boolean publish_Q1(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained, boolean QOS1_MSG_Repeat);
+   // Publish at QoS 1. A msgId of 0 allocates a new packet identifier, any other value resends that
+   // packet with the DUP flag set. Tracking the PUBACK and retransmitting is left to the caller.
+   // Returns the packet identifier used, 0 if the packet could not be written
+   uint16_t publish_Q1(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained, uint16_t msgId);
    boolean publish_P(const char* topic, const char* payload, boolean retained);
    boolean publish_P(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
    // Start to publish a message.
@@ -172,29 +220,27 @@ public:
    // a new buffer and held in memory at one time
    // Returns 1 if the message was started successfully, 0 if there was an error
    boolean beginPublish(const char* topic, unsigned int plength, boolean retained);
+   // Same as beginPublish at QoS 1, msgId follows the publish_Q1 rules and the id used is returned, 0 on error
+   uint16_t beginPublish_Q1(const char* topic, unsigned int plength, boolean retained, uint16_t msgId);
    // Finish off this publish message (started with beginPublish)
    // Returns 1 if the packet was sent successfully, 0 if there was an error
    int endPublish();
    // Write a single byte of payload (only to be used with beginPublish/endPublish)
    virtual size_t write(uint8_t);
    // Write size bytes from buffer into the payload (only to be used with beginPublish/endPublish)
-   // Returns the number of bytes written
+   // Returns the number of bytes written, anything short of size has dropped the connection
    virtual size_t write(const uint8_t *buffer, size_t size);
+   // Free send space the network client reports, 0 when it cannot tell
+   virtual int availableForWrite();
    boolean subscribe(const char* topic);
    boolean subscribe(const char* topic, uint8_t qos);
+   // All topics in one SUBSCRIBE packet, returns its packet identifier or 0 when it could not be sent
+   uint16_t subscribe(const char* topics[], uint8_t count, uint8_t qos);
    boolean unsubscribe(const char* topic);
    boolean loop();
    boolean connected();
    int state();
 
-    //               added         for  QOS 1 publication and resend
-//    uint32_t   _QOS1_SENT_TIME;                              //
-    boolean   _QOS1Acknowledged;                             //
-    int       _QOS1MSGID;                                    //
-    uint8_t   _SentQOS1buffer[MQTT_MAX_PACKET_SIZE];         //
-    char      _SentQOS1Topic[40];                            //  is 40 enough??
-    uint16_t  _SENTQOS1Length;                               //
-    //
 };
 
 
@@ -41,7 +41,7 @@ Ticker restartTicker;
 NetworkInterface wifiInterface("wifi", 2, 2);
 NetworkInterfacesController networkController;
 MQTTController mqttController;
-MQTTOTA ota(&mqttController, 5120);
+MQTTOTA ota(&mqttController, 16384);
 
 WiFiClient wiFiClient;
 
@@ -63,19 +63,12 @@ uint64_t getTimestamp() {
 // Sampling interval in seconds
 char errorMessage[32];
 
-bool on_message(const String &topic, DynamicJsonDocument json) {
+bool on_message(const String &topic, const JsonDocument &json) {
     Serial.print("Topic1: ");
     Serial.println(topic);
     Serial.print("Message1: ");
     Serial.println(json.as<String>());
 
-    if (json.containsKey("shared")) {
-        JsonObject sharedKeys = json["shared"].as<JsonObject>();
-        for (JsonPair kv: sharedKeys)
-            json[kv.key()] = sharedKeys[kv.key()];
-
-    }
-
     if (json.containsKey("method")) {
         String method = json["method"].as<String>();
 
@@ -95,7 +88,7 @@ bool on_message(const String &topic, DynamicJsonDocument json) {
             responseTopic.replace("request", "response");
             DynamicJsonDocument responsePayload(300);
             responsePayload["result"] = "true";
-            mqttController.addToPublishQueue(responseTopic, responsePayload.as<String>(), true);
+            mqttController.addToPublishQueue(responseTopic.c_str(), responsePayload, true);
             return true;
         }
     }
@@ -114,6 +107,8 @@ void connectToNetwork() {
 void connectToPlatform(Client &client, const bool enableOTA) {
 
     Serial.println("Trying to Connect Platform");
+    mqttController.setDefaultCallbackKeys({"method", "params"});
+    mqttController.requestSharedKeysOnConnect("desiredAllowSleep,desiredDisableIR,desiredSEN55TempOffset");
     mqttController.connect(client, "esp", TOKEN, "", TB_URL,
                            1883, on_message,
                            nullptr, [&]() {
@@ -127,17 +122,12 @@ void connectToPlatform(Client &client, const bool enableOTA) {
                 else
                     ota.stopHandleOTAMessages();
 
-                DynamicJsonDocument requestKeys(512);
-                requestKeys["sharedKeys"] = "desiredAllowSleep,desiredDisableIR,desiredSEN55TempOffset";
-                requestKeys.shrinkToFit();
-                mqttController.requestAttributesJson(requestKeys.as<String>());
-
                 if (getTimestamp() == 0) {
                     DynamicJsonDocument requestTime(512);
                     requestTime["method"] = "requestTimestamp";
                     requestTime.shrinkToFit();
                     mqttController.requestRPC(requestTime.as<String>(),
-                                              [](const String &rpcTopic, const DynamicJsonDocument &rpcJson) -> bool {
+                                              [](const String &rpcTopic, const JsonDocument &rpcJson) -> bool {
                                                   Serial.print("Updating Internal RTC to: ");
                                                   Serial.println(rpcJson.as<String>());
                                                   uint64_t tsFromCloud = rpcJson["timestamp"].as<uint64_t>();
@@ -147,6 +137,10 @@ void connectToPlatform(Client &client, const bool enableOTA) {
                                                   Serial.println(internalRtc.getDateTime(true));
                                                   getTimestamp();
                                                   return true;
+                                              },
+                                              [](uint32_t id, PendingResult result) {
+                                                  if (result == PENDING_TIMED_OUT)
+                                                      Serial.println("Timestamp request timed out");
                                               });
                 } else {
                     Serial.print("Internal RTC updated to: ");
@@ -226,6 +220,12 @@ void ErrtoMess(char *mess, uint8_t r);
 void Errorloop(char *mess, uint8_t r);
 void GetDeviceInfo();
 bool read_all(DynamicJsonDocument &data);
+
+// Readings are sent as numbers with the two decimals String(value) used to give them
+double round2(float value) {
+    return round(value * 100.0) / 100.0;
+}
+
 //enum SensorType { MHZ14A, MHZ14B, MHZ16, MHZ1911A, MHZ19B, MHZ19C, MHZ19D, MHZ19E };
 MHZ co2(MH_Z19_RX, MH_Z19_TX, CO2_IN, MHZ::MHZ19C);
 
@@ -241,10 +241,10 @@ void loopSPS30_MG811_MHZ19C(DynamicJsonDocument &data) {
   Serial.print("Raw voltage: ");
   float rawMG811 = mySensor.raw();
   Serial.print(rawMG811);
-  data["rawMG811"] = String(rawMG811);
+  data["rawMG811"] = round2(rawMG811);
   Serial.print("V, C02 Concetration: ");
   float readMG811 = mySensor.read();
-  data["readMG811"] = String(readMG811);
+  data["readMG811"] = round2(readMG811);
   Serial.print(readMG811);
   Serial.print(" ppm");
 
@@ -258,7 +258,7 @@ void loopSPS30_MG811_MHZ19C(DynamicJsonDocument &data) {
 
   if (ppm_uart > 0) {
     Serial.print(ppm_uart);
-    data["ppm_uart"] = String(ppm_uart);
+    data["ppm_uart"] = ppm_uart;
   } else {
     Serial.print("n/a");
   }
@@ -266,14 +266,14 @@ void loopSPS30_MG811_MHZ19C(DynamicJsonDocument &data) {
   int ppm_pwm = co2.readCO2PWM();
   Serial.print(", PPMpwm: ");
   Serial.print(ppm_pwm);
-  data["ppm_pwm"] = String(ppm_pwm);
+  data["ppm_pwm"] = ppm_pwm;
 
   int temperature = co2.getLastTemperature();
   Serial.print(", Temperature: ");
 
   if (temperature > 0) {
     Serial.println(temperature);
-    data["temperature"] = String(temperature);
+    data["temperature"] = temperature;
   } else {
     Serial.println("n/a");
   }
@@ -283,6 +283,9 @@ void loopSPS30_MG811_MHZ19C(DynamicJsonDocument &data) {
 
 uint64_t lastSPS30_MG811_MHZ19C = 0;
 
+// Readings within 2% of the last sent value are held back, each key is still sent every 15 minutes
+ChangeFilter telemetryFilter(0, 0.02, 900000);
+
 void core0Loop(void *parameter) {
     //Dont do anything 1
     esp_task_wdt_init(600, true); //enable panic so ESP32 restarts
@@ -300,7 +303,7 @@ void core0Loop(void *parameter) {
     if (data.size() > 0 && getTimestamp() > 0) {
         data.shrinkToFit();
         Serial.println("Data: " + data.as<String>());
-        mqttController.sendTelemetry(data, true, getTimestamp());
+        mqttController.sendTelemetry(data, false, getTimestamp());
     }
     delayMicroseconds(1);
     esp_task_wdt_reset();
@@ -320,6 +323,10 @@ void setup() {
 //    Serial.println("Hello from: " + preferences.getString("token", "not-set"));
     mqttController.init();
     mqttController.sendSystemAttributes(true);
+    telemetryFilter.setDeadband("ppm_uart", 10, 0, 900000);
+    telemetryFilter.setDeadband("ppm_pwm", 10, 0, 900000);
+    telemetryFilter.setDeadband("temperature", 1, 0, 900000);
+    mqttController.setTelemetryFilter(&telemetryFilter);
     initInterfaces();
     Wire.begin();
     esp_task_wdt_reset();
@@ -358,6 +365,7 @@ void loop() {
     if (networkController.getCurrentNetworkInterface() != nullptr &&
         networkController.getCurrentNetworkInterface()->lastConnectionStatus()) {
         mqttController.loop();
+        ota.loop();
     }
 
     networkController.loop();
@@ -507,34 +515,34 @@ bool read_all(DynamicJsonDocument &data)
   }
 
   Serial.print(val.MassPM1);
-  data["val.MassPM1"] = String(val.MassPM1);
+  data["val.MassPM1"] = round2(val.MassPM1);
   Serial.print(F("\t"));
   Serial.print(val.MassPM2);
-  data["val.MassPM2"] = String(val.MassPM2);
+  data["val.MassPM2"] = round2(val.MassPM2);
   Serial.print(F("\t"));
   Serial.print(val.MassPM4);
-  data["val.MassPM4"] = String(val.MassPM4);
+  data["val.MassPM4"] = round2(val.MassPM4);
   Serial.print(F("\t"));
   Serial.print(val.MassPM10);
-  data["val.MassPM10"] = String(val.MassPM10);
+  data["val.MassPM10"] = round2(val.MassPM10);
   Serial.print(F("\t"));
   Serial.print(val.NumPM0);
-  data["val.NumPM0"] = String(val.NumPM0);
+  data["val.NumPM0"] = round2(val.NumPM0);
   Serial.print(F("\t"));
   Serial.print(val.NumPM1);
-  data["val.NumPM1"] = String(val.NumPM1);
+  data["val.NumPM1"] = round2(val.NumPM1);
   Serial.print(F("\t"));
   Serial.print(val.NumPM2);
-  data["val.NumPM2"] = String(val.NumPM2);
+  data["val.NumPM2"] = round2(val.NumPM2);
   Serial.print(F("\t"));
   Serial.print(val.NumPM4);
-  data["val.NumPM4"] = String(val.NumPM4);
+  data["val.NumPM4"] = round2(val.NumPM4);
   Serial.print(F("\t"));
   Serial.print(val.NumPM10);
-  data["val.NumPM10"] = String(val.NumPM10);
+  data["val.NumPM10"] = round2(val.NumPM10);
   Serial.print(F("\t"));
   Serial.print(val.PartSize);
-  data["val.PartSize"] = String(val.PartSize);
+  data["val.PartSize"] = round2(val.PartSize);
   Serial.print(F("\n"));
 
   return(true);
@@ -0,0 +1,175 @@
+#ifndef SENSENET_NATIVE_ARDUINO_H
+#define SENSENET_NATIVE_ARDUINO_H
+
+/*
+ * Host stand-in for the parts of the ESP32 Arduino core the library uses, so the native env can build
+ * lib/common and PubSubClient unchanged. Time is virtual: millis() only moves when a test calls delay()
+ * or NativeClock::advance(), which keeps link emulation and timeouts deterministic.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "freertos/FreeRTOS.h"
+
+using std::min;
+using std::max;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define PROGMEM
+#define F(string) (string)
+#define pgm_read_byte_near(address) (*(const uint8_t *) (address))
+
+struct NativeClock {
+    static uint64_t &micros() {
+        static uint64_t now = 0;
+        return now;
+    }
+
+    static void advance(uint32_t ms) {
+        micros() += (uint64_t) ms * 1000;
+    }
+
+    static void advanceMicros(uint32_t us) {
+        micros() += us;
+    }
+};
+
+// 32 bits like on the device, so wrap handling in Uptime behaves the same
+inline unsigned long millis() {
+    return (uint32_t) (NativeClock::micros() / 1000);
+}
+
+inline unsigned long micros() {
+    return (uint32_t) NativeClock::micros();
+}
+
+inline void delay(uint32_t ms) {
+    NativeClock::advance(ms);
+}
+
+inline void delayMicroseconds(uint32_t us) {
+    NativeClock::advanceMicros(us);
+}
+
+inline void yield() {}
+
+inline std::mt19937 &nativeRandom() {
+    static std::mt19937 generator(1);
+    return generator;
+}
+
+inline void randomSeed(unsigned long seed) {
+    nativeRandom().seed(seed);
+}
+
+inline long random(long howBig) {
+    if (howBig <= 0) return 0;
+    return (long) (nativeRandom()() % (unsigned long) howBig);
+}
+
+inline long random(long howSmall, long howBig) {
+    if (howSmall >= howBig) return howSmall;
+    return howSmall + random(howBig - howSmall);
+}
+
+// ESP-IDF path helper used by the queue migration
+inline const char *pathToFileName(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash == nullptr ? path : slash + 1;
+}
+
+inline int xPortGetCoreID() {
+    return 1;
+}
+
+// Internal temperature sensor in ROM, MQTTController declares it itself. 128 F reads as 53.3 C
+extern "C" inline uint8_t temprature_sens_read() {
+    return 128;
+}
+
+// Heap and sketch figures are set by the tests, the OTA code sizes its buffers from them and checks deltas
+// against sketchMD5
+class EspClass {
+public:
+    uint32_t freeHeap = 200000;
+    uint32_t maxAllocHeap = 110000;
+    uint32_t minFreeHeap = 180000;
+    uint32_t restarts = 0;
+    uint32_t sketchSize = 0;
+    uint32_t freeSketchSpace = 0x140000;
+    String sketchMD5;
+
+    void restart() {
+        restarts++;
+    }
+
+    uint32_t getFreeHeap() {
+        return freeHeap;
+    }
+
+    uint32_t getMinFreeHeap() {
+        return minFreeHeap;
+    }
+
+    uint32_t getMaxAllocHeap() {
+        return maxAllocHeap;
+    }
+
+    uint8_t getCpuFreqMHz() {
+        return 240;
+    }
+
+    uint32_t getSketchSize() {
+        return sketchSize;
+    }
+
+    uint32_t getFreeSketchSpace() {
+        return freeSketchSpace;
+    }
+
+    String getSketchMD5() {
+        return sketchMD5;
+    }
+};
+
+inline EspClass ESP;
+
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long) {}
+
+    size_t write(uint8_t c) override {
+        return fputc(c, stdout) == EOF ? 0 : 1;
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override {
+        return fwrite(buffer, 1, size, stdout);
+    }
+
+    int available() override {
+        return 0;
+    }
+
+    int read() override {
+        return -1;
+    }
+
+    int peek() override {
+        return -1;
+    }
+};
+
+inline HardwareSerial Serial;
+
+#endif //SENSENET_NATIVE_ARDUINO_H
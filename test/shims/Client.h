@@ -0,0 +1,28 @@
+#ifndef SENSENET_NATIVE_CLIENT_H
+#define SENSENET_NATIVE_CLIENT_H
+
+#include "Stream.h"
+#include "IPAddress.h"
+
+class Client : public Stream {
+public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+
+    virtual int connect(const char *host, uint16_t port) = 0;
+
+    size_t write(uint8_t c) override = 0;
+
+    size_t write(const uint8_t *buffer, size_t size) override = 0;
+
+    virtual int read(uint8_t *buffer, size_t size) = 0;
+
+    int read() override = 0;
+
+    virtual void stop() = 0;
+
+    virtual uint8_t connected() = 0;
+
+    virtual explicit operator bool() = 0;
+};
+
+#endif //SENSENET_NATIVE_CLIENT_H
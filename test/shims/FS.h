@@ -0,0 +1,193 @@
+#ifndef SENSENET_NATIVE_FS_H
+#define SENSENET_NATIVE_FS_H
+
+#include <Arduino.h>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+// A file or directory of the host directory standing in for the flash file system
+class File : public Stream {
+public:
+    File() = default;
+
+    File(FILE *handle, const String &path, uint32_t *written = nullptr) :
+            handle(handle, fclose), filePath(path), written(written) {}
+
+    File(const std::vector<String> &entries, const String &path) :
+            directory(true), entries(entries), filePath(path) {}
+
+    explicit operator bool() const {
+        return handle != nullptr || directory;
+    }
+
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override {
+        if (!handle) return 0;
+        size_t n = fwrite(buffer, 1, size, handle.get());
+        if (written) *written += n;
+        return n;
+    }
+
+    int available() override {
+        return handle ? (int) (size() - position()) : 0;
+    }
+
+    int read() override {
+        return handle ? fgetc(handle.get()) : -1;
+    }
+
+    size_t read(uint8_t *buffer, size_t size) {
+        return handle ? fread(buffer, 1, size, handle.get()) : 0;
+    }
+
+    int peek() override {
+        if (!handle) return -1;
+        int c = fgetc(handle.get());
+        if (c >= 0) ungetc(c, handle.get());
+        return c;
+    }
+
+    void flush() override {
+        if (handle) fflush(handle.get());
+    }
+
+    bool seek(uint32_t position) {
+        return handle && fseek(handle.get(), position, SEEK_SET) == 0;
+    }
+
+    size_t position() const {
+        return handle ? ftell(handle.get()) : 0;
+    }
+
+    size_t size() const {
+        if (!handle) return 0;
+        long current = ftell(handle.get());
+        fseek(handle.get(), 0, SEEK_END);
+        long end = ftell(handle.get());
+        fseek(handle.get(), current, SEEK_SET);
+        return end;
+    }
+
+    void close() {
+        handle.reset();
+        directory = false;
+    }
+
+    bool isDirectory() const {
+        return directory;
+    }
+
+    const char *path() const {
+        return filePath.c_str();
+    }
+
+    String getNextFileName() {
+        return directory && nextEntry < entries.size() ? entries[nextEntry++] : String();
+    }
+
+private:
+    std::shared_ptr<FILE> handle;
+    bool directory = false;
+    std::vector<String> entries;
+    size_t nextEntry = 0;
+    String filePath;
+    uint32_t *written = nullptr;
+};
+
+namespace fs {
+
+// Maps absolute flash paths below a host directory. Opens and bytes written are counted so benchmarks can
+// compare layouts
+class FS {
+public:
+    explicit FS(const std::string &root) : root(root) {}
+
+    bool begin(bool formatOnFail = false) {
+        std::error_code error;
+        std::filesystem::create_directories(root, error);
+        return !error;
+    }
+
+    bool format() {
+        std::error_code error;
+        std::filesystem::remove_all(root, error);
+        return begin();
+    }
+
+    size_t totalBytes() const {
+        return 1441792;
+    }
+
+    size_t usedBytes() const {
+        size_t used = 0;
+        std::error_code error;
+        for (auto &entry: std::filesystem::recursive_directory_iterator(root, error))
+            if (entry.is_regular_file()) used += entry.file_size();
+        return used;
+    }
+
+    File open(const String &path, const char *mode = FILE_READ, bool create = false) {
+        opens++;
+        std::filesystem::path hostPath = host(path);
+        if (strcmp(mode, FILE_READ) == 0 && std::filesystem::is_directory(hostPath)) {
+            std::vector<String> names;
+            for (auto &entry: std::filesystem::directory_iterator(hostPath))
+                names.push_back(path + "/" + entry.path().filename().string().c_str());
+            std::sort(names.begin(), names.end());
+            return {names, path};
+        }
+        if (create) std::filesystem::create_directories(hostPath.parent_path());
+        const char *hostMode = strcmp(mode, FILE_WRITE) == 0 ? "wb+" : strcmp(mode, FILE_APPEND) == 0 ? "ab+" : "rb";
+        FILE *handle = fopen(hostPath.c_str(), hostMode);
+        if (handle == nullptr) return {};
+        return {handle, path, &written};
+    }
+
+    bool exists(const String &path) const {
+        return std::filesystem::exists(host(path));
+    }
+
+    bool mkdir(const String &path) {
+        return std::filesystem::create_directories(host(path));
+    }
+
+    bool remove(const String &path) {
+        std::error_code error;
+        return std::filesystem::remove(host(path), error);
+    }
+
+    bool rmdir(const String &path) {
+        return remove(path);
+    }
+
+    uint32_t getOpens() const {
+        return opens;
+    }
+
+    uint32_t getBytesWritten() const {
+        return written;
+    }
+
+private:
+    std::string root;
+    uint32_t opens = 0;
+    uint32_t written = 0;
+
+    std::filesystem::path host(const String &path) const {
+        return std::filesystem::path(root) / (path.c_str() + (path.startsWith("/") ? 1 : 0));
+    }
+};
+
+}
+
+using fs::FS;
+
+#endif //SENSENET_NATIVE_FS_H
@@ -0,0 +1,30 @@
+#ifndef SENSENET_NATIVE_IPADDRESS_H
+#define SENSENET_NATIVE_IPADDRESS_H
+
+#include <cstdint>
+#include "WString.h"
+
+class IPAddress {
+public:
+    IPAddress() = default;
+
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : bytes{a, b, c, d} {}
+
+    uint8_t operator[](int index) const {
+        return bytes[index];
+    }
+
+    bool operator==(const IPAddress &other) const {
+        return memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+    }
+
+    String toString() const {
+        return String((int) bytes[0]) + "." + String((int) bytes[1]) + "." + String((int) bytes[2]) + "." +
+               String((int) bytes[3]);
+    }
+
+private:
+    uint8_t bytes[4] = {};
+};
+
+#endif //SENSENET_NATIVE_IPADDRESS_H
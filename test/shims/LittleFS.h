@@ -0,0 +1,8 @@
+#ifndef SENSENET_NATIVE_LITTLEFS_H
+#define SENSENET_NATIVE_LITTLEFS_H
+
+#include "FS.h"
+
+inline fs::FS LittleFS((std::filesystem::temp_directory_path() / "sensenet-littlefs").string());
+
+#endif //SENSENET_NATIVE_LITTLEFS_H
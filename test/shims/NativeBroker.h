@@ -0,0 +1,118 @@
+#ifndef SENSENET_NATIVE_NATIVEBROKER_H
+#define SENSENET_NATIVE_NATIVEBROKER_H
+
+#include <string>
+#include <vector>
+#include "NativeClient.h"
+#include "PubSubClient.h"
+
+/*
+ * Minimal broker on the other end of a NativeClient. Every packet the device writes is answered at once:
+ * CONNACK, SUBACK granting what was asked, UNSUBACK, PINGRESP and PUBACK for QoS 1. Publishes are kept in
+ * `published` with their raw payload bytes. Answers arrive with the next pump().
+ */
+class NativeBroker {
+public:
+    struct Publish {
+        std::string topic;
+        std::vector<uint8_t> payload;
+        uint8_t qos;
+    };
+
+    std::vector<Publish> published;
+    uint32_t connects = 0;
+
+    explicit NativeBroker(NativeClient &client) : client(client) {
+        client.onWrite = [this](const uint8_t *data, size_t length) {
+            received.insert(received.end(), data, data + length);
+            parse();
+        };
+    }
+
+    void pump() {
+        client.arrive();
+    }
+
+    // Publishes on topic, in order
+    std::vector<Publish> on(const std::string &topic) const {
+        std::vector<Publish> matching;
+        for (const Publish &publish: published)
+            if (publish.topic == topic) matching.push_back(publish);
+        return matching;
+    }
+
+    static std::vector<uint8_t> packet(uint8_t header, const std::vector<uint8_t> &body) {
+        std::vector<uint8_t> out{header};
+        uint32_t length = body.size();
+        do {
+            uint8_t digit = length & 127;
+            length >>= 7;
+            out.push_back(length > 0 ? digit | 0x80 : digit);
+        } while (length > 0);
+        out.insert(out.end(), body.begin(), body.end());
+        return out;
+    }
+
+private:
+    NativeClient &client;
+    std::vector<uint8_t> received;
+
+    void parse() {
+        while (received.size() >= 2) {
+            uint32_t length = 0, multiplier = 1;
+            size_t position = 1;
+            uint8_t digit;
+            do {
+                if (position >= received.size()) return;
+                digit = received[position++];
+                length += (digit & 127) * multiplier;
+                multiplier *= 128;
+            } while (digit & 128);
+            if (received.size() < position + length) return;
+            std::vector<uint8_t> body(received.begin() + position, received.begin() + position + length);
+            uint8_t header = received[0];
+            received.erase(received.begin(), received.begin() + position + length);
+            handle(header, body);
+        }
+    }
+
+    void handle(uint8_t header, const std::vector<uint8_t> &body) {
+        switch (header & 0xF0) {
+            case MQTTCONNECT:
+                connects++;
+                client.send(packet(MQTTCONNACK, {0, 0}));
+                break;
+            case MQTTSUBSCRIBE: {
+                std::vector<uint8_t> ack{body[0], body[1]};
+                for (size_t position = 2; position + 2 < body.size();) {
+                    position += 2 + (body[position] << 8 | body[position + 1]);
+                    ack.push_back(body[position++]);
+                }
+                client.send(packet(MQTTSUBACK, ack));
+                break;
+            }
+            case MQTTUNSUBSCRIBE:
+                client.send(packet(MQTTUNSUBACK, {body[0], body[1]}));
+                break;
+            case MQTTPINGREQ:
+                client.send(packet(MQTTPINGRESP, {}));
+                break;
+            case MQTTPUBLISH: {
+                uint16_t topicLength = body[0] << 8 | body[1];
+                size_t position = 2 + topicLength;
+                uint8_t qos = (header >> 1) & 3;
+                if (qos > 0) {
+                    client.send(packet(MQTTPUBACK, {body[position], body[position + 1]}));
+                    position += 2;
+                }
+                published.push_back({std::string(body.begin() + 2, body.begin() + 2 + topicLength),
+                                     std::vector<uint8_t>(body.begin() + position, body.end()), qos});
+                break;
+            }
+            default:
+                break;
+        }
+    }
+};
+
+#endif //SENSENET_NATIVE_NATIVEBROKER_H
@@ -0,0 +1,119 @@
+#ifndef SENSENET_NATIVE_NATIVECLIENT_H
+#define SENSENET_NATIVE_NATIVECLIENT_H
+
+#include <deque>
+#include <functional>
+#include <vector>
+#include "Client.h"
+
+/*
+ * In-memory socket for the MQTT tests. Bytes the peer sends wait in `pending` until the test lets them
+ * arrive(), so packets can be fed to the parser in any fragmentation. Everything written is kept in
+ * `outbound` and handed to onWrite, which is where a broker emulator hooks in.
+ */
+class NativeClient : public Client {
+public:
+    std::deque<uint8_t> pending;
+    std::deque<uint8_t> inbound;
+    std::vector<uint8_t> outbound;
+    std::function<void(const uint8_t *, size_t)> onWrite;
+    // Bytes accepted by the next write() calls before they start to come up short
+    size_t writeCapacity = SIZE_MAX;
+    // Reported by availableForWrite(), 0 means unknown like on most Arduino clients
+    int writeSpace = 0;
+    bool open = false;
+    uint32_t connects = 0;
+    uint32_t stops = 0;
+
+    void send(const uint8_t *data, size_t length) {
+        pending.insert(pending.end(), data, data + length);
+    }
+
+    void send(const std::vector<uint8_t> &data) {
+        send(data.data(), data.size());
+    }
+
+    // Moves up to length pending bytes to the receive side, returns how many moved
+    size_t arrive(size_t length = SIZE_MAX) {
+        size_t n = 0;
+        while (n < length && !pending.empty()) {
+            inbound.push_back(pending.front());
+            pending.pop_front();
+            n++;
+        }
+        return n;
+    }
+
+    int connect(IPAddress ip, uint16_t port) override {
+        (void) ip;
+        (void) port;
+        return connect("", 0);
+    }
+
+    int connect(const char *host, uint16_t port) override {
+        (void) host;
+        (void) port;
+        open = true;
+        connects++;
+        pending.clear();
+        inbound.clear();
+        return 1;
+    }
+
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override {
+        if (!open) return 0;
+        size_t n = size < writeCapacity ? size : writeCapacity;
+        if (writeCapacity != SIZE_MAX) writeCapacity -= n;
+        outbound.insert(outbound.end(), buffer, buffer + n);
+        if (onWrite && n > 0) onWrite(buffer, n);
+        return n;
+    }
+
+    int availableForWrite() override {
+        return writeSpace;
+    }
+
+    int available() override {
+        return open ? (int) inbound.size() : 0;
+    }
+
+    int read() override {
+        if (!open || inbound.empty()) return -1;
+        uint8_t c = inbound.front();
+        inbound.pop_front();
+        return c;
+    }
+
+    int read(uint8_t *buffer, size_t size) override {
+        if (!open || inbound.empty()) return -1;
+        size_t n = 0;
+        while (n < size && !inbound.empty()) {
+            buffer[n++] = inbound.front();
+            inbound.pop_front();
+        }
+        return (int) n;
+    }
+
+    int peek() override {
+        return !open || inbound.empty() ? -1 : inbound.front();
+    }
+
+    void stop() override {
+        if (open) stops++;
+        open = false;
+    }
+
+    uint8_t connected() override {
+        return open;
+    }
+
+    explicit operator bool() override {
+        return open;
+    }
+};
+
+#endif //SENSENET_NATIVE_NATIVECLIENT_H
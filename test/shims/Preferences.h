@@ -0,0 +1,68 @@
+#ifndef SENSENET_NATIVE_PREFERENCES_H
+#define SENSENET_NATIVE_PREFERENCES_H
+
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// NVS kept in memory for the life of the test binary, so it outlives a simulated reboot
+class Preferences {
+public:
+    typedef std::map<std::string, std::map<std::string, std::vector<uint8_t>>> Store;
+
+    static Store &store() {
+        static Store namespaces;
+        return namespaces;
+    }
+
+    bool begin(const char *name, bool readOnly = false) {
+        if (name == nullptr || strlen(name) > 15) return false;
+        space = &store()[name];
+        this->readOnly = readOnly;
+        return true;
+    }
+
+    void end() {
+        space = nullptr;
+    }
+
+    bool isKey(const char *key) {
+        return space != nullptr && space->count(key) > 0;
+    }
+
+    bool remove(const char *key) {
+        return space != nullptr && !readOnly && space->erase(key) > 0;
+    }
+
+    bool clear() {
+        if (space == nullptr || readOnly) return false;
+        space->clear();
+        return true;
+    }
+
+    size_t putBytes(const char *key, const void *value, size_t len) {
+        if (space == nullptr || readOnly || value == nullptr) return 0;
+        (*space)[key].assign((const uint8_t *) value, (const uint8_t *) value + len);
+        return len;
+    }
+
+    size_t getBytesLength(const char *key) {
+        if (!isKey(key)) return 0;
+        return (*space)[key].size();
+    }
+
+    // Like NVS, nothing is copied into a buffer that is too small
+    size_t getBytes(const char *key, void *buf, size_t maxLen) {
+        size_t length = getBytesLength(key);
+        if (length == 0 || buf == nullptr || length > maxLen) return 0;
+        memcpy(buf, (*space)[key].data(), length);
+        return length;
+    }
+
+private:
+    std::map<std::string, std::vector<uint8_t>> *space = nullptr;
+    bool readOnly = false;
+};
+
+#endif //SENSENET_NATIVE_PREFERENCES_H
@@ -0,0 +1,70 @@
+#ifndef SENSENET_NATIVE_PRINT_H
+#define SENSENET_NATIVE_PRINT_H
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "WString.h"
+
+class Print {
+public:
+    virtual ~Print() = default;
+
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+        size_t n = 0;
+        while (n < size && write(buffer[n])) n++;
+        return n;
+    }
+
+    size_t write(const char *str) {
+        return str == nullptr ? 0 : write((const uint8_t *) str, strlen(str));
+    }
+
+    // 0 means the stream cannot tell, as on most Arduino clients
+    virtual int availableForWrite() {
+        return 0;
+    }
+
+    virtual void flush() {}
+
+    size_t print(const String &str) {
+        return write((const uint8_t *) str.c_str(), str.length());
+    }
+
+    size_t print(const char *str) {
+        return write(str);
+    }
+
+    size_t print(char c) {
+        return write((uint8_t) c);
+    }
+
+    template<typename T>
+    size_t print(T value) {
+        return print(String(value));
+    }
+
+    template<typename T>
+    size_t println(T value) {
+        return print(value) + println();
+    }
+
+    size_t println() {
+        return write("\r\n");
+    }
+
+    size_t printf(const char *format, ...) {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (length < 0) return 0;
+        return write((const uint8_t *) buffer, (size_t) length < sizeof(buffer) ? length : sizeof(buffer) - 1);
+    }
+};
+
+#endif //SENSENET_NATIVE_PRINT_H
@@ -0,0 +1,34 @@
+#ifndef SENSENET_NATIVE_STREAM_H
+#define SENSENET_NATIVE_STREAM_H
+
+#include "Print.h"
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+
+    virtual int read() = 0;
+
+    virtual int peek() = 0;
+
+    // Never waits, everything a host stream has is already there
+    size_t readBytes(char *buffer, size_t length) {
+        size_t n = 0;
+        int c;
+        while (n < length && (c = read()) >= 0) buffer[n++] = (char) c;
+        return n;
+    }
+
+    size_t readBytes(uint8_t *buffer, size_t length) {
+        return readBytes((char *) buffer, length);
+    }
+
+    String readString() {
+        String result;
+        int c;
+        while ((c = read()) >= 0) result += (char) c;
+        return result;
+    }
+};
+
+#endif //SENSENET_NATIVE_STREAM_H
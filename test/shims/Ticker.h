@@ -0,0 +1,42 @@
+#ifndef SENSENET_NATIVE_TICKER_H
+#define SENSENET_NATIVE_TICKER_H
+
+#include <Arduino.h>
+
+// Nothing runs in the background on the host, a test fires a due ticker itself with poll()
+class Ticker {
+public:
+    typedef std::function<void()> callback_function_t;
+
+    void once(float seconds, callback_function_t callback) {
+        once_ms((uint32_t) (seconds * 1000), callback);
+    }
+
+    void once_ms(uint32_t milliseconds, callback_function_t callback) {
+        this->callback = callback;
+        dueAt = millis() + milliseconds;
+        armed = true;
+    }
+
+    void detach() {
+        armed = false;
+    }
+
+    bool active() const {
+        return armed;
+    }
+
+    bool poll() {
+        if (!armed || (int32_t) (millis() - dueAt) < 0) return false;
+        armed = false;
+        if (callback) callback();
+        return true;
+    }
+
+private:
+    callback_function_t callback;
+    uint32_t dueAt = 0;
+    bool armed = false;
+};
+
+#endif //SENSENET_NATIVE_TICKER_H
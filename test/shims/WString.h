@@ -0,0 +1,301 @@
+#ifndef SENSENET_NATIVE_WSTRING_H
+#define SENSENET_NATIVE_WSTRING_H
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+// Subset of the Arduino String the library and ArduinoJson use, backed by std::string
+class String {
+public:
+    String() = default;
+
+    String(const char *cstr) : data(cstr == nullptr ? "" : cstr) {}
+
+    String(const std::string &str) : data(str) {}
+
+    explicit String(char c) : data(1, c) {}
+
+    explicit String(unsigned char value, unsigned char base = 10) : String((unsigned long) value, base) {}
+
+    explicit String(int value, unsigned char base = 10) : String((long) value, base) {}
+
+    explicit String(unsigned int value, unsigned char base = 10) : String((unsigned long) value, base) {}
+
+    explicit String(long value, unsigned char base = 10) {
+        if (base == 10 || value >= 0) data = value < 0 ? "-" + format((unsigned long) -value, base)
+                                                       : format((unsigned long) value, base);
+        else data = format((unsigned long) value, base);
+    }
+
+    explicit String(unsigned long value, unsigned char base = 10) : data(format(value, base)) {}
+
+    explicit String(long long value, unsigned char base = 10) : String((long) value, base) {}
+
+    explicit String(unsigned long long value, unsigned char base = 10) : String((unsigned long) value, base) {}
+
+    explicit String(float value, unsigned int decimals = 2) : String((double) value, decimals) {}
+
+    explicit String(double value, unsigned int decimals = 2) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+        data = buffer;
+    }
+
+    String &operator=(const char *cstr) {
+        data = cstr == nullptr ? "" : cstr;
+        return *this;
+    }
+
+    const char *c_str() const {
+        return data.c_str();
+    }
+
+    unsigned int length() const {
+        return data.length();
+    }
+
+    bool isEmpty() const {
+        return data.empty();
+    }
+
+    bool reserve(unsigned int size) {
+        data.reserve(size);
+        return true;
+    }
+
+    bool concat(const String &str) {
+        data += str.data;
+        return true;
+    }
+
+    bool concat(const char *cstr) {
+        if (cstr != nullptr) data += cstr;
+        return true;
+    }
+
+    bool concat(const char *cstr, unsigned int length) {
+        if (cstr != nullptr) data.append(cstr, length);
+        return true;
+    }
+
+    bool concat(char c) {
+        data += c;
+        return true;
+    }
+
+    template<typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+    bool concat(T value) {
+        return concat(String(value));
+    }
+
+    String &operator+=(const String &str) {
+        concat(str);
+        return *this;
+    }
+
+    String &operator+=(const char *cstr) {
+        concat(cstr);
+        return *this;
+    }
+
+    String &operator+=(char c) {
+        concat(c);
+        return *this;
+    }
+
+    template<typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+    String &operator+=(T value) {
+        concat(value);
+        return *this;
+    }
+
+    bool equals(const String &other) const {
+        return data == other.data;
+    }
+
+    bool equals(const char *cstr) const {
+        return data == (cstr == nullptr ? "" : cstr);
+    }
+
+    bool operator==(const String &other) const {
+        return equals(other);
+    }
+
+    bool operator==(const char *cstr) const {
+        return equals(cstr);
+    }
+
+    bool operator!=(const String &other) const {
+        return !equals(other);
+    }
+
+    bool operator!=(const char *cstr) const {
+        return !equals(cstr);
+    }
+
+    bool operator<(const String &other) const {
+        return data < other.data;
+    }
+
+    bool equalsIgnoreCase(const String &other) const {
+        if (data.size() != other.data.size()) return false;
+        for (size_t i = 0; i < data.size(); i++)
+            if (tolower((unsigned char) data[i]) != tolower((unsigned char) other.data[i])) return false;
+        return true;
+    }
+
+    bool startsWith(const String &prefix) const {
+        return data.compare(0, prefix.data.size(), prefix.data) == 0;
+    }
+
+    bool endsWith(const String &suffix) const {
+        return data.size() >= suffix.data.size() &&
+               data.compare(data.size() - suffix.data.size(), suffix.data.size(), suffix.data) == 0;
+    }
+
+    char charAt(unsigned int index) const {
+        return index < data.size() ? data[index] : 0;
+    }
+
+    char operator[](unsigned int index) const {
+        return charAt(index);
+    }
+
+    char &operator[](unsigned int index) {
+        return data[index];
+    }
+
+    int indexOf(char c, unsigned int from = 0) const {
+        size_t position = data.find(c, from);
+        return position == std::string::npos ? -1 : (int) position;
+    }
+
+    int indexOf(const String &str, unsigned int from = 0) const {
+        size_t position = data.find(str.data, from);
+        return position == std::string::npos ? -1 : (int) position;
+    }
+
+    int lastIndexOf(char c) const {
+        size_t position = data.rfind(c);
+        return position == std::string::npos ? -1 : (int) position;
+    }
+
+    String substring(unsigned int from) const {
+        return from >= data.size() ? String() : String(data.substr(from));
+    }
+
+    String substring(unsigned int from, unsigned int to) const {
+        if (from > to) std::swap(from, to);
+        if (from >= data.size()) return {};
+        return String(data.substr(from, to - from));
+    }
+
+    void replace(const String &find, const String &replacement) {
+        if (find.data.empty()) return;
+        size_t position = 0;
+        while ((position = data.find(find.data, position)) != std::string::npos) {
+            data.replace(position, find.data.size(), replacement.data);
+            position += replacement.data.size();
+        }
+    }
+
+    void replace(char find, char replacement) {
+        for (char &c: data)
+            if (c == find) c = replacement;
+    }
+
+    void remove(unsigned int index, unsigned int count = (unsigned int) -1) {
+        if (index < data.size()) data.erase(index, count);
+    }
+
+    void trim() {
+        size_t start = 0, end = data.size();
+        while (start < end && isspace((unsigned char) data[start])) start++;
+        while (end > start && isspace((unsigned char) data[end - 1])) end--;
+        data = data.substr(start, end - start);
+    }
+
+    void toUpperCase() {
+        for (char &c: data) c = (char) toupper((unsigned char) c);
+    }
+
+    void toLowerCase() {
+        for (char &c: data) c = (char) tolower((unsigned char) c);
+    }
+
+    long toInt() const {
+        return strtol(data.c_str(), nullptr, 10);
+    }
+
+    void toCharArray(char *buf, unsigned int bufsize, unsigned int index = 0) const {
+        if (bufsize == 0 || buf == nullptr) return;
+        size_t n = index < data.size() ? std::min<size_t>(bufsize - 1, data.size() - index) : 0;
+        if (n > 0) memcpy(buf, data.data() + index, n);
+        buf[n] = '\0';
+    }
+
+    float toFloat() const {
+        return strtof(data.c_str(), nullptr);
+    }
+
+private:
+    std::string data;
+
+    static std::string format(unsigned long value, unsigned char base) {
+        if (base < 2 || base > 36) base = 10;
+        char buffer[sizeof(unsigned long) * 8 + 1];
+        char *end = buffer + sizeof(buffer) - 1;
+        char *position = end;
+        *position = '\0';
+        do {
+            unsigned digit = value % base;
+            *--position = (char) (digit < 10 ? '0' + digit : 'a' + digit - 10);
+            value /= base;
+        } while (value);
+        return position;
+    }
+};
+
+// ArduinoJson recognises concatenations by this type, like on the device
+class StringSumHelper : public String {
+public:
+    StringSumHelper(const String &str) : String(str) {}
+};
+
+inline StringSumHelper operator+(const String &lhs, const String &rhs) {
+    String result = lhs;
+    result += rhs;
+    return result;
+}
+
+inline StringSumHelper operator+(const String &lhs, const char *rhs) {
+    String result = lhs;
+    result += rhs;
+    return result;
+}
+
+inline StringSumHelper operator+(const char *lhs, const String &rhs) {
+    String result = lhs;
+    result += rhs;
+    return result;
+}
+
+inline StringSumHelper operator+(const String &lhs, char rhs) {
+    String result = lhs;
+    result += rhs;
+    return result;
+}
+
+template<typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+inline StringSumHelper operator+(const String &lhs, T rhs) {
+    String result = lhs;
+    result += rhs;
+    return result;
+}
+
+#endif //SENSENET_NATIVE_WSTRING_H
@@ -0,0 +1,25 @@
+#ifndef SENSENET_NATIVE_WIFI_H
+#define SENSENET_NATIVE_WIFI_H
+
+#include <Arduino.h>
+#include "IPAddress.h"
+
+// Resolves every name to brokerIp, a test can make lookups fail
+class WiFiClass {
+public:
+    IPAddress brokerIp = IPAddress(127, 0, 0, 1);
+    bool resolves = true;
+    uint32_t lookups = 0;
+
+    int hostByName(const char *host, IPAddress &result) {
+        (void) host;
+        lookups++;
+        if (!resolves) return 0;
+        result = brokerIp;
+        return 1;
+    }
+};
+
+inline WiFiClass WiFi;
+
+#endif //SENSENET_NATIVE_WIFI_H
@@ -0,0 +1,6 @@
+#ifndef SENSENET_NATIVE_ESP_IMAGE_FORMAT_H
+#define SENSENET_NATIVE_ESP_IMAGE_FORMAT_H
+
+#define ESP_IMAGE_HEADER_MAGIC 0xE9
+
+#endif //SENSENET_NATIVE_ESP_IMAGE_FORMAT_H
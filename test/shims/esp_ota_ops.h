@@ -0,0 +1,51 @@
+#ifndef SENSENET_NATIVE_ESP_OTA_OPS_H
+#define SENSENET_NATIVE_ESP_OTA_OPS_H
+
+#include "esp_partition.h"
+#include "esp_image_format.h"
+
+#define ESP_ERR_OTA_VALIDATE_FAILED 0x1503
+
+// The two application slots of the default partition table, the tests pick which one is running
+struct NativeOta {
+    static const esp_partition_t *slots() {
+        static const esp_partition_t partitions[2] = {{0x10000,  0x140000, "app0"},
+                                                      {0x150000, 0x140000, "app1"}};
+        return partitions;
+    }
+
+    static uint8_t &running() {
+        static uint8_t slot = 0;
+        return slot;
+    }
+
+    static uint8_t &boot() {
+        static uint8_t slot = 0;
+        return slot;
+    }
+};
+
+inline const esp_partition_t *esp_ota_get_running_partition() {
+    return NativeOta::slots() + NativeOta::running();
+}
+
+inline const esp_partition_t *esp_ota_get_boot_partition() {
+    return NativeOta::slots() + NativeOta::boot();
+}
+
+inline const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from) {
+    if (start_from == nullptr) start_from = esp_ota_get_running_partition();
+    return NativeOta::slots() + (start_from == NativeOta::slots() ? 1 : 0);
+}
+
+// Only the magic byte is validated here
+inline esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) {
+    if (partition != NativeOta::slots() && partition != NativeOta::slots() + 1) return ESP_ERR_INVALID_ARG;
+    uint8_t magic;
+    if (esp_partition_read(partition, 0, &magic, 1) != ESP_OK || magic != ESP_IMAGE_HEADER_MAGIC)
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    NativeOta::boot() = partition - NativeOta::slots();
+    return ESP_OK;
+}
+
+#endif //SENSENET_NATIVE_ESP_OTA_OPS_H
@@ -0,0 +1,72 @@
+#ifndef SENSENET_NATIVE_ESP_PARTITION_H
+#define SENSENET_NATIVE_ESP_PARTITION_H
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL (-1)
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_SIZE 0x104
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+} esp_partition_t;
+
+/*
+ * Partition contents kept in memory, by address. It behaves like NOR flash: erasing works on whole sectors
+ * and sets the bits, a write can only clear them, so data written without an erase comes out wrong instead
+ * of silently right.
+ */
+struct NativeFlash {
+    static std::map<uint32_t, std::vector<uint8_t>> &contents() {
+        static std::map<uint32_t, std::vector<uint8_t>> flash;
+        return flash;
+    }
+
+    static std::vector<uint8_t> &of(const esp_partition_t *partition) {
+        std::vector<uint8_t> &data = contents()[partition->address];
+        if (data.size() != partition->size) data.assign(partition->size, 0xFF);
+        return data;
+    }
+
+    static uint32_t &sectorErases() {
+        static uint32_t erases = 0;
+        return erases;
+    }
+};
+
+inline esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size) {
+    if (partition == nullptr || dst == nullptr) return ESP_ERR_INVALID_ARG;
+    if (src_offset > partition->size || size > partition->size - src_offset) return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, NativeFlash::of(partition).data() + src_offset, size);
+    return ESP_OK;
+}
+
+inline esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src,
+                                     size_t size) {
+    if (partition == nullptr || src == nullptr) return ESP_ERR_INVALID_ARG;
+    if (dst_offset > partition->size || size > partition->size - dst_offset) return ESP_ERR_INVALID_SIZE;
+    uint8_t *data = NativeFlash::of(partition).data() + dst_offset;
+    for (size_t i = 0; i < size; i++) data[i] &= ((const uint8_t *) src)[i];
+    return ESP_OK;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size) {
+    if (partition == nullptr) return ESP_ERR_INVALID_ARG;
+    if (offset > partition->size || size > partition->size - offset) return ESP_ERR_INVALID_SIZE;
+    if (offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE) return ESP_ERR_INVALID_SIZE;
+    memset(NativeFlash::of(partition).data() + offset, 0xFF, size);
+    NativeFlash::sectorErases() += size / SPI_FLASH_SEC_SIZE;
+    return ESP_OK;
+}
+
+#endif //SENSENET_NATIVE_ESP_PARTITION_H
@@ -0,0 +1,106 @@
+#ifndef SENSENET_NATIVE_ESP_ROM_MD5_H
+#define SENSENET_NATIVE_ESP_ROM_MD5_H
+
+#include <cstdint>
+#include <cstring>
+
+// The ROM MD5 of the ESP32 is the public domain Colin Plumb implementation, this is the same one with the
+// same context layout: buf holds the state, bits the message length in bits, in the partial block
+
+typedef struct MD5Context {
+    uint32_t buf[4];
+    uint32_t bits[2];
+    uint8_t in[64];
+} md5_context_t;
+
+#define ESP_ROM_MD5_DIGEST_LEN 16
+
+inline void nativeMd5Transform(uint32_t buf[4], const uint8_t block[64]) {
+    static const uint32_t k[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+    static const uint8_t r[64] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+                                  5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+                                  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+                                  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+    uint32_t w[16];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t) block[i * 4] | (uint32_t) block[i * 4 + 1] << 8 | (uint32_t) block[i * 4 + 2] << 16 |
+               (uint32_t) block[i * 4 + 3] << 24;
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        uint32_t t = d;
+        d = c;
+        c = b;
+        uint32_t x = a + f + k[i] + w[g];
+        b = b + ((x << r[i]) | (x >> (32 - r[i])));
+        a = t;
+    }
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+inline void esp_rom_md5_init(md5_context_t *context) {
+    context->buf[0] = 0x67452301;
+    context->buf[1] = 0xefcdab89;
+    context->buf[2] = 0x98badcfe;
+    context->buf[3] = 0x10325476;
+    context->bits[0] = context->bits[1] = 0;
+}
+
+inline void esp_rom_md5_update(md5_context_t *context, const void *data, uint32_t len) {
+    const uint8_t *buf = (const uint8_t *) data;
+    uint32_t used = (context->bits[0] >> 3) & 0x3f;
+    uint32_t bits = context->bits[0];
+    if ((context->bits[0] = bits + (len << 3)) < bits) context->bits[1]++;
+    context->bits[1] += len >> 29;
+    while (len > 0) {
+        uint32_t n = 64 - used < len ? 64 - used : len;
+        memcpy(context->in + used, buf, n);
+        used += n;
+        buf += n;
+        len -= n;
+        if (used == 64) {
+            nativeMd5Transform(context->buf, context->in);
+            used = 0;
+        }
+    }
+}
+
+inline void esp_rom_md5_final(uint8_t *digest, md5_context_t *context) {
+    uint8_t length[8];
+    for (int i = 0; i < 4; i++) {
+        length[i] = (uint8_t) (context->bits[0] >> (i * 8));
+        length[i + 4] = (uint8_t) (context->bits[1] >> (i * 8));
+    }
+    uint32_t used = (context->bits[0] >> 3) & 0x3f;
+    static const uint8_t padding[64] = {0x80};
+    esp_rom_md5_update(context, padding, used < 56 ? 56 - used : 120 - used);
+    esp_rom_md5_update(context, length, 8);
+    for (int i = 0; i < 16; i++) digest[i] = (uint8_t) (context->buf[i / 4] >> ((i % 4) * 8));
+}
+
+#endif //SENSENET_NATIVE_ESP_ROM_MD5_H
@@ -0,0 +1,75 @@
+#ifndef INC_FREERTOS_H
+#define INC_FREERTOS_H
+
+/*
+ * Single threaded stand-in for the FreeRTOS tasks and semaphores the library uses. Defining INC_FREERTOS_H
+ * builds the same locking code as on the device. A take that waits forever on a semaphore nobody is left to
+ * give would hang the device, here it is counted in NativeRtos::deadlocks() and fails instead. takes()
+ * counts every take, so a test can tell that a path never locks. Tests switch NativeRtos::currentTask() to
+ * act as a producer task.
+ */
+
+#include <cstdint>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef void *TaskHandle_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+
+struct NativeSemaphore {
+    bool available;
+};
+
+typedef NativeSemaphore *SemaphoreHandle_t;
+
+struct NativeRtos {
+    static uint32_t &takes() {
+        static uint32_t count = 0;
+        return count;
+    }
+
+    static uint32_t &deadlocks() {
+        static uint32_t count = 0;
+        return count;
+    }
+
+    static TaskHandle_t loopTask() {
+        static uint8_t task;
+        return &task;
+    }
+
+    static TaskHandle_t &currentTask() {
+        static TaskHandle_t task = loopTask();
+        return task;
+    }
+};
+
+// Created empty like in FreeRTOS, the first give makes it available
+inline SemaphoreHandle_t xSemaphoreCreateBinary() {
+    return new NativeSemaphore{false};
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait) {
+    NativeRtos::takes()++;
+    if (!semaphore->available) {
+        if (ticksToWait == portMAX_DELAY) NativeRtos::deadlocks()++;
+        return pdFALSE;
+    }
+    semaphore->available = false;
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    if (semaphore->available) return pdFALSE;
+    semaphore->available = true;
+    return pdTRUE;
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return NativeRtos::currentTask();
+}
+
+#endif //INC_FREERTOS_H
@@ -0,0 +1,117 @@
+#ifndef SENSENET_NATIVE_MBEDTLS_SHA256_H
+#define SENSENET_NATIVE_MBEDTLS_SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "version.h"
+
+// Reference SHA-256 behind the mbedTLS 2.28 API and the software context layout: state holds the chaining
+// values, total the bytes hashed so far and buffer the partial block at its start
+
+typedef struct mbedtls_sha256_context {
+    uint32_t total[2];
+    uint32_t state[8];
+    unsigned char buffer[64];
+    int is224;
+} mbedtls_sha256_context;
+
+inline void nativeSha256Block(uint32_t state[8], const unsigned char block[64]) {
+    static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    auto ror = [](uint32_t x, int n) -> uint32_t { return (x >> n) | (x << (32 - n)); };
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 | (uint32_t) block[i * 4 + 2] << 8 |
+               block[i * 4 + 3];
+    for (int i = 16; i < 64; i++)
+        w[i] = w[i - 16] + (ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 7] +
+               (ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {
+    if (ctx != nullptr) memset(ctx, 0, sizeof(*ctx));
+}
+
+inline void mbedtls_sha256_clone(mbedtls_sha256_context *dst, const mbedtls_sha256_context *src) {
+    *dst = *src;
+}
+
+inline int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224) {
+    static const uint32_t sha224Init[8] = {
+            0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4};
+    static const uint32_t sha256Init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    ctx->total[0] = ctx->total[1] = 0;
+    memcpy(ctx->state, is224 ? sha224Init : sha256Init, sizeof(ctx->state));
+    ctx->is224 = is224;
+    return 0;
+}
+
+inline int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen) {
+    size_t left = ctx->total[0] & 63;
+    ctx->total[0] += (uint32_t) ilen;
+    if (ctx->total[0] < (uint32_t) ilen) ctx->total[1]++;
+    if (left > 0 && ilen >= 64 - left) {
+        memcpy(ctx->buffer + left, input, 64 - left);
+        nativeSha256Block(ctx->state, ctx->buffer);
+        input += 64 - left;
+        ilen -= 64 - left;
+        left = 0;
+    }
+    for (; ilen >= 64; input += 64, ilen -= 64) nativeSha256Block(ctx->state, input);
+    if (ilen > 0) memcpy(ctx->buffer + left, input, ilen);
+    return 0;
+}
+
+inline int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32]) {
+    size_t used = ctx->total[0] & 63;
+    uint64_t bits = ((uint64_t) ctx->total[1] << 32 | ctx->total[0]) * 8;
+    ctx->buffer[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buffer + used, 0, 64 - used);
+        nativeSha256Block(ctx->state, ctx->buffer);
+        used = 0;
+    }
+    memset(ctx->buffer + used, 0, 56 - used);
+    for (int i = 0; i < 8; i++) ctx->buffer[63 - i] = (unsigned char) (bits >> (i * 8));
+    nativeSha256Block(ctx->state, ctx->buffer);
+    for (int i = 0; i < (ctx->is224 ? 28 : 32); i++)
+        output[i] = (unsigned char) (ctx->state[i / 4] >> (24 - i % 4 * 8));
+    return 0;
+}
+
+#endif //SENSENET_NATIVE_MBEDTLS_SHA256_H
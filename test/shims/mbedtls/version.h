@@ -0,0 +1,7 @@
+#ifndef SENSENET_NATIVE_MBEDTLS_VERSION_H
+#define SENSENET_NATIVE_MBEDTLS_VERSION_H
+
+// The mbedTLS of the Arduino ESP32 2.x core, ESP-IDF 4.4
+#define MBEDTLS_VERSION_NUMBER 0x021C0000
+
+#endif //SENSENET_NATIVE_MBEDTLS_VERSION_H
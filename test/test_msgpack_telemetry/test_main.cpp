@@ -0,0 +1,303 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "NativeBroker.h"
+#include "sensenet.h"
+
+// Telemetry is queued as MessagePack by sendTelemetry and published as is or turned back into JSON, depending
+// on the wire encoding. What reaches the broker is checked with a decoder of its own, not with ArduinoJson
+
+#define TS 1760659200123ULL
+
+// As in src/main.cpp
+static double round2(float value) {
+    return round(value * 100.0) / 100.0;
+}
+
+static const char *const keys[] = {"rawMG811", "readMG811", "val.MassPM1", "val.MassPM2", "val.MassPM4",
+                                   "val.MassPM10", "val.NumPM0", "val.NumPM1", "val.NumPM2", "val.NumPM4",
+                                   "val.NumPM10", "val.PartSize"};
+
+#define KEY_COUNT (sizeof(keys) / sizeof(keys[0]))
+#define READING_COUNT (sizeof(readings) / sizeof(readings[0]))
+
+// Sensor readings as floats, integral ones included since they are stored as doubles all the same
+static const float readings[][KEY_COUNT] = {
+        {1843.0f, 412.73f, 3.141f, 5.5f, 7.0049f, 8.125f, 21.875f, 25.3f, 25.91f, 25.99f, 26.0f, 0.5249f},
+        {0.0f, 0.005f, 0.0049f, 0.015f, 1e-4f, 99.995f, 1234.5678f, 65535.0f, 4.2e6f, 0.33333f, 0.66666f, 1.0f},
+        {-1.0f, -0.004f, -12.345f, 100.0f, 0.1f, 0.2f, 0.7f, 3.3f, 16777216.0f, 0.01f, 0.99f, 2.675f},
+};
+
+// The MessagePack subset a telemetry publish may contain, decoded straight from the specification
+struct MsgPackValue {
+    enum Type {
+        NIL, BOOLEAN, UINT, INT, FLOAT32, FLOAT64, STRING, ARRAY, MAP
+    } type = NIL;
+    uint64_t uint = 0;
+    int64_t sint = 0;
+    double number = 0;
+    std::string string;
+    // Array elements, or map keys and values alternating
+    std::vector<MsgPackValue> items;
+};
+
+class MsgPackReader {
+public:
+    explicit MsgPackReader(const std::vector<uint8_t> &bytes) : bytes(bytes) {}
+
+    bool atEnd() const {
+        return position == bytes.size();
+    }
+
+    MsgPackValue read() {
+        MsgPackValue value;
+        uint8_t type = next();
+        if (type <= 0x7f) return unsignedValue(type);
+        if (type >= 0xe0) return signedValue((int8_t) type);
+        if ((type & 0xf0) == 0x80) return container(MsgPackValue::MAP, type & 0x0f);
+        if ((type & 0xf0) == 0x90) return container(MsgPackValue::ARRAY, type & 0x0f);
+        if ((type & 0xe0) == 0xa0) return string(type & 0x1f);
+        switch (type) {
+            case 0xc0:
+                return value;
+            case 0xc2:
+            case 0xc3:
+                value.type = MsgPackValue::BOOLEAN;
+                value.uint = type & 1;
+                return value;
+            case 0xca: {
+                uint32_t bits = bigEndian(4);
+                float number;
+                memcpy(&number, &bits, sizeof(number));
+                value.type = MsgPackValue::FLOAT32;
+                value.number = number;
+                return value;
+            }
+            case 0xcb: {
+                uint64_t bits = bigEndian(8);
+                memcpy(&value.number, &bits, sizeof(value.number));
+                value.type = MsgPackValue::FLOAT64;
+                return value;
+            }
+            case 0xcc:
+                return unsignedValue(bigEndian(1));
+            case 0xcd:
+                return unsignedValue(bigEndian(2));
+            case 0xce:
+                return unsignedValue(bigEndian(4));
+            case 0xcf:
+                return unsignedValue(bigEndian(8));
+            case 0xd0:
+                return signedValue((int8_t) bigEndian(1));
+            case 0xd1:
+                return signedValue((int16_t) bigEndian(2));
+            case 0xd2:
+                return signedValue((int32_t) bigEndian(4));
+            case 0xd3:
+                return signedValue((int64_t) bigEndian(8));
+            case 0xd9:
+                return string(bigEndian(1));
+            case 0xda:
+                return string(bigEndian(2));
+            case 0xdc:
+                return container(MsgPackValue::ARRAY, bigEndian(2));
+            case 0xde:
+                return container(MsgPackValue::MAP, bigEndian(2));
+            default:
+                TEST_FAIL_MESSAGE("MessagePack type a telemetry publish should not contain");
+                return value;
+        }
+    }
+
+private:
+    const std::vector<uint8_t> &bytes;
+    size_t position = 0;
+
+    uint8_t next() {
+        TEST_ASSERT_TRUE_MESSAGE(position < bytes.size(), "MessagePack cut short");
+        return bytes[position++];
+    }
+
+    uint64_t bigEndian(size_t length) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < length; i++) value = value << 8 | next();
+        return value;
+    }
+
+    static MsgPackValue unsignedValue(uint64_t number) {
+        MsgPackValue value;
+        value.type = MsgPackValue::UINT;
+        value.uint = number;
+        return value;
+    }
+
+    static MsgPackValue signedValue(int64_t number) {
+        MsgPackValue value;
+        value.type = MsgPackValue::INT;
+        value.sint = number;
+        return value;
+    }
+
+    MsgPackValue string(size_t length) {
+        MsgPackValue value;
+        value.type = MsgPackValue::STRING;
+        for (size_t i = 0; i < length; i++) value.string += (char) next();
+        return value;
+    }
+
+    MsgPackValue container(MsgPackValue::Type type, size_t count) {
+        MsgPackValue value;
+        value.type = type;
+        for (size_t i = 0; i < (type == MsgPackValue::MAP ? count * 2 : count); i++) value.items.push_back(read());
+        return value;
+    }
+};
+
+struct Device {
+    NativeClient client;
+    NativeBroker broker{client};
+    MQTTController controller;
+
+    explicit Device(WireEncoding encoding) {
+        controller.init();
+        controller.setWireEncoding(encoding);
+        controller.connect(client, "esp", "token", "", "thingsboard.local", 1883,
+                           [](const String &, const JsonDocument &) -> bool { return false; });
+        run(5000);
+        TEST_ASSERT_TRUE(controller.isConnected());
+    }
+
+    void run(uint32_t ms) {
+        for (uint32_t i = 0; i < ms; i++) {
+            NativeClock::advance(1);
+            broker.pump();
+            controller.loop();
+        }
+    }
+
+    void sendReadings(size_t row, uint64_t ts) {
+        DynamicJsonDocument data(5120);
+        for (size_t i = 0; i < KEY_COUNT; i++) data[keys[i]] = round2(readings[row][i]);
+        TEST_ASSERT_TRUE(controller.sendTelemetry(data, true, ts));
+    }
+
+    std::vector<NativeBroker::Publish> telemetry() {
+        return broker.on(V1_TELEMETRY_TOPIC);
+    }
+};
+
+// Keys in order, each value a float32 where the double survives it and a float64 otherwise, never an
+// integer. Binary floats carry the double exactly, so it has to come back bit for bit
+static void checkReadings(const MsgPackValue &values, size_t row) {
+    TEST_ASSERT_EQUAL_INT(MsgPackValue::MAP, values.type);
+    TEST_ASSERT_EQUAL_size_t(KEY_COUNT * 2, values.items.size());
+    for (size_t i = 0; i < KEY_COUNT; i++) {
+        TEST_ASSERT_EQUAL_STRING(keys[i], values.items[i * 2].string.c_str());
+        const MsgPackValue &value = values.items[i * 2 + 1];
+        double expected = round2(readings[row][i]);
+        TEST_ASSERT_EQUAL_INT((double) (float) expected == expected ? MsgPackValue::FLOAT32 : MsgPackValue::FLOAT64,
+                              value.type);
+        TEST_ASSERT_TRUE(value.number == expected);
+    }
+}
+
+static void checkEnvelope(const MsgPackValue &element, uint64_t ts, size_t row) {
+    TEST_ASSERT_EQUAL_INT(MsgPackValue::MAP, element.type);
+    TEST_ASSERT_EQUAL_size_t(4, element.items.size());
+    TEST_ASSERT_EQUAL_STRING("ts", element.items[0].string.c_str());
+    TEST_ASSERT_EQUAL_INT(MsgPackValue::UINT, element.items[1].type);
+    TEST_ASSERT_TRUE(element.items[1].uint == ts);
+    TEST_ASSERT_EQUAL_STRING("values", element.items[2].string.c_str());
+    checkReadings(element.items[3], row);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+// sendTelemetry with a timestamp puts the {ts, values} envelope in front of the packed readings, a lone
+// message goes out exactly as it was queued
+void test_timestamp_envelope() {
+    Device device(WIRE_ENCODING_MSGPACK);
+    device.sendReadings(1, TS);
+    device.run(200);
+
+    std::vector<NativeBroker::Publish> telemetry = device.telemetry();
+    TEST_ASSERT_EQUAL_size_t(1, telemetry.size());
+    const std::vector<uint8_t> &payload = telemetry[0].payload;
+    const uint8_t envelope[] = {0x82, 0xa2, 't', 's', 0xcf, 0x00, 0x00, 0x01, 0x99, 0xef, 0x77, 0x58, 0x7b,
+                                0xa6, 'v', 'a', 'l', 'u', 'e', 's'};
+    TEST_ASSERT_TRUE(payload.size() > sizeof(envelope));
+    TEST_ASSERT_EQUAL_MEMORY(envelope, payload.data(), sizeof(envelope));
+
+    MsgPackReader reader(payload);
+    checkEnvelope(reader.read(), TS, 1);
+    TEST_ASSERT_TRUE(reader.atEnd());
+}
+
+// Consecutive telemetry goes out as one array16 of the queued maps, with and without a timestamp
+void test_batch_on_msgpack_wire() {
+    Device device(WIRE_ENCODING_MSGPACK);
+    for (size_t row = 0; row < READING_COUNT; row++) device.sendReadings(row, TS + row);
+    device.sendReadings(0, 0);
+    device.run(200);
+
+    std::vector<NativeBroker::Publish> telemetry = device.telemetry();
+    TEST_ASSERT_EQUAL_size_t(1, telemetry.size());
+    TEST_ASSERT_EQUAL_HEX8(0xdc, telemetry[0].payload[0]);
+    MsgPackReader reader(telemetry[0].payload);
+    MsgPackValue batch = reader.read();
+    TEST_ASSERT_TRUE(reader.atEnd());
+    TEST_ASSERT_EQUAL_INT(MsgPackValue::ARRAY, batch.type);
+    TEST_ASSERT_EQUAL_size_t(READING_COUNT + 1, batch.items.size());
+    for (size_t row = 0; row < READING_COUNT; row++) checkEnvelope(batch.items[row], TS + row, row);
+    checkReadings(batch.items[READING_COUNT], 0);
+}
+
+// The readings after `from` in a JSON payload, scanned with strtod. JSON text does not promise the double
+// back bit for bit, ArduinoJson prints at most 9 decimals, so the values only have to be close
+static size_t checkJsonReadings(const std::string &json, size_t from, size_t row) {
+    for (size_t i = 0; i < KEY_COUNT; i++) {
+        std::string key = std::string("\"") + keys[i] + "\":";
+        size_t at = json.find(key, from);
+        TEST_ASSERT_TRUE(at != std::string::npos);
+        from = at + key.size();
+        char *end;
+        double value = strtod(json.c_str() + from, &end);
+        TEST_ASSERT_TRUE(end > json.c_str() + from);
+        double expected = round2(readings[row][i]);
+        TEST_ASSERT_TRUE(fabs(value - expected) <= 1e-6 * max(1.0, fabs(expected)));
+    }
+    return from;
+}
+
+// On a JSON wire the queued MessagePack is decoded and printed as a JSON array of the same envelopes
+void test_batch_on_json_wire() {
+    Device device(WIRE_ENCODING_JSON);
+    for (size_t row = 0; row < READING_COUNT; row++) device.sendReadings(row, TS + row);
+    device.run(200);
+
+    std::vector<NativeBroker::Publish> telemetry = device.telemetry();
+    TEST_ASSERT_EQUAL_size_t(1, telemetry.size());
+    std::string json(telemetry[0].payload.begin(), telemetry[0].payload.end());
+    TEST_ASSERT_EQUAL_HEX8('[', json.front());
+    TEST_ASSERT_EQUAL_HEX8(']', json.back());
+    size_t from = 0;
+    for (size_t row = 0; row < READING_COUNT; row++) {
+        std::string ts = "{\"ts\":" + std::to_string(TS + row) + ",\"values\":{";
+        from = json.find(ts, from);
+        TEST_ASSERT_TRUE(from != std::string::npos);
+        from = checkJsonReadings(json, from + ts.size(), row);
+    }
+    TEST_ASSERT_TRUE(json.find("\"ts\"", from) == std::string::npos);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_timestamp_envelope);
+    RUN_TEST(test_batch_on_msgpack_wire);
+    RUN_TEST(test_batch_on_json_wire);
+    return UNITY_END();
+}
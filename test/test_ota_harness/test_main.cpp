@@ -0,0 +1,571 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+#include "NativeClient.h"
+#include "sensenet.h"
+
+/*
+ * Whole OTA path on the host: MQTTOTA and MQTTController drive PubSubClient over NativeClient, the other end
+ * is a ThingsBoard emulator answering the connect sequence, the shared attributes request and the chunk
+ * requests. Its replies take a round trip plus the downlink time, chunk responses can be lost or held back
+ * behind later ones. Time is virtual, the loop advances it one millisecond per iteration.
+ *
+ * The emulator serves an image file like ThingsBoard serves an uploaded package: SENSENET_OTA_IMAGE when set,
+ * else the firmware.bin of the last device build, else a generated image written to a temporary file.
+ */
+
+typedef std::vector<uint8_t> Bytes;
+
+#define FIRMWARE_SIZE (160 * 1024 + 123)
+#define FIRMWARE_TITLE "sensenet"
+#define FIRMWARE_BUILD ".pio/build/esp32doit-devkit-v1/firmware.bin"
+#define SIMULATION_LIMIT_MS 900000
+
+struct Link {
+    uint32_t rttMs;
+    // Downlink rate, 0 for unlimited
+    uint32_t bytesPerSecond;
+    // Shares of the chunk responses lost and held back by up to reorderMs
+    float loss;
+    float reorder;
+    uint32_t reorderMs;
+};
+
+static Bytes firmware, runningFirmware;
+static String firmwarePath, firmwareChecksum;
+
+#ifdef __GLIBC__
+
+#include <malloc.h>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+void __libc_free(void *pointer);
+}
+
+/*
+ * Heap held by the device code, glibc lets the test replace malloc and friends. Blocks allocated while
+ * counting is set are tracked until freed, wherever that happens. The table is fixed so that tracking never
+ * allocates itself: linear probing, deletion shifts entries back.
+ */
+struct DeviceHeap {
+    static const size_t slots = 1 << 16;
+    void *pointers[slots];
+    size_t sizes[slots];
+    size_t entries = 0, inUse = 0, peak = 0;
+    bool counting = false, overflow = false;
+
+    static size_t slot(void *pointer) {
+        return (size_t) (((uintptr_t) pointer >> 4) * 0x9E3779B97F4A7C15ULL >> 48) & (slots - 1);
+    }
+
+    void add(void *pointer, size_t size) {
+        if (entries >= slots / 2) {
+            overflow = true;
+            return;
+        }
+        size_t i = slot(pointer);
+        while (pointers[i] != nullptr) i = (i + 1) & (slots - 1);
+        pointers[i] = pointer;
+        sizes[i] = size;
+        entries++;
+        inUse += size;
+        peak = max(peak, inUse);
+    }
+
+    // Size of a tracked block, 0 when it was not
+    size_t remove(void *pointer) {
+        if (pointer == nullptr) return 0;
+        size_t i = slot(pointer);
+        while (pointers[i] != pointer) {
+            if (pointers[i] == nullptr) return 0;
+            i = (i + 1) & (slots - 1);
+        }
+        size_t size = sizes[i];
+        for (size_t j = (i + 1) & (slots - 1); pointers[j] != nullptr; j = (j + 1) & (slots - 1)) {
+            size_t home = slot(pointers[j]);
+            if (((j - home) & (slots - 1)) < ((j - i) & (slots - 1))) continue;
+            pointers[i] = pointers[j];
+            sizes[i] = sizes[j];
+            i = j;
+        }
+        pointers[i] = nullptr;
+        entries--;
+        inUse -= size;
+        return size;
+    }
+};
+
+static DeviceHeap deviceHeap;
+
+extern "C" void *malloc(size_t size) {
+    void *pointer = __libc_malloc(size);
+    if (pointer != nullptr && deviceHeap.counting) deviceHeap.add(pointer, size);
+    return pointer;
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    void *pointer = __libc_calloc(count, size);
+    if (pointer != nullptr && deviceHeap.counting) deviceHeap.add(pointer, count * size);
+    return pointer;
+}
+
+extern "C" void *realloc(void *pointer, size_t size) {
+    size_t tracked = deviceHeap.remove(pointer);
+    void *moved = __libc_realloc(pointer, size);
+    if (moved != nullptr && (tracked > 0 || deviceHeap.counting)) deviceHeap.add(moved, size);
+    else if (moved == nullptr && size > 0 && tracked > 0) deviceHeap.add(pointer, tracked);
+    return moved;
+}
+
+extern "C" void free(void *pointer) {
+    deviceHeap.remove(pointer);
+    __libc_free(pointer);
+}
+
+#define HEAP_TRACKED true
+
+#else
+
+// Without glibc malloc cannot be replaced portably, the report leaves peak heap out
+struct DeviceHeap {
+    size_t inUse = 0, peak = 0;
+    bool counting = false, overflow = false;
+};
+
+static DeviceHeap deviceHeap;
+
+#define HEAP_TRACKED false
+
+#endif
+
+// Counts allocations as the device's while in scope, or stops counting them
+struct HeapScope {
+    bool previous;
+
+    explicit HeapScope(bool counting) : previous(deviceHeap.counting) {
+        deviceHeap.counting = counting;
+    }
+
+    ~HeapScope() {
+        deviceHeap.counting = previous;
+    }
+};
+
+static Bytes packet(uint8_t header, const Bytes &body) {
+    Bytes out{header};
+    uint32_t length = body.size();
+    do {
+        uint8_t digit = length & 127;
+        length >>= 7;
+        out.push_back(length > 0 ? digit | 0x80 : digit);
+    } while (length > 0);
+    out.insert(out.end(), body.begin(), body.end());
+    return out;
+}
+
+static Bytes publishPacket(const String &topic, const uint8_t *payload, size_t length) {
+    Bytes body{(uint8_t) (topic.length() >> 8), (uint8_t) (topic.length() & 0xFF)};
+    body.insert(body.end(), topic.c_str(), topic.c_str() + topic.length());
+    body.insert(body.end(), payload, payload + length);
+    return packet(MQTTPUBLISH, body);
+}
+
+class ThingsBoardEmulator {
+public:
+    uint32_t connects = 0, chunkRequests = 0, chunkResponses = 0, lost = 0, heldBack = 0;
+    // Requests whose response reached the device
+    uint32_t roundTrips = 0;
+    uint64_t chunkBytes = 0;
+    uint64_t firstChunkRequestAt = 0;
+    // Offset of the first chunk requested on each connection
+    std::vector<uint32_t> firstOffsets;
+    uint32_t maxOffset = 0;
+    std::set<uint32_t> requestIds;
+    std::vector<String> states;
+
+    ThingsBoardEmulator(const Link &link, uint32_t seed) : link(link), generator(seed) {
+        image = fopen(firmwarePath.c_str(), "rb");
+        TEST_ASSERT_NOT_NULL(image);
+    }
+
+    ~ThingsBoardEmulator() {
+        fclose(image);
+    }
+
+    void attach(NativeClient &client) {
+        this->client = &client;
+        client.onWrite = [this](const uint8_t *data, size_t length) {
+            HeapScope emulator(false);
+            received.insert(received.end(), data, data + length);
+            parse();
+        };
+        deliveries.clear();
+        received.clear();
+    }
+
+    // Lets everything due by now arrive at the device
+    void pump() {
+        uint64_t now = NativeClock::micros();
+        while (!deliveries.empty() && deliveries.begin()->first <= now) {
+            const Delivery &delivery = deliveries.begin()->second;
+            if (client->connected()) {
+                client->send(delivery.data);
+                if (delivery.response) roundTrips++;
+            }
+            deliveries.erase(deliveries.begin());
+        }
+        client->arrive();
+    }
+
+    bool failed() const {
+        for (const String &state: states)
+            if (state == "FAILED") return true;
+        return false;
+    }
+
+private:
+    struct Delivery {
+        Bytes data;
+        bool response;
+    };
+
+    Link link;
+    FILE *image;
+    std::mt19937 generator;
+    NativeClient *client = nullptr;
+    Bytes received;
+    std::multimap<uint64_t, Delivery> deliveries;
+    uint64_t downlinkFreeAt = 0;
+    bool firstOfConnection = false;
+
+    double uniform() {
+        return std::uniform_real_distribution<double>(0, 1)(generator);
+    }
+
+    // A response answers a request publish, acks do not count as round trips
+    void reply(const Bytes &data, bool chunk, bool response = false) {
+        if (chunk && uniform() < link.loss) {
+            lost++;
+            return;
+        }
+        uint64_t at = NativeClock::micros() + (uint64_t) link.rttMs * 1000;
+        if (link.bytesPerSecond > 0) {
+            at = max(at, downlinkFreeAt) + (uint64_t) data.size() * 1000000 / link.bytesPerSecond;
+            downlinkFreeAt = at;
+        }
+        if (chunk && uniform() < link.reorder) {
+            at += generator() % ((uint64_t) link.reorderMs * 1000 + 1);
+            heldBack++;
+        }
+        deliveries.emplace(at, Delivery{data, response});
+    }
+
+    // Splits the device's byte stream into packets
+    void parse() {
+        while (received.size() >= 2) {
+            uint32_t length = 0, multiplier = 1;
+            size_t position = 1;
+            uint8_t digit;
+            do {
+                if (position >= received.size()) return;
+                digit = received[position++];
+                length += (digit & 127) * multiplier;
+                multiplier *= 128;
+            } while (digit & 128);
+            if (received.size() < position + length) return;
+            Bytes body(received.begin() + position, received.begin() + position + length);
+            uint8_t header = received[0];
+            received.erase(received.begin(), received.begin() + position + length);
+            handle(header, body);
+        }
+    }
+
+    void handle(uint8_t header, const Bytes &body) {
+        switch (header & 0xF0) {
+            case MQTTCONNECT:
+                connects++;
+                deliveries.clear();
+                firstOfConnection = true;
+                reply(packet(MQTTCONNACK, {0, 0}), false);
+                break;
+            case MQTTSUBSCRIBE: {
+                Bytes ack{body[0], body[1]};
+                for (size_t position = 2; position + 2 < body.size();) {
+                    position += 2 + (body[position] << 8 | body[position + 1]);
+                    ack.push_back(body[position++]);
+                }
+                reply(packet(MQTTSUBACK, ack), false);
+                break;
+            }
+            case MQTTUNSUBSCRIBE:
+                reply(packet(MQTTUNSUBACK, {body[0], body[1]}), false);
+                break;
+            case MQTTPINGREQ:
+                reply(packet(MQTTPINGRESP, {}), false);
+                break;
+            case MQTTPUBLISH:
+                handlePublish(header, body);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void handlePublish(uint8_t header, const Bytes &body) {
+        uint16_t topicLength = body[0] << 8 | body[1];
+        String topic = String(std::string(body.begin() + 2, body.begin() + 2 + topicLength));
+        size_t position = 2 + topicLength;
+        if (header & MQTTQOS1) {
+            reply(packet(MQTTPUBACK, {body[position], body[position + 1]}), false);
+            position += 2;
+        }
+        String payload = String(std::string(body.begin() + position, body.end()));
+
+        if (topic.startsWith("v2/fw/request/")) {
+            unsigned long requestId, chunk;
+            TEST_ASSERT_EQUAL_INT(2, sscanf(topic.c_str(), "v2/fw/request/%lu/chunk/%lu", &requestId, &chunk));
+            uint32_t size = payload.toInt();
+            uint32_t offset = chunk * size;
+            TEST_ASSERT_LESS_THAN(firmware.size(), offset);
+            if (firstChunkRequestAt == 0) firstChunkRequestAt = NativeClock::micros() / 1000;
+            if (firstOfConnection) firstOffsets.push_back(offset);
+            firstOfConnection = false;
+            maxOffset = max(maxOffset, offset);
+            requestIds.insert(requestId);
+            chunkRequests++;
+
+            Bytes data(min((uint32_t) firmware.size() - offset, size));
+            TEST_ASSERT_EQUAL_INT(0, fseek(image, offset, SEEK_SET));
+            TEST_ASSERT_EQUAL_size_t(data.size(), fread(data.data(), 1, data.size(), image));
+            chunkResponses++;
+            chunkBytes += data.size();
+            reply(publishPacket("v2/fw/response/" + String(requestId) + "/chunk/" + String(chunk), data.data(),
+                                data.size()), true, true);
+        } else if (topic.startsWith("v1/devices/me/attributes/request/")) {
+            DynamicJsonDocument request(512);
+            TEST_ASSERT_FALSE(deserializeJson(request, payload));
+            String keys = "," + request["sharedKeys"].as<String>() + ",";
+            DynamicJsonDocument response(512);
+            if (keys.indexOf("," FW_TITLE_ATTR ",") >= 0) response["shared"][FW_TITLE_ATTR] = FIRMWARE_TITLE;
+            if (keys.indexOf("," FW_VERSION_ATTR ",") >= 0) response["shared"][FW_VERSION_ATTR] = "2.0.0";
+            if (keys.indexOf("," FW_SIZE_ATTR ",") >= 0) response["shared"][FW_SIZE_ATTR] = firmware.size();
+            if (keys.indexOf("," FW_CHECKSUM_ATTR ",") >= 0) response["shared"][FW_CHECKSUM_ATTR] = firmwareChecksum;
+            if (keys.indexOf("," FW_CHECKSUM_ALG_ATTR ",") >= 0) response["shared"][FW_CHECKSUM_ALG_ATTR] = "SHA256";
+            String json;
+            serializeJson(response, json);
+            String responseTopic = topic;
+            responseTopic.replace("request", "response");
+            reply(publishPacket(responseTopic, (const uint8_t *) json.c_str(), json.length()), false, true);
+        } else if (topic == V1_TELEMETRY_TOPIC) {
+            // Batches arrive as an array
+            DynamicJsonDocument telemetry(4096);
+            TEST_ASSERT_FALSE(deserializeJson(telemetry, payload));
+            const JsonDocument &values = telemetry;
+            bool batch = values.is<JsonArray>();
+            for (size_t i = 0; i < (batch ? values.size() : 1); i++) {
+                JsonVariantConst element = batch ? values[(int) i] : (JsonVariantConst) values;
+                if (element.containsKey(FW_STATE_ATTR)) states.push_back(element[FW_STATE_ATTR].as<String>());
+            }
+        }
+    }
+};
+
+// What main.cpp wires up: the controller connects, the connect event starts the OTA handling
+struct Device {
+    NativeClient client;
+    MQTTController controller;
+    MQTTOTA ota;
+
+    explicit Device(uint16_t chunkSize) : ota(&controller, chunkSize) {
+        HeapScope device(true);
+        controller.init();
+        controller.connect(client, "esp", "token", "", "thingsboard.local", 1883,
+                           [](const String &, const JsonDocument &) -> bool { return false; }, nullptr,
+                           [this]() { ota.begin(FIRMWARE_TITLE, "1.0.0"); });
+    }
+
+    void loop() {
+        HeapScope device(true);
+        controller.loop();
+        ota.loop();
+    }
+};
+
+static bool installed() {
+    return esp_ota_get_boot_partition() == esp_ota_get_next_update_partition(nullptr);
+}
+
+// Runs device and emulator until done() or the emulator saw the update fail
+static bool run(Device &device, ThingsBoardEmulator &thingsBoard, const std::function<bool()> &done) {
+    for (uint32_t ms = 0; ms < SIMULATION_LIMIT_MS; ms++) {
+        NativeClock::advance(1);
+        thingsBoard.pump();
+        device.loop();
+        if (done()) return true;
+        if (thingsBoard.failed()) return false;
+    }
+    return false;
+}
+
+static void checkInstalled() {
+    TEST_ASSERT_TRUE(installed());
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(nullptr);
+    TEST_ASSERT_EQUAL_MEMORY(firmware.data(), NativeFlash::of(partition).data(), firmware.size());
+}
+
+void setUp() {
+    OTAUpdate.abortUpdate();
+    Preferences::store().clear();
+    NativeOta::running() = 0;
+    NativeOta::boot() = 0;
+    const esp_partition_t *update = esp_ota_get_next_update_partition(nullptr);
+    esp_partition_erase_range(update, 0, update->size);
+}
+
+void tearDown() {}
+
+// One download per largest chunk size over a slow, lossy link that reorders, reported like the OTA metrics.
+// Heap is what the device code holds once set up and at most while it downloads. Setting up is left out of
+// the peak, the host file system shim allocates there in ways LittleFS would not
+void test_download_per_chunk_size() {
+    const Link link = {150, 64 * 1024, 0.02f, 0.2f, 400};
+    for (uint16_t chunkSize: {1024, 2048, 4096, 8192, 16384}) {
+        setUp();
+        size_t heapBefore = deviceHeap.inUse;
+        Device device(chunkSize);
+        size_t heapSetUp = deviceHeap.inUse - heapBefore;
+        deviceHeap.peak = deviceHeap.inUse;
+        ThingsBoardEmulator thingsBoard(link, chunkSize);
+        thingsBoard.attach(device.client);
+        uint32_t retriesBefore = Metrics.counter("OTA Chunk Retries")->get();
+
+        TEST_ASSERT_TRUE(run(device, thingsBoard, installed));
+        checkInstalled();
+        TEST_ASSERT_EQUAL_UINT32(1, thingsBoard.connects);
+
+        TEST_ASSERT_FALSE(deviceHeap.overflow);
+        TEST_ASSERT_EQUAL_UINT32(thingsBoard.chunkResponses - thingsBoard.lost, thingsBoard.roundTrips - 1);
+
+        uint64_t duration = NativeClock::micros() / 1000 - thingsBoard.firstChunkRequestAt;
+        char heap[48] = "heap n/a without glibc";
+        if (HEAP_TRACKED)
+            snprintf(heap, sizeof(heap), "heap %u B set up, peak %6u B", (unsigned) heapSetUp,
+                     (unsigned) (deviceHeap.peak - heapBefore));
+        char report[240];
+        snprintf(report, sizeof(report),
+                 "chunk %5u: %u B in %6lu ms, %6lu B/s, %4u requests, %3u retries, %3u lost, %3u late, "
+                 "%4u round trips, RTT avg %lu ms, last chunk size %u, %s",
+                 chunkSize, (unsigned) firmware.size(), (unsigned long) duration,
+                 (unsigned long) (firmware.size() * 1000 / max(duration, (uint64_t) 1)), thingsBoard.chunkRequests,
+                 Metrics.counter("OTA Chunk Retries")->get() - retriesBefore, thingsBoard.lost, thingsBoard.heldBack,
+                 thingsBoard.roundTrips, (unsigned long) Metrics.gauge("OTA Chunk RTT Avg")->get(),
+                 Metrics.gauge("OTA Chunk Size")->get(), heap);
+        TEST_MESSAGE(report);
+    }
+}
+
+// A dropped connection continues the download with the same request ids once the shared attributes are back
+void test_reconnect_continues_download() {
+    Device device(4096);
+    ThingsBoardEmulator thingsBoard({100, 0, 0, 0, 0}, 5);
+    thingsBoard.attach(device.client);
+
+    TEST_ASSERT_TRUE(run(device, thingsBoard, [&]() { return thingsBoard.chunkResponses >= 10; }));
+    device.client.stop();
+    TEST_ASSERT_TRUE(run(device, thingsBoard, installed));
+    checkInstalled();
+
+    TEST_ASSERT_EQUAL_UINT32(2, thingsBoard.connects);
+    TEST_ASSERT_EQUAL_size_t(2, thingsBoard.firstOffsets.size());
+    TEST_ASSERT_GREATER_THAN(0, thingsBoard.firstOffsets[1]);
+    // One request base, a response to a request of the first connection still matches
+    std::set<uint32_t> bases;
+    for (uint32_t requestId: thingsBoard.requestIds) bases.insert(requestId / 32);
+    TEST_ASSERT_EQUAL_size_t(1, bases.size());
+    // Nothing was downloaded twice but what was in flight when the connection dropped
+    TEST_ASSERT_LESS_THAN(firmware.size() + MQTT_OTA_WINDOW * 4096 + 1, thingsBoard.chunkBytes);
+}
+
+// Power lost halfway: a new device finds the checkpoint and only asks for what came after it
+void test_reboot_resumes_from_checkpoint() {
+    ThingsBoardEmulator thingsBoard({100, 0, 0, 0, 0}, 7);
+    {
+        Device device(4096);
+        thingsBoard.attach(device.client);
+        TEST_ASSERT_TRUE(run(device, thingsBoard, [&]() {
+            return thingsBoard.maxOffset >= OTA_CHECKPOINT_INTERVAL * 2 + 4096;
+        }));
+        // Nothing past this point survives a reboot but NVS and flash
+        OTAUpdate.abortUpdate();
+    }
+
+    Device device(4096);
+    thingsBoard.attach(device.client);
+    TEST_ASSERT_TRUE(run(device, thingsBoard, installed));
+    checkInstalled();
+
+    TEST_ASSERT_EQUAL_size_t(2, thingsBoard.firstOffsets.size());
+    TEST_ASSERT_EQUAL_UINT32(0, thingsBoard.firstOffsets[0]);
+    TEST_ASSERT_GREATER_OR_EQUAL(OTA_CHECKPOINT_INTERVAL * 2, thingsBoard.firstOffsets[1]);
+    TEST_ASSERT_EQUAL_UINT32(0, thingsBoard.firstOffsets[1] % OTA_CHECKPOINT_INTERVAL);
+}
+
+// Reads the image to serve, generating one into a temporary file when there is none
+static void loadFirmware() {
+    const char *path = getenv("SENSENET_OTA_IMAGE");
+    if (path == nullptr && std::filesystem::exists(FIRMWARE_BUILD)) path = FIRMWARE_BUILD;
+    if (path == nullptr) {
+        std::mt19937 generator(2024);
+        Bytes generated(FIRMWARE_SIZE);
+        for (uint8_t &b: generated) b = generator();
+        generated[0] = ESP_IMAGE_HEADER_MAGIC;
+        firmwarePath = (std::filesystem::temp_directory_path() / "sensenet-ota-image.bin").string().c_str();
+        FILE *file = fopen(firmwarePath.c_str(), "wb");
+        TEST_ASSERT_NOT_NULL(file);
+        TEST_ASSERT_EQUAL_size_t(generated.size(), fwrite(generated.data(), 1, generated.size(), file));
+        fclose(file);
+    } else {
+        firmwarePath = path;
+    }
+
+    FILE *file = fopen(firmwarePath.c_str(), "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    uint8_t buffer[4096];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) > 0;) firmware.insert(firmware.end(), buffer, buffer + n);
+    fclose(file);
+    TEST_ASSERT_EQUAL_HEX8(ESP_IMAGE_HEADER_MAGIC, firmware[0]);
+}
+
+int main(int argc, char **argv) {
+    loadFirmware();
+    runningFirmware.assign(200000, 0);
+    runningFirmware[0] = ESP_IMAGE_HEADER_MAGIC;
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_partition_erase_range(running, 0, running->size);
+    esp_partition_write(running, 0, runningFirmware.data(), runningFirmware.size());
+    ESP.sketchSize = runningFirmware.size();
+
+    OTAHash hash;
+    hash.begin(OTA_HASH_SHA256);
+    hash.update(firmware.data(), firmware.size());
+    char hex[OTA_HASH_HEX_SIZE];
+    hash.finish(hex);
+    firmwareChecksum = hex;
+
+    UNITY_BEGIN();
+    RUN_TEST(test_download_per_chunk_size);
+    RUN_TEST(test_reconnect_continues_download);
+    RUN_TEST(test_reboot_resumes_from_checkpoint);
+    return UNITY_END();
+}
@@ -0,0 +1,126 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "OTAHash.tpp"
+
+// Digests of "abc", of nothing and of testData(), from Python's hashlib
+struct Vector {
+    OTAHashType type;
+    const char *abc, *empty, *data;
+};
+
+static const Vector vectors[] = {
+        {OTA_HASH_MD5,    "900150983cd24fb0d6963f7d28e17f72",
+                "d41d8cd98f00b204e9800998ecf8427e",
+                "8bf88e947553edd4a627d51b118e3531"},
+        {OTA_HASH_SHA256, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+                "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+                "6cb96e84bff09669071e1bb5c7598c302b02147a9d7e440d6343c6778717c80f"},
+        {OTA_HASH_SHA384, "cb00753f45a35e8bb5a03d699ac65007272c32ab0eded1631a8b605a43ff5bed8086072ba1e7cc2358baeca134c825a7",
+                "38b060a751ac96384cd9327eb1b1e36a21fdb71114be07434c0cc7bf63f6e1da274edebfe76f65fbd51ad2f14898b95b",
+                "05a30f676e86229108676ad1fa57619cf7499a92da5e81e2f7376bfe4afe0f0705134566a32317806956f6a5dd44c628"},
+        {OTA_HASH_SHA512, "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f",
+                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e",
+                "5dc9d0b40d97f4fb41ca47e8afa5efa0cb8aaafc4d2aa080aaf6daa109f31f97358690e72659d61369cbbb3e0cc6639b8abd72b9d75acb33d9c1e5dc0ac4feab"},
+};
+
+#define TEST_DATA_SIZE 10007
+
+static uint8_t testData[TEST_DATA_SIZE];
+
+static String digestOf(OTAHashType type, const uint8_t *data, size_t length) {
+    OTAHash hash;
+    hash.begin(type);
+    hash.update(data, length);
+    char hex[OTA_HASH_HEX_SIZE];
+    hash.finish(hex);
+    return hex;
+}
+
+void setUp() {
+    for (uint32_t i = 0; i < TEST_DATA_SIZE; i++) testData[i] = (uint8_t) (i * 31 + (i >> 8));
+}
+
+void tearDown() {}
+
+void test_known_digests() {
+    for (const Vector &vector: vectors) {
+        TEST_ASSERT_EQUAL_STRING(vector.abc, digestOf(vector.type, (const uint8_t *) "abc", 3).c_str());
+        TEST_ASSERT_EQUAL_STRING(vector.empty, digestOf(vector.type, nullptr, 0).c_str());
+        TEST_ASSERT_EQUAL_STRING(vector.data, digestOf(vector.type, testData, TEST_DATA_SIZE).c_str());
+    }
+}
+
+// Chunk boundaries anywhere in a block, including lengths around the padding limit
+void test_chunked_updates() {
+    const size_t steps[] = {1, 3, 55, 56, 63, 64, 65, 111, 112, 127, 128, 129, 1000};
+    for (const Vector &vector: vectors) {
+        for (size_t step: steps) {
+            OTAHash hash;
+            hash.begin(vector.type);
+            for (size_t offset = 0; offset < TEST_DATA_SIZE; offset += step)
+                hash.update(testData + offset, min(step, (size_t) TEST_DATA_SIZE - offset));
+            char hex[OTA_HASH_HEX_SIZE];
+            hash.finish(hex);
+            TEST_ASSERT_EQUAL_STRING(vector.data, hex);
+        }
+    }
+}
+
+// What a checkpoint does across a reboot: the state is copied out as bytes and a fresh hash goes on from it.
+// Saving works on a clone, the hash it was taken from goes on unchanged
+void test_restore_from_saved_state() {
+    const size_t splits[] = {0, 1, 64, 100, 128, 4096, 5003, TEST_DATA_SIZE};
+    for (const Vector &vector: vectors) {
+        for (size_t split: splits) {
+            OTAHash::State saved;
+            {
+                OTAHash hash;
+                hash.begin(vector.type);
+                hash.update(testData, split);
+                hash.save(saved);
+                hash.update(testData + split, TEST_DATA_SIZE - split);
+                char hex[OTA_HASH_HEX_SIZE];
+                hash.finish(hex);
+                TEST_ASSERT_EQUAL_STRING(vector.data, hex);
+            }
+            TEST_ASSERT_EQUAL_UINT64(split, saved.length);
+            uint8_t bytes[sizeof(OTAHash::State)];
+            memcpy(bytes, &saved, sizeof(bytes));
+            OTAHash::State loaded;
+            memcpy(&loaded, bytes, sizeof(loaded));
+
+            OTAHash resumed;
+            TEST_ASSERT_TRUE(resumed.restore(vector.type, loaded));
+            resumed.update(testData + split, TEST_DATA_SIZE - split);
+            char hex[OTA_HASH_HEX_SIZE];
+            resumed.finish(hex);
+            TEST_ASSERT_EQUAL_STRING(vector.data, hex);
+        }
+    }
+}
+
+void test_restore_rejects_foreign_state() {
+    OTAHash hash;
+    hash.begin(OTA_HASH_SHA256);
+    hash.update(testData, 100);
+    OTAHash::State saved;
+    hash.save(saved);
+
+    OTAHash other;
+    TEST_ASSERT_FALSE(other.restore(OTA_HASH_SHA512, saved));
+    saved.version++;
+    TEST_ASSERT_FALSE(other.restore(OTA_HASH_SHA256, saved));
+    // Nothing is hashed without a valid state
+    char hex[OTA_HASH_HEX_SIZE];
+    other.finish(hex);
+    TEST_ASSERT_EQUAL_STRING("0000000000000000000000000000000000000000000000000000000000000000", hex);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_known_digests);
+    RUN_TEST(test_chunked_updates);
+    RUN_TEST(test_restore_from_saved_state);
+    RUN_TEST(test_restore_rejects_foreign_state);
+    return UNITY_END();
+}
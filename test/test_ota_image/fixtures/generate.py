@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Regenerates the packed image fixtures of test_ota_image with tools/ota_image.py.
+
+    python3 test/test_ota_image/fixtures/generate.py
+
+base.bin and update.bin are firmware-like images, update.bin a new build of base.bin. Each update-*.snz is
+what `ota_image.py pack` writes for them: plain LZ at several window sizes and a delta against base.bin.
+"""
+
+import os
+import random
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TOOL = os.path.join(HERE, "..", "..", "..", "tools", "ota_image.py")
+IMAGE_MAGIC = 0xE9
+
+
+def make_image(size, seed):
+    """Random stretches, runs of one byte, short patterns and repeats from near and far."""
+    generator = random.Random(seed)
+    image = bytearray([IMAGE_MAGIC])
+    while len(image) < size:
+        length = generator.randrange(300) + 1
+        kind = generator.randrange(4)
+        if kind == 0:
+            image += bytes(generator.randrange(256) for _ in range(length))
+        elif kind == 1:
+            image += bytes([generator.randrange(256)]) * length
+        elif kind == 2:
+            pattern = bytes(generator.randrange(256) for _ in range(generator.randrange(8) + 1))
+            image += bytes(pattern[i % len(pattern)] for i in range(length))
+        else:
+            distance = generator.randrange(min(len(image), 6000)) + 1
+            for _ in range(length):
+                image.append(image[-distance])
+    return bytes(image[:size])
+
+
+def make_update(base, seed):
+    """Most of base moved around a little, some of it changed."""
+    generator = random.Random(seed)
+    image = bytearray()
+    position = 0
+    while position < len(base):
+        length = min(generator.randrange(6000) + 8, len(base) - position)
+        image += base[position:position + length]
+        position += length
+        kind = generator.randrange(3)
+        if kind == 0:
+            position += generator.randrange(200)
+        elif kind == 1:
+            image += make_image(generator.randrange(500) + 1, generator.randrange(1 << 30))[1:]
+        else:
+            for _ in range(10):
+                image[generator.randrange(len(image))] ^= 0x5A
+    image[0] = IMAGE_MAGIC
+    return bytes(image)
+
+
+def pack(output, *arguments):
+    subprocess.run([sys.executable, TOOL, "pack", os.path.join(HERE, "update.bin"), "-o",
+                    os.path.join(HERE, output)] + list(arguments), check=True)
+
+
+def main():
+    base = make_image(24000, 1)
+    with open(os.path.join(HERE, "base.bin"), "wb") as file:
+        file.write(base)
+    with open(os.path.join(HERE, "update.bin"), "wb") as file:
+        file.write(make_update(base, 2))
+
+    for window_bits in (8, 10, 12):
+        pack("update-w%d.snz" % window_bits, "--window-bits", str(window_bits))
+    pack("update-delta.snz", "--base", os.path.join(HERE, "base.bin"))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
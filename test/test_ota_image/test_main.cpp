@@ -0,0 +1,222 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <esp_rom_md5.h>
+#include <filesystem>
+#include <random>
+#include <vector>
+#include "OTAImage.tpp"
+
+// Decodes images packed by tools/ota_image.py with the input cut at arbitrary points, within the header, a
+// literal run or the arguments of a copy, and across a checkpoint restore(). The fixtures come from
+// fixtures/generate.py, run it again after changing the format
+
+typedef std::vector<uint8_t> Bytes;
+
+static void md5Of(const Bytes &data, uint8_t digest[16]) {
+    md5_context_t context;
+    esp_rom_md5_init(&context);
+    esp_rom_md5_update(&context, data.data(), data.size());
+    esp_rom_md5_final(digest, &context);
+}
+
+static String md5Hex(const Bytes &data) {
+    uint8_t digest[16];
+    md5Of(data, digest);
+    char hex[33];
+    for (uint8_t i = 0; i < 16; i++) sprintf(hex + i * 2, "%02x", digest[i]);
+    return hex;
+}
+
+// Run from the project directory like PlatformIO does, or from anywhere with the source path known
+static Bytes fixture(const char *name) {
+    std::filesystem::path path = std::filesystem::path("test/test_ota_image/fixtures") / name;
+    if (!std::filesystem::exists(path)) path = std::filesystem::path(__FILE__).parent_path() / "fixtures" / name;
+    FILE *file = fopen(path.c_str(), "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    Bytes data;
+    uint8_t buffer[4096];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) > 0;) data.insert(data.end(), buffer, buffer + n);
+    fclose(file);
+    TEST_ASSERT_FALSE(data.empty());
+    return data;
+}
+
+static void installRunning(const Bytes &image) {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    TEST_ASSERT_EQUAL_INT(ESP_OK, esp_partition_erase_range(running, 0, running->size));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, esp_partition_write(running, 0, image.data(), image.size()));
+    ESP.sketchSize = image.size();
+    ESP.sketchMD5 = md5Hex(image);
+}
+
+// Cuts input into pieces of 1 to maxPiece bytes
+static std::vector<size_t> randomCuts(size_t length, size_t maxPiece, uint32_t seed) {
+    std::mt19937 generator(seed);
+    std::vector<size_t> cuts;
+    for (size_t position = 0; position < length;) {
+        position = min(length, position + generator() % maxPiece + 1);
+        cuts.push_back(position);
+    }
+    return cuts;
+}
+
+static Bytes decodeInPieces(const Bytes &packed, const std::vector<size_t> &cuts) {
+    Bytes output;
+    OTAImageDecoder::Writer collect = [&output](const uint8_t *data, size_t len) -> int {
+        TEST_ASSERT_TRUE(len > 0 && len <= OTA_IMAGE_STAGE_SIZE);
+        output.insert(output.end(), data, data + len);
+        return 0;
+    };
+    OTAImageDecoder decoder;
+    decoder.begin();
+    size_t position = 0;
+    for (size_t cut: cuts) {
+        TEST_ASSERT_EQUAL_INT(0, decoder.decode(packed.data() + position, cut - position, collect));
+        position = cut;
+    }
+    TEST_ASSERT_EQUAL_size_t(packed.size(), position);
+    TEST_ASSERT_TRUE(decoder.isComplete());
+    TEST_ASSERT_EQUAL_UINT32(output.size(), decoder.getImageSize());
+    uint8_t digest[16];
+    md5Of(output, digest);
+    TEST_ASSERT_EQUAL_MEMORY(digest, decoder.getImageMD5(), 16);
+    return output;
+}
+
+static void checkAnySplit(const Bytes &image, const Bytes &packed) {
+    std::vector<size_t> whole{packed.size()};
+    TEST_ASSERT_TRUE(decodeInPieces(packed, whole) == image);
+
+    std::vector<size_t> byteByByte;
+    for (size_t i = 1; i <= packed.size(); i++) byteByByte.push_back(i);
+    TEST_ASSERT_TRUE(decodeInPieces(packed, byteByByte) == image);
+
+    for (uint32_t seed = 1; seed <= 20; seed++)
+        TEST_ASSERT_TRUE(decodeInPieces(packed, randomCuts(packed.size(), seed * 37, seed)) == image);
+}
+
+void setUp() {
+    NativeOta::running() = 0;
+}
+
+void tearDown() {}
+
+void test_lz_any_split() {
+    Bytes image = fixture("update.bin");
+    for (const char *name: {"update-w8.snz", "update-w10.snz", "update-w12.snz"}) {
+        Bytes packed = fixture(name);
+        TEST_ASSERT_LESS_THAN(image.size(), packed.size());
+        checkAnySplit(image, packed);
+    }
+}
+
+void test_delta_any_split() {
+    installRunning(fixture("base.bin"));
+    Bytes image = fixture("update.bin");
+    Bytes packed = fixture("update-delta.snz");
+    // Mostly copies out of the running image
+    TEST_ASSERT_LESS_THAN(image.size() / 4, packed.size());
+    checkAnySplit(image, packed);
+}
+
+// Decodes up to cut into the update partition, checkpoints the State as bytes like NVS would and lets a
+// fresh decoder restore() it from the partition and finish the image
+static void checkRestoreAt(const Bytes &image, const Bytes &packed, size_t cut) {
+    const esp_partition_t *target = esp_ota_get_next_update_partition(nullptr);
+    uint32_t eraseSize = (image.size() + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    TEST_ASSERT_EQUAL_INT(ESP_OK, esp_partition_erase_range(target, 0, eraseSize));
+    uint32_t written = 0;
+    OTAImageDecoder::Writer flash = [&written, target](const uint8_t *data, size_t len) -> int {
+        if (esp_partition_write(target, written, data, len) != ESP_OK) return -1;
+        written += len;
+        return 0;
+    };
+
+    uint8_t saved[sizeof(OTAImageDecoder::State)];
+    {
+        OTAImageDecoder decoder;
+        decoder.begin();
+        TEST_ASSERT_EQUAL_INT(0, decoder.decode(packed.data(), cut, flash));
+        TEST_ASSERT_EQUAL_UINT32(written, decoder.getState().produced);
+        memcpy(saved, &decoder.getState(), sizeof(saved));
+    }
+    OTAImageDecoder::State state;
+    memcpy(&state, saved, sizeof(state));
+
+    OTAImageDecoder resumed;
+    TEST_ASSERT_EQUAL_INT(0, resumed.restore(state, target));
+    std::vector<size_t> cuts = randomCuts(packed.size() - cut, 500, cut);
+    size_t position = cut;
+    for (size_t next: cuts) {
+        TEST_ASSERT_EQUAL_INT(0, resumed.decode(packed.data() + position, cut + next - position, flash));
+        position = cut + next;
+    }
+    TEST_ASSERT_TRUE(resumed.isComplete());
+    TEST_ASSERT_EQUAL_UINT32(image.size(), written);
+    TEST_ASSERT_EQUAL_MEMORY(image.data(), NativeFlash::of(target).data(), image.size());
+}
+
+static void checkRestoreAnywhere(const Bytes &image, const Bytes &packed, uint32_t seed) {
+    // Before, inside and right after the header, then spread over the rest
+    std::vector<size_t> cuts = {0, 1, 20, OTA_IMAGE_HEADER_SIZE - 1, OTA_IMAGE_HEADER_SIZE,
+                                OTA_IMAGE_HEADER_SIZE + 1, OTA_IMAGE_HEADER_SIZE + 2, OTA_IMAGE_HEADER_SIZE + 3,
+                                packed.size() - 1, packed.size()};
+    std::mt19937 generator(seed);
+    for (int i = 0; i < 150; i++) cuts.push_back(generator() % packed.size());
+    for (size_t cut: cuts) checkRestoreAt(image, packed, cut);
+}
+
+void test_restore_lz_mid_stream() {
+    // Far more output than the window, restore() has to bring back the bytes a later copy refers to
+    checkRestoreAnywhere(fixture("update.bin"), fixture("update-w10.snz"), 22);
+}
+
+void test_restore_delta_mid_stream() {
+    installRunning(fixture("base.bin"));
+    checkRestoreAnywhere(fixture("update.bin"), fixture("update-delta.snz"), 33);
+}
+
+void test_rejected_images() {
+    OTAImageDecoder::Writer ignore = [](const uint8_t *, size_t) -> int { return 0; };
+    OTAImageDecoder decoder;
+    // A delta made from another build than the running one
+    Bytes other = fixture("base.bin");
+    other[100] ^= 0x5A;
+    installRunning(other);
+    Bytes packed = fixture("update-delta.snz");
+    decoder.begin();
+    TEST_ASSERT_EQUAL_INT(IMAGE_BASE_MISMATCH, decoder.decode(packed.data(), packed.size(), ignore));
+
+    packed = fixture("update-w12.snz");
+    packed[5] = OTA_IMAGE_MAX_WINDOW_BITS + 1;
+    decoder.begin();
+    TEST_ASSERT_EQUAL_INT(IMAGE_WINDOW_TOO_LARGE, decoder.decode(packed.data(), packed.size(), ignore));
+
+    packed[5] = 12;
+    packed[0] = 'X';
+    decoder.begin();
+    TEST_ASSERT_EQUAL_INT(IMAGE_CORRUPT, decoder.decode(packed.data(), packed.size(), ignore));
+
+    // A back reference in front of the first byte
+    packed = fixture("update-w12.snz");
+    packed.resize(OTA_IMAGE_HEADER_SIZE);
+    packed.insert(packed.end(), {0x00, ESP_IMAGE_HEADER_MAGIC, 0x80, 0x02, 0x00});
+    decoder.begin();
+    TEST_ASSERT_EQUAL_INT(IMAGE_CORRUPT, decoder.decode(packed.data(), packed.size(), ignore));
+
+    // A copy out of the running image in a plain LZ image
+    packed.resize(OTA_IMAGE_HEADER_SIZE);
+    packed.insert(packed.end(), {0xC0, 0x07, 0x00, 0x00, 0x00, 0x00});
+    decoder.begin();
+    TEST_ASSERT_EQUAL_INT(IMAGE_CORRUPT, decoder.decode(packed.data(), packed.size(), ignore));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_lz_any_split);
+    RUN_TEST(test_delta_any_split);
+    RUN_TEST(test_restore_lz_mid_stream);
+    RUN_TEST(test_restore_delta_mid_stream);
+    RUN_TEST(test_rejected_images);
+    return UNITY_END();
+}
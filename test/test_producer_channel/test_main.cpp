@@ -0,0 +1,131 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "NativeBroker.h"
+#include "sensenet.h"
+
+// Documents queued from a producer task are serialized straight into the producer channel. The task that
+// owns the channel must never take a semaphore, so the controller task can never hold it up
+
+#define TS 1700000000000ULL
+
+static uint8_t producerTask, otherProducerTask;
+
+struct Device {
+    NativeClient client;
+    NativeBroker broker{client};
+    MQTTController controller;
+
+    Device() {
+        controller.init();
+        controller.connect(client, "esp", "token", "", "thingsboard.local", 1883,
+                           [](const String &, const JsonDocument &) -> bool { return false; });
+        run(5000);
+        TEST_ASSERT_TRUE(controller.isConnected());
+    }
+
+    void run(uint32_t ms) {
+        for (uint32_t i = 0; i < ms; i++) {
+            NativeClock::advance(1);
+            broker.pump();
+            controller.loop();
+        }
+    }
+
+    // Telemetry elements as published, batches are split up
+    std::vector<std::string> telemetry() {
+        std::vector<std::string> elements;
+        for (const NativeBroker::Publish &publish: broker.on(V1_TELEMETRY_TOPIC)) {
+            DynamicJsonDocument doc(4096);
+            TEST_ASSERT_FALSE(deserializeJson(doc, (const char *) publish.payload.data(), publish.payload.size()));
+            const JsonDocument &values = doc;
+            bool batch = values.is<JsonArray>();
+            for (size_t i = 0; i < (batch ? values.size() : 1); i++) {
+                String element;
+                serializeJson(batch ? values[(int) i] : (JsonVariantConst) values, element);
+                elements.push_back(element.c_str());
+            }
+        }
+        return elements;
+    }
+};
+
+static void sendReading(MQTTController &controller, int reading, uint64_t ts) {
+    DynamicJsonDocument data(256);
+    data["reading"] = reading;
+    TEST_ASSERT_TRUE(controller.sendTelemetry(data, true, ts));
+}
+
+void setUp() {
+    NativeRtos::currentTask() = NativeRtos::loopTask();
+    NativeRtos::deadlocks() = 0;
+}
+
+void tearDown() {
+    NativeRtos::currentTask() = NativeRtos::loopTask();
+}
+
+void test_producer_serializes_without_locking() {
+    Device device;
+    NativeRtos::currentTask() = &producerTask;
+    uint32_t takes = NativeRtos::takes();
+    for (int i = 0; i < 3; i++) sendReading(device.controller, i, TS + i);
+    TEST_ASSERT_EQUAL_UINT32(takes, NativeRtos::takes());
+
+    NativeRtos::currentTask() = NativeRtos::loopTask();
+    device.run(200);
+    std::vector<std::string> telemetry = device.telemetry();
+    TEST_ASSERT_EQUAL_size_t(3, telemetry.size());
+    TEST_ASSERT_EQUAL_STRING("{\"ts\":1700000000000,\"values\":{\"reading\":0}}", telemetry[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("{\"ts\":1700000000002,\"values\":{\"reading\":2}}", telemetry[2].c_str());
+    TEST_ASSERT_EQUAL_UINT32(0, NativeRtos::deadlocks());
+}
+
+// A second producer task has no channel, it serializes under the queue lock like the controller task
+void test_other_producer_uses_the_queue_lock() {
+    Device device;
+    NativeRtos::currentTask() = &producerTask;
+    sendReading(device.controller, 1, TS + 1);
+    NativeRtos::currentTask() = &otherProducerTask;
+    uint32_t takes = NativeRtos::takes();
+    sendReading(device.controller, 2, TS + 2);
+    TEST_ASSERT_EQUAL_UINT32(takes + 1, NativeRtos::takes());
+    NativeRtos::currentTask() = NativeRtos::loopTask();
+    sendReading(device.controller, 3, 0);
+
+    device.run(200);
+    std::vector<std::string> telemetry = device.telemetry();
+    TEST_ASSERT_EQUAL_size_t(3, telemetry.size());
+    // The queue comes before the channel, which is only drained into it by loop()
+    TEST_ASSERT_EQUAL_STRING("{\"ts\":1700000000002,\"values\":{\"reading\":2}}", telemetry[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("{\"reading\":3}", telemetry[1].c_str());
+    TEST_ASSERT_EQUAL_STRING("{\"ts\":1700000000001,\"values\":{\"reading\":1}}", telemetry[2].c_str());
+    TEST_ASSERT_EQUAL_UINT32(0, NativeRtos::deadlocks());
+}
+
+// Decoding {ts, values} again takes the readings plus the envelope, both have to fit transmitDoc
+void test_envelope_counts_against_transmit_doc() {
+    Device device;
+    DynamicJsonDocument data(MQTT_TRANSMIT_DOC_SIZE * 2);
+    for (int i = 0; data.memoryUsage() < MQTT_TRANSMIT_DOC_SIZE - 256; i++) data[String("k") + String(i)] = i;
+    String pad;
+    data["pad"] = pad;
+    while (data.memoryUsage() <= MQTT_TRANSMIT_DOC_SIZE - MQTT_TS_ENVELOPE_USAGE / 2) {
+        pad += "x";
+        data["pad"] = pad;
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(MQTT_TRANSMIT_DOC_SIZE, data.memoryUsage());
+
+    TEST_ASSERT_TRUE(device.controller.sendTelemetry(data, true, 0));
+    TEST_ASSERT_FALSE(device.controller.sendTelemetry(data, true, TS));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_producer_serializes_without_locking);
+    RUN_TEST(test_other_producer_uses_the_queue_lock);
+    RUN_TEST(test_envelope_counts_against_transmit_doc);
+    return UNITY_END();
+}
@@ -0,0 +1,309 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "NativeClient.h"
+#include "PubSubClient.h"
+
+// Feeds broker packets to PubSubClient in arbitrary fragments, the parser has to resume wherever a segment ends
+
+// Mixed traffic pushed through the parser by the benchmark
+#define BENCH_BYTES (16u * 1024 * 1024)
+
+struct Received {
+    String topic;
+    std::vector<uint8_t> payload;
+};
+
+static NativeClient *client;
+static PubSubClient *mqtt;
+static std::vector<Received> received;
+static std::vector<uint16_t> pubacks;
+static std::vector<uint16_t> subacks;
+
+static std::vector<uint8_t> packet(uint8_t header, const std::vector<uint8_t> &body) {
+    std::vector<uint8_t> out{header};
+    uint32_t length = body.size();
+    do {
+        uint8_t digit = length & 127;
+        length >>= 7;
+        out.push_back(length > 0 ? digit | 0x80 : digit);
+    } while (length > 0);
+    out.insert(out.end(), body.begin(), body.end());
+    return out;
+}
+
+static std::vector<uint8_t> publishPacket(const char *topic, const std::vector<uint8_t> &payload, uint16_t msgId) {
+    size_t tlen = strlen(topic);
+    std::vector<uint8_t> body{(uint8_t) (tlen >> 8), (uint8_t) (tlen & 0xFF)};
+    body.insert(body.end(), topic, topic + tlen);
+    if (msgId != 0) {
+        body.push_back(msgId >> 8);
+        body.push_back(msgId & 0xFF);
+    }
+    body.insert(body.end(), payload.begin(), payload.end());
+    return packet(msgId != 0 ? MQTTPUBLISH | MQTTQOS1 : MQTTPUBLISH, body);
+}
+
+static std::vector<uint8_t> idPacket(uint8_t header, uint16_t msgId) {
+    return packet(header, {(uint8_t) (msgId >> 8), (uint8_t) (msgId & 0xFF)});
+}
+
+static double elapsedUs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::vector<uint8_t> makePayload(size_t length, uint8_t seed) {
+    std::vector<uint8_t> payload(length);
+    for (size_t i = 0; i < length; i++) payload[i] = (uint8_t) (seed + i * 7);
+    return payload;
+}
+
+// Lets the pending bytes arrive fragment by fragment, maxFragment 1 is byte by byte, 0 picks random sizes
+static void feed(size_t maxFragment) {
+    while (!client->pending.empty()) {
+        client->arrive(maxFragment == 0 ? random(1, 300) : maxFragment);
+        mqtt->loop();
+    }
+    // A loop() call handles at most MQTT_MAX_PACKETS_PER_LOOP packets
+    while (client->available() > 0) mqtt->loop();
+}
+
+static void connectBroker() {
+    TEST_ASSERT_TRUE(mqtt->beginConnect("sensenet", "token", nullptr));
+    client->send(packet(MQTTCONNACK, {0, 0}));
+    while (!client->pending.empty()) {
+        client->arrive(1);
+        mqtt->pollConnect();
+    }
+    TEST_ASSERT_EQUAL_INT(MQTT_CONNECTED, mqtt->pollConnect());
+    client->outbound.clear();
+}
+
+struct Expected {
+    const char *topic;
+    std::vector<uint8_t> payload;
+    uint16_t msgId;
+};
+
+// Mixed traffic: QoS 0 and 1, empty and multi-byte-length payloads, acks and a ping response in between
+static std::vector<Expected> sendMixedTraffic(uint8_t round) {
+    std::vector<Expected> expected = {
+            {"v1/devices/me/attributes",              makePayload(12, round),       0},
+            {"v1/devices/me/rpc/request/17",          makePayload(300, round + 1),  0x1234},
+            {"v1/devices/me/attributes/response/3",   {},                           0},
+            {"v2/fw/response/0/chunk/42",             makePayload(2000, round + 2), 0},
+            {"t",                                     makePayload(127, round + 3),  7},
+            {"v1/devices/me/attributes",              makePayload(128, round + 4),  0},
+    };
+    for (size_t i = 0; i < expected.size(); i++) {
+        client->send(publishPacket(expected[i].topic, expected[i].payload, expected[i].msgId));
+        if (i == 1) client->send(idPacket(MQTTPUBACK, 0x0102 + round));
+        if (i == 2) client->send(packet(MQTTPINGRESP, {}));
+        if (i == 3) client->send(packet(MQTTSUBACK, {0, (uint8_t) (round + 1), 1}));
+    }
+    return expected;
+}
+
+static void checkMixedTraffic(const std::vector<Expected> &expected, uint8_t round) {
+    TEST_ASSERT_EQUAL_size_t(expected.size(), received.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        TEST_ASSERT_EQUAL_STRING(expected[i].topic, received[i].topic.c_str());
+        TEST_ASSERT_EQUAL_size_t(expected[i].payload.size(), received[i].payload.size());
+        if (!expected[i].payload.empty())
+            TEST_ASSERT_EQUAL_MEMORY(expected[i].payload.data(), received[i].payload.data(),
+                                     expected[i].payload.size());
+    }
+    TEST_ASSERT_EQUAL_size_t(1, pubacks.size());
+    TEST_ASSERT_EQUAL_UINT16(0x0102 + round, pubacks[0]);
+    TEST_ASSERT_EQUAL_size_t(1, subacks.size());
+    TEST_ASSERT_EQUAL_UINT16(round + 1, subacks[0]);
+
+    // Every QoS 1 publish is acknowledged exactly once with its own packet identifier
+    std::vector<uint8_t> acks;
+    for (const Expected &e: expected) {
+        if (e.msgId == 0) continue;
+        std::vector<uint8_t> ack = idPacket(MQTTPUBACK, e.msgId);
+        acks.insert(acks.end(), ack.begin(), ack.end());
+    }
+    TEST_ASSERT_EQUAL_size_t(acks.size(), client->outbound.size());
+    TEST_ASSERT_EQUAL_MEMORY(acks.data(), client->outbound.data(), acks.size());
+}
+
+static void clearReceived() {
+    received.clear();
+    pubacks.clear();
+    subacks.clear();
+    client->outbound.clear();
+}
+
+void setUp() {
+    client = new NativeClient();
+    mqtt = new PubSubClient(*client);
+    mqtt->setServer("broker", 1883);
+    TEST_ASSERT_TRUE(mqtt->setBufferSize(2100));
+    mqtt->setCallback([](char *topic, uint8_t *payload, unsigned int length) {
+        received.push_back({topic, std::vector<uint8_t>(payload, payload + length)});
+    });
+    mqtt->setPubackCallback([](uint16_t msgId) { pubacks.push_back(msgId); });
+    mqtt->setSubackCallback([](uint16_t msgId) { subacks.push_back(msgId); });
+    clearReceived();
+    connectBroker();
+}
+
+void tearDown() {
+    delete mqtt;
+    delete client;
+}
+
+void test_byte_by_byte() {
+    std::vector<Expected> expected = sendMixedTraffic(0);
+    feed(1);
+    checkMixedTraffic(expected, 0);
+    TEST_ASSERT_TRUE(mqtt->connected());
+}
+
+void test_random_fragments() {
+    randomSeed(42);
+    for (uint8_t round = 0; round < 50; round++) {
+        clearReceived();
+        std::vector<Expected> expected = sendMixedTraffic(round);
+        feed(0);
+        checkMixedTraffic(expected, round);
+    }
+    TEST_ASSERT_TRUE(mqtt->connected());
+}
+
+void test_whole_stream_at_once() {
+    std::vector<Expected> expected = sendMixedTraffic(3);
+    feed(SIZE_MAX);
+    checkMixedTraffic(expected, 3);
+}
+
+void test_oversized_packet_is_dropped_between_fragments() {
+    TEST_ASSERT_TRUE(mqtt->setBufferSize(128));
+    randomSeed(7);
+    for (size_t fragment: {(size_t) 1, (size_t) 0, (size_t) 5}) {
+        clearReceived();
+        client->send(publishPacket("a", makePayload(20, 1), 0));
+        client->send(publishPacket("too/big", makePayload(500, 2), 9));
+        client->send(publishPacket("b", makePayload(30, 3), 0));
+        feed(fragment);
+        TEST_ASSERT_EQUAL_size_t(2, received.size());
+        TEST_ASSERT_EQUAL_STRING("a", received[0].topic.c_str());
+        TEST_ASSERT_EQUAL_STRING("b", received[1].topic.c_str());
+        std::vector<uint8_t> payload = makePayload(30, 3);
+        TEST_ASSERT_EQUAL_MEMORY(payload.data(), received[1].payload.data(), payload.size());
+    }
+    TEST_ASSERT_TRUE(mqtt->connected());
+}
+
+void test_resize_mid_packet() {
+    std::vector<uint8_t> payload = makePayload(1500, 5);
+    client->send(publishPacket("v2/fw/response/0/chunk/1", payload, 0));
+    client->arrive(700);
+    mqtt->loop();
+    // Growing keeps what was already assembled
+    TEST_ASSERT_TRUE(mqtt->setBufferSize(4096));
+    feed(33);
+    TEST_ASSERT_EQUAL_size_t(1, received.size());
+    TEST_ASSERT_EQUAL_MEMORY(payload.data(), received[0].payload.data(), payload.size());
+}
+
+void test_rx_size_does_not_limit_control_packets() {
+    // The receive side is tiny, SUBSCRIBE is still built in the MQTT_TX_BUFFER_SIZE buffer
+    TEST_ASSERT_TRUE(mqtt->setBufferSize(32));
+    TEST_ASSERT_EQUAL_UINT16(32, mqtt->getBufferSize());
+    String topic = "v1/devices/me/";
+    while (topic.length() < 200) topic += "attributes/";
+    TEST_ASSERT_TRUE(mqtt->subscribe(topic.c_str(), 1));
+    TEST_ASSERT_EQUAL_UINT8(MQTTSUBSCRIBE | MQTTQOS1, client->outbound[0]);
+    TEST_ASSERT_GREATER_THAN(topic.length(), client->outbound.size());
+}
+
+void test_short_write_drops_connection() {
+    std::vector<uint8_t> payload = makePayload(600, 9);
+    // The header and topic go out, the payload only in part
+    client->writeCapacity = 100;
+    TEST_ASSERT_EQUAL_UINT16(0, mqtt->publish_Q1("v1/devices/me/telemetry", payload.data(), payload.size(), false, 0));
+    TEST_ASSERT_EQUAL_INT(MQTT_CONNECTION_LOST, mqtt->state());
+    TEST_ASSERT_FALSE(mqtt->connected());
+    TEST_ASSERT_FALSE(client->connected());
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt->getShortWrites());
+    TEST_ASSERT_EQUAL_size_t(100, client->outbound.size());
+}
+
+// Parse throughput on randomly fragmented mixed traffic and the longest single loop() call, then a segment
+// that stops mid-packet: loop() takes what is there and returns at once instead of waiting for the rest
+void test_benchmark_fragmented_stream() {
+    static size_t packets, payloadBytes;
+    packets = payloadBytes = 0;
+    mqtt->setCallback([](char *topic, uint8_t *payload, unsigned int length) {
+        packets++;
+        payloadBytes += length;
+    });
+    randomSeed(11);
+    size_t streamBytes = 0, loops = 0, expectedPackets = 0;
+    double longestLoopUs = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint8_t round = 0; streamBytes < BENCH_BYTES; round++) {
+        clearReceived();
+        expectedPackets += sendMixedTraffic(round).size();
+        streamBytes += client->pending.size();
+        while (!client->pending.empty() || client->available() > 0) {
+            client->arrive(random(1, 1500));
+            auto loopStart = std::chrono::steady_clock::now();
+            mqtt->loop();
+            longestLoopUs = max(longestLoopUs, elapsedUs(loopStart));
+            loops++;
+        }
+    }
+    double totalUs = elapsedUs(start);
+    TEST_ASSERT_EQUAL_size_t(expectedPackets, packets);
+    TEST_ASSERT_TRUE(mqtt->connected());
+
+    clearReceived();
+    std::vector<uint8_t> stalled = publishPacket("v2/fw/response/0/chunk/9", makePayload(2000, 4), 0);
+    client->send(stalled.data(), 700);
+    client->arrive();
+    uint32_t stalledAt = millis();
+    double stalledLongestUs = 0;
+    for (int i = 0; i < 1000; i++) {
+        auto loopStart = std::chrono::steady_clock::now();
+        TEST_ASSERT_TRUE(mqtt->loop());
+        stalledLongestUs = max(stalledLongestUs, elapsedUs(loopStart));
+    }
+    // Nothing waited on the socket timeout, the clock only moves when the test moves it
+    TEST_ASSERT_EQUAL_UINT32(stalledAt, millis());
+    size_t packetsBefore = packets;
+    client->send(stalled.data() + 700, stalled.size() - 700);
+    feed(SIZE_MAX);
+    TEST_ASSERT_EQUAL_size_t(packetsBefore + 1, packets);
+
+    char report[200];
+    snprintf(report, sizeof(report), "fragmented stream: %.1f MB in %.1f ms, %.1f MB/s, %u packets, %u loop() calls, "
+                                     "longest loop() %.1f us", streamBytes / 1048576.0, totalUs / 1000,
+             streamBytes / totalUs, (unsigned) packets, (unsigned) loops, longestLoopUs);
+    TEST_MESSAGE(report);
+    snprintf(report, sizeof(report), "stalled segment: 700 of %u bytes in, longest of 1000 loop() calls %.1f us",
+             (unsigned) stalled.size(), stalledLongestUs);
+    TEST_MESSAGE(report);
+
+    // Generous bounds for a loaded host, a blocking read would sit in the 15 s socket timeout
+    TEST_ASSERT_LESS_THAN(50000, longestLoopUs);
+    TEST_ASSERT_LESS_THAN(50000, stalledLongestUs);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_byte_by_byte);
+    RUN_TEST(test_random_fragments);
+    RUN_TEST(test_whole_stream_at_once);
+    RUN_TEST(test_oversized_packet_is_dropped_between_fragments);
+    RUN_TEST(test_resize_mid_packet);
+    RUN_TEST(test_rx_size_does_not_limit_control_packets);
+    RUN_TEST(test_short_write_drops_connection);
+    RUN_TEST(test_benchmark_fragmented_stream);
+    return UNITY_END();
+}
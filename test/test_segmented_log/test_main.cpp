@@ -0,0 +1,220 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+#include <chrono>
+#include <vector>
+#include "Uptime.h"
+#include "SegmentedLog.tpp"
+
+// Telemetry sized records, enough of them to roll over several segments
+#define BENCH_MESSAGES 600
+#define BENCH_PAYLOAD_SIZE 180
+
+static const char *benchTopic = "v1/devices/me/telemetry";
+
+static void makePayload(uint32_t index, uint8_t *payload) {
+    for (uint32_t i = 0; i < BENCH_PAYLOAD_SIZE; i++) payload[i] = (uint8_t) ('a' + (index + i) % 26);
+    // Text like the String payloads of the baseline queue
+    char digits[12];
+    memcpy(payload, digits, snprintf(digits, sizeof(digits), "%u", index));
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The flash queue SegmentedLog replaced, push, peek and removeLastPeek as in the baseline Queue.tpp minus
+// the debug prints: one file per message holding a {payload, topic} JSON document, the next one found by
+// probing indexes with exists()
+struct BaselineFileQueue {
+    String queueDirString = "/queue";
+    uint32_t maxIndex = 1;
+    uint32_t minIndex = 1;
+    uint16_t currentSize = 0;
+    String lastPeekFilePath = "";
+
+    bool writeToFile(const char *message, String filename) {
+        filename = queueDirString + String("/") + filename;
+        File file = LittleFS.open(filename, FILE_WRITE, true);
+        if (!file) return false;
+        bool result = file.print(message);
+        file.close();
+        return result;
+    }
+
+    uint16_t getSize() {
+        if (currentSize == 0) {
+            maxIndex = 1;
+            minIndex = 1;
+        }
+        return currentSize;
+    }
+
+    bool push(const String &topic, const String &payload) {
+        DynamicJsonDocument data(1024);
+        data["payload"] = payload;
+        data["topic"] = topic;
+        data.shrinkToFit();
+        bool result = writeToFile(data.as<String>().c_str(), String(maxIndex));
+        if (result) {
+            maxIndex++;
+            currentSize++;
+        }
+        return result;
+    }
+
+    bool peek(String &topic, String &payload) {
+        if (getSize() == 0) return false;
+        bool found = false;
+        while (minIndex <= maxIndex) {
+            if (LittleFS.exists(queueDirString + "/" + String(minIndex))) {
+                found = true;
+                break;
+            }
+            minIndex++;
+        }
+        if (!found) return false;
+
+        File file = LittleFS.open(queueDirString + "/" + String(minIndex), FILE_READ);
+        DynamicJsonDocument doc(1024);
+        deserializeJson(doc, file.readString());
+        lastPeekFilePath = file.path();
+        topic = doc["topic"].as<String>();
+        payload = doc["payload"].as<String>();
+        file.close();
+        return true;
+    }
+
+    bool removeLastPeek() {
+        if (getSize() == 0 || lastPeekFilePath.isEmpty()) return false;
+        bool result = LittleFS.remove(lastPeekFilePath);
+        if (result) {
+            currentSize--;
+            uint32_t i = strtol(pathToFileName(lastPeekFilePath.c_str()), NULL, 10);
+            if (i >= minIndex) minIndex = i + 1;
+        }
+        return result;
+    }
+};
+
+void setUp() {
+    LittleFS.format();
+}
+
+void tearDown() {}
+
+void test_records_come_back_in_order() {
+    SegmentedLog log("/log", 4, 4096);
+    TEST_ASSERT_TRUE(log.begin());
+    uint8_t payload[BENCH_PAYLOAD_SIZE];
+    for (uint32_t i = 0; i < 40; i++) {
+        makePayload(i, payload);
+        TEST_ASSERT_TRUE(log.append(benchTopic, strlen(benchTopic), payload, sizeof(payload), 1000 + i));
+    }
+    TEST_ASSERT_EQUAL_UINT32(40, log.getCount());
+
+    for (uint32_t i = 0; i < 40; i++) {
+        TEST_ASSERT_TRUE(log.peek());
+        TEST_ASSERT_EQUAL_STRING(benchTopic, log.getPeekedTopic());
+        TEST_ASSERT_EQUAL_UINT16(BENCH_PAYLOAD_SIZE, log.getPeekedPayloadLength());
+        makePayload(i, payload);
+        TEST_ASSERT_EQUAL_MEMORY(payload, log.getPeekedPayload(), BENCH_PAYLOAD_SIZE);
+        TEST_ASSERT_EQUAL_UINT32(1000 + i, log.getPeekedEnqueuedAt());
+        TEST_ASSERT_TRUE(log.removeFirst());
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, log.getCount());
+}
+
+// At most QUEUE_TAIL_CHECKPOINT consumed records come back after a restart, and in order
+void test_recovers_from_tail_checkpoint() {
+    uint8_t payload[BENCH_PAYLOAD_SIZE];
+    {
+        SegmentedLog log("/log", 4, 4096);
+        TEST_ASSERT_TRUE(log.begin());
+        for (uint32_t i = 0; i < 30; i++) {
+            makePayload(i, payload);
+            TEST_ASSERT_TRUE(log.append(benchTopic, strlen(benchTopic), payload, sizeof(payload), 1000 + i));
+        }
+        for (uint32_t i = 0; i < 20; i++) TEST_ASSERT_TRUE(log.removeFirst());
+    }
+
+    SegmentedLog log("/log", 4, 4096);
+    TEST_ASSERT_TRUE(log.begin());
+    uint32_t count = log.getCount();
+    TEST_ASSERT_TRUE(count >= 10 && count <= 10 + QUEUE_TAIL_CHECKPOINT);
+    TEST_ASSERT_TRUE(log.peek());
+    makePayload(30 - count, payload);
+    TEST_ASSERT_EQUAL_MEMORY(payload, log.getPeekedPayload(), BENCH_PAYLOAD_SIZE);
+    // Enqueue times from an earlier boot mean nothing
+    TEST_ASSERT_EQUAL_UINT32(0, log.getPeekedEnqueuedAt());
+}
+
+// Same workload through both layouts: fill, then peek and remove everything. The segmented log has to
+// get by with far fewer file opens, rates and bytes written per message are reported for comparison
+void test_benchmark_against_baseline_queue() {
+    uint8_t payload[BENCH_PAYLOAD_SIZE];
+
+    uint32_t opens = LittleFS.getOpens(), written = LittleFS.getBytesWritten();
+    auto start = std::chrono::steady_clock::now();
+    SegmentedLog log("/log", 8, 32768);
+    TEST_ASSERT_TRUE(log.begin());
+    for (uint32_t i = 0; i < BENCH_MESSAGES; i++) {
+        makePayload(i, payload);
+        TEST_ASSERT_TRUE(log.append(benchTopic, strlen(benchTopic), payload, sizeof(payload)));
+    }
+    double logPushMs = elapsedMs(start);
+    for (uint32_t i = 0; i < BENCH_MESSAGES; i++) {
+        TEST_ASSERT_TRUE(log.peek());
+        TEST_ASSERT_TRUE(log.removeFirst());
+    }
+    double logTotalMs = elapsedMs(start);
+    uint32_t logOpens = LittleFS.getOpens() - opens;
+    uint32_t logBytes = LittleFS.getBytesWritten() - written;
+    TEST_ASSERT_EQUAL_UINT32(log.getBytesWritten(), logBytes);
+
+    // Payloads as the baseline got them, Strings built before the clock starts
+    std::vector<String> payloads;
+    for (uint32_t i = 0; i < BENCH_MESSAGES; i++) {
+        makePayload(i, payload);
+        String text;
+        for (uint8_t c: payload) text += (char) c;
+        payloads.push_back(text);
+    }
+    LittleFS.mkdir("/queue");
+    opens = LittleFS.getOpens();
+    written = LittleFS.getBytesWritten();
+    start = std::chrono::steady_clock::now();
+    BaselineFileQueue queue;
+    for (uint32_t i = 0; i < BENCH_MESSAGES; i++) TEST_ASSERT_TRUE(queue.push(benchTopic, payloads[i]));
+    double queuePushMs = elapsedMs(start);
+    for (uint32_t i = 0; i < BENCH_MESSAGES; i++) {
+        String topic, peeked;
+        TEST_ASSERT_TRUE(queue.peek(topic, peeked));
+        TEST_ASSERT_TRUE(peeked == payloads[i]);
+        TEST_ASSERT_TRUE(queue.removeLastPeek());
+    }
+    double queueTotalMs = elapsedMs(start);
+    uint32_t queueOpens = LittleFS.getOpens() - opens;
+    uint32_t queueBytes = LittleFS.getBytesWritten() - written;
+    TEST_ASSERT_EQUAL_UINT16(0, queue.getSize());
+
+    char report[200];
+    snprintf(report, sizeof(report), "segmented log: %.0f msgs/s, %.1f bytes/msg, %u opens, push %.1f ms, "
+                                     "total %.1f ms", BENCH_MESSAGES * 1000.0 / logTotalMs,
+             (double) logBytes / BENCH_MESSAGES, logOpens, logPushMs, logTotalMs);
+    TEST_MESSAGE(report);
+    snprintf(report, sizeof(report), "baseline queue: %.0f msgs/s, %.1f bytes/msg, %u opens, push %.1f ms, "
+                                     "total %.1f ms", BENCH_MESSAGES * 1000.0 / queueTotalMs,
+             (double) queueBytes / BENCH_MESSAGES, queueOpens, queuePushMs, queueTotalMs);
+    TEST_MESSAGE(report);
+
+    TEST_ASSERT_TRUE(logOpens * 10 < queueOpens);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_records_come_back_in_order);
+    RUN_TEST(test_recovers_from_tail_checkpoint);
+    RUN_TEST(test_benchmark_against_baseline_queue);
+    return UNITY_END();
+}
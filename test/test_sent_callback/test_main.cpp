@@ -0,0 +1,83 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "NativeBroker.h"
+#include "sensenet.h"
+
+// The sent callback runs from MQTTController::loop() once semaQueue is given back, a callback queueing a
+// message must not wait on it. The FreeRTOS shim counts such a wait as a deadlock
+
+struct Sent {
+    std::string topic, payload;
+    uint32_t latencyMs;
+};
+
+static void run(MQTTController &controller, NativeBroker &broker, uint32_t ms) {
+    for (uint32_t i = 0; i < ms; i++) {
+        NativeClock::advance(1);
+        broker.pump();
+        controller.loop();
+    }
+}
+
+void setUp() {
+    NativeRtos::deadlocks() = 0;
+}
+
+void tearDown() {}
+
+void test_callback_queues_messages() {
+    NativeClient client;
+    NativeBroker broker(client);
+    MQTTController controller;
+    controller.init();
+    controller.connect(client, "esp", "token", "", "thingsboard.local", 1883,
+                       [](const String &, const JsonDocument &) -> bool { return false; });
+    run(controller, broker, 5000);
+    TEST_ASSERT_TRUE(controller.isConnected());
+
+    std::vector<Sent> sent;
+    controller.onSentMQTTMessageCallback([&](const MQTTMessageView &message, uint32_t latencyMs) {
+        std::string payload((const char *) message.payload, message.payloadLength);
+        if (strcmp(message.topic, V1_TELEMETRY_TOPIC) == 0) {
+            String reply = String("{\"sent\":") + String((uint32_t) sent.size()) + "}";
+            TEST_ASSERT_TRUE(controller.addToPublishQueue(V1_Attributes_TOPIC, reply, true));
+        }
+        // Queueing changed the queue, the message handed in is a copy and still reads the same
+        TEST_ASSERT_EQUAL_STRING(payload.c_str(),
+                                 std::string((const char *) message.payload, message.payloadLength).c_str());
+        sent.push_back({message.topic, payload, latencyMs});
+    });
+
+    for (uint8_t i = 0; i < 3; i++) {
+        String telemetry = String("{\"reading\":") + String(i) + "}";
+        TEST_ASSERT_TRUE(controller.addToPublishQueue(V1_TELEMETRY_TOPIC, telemetry, true));
+        NativeClock::advance(10);
+    }
+    run(controller, broker, 200);
+
+    TEST_ASSERT_EQUAL_UINT32(0, NativeRtos::deadlocks());
+    std::vector<std::string> telemetry, replies;
+    for (const Sent &message: sent) {
+        if (message.topic == V1_TELEMETRY_TOPIC) telemetry.push_back(message.payload);
+        else if (message.payload.find("\"sent\"") != std::string::npos) replies.push_back(message.payload);
+    }
+    TEST_ASSERT_EQUAL_size_t(3, telemetry.size());
+    TEST_ASSERT_EQUAL_STRING("{\"reading\":0}", telemetry[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("{\"reading\":2}", telemetry[2].c_str());
+    TEST_ASSERT_GREATER_OR_EQUAL(30, sent[0].latencyMs);
+    // What the callback queued went out on the next drain
+    TEST_ASSERT_EQUAL_size_t(3, replies.size());
+    size_t delivered = 0;
+    for (const NativeBroker::Publish &publish: broker.on(V1_Attributes_TOPIC))
+        if (std::string(publish.payload.begin(), publish.payload.end()).find("\"sent\"") != std::string::npos)
+            delivered++;
+    TEST_ASSERT_EQUAL_size_t(3, delivered);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_callback_queues_messages);
+    return UNITY_END();
+}
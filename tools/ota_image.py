@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+"""Packs firmware images for the MQTT OTA update, see lib/common/OTAImage.tpp for the format.
+
+    ota_image.py pack .pio/build/<env>/firmware.bin -o firmware.snz
+    ota_image.py pack new/firmware.bin --base old/firmware.bin -o delta.snz
+    ota_image.py unpack delta.snz --base old/firmware.bin -o firmware.bin
+
+Upload the .snz file to ThingsBoard instead of firmware.bin. A delta only installs on a device running
+exactly the --base image, anything else fails the update before a byte is written. Every packed file is
+unpacked again and compared before it is written out.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"SNZ1"
+HEADER = struct.Struct("<4sBBHI16sI16s")
+TYPE_LZ = 0
+TYPE_DELTA = 1
+
+MAX_LITERALS = 128
+MIN_MATCH = 3
+MAX_MATCH = 66
+MIN_COPY = 8
+MAX_COPY = 16384
+CHAIN_DEPTH = 16
+BASE_STEP = 4
+
+
+class Packer:
+    def __init__(self, image, base, window_bits):
+        self.image = image
+        self.base = base
+        self.window = 1 << window_bits
+        self.out = bytearray()
+        self.literals = bytearray()
+        self.chains = {}
+        self.base_index = {}
+        if base is not None:
+            # Every BASE_STEP-th position is enough, a match found late is extended backwards
+            for position in range(0, len(base) - MIN_COPY + 1, BASE_STEP):
+                self.base_index.setdefault(base[position:position + MIN_COPY], position)
+
+    def flush_literals(self):
+        for start in range(0, len(self.literals), MAX_LITERALS):
+            block = self.literals[start:start + MAX_LITERALS]
+            self.out.append(len(block) - 1)
+            self.out += block
+        self.literals.clear()
+
+    def insert(self, position):
+        key = self.image[position:position + MIN_MATCH]
+        if len(key) < MIN_MATCH:
+            return
+        chain = self.chains.setdefault(key, [])
+        chain.append(position)
+        if len(chain) > CHAIN_DEPTH:
+            del chain[0]
+
+    def window_match(self, position):
+        image = self.image
+        best_length, best_distance = 0, 0
+        limit = min(MAX_MATCH, len(image) - position)
+        for candidate in reversed(self.chains.get(image[position:position + MIN_MATCH], ())):
+            distance = position - candidate
+            if distance > self.window:
+                break
+            length = 0
+            while length < limit and image[candidate + length] == image[position + length]:
+                length += 1
+            if length > best_length:
+                best_length, best_distance = length, distance
+                if length == limit:
+                    break
+        return best_length, best_distance
+
+    def base_match(self, position):
+        image, base = self.image, self.base
+        source = self.base_index.get(image[position:position + MIN_COPY])
+        if source is None:
+            return 0, 0, 0
+        length = 0
+        while position + length < len(image) and source + length < len(base) and \
+                image[position + length] == base[source + length]:
+            length += 1
+        back = 0
+        while back < len(self.literals) and source - back > 0 and \
+                base[source - back - 1] == self.literals[len(self.literals) - back - 1]:
+            back += 1
+        return length, source, back
+
+    def emit_copy(self, source, length):
+        while length:
+            count = min(length, MAX_COPY)
+            self.out.append(0xC0 | ((count - 1) >> 8))
+            self.out.append((count - 1) & 0xFF)
+            self.out += struct.pack("<I", source)
+            source += count
+            length -= count
+
+    def pack(self):
+        image = self.image
+        position = 0
+        while position < len(image):
+            if self.base is not None:
+                length, source, back = self.base_match(position)
+                if length + back >= MIN_COPY:
+                    if back:
+                        del self.literals[-back:]
+                    self.flush_literals()
+                    self.emit_copy(source - back, length + back)
+                    for covered in range(position, position + length):
+                        self.insert(covered)
+                    position += length
+                    continue
+
+            length, distance = self.window_match(position)
+            if length >= MIN_MATCH:
+                self.flush_literals()
+                self.out.append(0x80 | (length - MIN_MATCH))
+                self.out += struct.pack("<H", distance)
+                for covered in range(position, position + length):
+                    self.insert(covered)
+                position += length
+                continue
+
+            self.literals.append(image[position])
+            self.insert(position)
+            position += 1
+        self.flush_literals()
+        return bytes(self.out)
+
+
+def pack(image, base=None, window_bits=12):
+    header = HEADER.pack(MAGIC, TYPE_LZ if base is None else TYPE_DELTA, window_bits, 0, len(image),
+                         hashlib.md5(image).digest(), 0 if base is None else len(base),
+                         bytes(16) if base is None else hashlib.md5(base).digest())
+    return header + Packer(image, base, window_bits).pack()
+
+
+def unpack(data, base=None):
+    magic, kind, window_bits, _, size, md5, base_size, base_md5 = HEADER.unpack_from(data)
+    if magic != MAGIC or kind > TYPE_DELTA:
+        raise ValueError("not a packed image")
+    if kind == TYPE_DELTA and (base is None or len(base) != base_size or hashlib.md5(base).digest() != base_md5):
+        raise ValueError("delta needs the exact base image it was made from")
+
+    out = bytearray()
+    position = HEADER.size
+    while position < len(data):
+        op = data[position]
+        position += 1
+        if op < 0x80:
+            out += data[position:position + op + 1]
+            position += op + 1
+        elif op < 0xC0:
+            distance, = struct.unpack_from("<H", data, position)
+            position += 2
+            if distance == 0 or distance > (1 << window_bits) or distance > len(out):
+                raise ValueError("distance out of the window")
+            for _ in range((op & 0x3F) + MIN_MATCH):
+                out.append(out[-distance])
+        else:
+            length = (((op & 0x3F) << 8) | data[position]) + 1
+            source, = struct.unpack_from("<I", data, position + 1)
+            position += 5
+            if kind != TYPE_DELTA or source + length > base_size:
+                raise ValueError("copy outside the base image")
+            out += base[source:source + length]
+
+    if len(out) != size or hashlib.md5(out).digest() != md5:
+        raise ValueError("unpacked image does not match its checksum")
+    return bytes(out)
+
+
+def read(path):
+    with open(path, "rb") as file:
+        return file.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    pack_command = commands.add_parser("pack", help="compress an application image, or diff it against --base")
+    pack_command.add_argument("image")
+    pack_command.add_argument("-o", "--output", required=True)
+    pack_command.add_argument("--base", help="image the devices are running now, makes a delta")
+    pack_command.add_argument("--window-bits", type=int, default=12,
+                              help="back reference window, the device allows up to OTA_IMAGE_MAX_WINDOW_BITS")
+
+    unpack_command = commands.add_parser("unpack", help="restore and verify the application image")
+    unpack_command.add_argument("image")
+    unpack_command.add_argument("-o", "--output", required=True)
+    unpack_command.add_argument("--base")
+
+    args = parser.parse_args()
+    base = read(args.base) if args.base else None
+    try:
+        if args.command == "pack":
+            if not 8 <= args.window_bits <= 15:
+                parser.error("--window-bits must be between 8 and 15")
+            image = read(args.image)
+            if not image or image[0] != 0xE9:
+                parser.error(args.image + " is not an ESP32 application image")
+            packed = pack(image, base, args.window_bits)
+            if unpack(packed, base) != image:
+                raise ValueError("packed image does not unpack to the original")
+            result = packed
+            print("%s: %d -> %d bytes (%.1f%%), md5 %s" % (args.output, len(image), len(packed),
+                                                          100.0 * len(packed) / len(image),
+                                                          hashlib.md5(packed).hexdigest()))
+        else:
+            result = unpack(read(args.image), base)
+    except (ValueError, IndexError, struct.error) as error:
+        print("error: %s" % error, file=sys.stderr)
+        return 1
+
+    with open(args.output, "wb") as file:
+        file.write(result)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())